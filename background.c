@@ -0,0 +1,465 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "background.h"
+#include "threadpool.h"
+
+
+/**
+ * @brief Cubic convolution (Catmull-Rom) weights for the 4 samples around a
+ * point a fraction t of the way from the second sample to the third.
+ */
+static void cubicWeights(double t, double* w)
+{
+    double t2 = t*t;
+    double t3 = t2*t;
+    w[0] = 0.5*(-t3 + 2.0*t2 - t);
+    w[1] = 0.5*(3.0*t3 - 5.0*t2 + 2.0);
+    w[2] = 0.5*(-3.0*t3 + 4.0*t2 + t);
+    w[3] = 0.5*(t3 - t2);
+}
+
+
+/**
+ * @brief Tiles and weights for interpolating the mesh at pixel offset p from
+ * its origin, along one axis of n tiles spanning length pixels. Taps past the edge of the mesh are
+ * extrapolated linearly from the two edge tiles, so a sky gradient carries on
+ * to the edge of the region instead of flattening out over the last half
+ * tile; their weights are folded into those tiles.
+ */
+static void cubicTaps(int p, int length, int n, int* index, double* w)
+{
+    // position in tiles, 0 at the centre of the first tile
+    double u = (p + 0.5) * n / length - 0.5;
+    int k = (int)floor(u);
+    double taps[4];
+    cubicWeights(u - k, taps);
+
+    // the 4 tiles the taps can land on
+    int base = k - 1;
+    if (base > n - 4) {
+        base = n - 4;
+    }
+    if (base < 0) {
+        base = 0;
+    }
+    for (int m = 0; m < 4; m++) {
+        index[m] = (base + m < n) ? base + m : n - 1;
+        w[m] = 0.0;
+    }
+    for (int m = 0; m < 4; m++) {
+        int idx = k - 1 + m;
+        if (n == 1) {
+            w[0] += taps[m];
+        } else if (idx < 0) {
+            w[0 - base] += (1 - idx) * taps[m];
+            w[1 - base] += idx * taps[m];
+        } else if (idx > n - 1) {
+            int e = idx - (n - 1);
+            w[n - 1 - base] += (1 + e) * taps[m];
+            w[n - 2 - base] -= e * taps[m];
+        } else {
+            w[idx - base] += taps[m];
+        }
+    }
+}
+
+
+/**
+ * @brief Median of a tile's pixels after repeatedly dropping those more than
+ * BACKGROUND_CLIP_SIGMA standard deviations from the median, so stars and
+ * other bright structure are clipped away. Works on the histogram of pixel
+ * values, so each iteration costs the width of the surviving value range
+ * rather than a pass over the pixels.
+ * 
+ * @param pHist counts of each pixel value, zero outside [lo, hi]
+ * @param lo, hi smallest and largest pixel value present
+ */
+static double clippedMedian(const uint32_t* pHist, int lo, int hi)
+{
+    double median = lo;
+    for (int iter = 0; iter <= BACKGROUND_CLIP_ITERATIONS; iter++) {
+        uint64_t n = 0;
+        double sum = 0.0, sum2 = 0.0;
+        for (int v = lo; v <= hi; v++) {
+            n += pHist[v];
+            sum += (double)pHist[v] * v;
+            sum2 += (double)pHist[v] * v * v;
+        }
+        // lower median
+        uint64_t below = 0;
+        for (int v = lo; v <= hi; v++) {
+            below += pHist[v];
+            if (2*below > n - 1) {
+                median = v;
+                break;
+            }
+        }
+        if (iter == BACKGROUND_CLIP_ITERATIONS) {
+            break;
+        }
+        double mean = sum / n;
+        double sigma = sqrt(fmax(0.0, sum2 / n - mean*mean));
+        int newLo = (int)ceil(median - BACKGROUND_CLIP_SIGMA*sigma);
+        int newHi = (int)floor(median + BACKGROUND_CLIP_SIGMA*sigma);
+        newLo = (newLo > lo) ? newLo : lo;
+        newHi = (newHi < hi) ? newHi : hi;
+        // the median itself always survives
+        if ((newLo == lo) && (newHi == hi)) {
+            break;
+        }
+        lo = newLo;
+        hi = newHi;
+    }
+    return median;
+}
+
+
+/**
+ * @brief Start of tile t of n spanning [p0, p1) along one axis. Tiles are as
+ * near the requested size as divides the region evenly, so every tile
+ * centre is where the interpolation expects it.
+ */
+static int meshEdge(int p0, int p1, int n, int t)
+{
+    return p0 + (int)((int64_t)t * (p1 - p0) / n);
+}
+
+
+struct mesh_job_t {
+    const uint16_t* pImage;
+    const uint8_t* pMask;
+    uint16_t imageWidth;
+    struct background_mesh_t* pMesh;
+    int failed;
+};
+
+
+/**
+ * @brief parallelFor() task: estimate the background of every tile in one
+ * row of the mesh. Tiles with too few unmasked pixels are set to NAN.
+ */
+static void estimateTileRow(void* arg, int ty)
+{
+    struct mesh_job_t* job = (struct mesh_job_t*)arg;
+    struct background_mesh_t* pMesh = job->pMesh;
+    uint32_t* pHist = calloc(UINT16_MAX + 1, sizeof(uint32_t));
+    if (pHist == NULL) {
+        job->failed = 1;
+        return;
+    }
+
+    int tj0 = meshEdge(pMesh->j0, pMesh->j1, pMesh->ny, ty);
+    int tj1 = meshEdge(pMesh->j0, pMesh->j1, pMesh->ny, ty + 1);
+    for (int tx = 0; tx < pMesh->nx; tx++) {
+        int ti0 = meshEdge(pMesh->i0, pMesh->i1, pMesh->nx, tx);
+        int ti1 = meshEdge(pMesh->i0, pMesh->i1, pMesh->nx, tx + 1);
+        int n = 0;
+        int lo = UINT16_MAX, hi = 0;
+        for (int j = tj0; j < tj1; j++) {
+            const uint16_t* pRow = job->pImage + (size_t)j * job->imageWidth;
+            const uint8_t* pMaskRow = job->pMask + (size_t)j * job->imageWidth;
+            for (int i = ti0; i < ti1; i++) {
+                if (pMaskRow[i]) {
+                    uint16_t v = pRow[i];
+                    pHist[v]++;
+                    lo = (v < lo) ? v : lo;
+                    hi = (v > hi) ? v : hi;
+                    n++;
+                }
+            }
+        }
+        int area = (ti1 - ti0) * (tj1 - tj0);
+        pMesh->values[ty*pMesh->nx + tx] =
+            ((n > 0) && (n >= BACKGROUND_MIN_TILE_FRACTION * area)) ?
+            (float)clippedMedian(pHist, lo, hi) : NAN;
+        if (n > 0) {
+            memset(pHist + lo, 0, (hi - lo + 1) * sizeof(uint32_t));
+        }
+    }
+    free(pHist);
+}
+
+
+/**
+ * @brief Interpolate a tile without an estimate linearly between the nearest
+ * tiles with one on either side of it, along the row and along the column,
+ * and average the two.
+ * 
+ * @return int 0 if there is no pair of tiles to interpolate between, 1
+ * otherwise
+ */
+static int interpolateMissingTile(const float* values, int nx, int ny,
+    int tx, int ty, float* pValue)
+{
+    double sum = 0.0;
+    int count = 0;
+    int l = tx - 1, r = tx + 1, u = ty - 1, d = ty + 1;
+    while ((l >= 0) && isnan(values[ty*nx + l])) {
+        l--;
+    }
+    while ((r < nx) && isnan(values[ty*nx + r])) {
+        r++;
+    }
+    while ((u >= 0) && isnan(values[u*nx + tx])) {
+        u--;
+    }
+    while ((d < ny) && isnan(values[d*nx + tx])) {
+        d++;
+    }
+    if ((l >= 0) && (r < nx)) {
+        double vl = values[ty*nx + l], vr = values[ty*nx + r];
+        sum += vl + (vr - vl) * (tx - l) / (r - l);
+        count++;
+    }
+    if ((u >= 0) && (d < ny)) {
+        double vu = values[u*nx + tx], vd = values[d*nx + tx];
+        sum += vu + (vd - vu) * (ty - u) / (d - u);
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    *pValue = sum / count;
+    return 1;
+}
+
+
+/**
+ * @brief Fill tiles without an estimate, such as those under a large masked
+ * area. Tiles with estimates on both sides are interpolated between them;
+ * the rest, towards the edges, take the mean of their neighbours that have a
+ * value, growing inwards until every tile is set.
+ * 
+ * @return int -1 if no tile has an estimate, 0 otherwise
+ */
+static int fillMissingTiles(struct background_mesh_t* pMesh)
+{
+    int nx = pMesh->nx, ny = pMesh->ny;
+    float filled[nx * ny];
+    int missing = 1;
+
+    memcpy(filled, pMesh->values, sizeof(filled));
+    for (int t = 0; t < nx * ny; t++) {
+        if (isnan(pMesh->values[t])) {
+            interpolateMissingTile(pMesh->values, nx, ny, t % nx, t / nx,
+                filled + t);
+        }
+    }
+    memcpy(pMesh->values, filled, sizeof(filled));
+
+    while (missing) {
+        int progress = 0;
+        missing = 0;
+        memcpy(filled, pMesh->values, sizeof(filled));
+        for (int ty = 0; ty < ny; ty++) {
+            for (int tx = 0; tx < nx; tx++) {
+                if (!isnan(pMesh->values[ty*nx + tx])) {
+                    continue;
+                }
+                double sum = 0.0;
+                int count = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int x = tx + dx, y = ty + dy;
+                        if ((x < 0) || (x >= nx) || (y < 0) || (y >= ny)) {
+                            continue;
+                        }
+                        float v = pMesh->values[y*nx + x];
+                        if (!isnan(v)) {
+                            sum += v;
+                            count++;
+                        }
+                    }
+                }
+                if (count > 0) {
+                    filled[ty*nx + tx] = sum / count;
+                    progress = 1;
+                } else {
+                    missing = 1;
+                }
+            }
+        }
+        memcpy(pMesh->values, filled, sizeof(filled));
+        if (missing && !progress) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Median filter over the mesh, so a tile pulled up by a large bright
+ * object does not raise the background around it. Interior tiles take the
+ * median of their 3x3 neighbourhood and edge tiles that of their 3
+ * neighbours along the edge; corners are kept. Every window is centred on
+ * its tile, so a sky gradient passes through unchanged.
+ */
+static void medianFilterMesh(struct background_mesh_t* pMesh)
+{
+    int nx = pMesh->nx, ny = pMesh->ny;
+    float filtered[nx * ny];
+
+    for (int ty = 0; ty < ny; ty++) {
+        for (int tx = 0; tx < nx; tx++) {
+            bool edgeX = (tx == 0) || (tx == nx - 1);
+            bool edgeY = (ty == 0) || (ty == ny - 1);
+            // window half-widths
+            int rx = edgeX ? 0 : 1;
+            int ry = edgeY ? 0 : 1;
+            if (edgeX && !edgeY) {
+                ry = 1;
+            } else if (edgeY && !edgeX) {
+                rx = 1;
+            } else if (edgeX && edgeY) {
+                rx = ry = 0;
+            }
+            float v[9];
+            int n = 0;
+            for (int dy = -ry; dy <= ry; dy++) {
+                for (int dx = -rx; dx <= rx; dx++) {
+                    // insertion sort as we go
+                    float value = pMesh->values[(ty + dy)*nx + tx + dx];
+                    int k = n++;
+                    while ((k > 0) && (v[k - 1] > value)) {
+                        v[k] = v[k - 1];
+                        k--;
+                    }
+                    v[k] = value;
+                }
+            }
+            filtered[ty*nx + tx] = v[n / 2];
+        }
+    }
+    memcpy(pMesh->values, filtered, sizeof(filtered));
+}
+
+
+/**
+ * @brief Estimate the sky background on a mesh of tiles covering a region of
+ * an image. Each tile is reduced to the sigma-clipped median of its unmasked
+ * pixels, tiles with too few are filled in from their neighbours, and the
+ * mesh is median filtered. The cost is one read of each pixel plus work per
+ * tile, independent of any filter radius.
+ * 
+ * @param[in] pImage image, imageWidth pixels per row
+ * @param[in] pMask 1 for pixels to use, 0 for masked ones
+ * @param i0, j0, i1, j1 region to cover; columns [i0, i1), rows [j0, j1)
+ * @param tileSize side of a mesh tile [px]; adjusted so that a whole number
+ * of tiles covers the region
+ * @param pMesh mesh to fill in; its buffers are reused when the geometry is
+ * unchanged. Free with freeBackgroundMesh().
+ * @return int -1 if failed, 0 otherwise
+ */
+int estimateBackgroundMesh(
+    const uint16_t* pImage,
+    const uint8_t* pMask,
+    uint16_t imageWidth,
+    int i0,
+    int j0,
+    int i1,
+    int j1,
+    int tileSize,
+    struct background_mesh_t* pMesh)
+{
+    if ((tileSize < 1) || (i1 <= i0) || (j1 <= j0)) {
+        return -1;
+    }
+    // round to the nearest number of tiles, at least one
+    int nx = (i1 - i0 + tileSize / 2) / tileSize;
+    int ny = (j1 - j0 + tileSize / 2) / tileSize;
+    nx = (nx > 0) ? nx : 1;
+    ny = (ny > 0) ? ny : 1;
+    if ((pMesh->values == NULL) || (pMesh->tile_size != tileSize) ||
+        (pMesh->i0 != i0) || (pMesh->j0 != j0) || (pMesh->i1 != i1) ||
+        (pMesh->j1 != j1)) {
+        freeBackgroundMesh(pMesh);
+        pMesh->values = malloc((size_t)nx * ny * sizeof(float));
+        pMesh->col_index = malloc((size_t)(i1 - i0) * 4 * sizeof(int));
+        pMesh->col_weight = malloc((size_t)(i1 - i0) * 4 * sizeof(double));
+        if (!pMesh->values || !pMesh->col_index || !pMesh->col_weight) {
+            fprintf(stderr, "estimateBackgroundMesh: out of memory.\n");
+            freeBackgroundMesh(pMesh);
+            return -1;
+        }
+        pMesh->tile_size = tileSize;
+        pMesh->i0 = i0;
+        pMesh->j0 = j0;
+        pMesh->i1 = i1;
+        pMesh->j1 = j1;
+        pMesh->nx = nx;
+        pMesh->ny = ny;
+        for (int c = 0; c < i1 - i0; c++) {
+            cubicTaps(c, i1 - i0, nx, pMesh->col_index + 4*c,
+                pMesh->col_weight + 4*c);
+        }
+    }
+
+    struct mesh_job_t job = {
+        .pImage = pImage,
+        .pMask = pMask,
+        .imageWidth = imageWidth,
+        .pMesh = pMesh,
+        .failed = 0,
+    };
+    parallelFor(ny, estimateTileRow, &job);
+    if (job.failed) {
+        fprintf(stderr, "estimateBackgroundMesh: out of memory.\n");
+        return -1;
+    }
+    if (fillMissingTiles(pMesh) < 0) {
+        fprintf(stderr, "estimateBackgroundMesh: every tile is masked.\n");
+        return -1;
+    }
+    medianFilterMesh(pMesh);
+    return 0;
+}
+
+
+/**
+ * @brief Interpolate the background for columns [i0, i1) of image row j,
+ * which must lie inside the region the mesh was estimated over.
+ * 
+ * @param[out] pRow background, indexed by image column
+ */
+void backgroundMeshRow(
+    const struct background_mesh_t* pMesh,
+    int j,
+    int i0,
+    int i1,
+    double* pRow)
+{
+    int nx = pMesh->nx;
+    int rowIndex[4];
+    double rowWeight[4];
+    double columns[nx];
+
+    // interpolate down each column of tiles, then along the row
+    cubicTaps(j - pMesh->j0, pMesh->j1 - pMesh->j0, pMesh->ny, rowIndex,
+        rowWeight);
+    for (int tx = 0; tx < nx; tx++) {
+        columns[tx] = 0.0;
+        for (int m = 0; m < 4; m++) {
+            columns[tx] += rowWeight[m] * pMesh->values[rowIndex[m]*nx + tx];
+        }
+    }
+    for (int i = i0; i < i1; i++) {
+        const int* index = pMesh->col_index + 4*(i - pMesh->i0);
+        const double* weight = pMesh->col_weight + 4*(i - pMesh->i0);
+        pRow[i] = weight[0]*columns[index[0]] + weight[1]*columns[index[1]] +
+            weight[2]*columns[index[2]] + weight[3]*columns[index[3]];
+    }
+}
+
+
+void freeBackgroundMesh(struct background_mesh_t* pMesh)
+{
+    free(pMesh->values);
+    free(pMesh->col_index);
+    free(pMesh->col_weight);
+    memset(pMesh, 0, sizeof(struct background_mesh_t));
+}
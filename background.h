@@ -0,0 +1,45 @@
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include <stdint.h>
+
+// sigma clipping of each mesh tile: iterations and clip level
+#define BACKGROUND_CLIP_ITERATIONS 5
+#define BACKGROUND_CLIP_SIGMA 3.0
+// tiles with fewer unmasked pixels than this fraction are filled in from
+// their neighbours
+#define BACKGROUND_MIN_TILE_FRACTION 0.25
+
+/* Sky background sampled on a coarse mesh of square tiles: one
+** sigma-clipped median per tile, interpolated between tile centres with
+** cubic convolution. */
+struct background_mesh_t {
+    int tile_size;  // requested tile side [px]
+    int i0, j0;     // image position of the first tile's corner
+    int i1, j1;     // end of the region the mesh covers
+    int nx, ny;     // tiles per row and column
+    float* values;  // ny * nx tile backgrounds
+    // per column of the region: the 4 tile columns and their weights
+    int* col_index;
+    double* col_weight;
+};
+
+int estimateBackgroundMesh(
+    const uint16_t* pImage,
+    const uint8_t* pMask,
+    uint16_t imageWidth,
+    int i0,
+    int j0,
+    int i1,
+    int j1,
+    int tileSize,
+    struct background_mesh_t* pMesh);
+void backgroundMeshRow(
+    const struct background_mesh_t* pMesh,
+    int j,
+    int i0,
+    int i1,
+    double* pRow);
+void freeBackgroundMesh(struct background_mesh_t* pMesh);
+
+#endif
@@ -0,0 +1,316 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blob_index.h"
+
+
+/**
+ * @brief Grid column or row of a coordinate, clamped to the grid.
+ */
+static int cellOf(double p, int cellSize, int n)
+{
+    int c = (int)floor(p / cellSize);
+    return (c < 0) ? 0 : ((c >= n) ? n - 1 : c);
+}
+
+
+static void linkBlob(struct blob_index_t* pIndex, uint32_t id)
+{
+    uint32_t c = cellOf(pIndex->y[id], pIndex->cell_size, pIndex->ny) *
+        pIndex->nx + cellOf(pIndex->x[id], pIndex->cell_size, pIndex->nx);
+    pIndex->cell[id] = c;
+    pIndex->next[id] = pIndex->head[c];
+    pIndex->head[c] = id;
+}
+
+
+static void unlinkBlob(struct blob_index_t* pIndex, uint32_t id)
+{
+    int32_t* link = &pIndex->head[pIndex->cell[id]];
+    while (*link != (int32_t)id) {
+        link = &pIndex->next[*link];
+    }
+    *link = pIndex->next[id];
+}
+
+
+/**
+ * @brief Empty the index and lay out its grid over a width x height area.
+ * Memory is kept from one use to the next and only grows.
+ *
+ * @param cellSize grid cell side [px], usually the distance neighbours are
+ * searched to; raised to BLOB_INDEX_MIN_CELL
+ * @return int -1 if failed, 0 otherwise
+ */
+int resetBlobIndex(
+    struct blob_index_t* pIndex,
+    int width,
+    int height,
+    int cellSize)
+{
+    if ((width < 1) || (height < 1)) {
+        return -1;
+    }
+    cellSize = (cellSize > BLOB_INDEX_MIN_CELL) ? cellSize :
+        BLOB_INDEX_MIN_CELL;
+    int nx = (width + cellSize - 1) / cellSize;
+    int ny = (height + cellSize - 1) / cellSize;
+    if ((uint32_t)(nx * ny) > pIndex->num_cells_alloc) {
+        int32_t* head = realloc(pIndex->head, (size_t)nx * ny *
+            sizeof(int32_t));
+        if (head == NULL) {
+            fprintf(stderr, "resetBlobIndex: out of memory.\n");
+            return -1;
+        }
+        pIndex->head = head;
+        pIndex->num_cells_alloc = nx * ny;
+    }
+    pIndex->width = width;
+    pIndex->height = height;
+    pIndex->cell_size = cellSize;
+    pIndex->nx = nx;
+    pIndex->ny = ny;
+    memset(pIndex->head, 0xff, (size_t)nx * ny * sizeof(int32_t));
+    pIndex->count = 0;
+    return 0;
+}
+
+
+/**
+ * @brief Add a blob to the index.
+ *
+ * @return int the blob's number, the count of blobs before it; -1 if failed
+ */
+int insertBlob(struct blob_index_t* pIndex, double x, double y, double mag)
+{
+    if (pIndex->count == pIndex->alloc) {
+        uint32_t alloc = pIndex->alloc ? 2*pIndex->alloc : 512;
+        int32_t* next = realloc(pIndex->next, alloc * sizeof(int32_t));
+        if (next != NULL) {
+            pIndex->next = next;
+        }
+        uint32_t* cell = realloc(pIndex->cell, alloc * sizeof(uint32_t));
+        if (cell != NULL) {
+            pIndex->cell = cell;
+        }
+        double* px = realloc(pIndex->x, alloc * sizeof(double));
+        if (px != NULL) {
+            pIndex->x = px;
+        }
+        double* py = realloc(pIndex->y, alloc * sizeof(double));
+        if (py != NULL) {
+            pIndex->y = py;
+        }
+        double* pmag = realloc(pIndex->mag, alloc * sizeof(double));
+        if (pmag != NULL) {
+            pIndex->mag = pmag;
+        }
+        uint32_t* found = realloc(pIndex->found, alloc * sizeof(uint32_t));
+        if (found != NULL) {
+            pIndex->found = found;
+        }
+        if (!next || !cell || !px || !py || !pmag || !found) {
+            fprintf(stderr, "insertBlob: out of memory.\n");
+            return -1;
+        }
+        pIndex->alloc = alloc;
+    }
+    uint32_t id = pIndex->count++;
+    pIndex->x[id] = x;
+    pIndex->y[id] = y;
+    pIndex->mag[id] = mag;
+    linkBlob(pIndex, id);
+    return id;
+}
+
+
+/**
+ * @brief Change the position and brightness of a blob already in the index.
+ */
+void replaceBlob(struct blob_index_t* pIndex, uint32_t id, double x, double y,
+    double mag)
+{
+    unlinkBlob(pIndex, id);
+    pIndex->x[id] = x;
+    pIndex->y[id] = y;
+    pIndex->mag[id] = mag;
+    linkBlob(pIndex, id);
+}
+
+
+/**
+ * @brief Find the blobs within a square around a point: those less than
+ * radius from it in both x and y.
+ *
+ * @param[out] pIds set to the blobs found, in no particular order. They stay
+ * valid until the index is next changed or searched.
+ * @return uint32_t number of blobs found
+ */
+uint32_t findNeighbours(
+    struct blob_index_t* pIndex,
+    double x,
+    double y,
+    double radius,
+    const uint32_t** pIds)
+{
+    uint32_t n = 0;
+    *pIds = pIndex->found;
+    if ((radius <= 0.0) || (pIndex->count == 0)) {
+        return 0;
+    }
+    int cx0 = cellOf(x - radius, pIndex->cell_size, pIndex->nx);
+    int cx1 = cellOf(x + radius, pIndex->cell_size, pIndex->nx);
+    int cy0 = cellOf(y - radius, pIndex->cell_size, pIndex->ny);
+    int cy1 = cellOf(y + radius, pIndex->cell_size, pIndex->ny);
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            for (int32_t id = pIndex->head[cy*pIndex->nx + cx]; id >= 0;
+                 id = pIndex->next[id]) {
+                if ((fabs(pIndex->x[id] - x) < radius) &&
+                    (fabs(pIndex->y[id] - y) < radius)) {
+                    pIndex->found[n++] = id;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+
+/**
+ * @brief Find the blob nearest a point, e.g. to match a star to the blobs
+ * of another frame.
+ *
+ * @param radius search no further than this [px]
+ * @return int the nearest blob's number, -1 if there is none within radius
+ */
+int nearestBlob(
+    const struct blob_index_t* pIndex,
+    double x,
+    double y,
+    double radius)
+{
+    int nearest = -1;
+    double best = radius * radius;
+    if ((radius <= 0.0) || (pIndex->count == 0)) {
+        return -1;
+    }
+    int cx0 = cellOf(x - radius, pIndex->cell_size, pIndex->nx);
+    int cx1 = cellOf(x + radius, pIndex->cell_size, pIndex->nx);
+    int cy0 = cellOf(y - radius, pIndex->cell_size, pIndex->ny);
+    int cy1 = cellOf(y + radius, pIndex->cell_size, pIndex->ny);
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            for (int32_t id = pIndex->head[cy*pIndex->nx + cx]; id >= 0;
+                 id = pIndex->next[id]) {
+                double dx = pIndex->x[id] - x;
+                double dy = pIndex->y[id] - y;
+                double d2 = dx*dx + dy*dy;
+                // ties go to the lower number, whatever the cell order
+                if ((d2 < best) || ((d2 == best) && (nearest >= 0) &&
+                    (id < nearest))) {
+                    best = d2;
+                    nearest = id;
+                }
+            }
+        }
+    }
+    return nearest;
+}
+
+
+/**
+ * @brief Whether blob a ranks below blob b: it is fainter, or as bright and
+ * inserted later.
+ */
+static int dimmer(const double* mag, uint32_t a, uint32_t b)
+{
+    return (mag[a] < mag[b]) || ((mag[a] == mag[b]) && (a > b));
+}
+
+
+static void siftDown(const double* mag, uint32_t* heap, uint32_t n,
+    uint32_t parent)
+{
+    uint32_t child;
+    while ((child = 2*parent + 1) < n) {
+        if ((child + 1 < n) && dimmer(mag, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!dimmer(mag, heap[child], heap[parent])) {
+            break;
+        }
+        uint32_t tmp = heap[parent];
+        heap[parent] = heap[child];
+        heap[child] = tmp;
+        parent = child;
+    }
+}
+
+
+/**
+ * @brief Pick the k brightest blobs, in O(n log k) time and without
+ * allocating: a min-heap of the best k so far is kept in the index's result
+ * array, with the faintest on top to be replaced, and is then sorted.
+ *
+ * @param[out] pIds set to the blobs picked, brightest first, with equally
+ * bright blobs in the order they were inserted. They stay valid until the
+ * index is next changed or searched.
+ * @return uint32_t number of blobs picked, the lesser of k and the count
+ */
+uint32_t brightestBlobs(
+    struct blob_index_t* pIndex,
+    uint32_t k,
+    const uint32_t** pIds)
+{
+    const double* mag = pIndex->mag;
+    uint32_t* heap = pIndex->found;
+    uint32_t n = 0;
+    *pIds = heap;
+    if (k == 0) {
+        return 0;
+    }
+    for (uint32_t id = 0; id < pIndex->count; id++) {
+        if (n < k) {
+            // sift up
+            uint32_t child = n++;
+            heap[child] = id;
+            while (child > 0) {
+                uint32_t parent = (child - 1) / 2;
+                if (!dimmer(mag, heap[child], heap[parent])) {
+                    break;
+                }
+                uint32_t tmp = heap[parent];
+                heap[parent] = heap[child];
+                heap[child] = tmp;
+                child = parent;
+            }
+        } else if (dimmer(mag, heap[0], id)) {
+            heap[0] = id;
+            siftDown(mag, heap, n, 0);
+        }
+    }
+    // heap sort: the faintest left on top goes to the end each time
+    for (uint32_t end = n; end > 1; end--) {
+        uint32_t tmp = heap[0];
+        heap[0] = heap[end - 1];
+        heap[end - 1] = tmp;
+        siftDown(mag, heap, end - 1, 0);
+    }
+    return n;
+}
+
+
+void freeBlobIndex(struct blob_index_t* pIndex)
+{
+    free(pIndex->head);
+    free(pIndex->next);
+    free(pIndex->cell);
+    free(pIndex->x);
+    free(pIndex->y);
+    free(pIndex->mag);
+    free(pIndex->found);
+    memset(pIndex, 0, sizeof(struct blob_index_t));
+}
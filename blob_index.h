@@ -0,0 +1,55 @@
+#ifndef BLOB_INDEX_H
+#define BLOB_INDEX_H
+
+#include <stdint.h>
+
+// smallest grid cell, so that tiny spacings do not make huge grids [px]
+#define BLOB_INDEX_MIN_CELL 8
+
+/* Blob positions hashed into a uniform grid of square cells, so that the
+** blobs near a point are found by looking in the few cells around it rather
+** than at every blob. Blobs are numbered in the order they are inserted, and
+** carry a brightness to pick the brightest by. */
+struct blob_index_t {
+    int width, height;      // area covered [px]; blobs outside go in the
+                            // edge cells
+    int cell_size;          // [px]
+    int nx, ny;             // cells per row and column
+    int32_t* head;          // ny * nx first blob in each cell, -1 if none
+    uint32_t num_cells_alloc;
+    int32_t* next;          // per blob: next blob in the same cell, or -1
+    uint32_t* cell;         // per blob: the cell it is in
+    double* x;              // per blob position [px]
+    double* y;
+    double* mag;            // per blob brightness
+    uint32_t* found;        // findNeighbours() and brightestBlobs() results
+    uint32_t count;
+    uint32_t alloc;
+};
+
+int resetBlobIndex(
+    struct blob_index_t* pIndex,
+    int width,
+    int height,
+    int cellSize);
+int insertBlob(struct blob_index_t* pIndex, double x, double y, double mag);
+void replaceBlob(struct blob_index_t* pIndex, uint32_t id, double x, double y,
+    double mag);
+uint32_t findNeighbours(
+    struct blob_index_t* pIndex,
+    double x,
+    double y,
+    double radius,
+    const uint32_t** pIds);
+int nearestBlob(
+    const struct blob_index_t* pIndex,
+    double x,
+    double y,
+    double radius);
+uint32_t brightestBlobs(
+    struct blob_index_t* pIndex,
+    uint32_t k,
+    const uint32_t** pIds);
+void freeBlobIndex(struct blob_index_t* pIndex);
+
+#endif
@@ -0,0 +1,199 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "calibration.h"
+
+#ifdef CALIBRATION_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+
+/**
+ * @brief Set up calibration from master frames.
+ * 
+ * @param dark master dark, or NULL. Ownership passes to pCal, which frees it
+ * with freeCalibration().
+ * @param flat master flat (an average of evenly lit frames, not dark
+ * subtracted), or NULL. Only read; gains are derived from it.
+ * @param num_pix pixels in each frame
+ * @param pCal filled in
+ * @return int -1 if failed, 0 otherwise
+ */
+int buildCalibration(uint16_t* dark, const uint16_t* flat, size_t num_pix,
+    struct calibration_t* pCal)
+{
+    memset(pCal, 0, sizeof(struct calibration_t));
+    pCal->num_pix = num_pix;
+    pCal->dark = dark;
+    if (dark != NULL) {
+        double sum = 0.0;
+        for (size_t i = 0; i < num_pix; i++) {
+            sum += dark[i];
+        }
+        pCal->pedestal = (uint16_t)lround(sum / num_pix);
+    }
+    if (flat == NULL) {
+        return 0;
+    }
+
+    pCal->gain = malloc(num_pix * sizeof(int16_t));
+    if (pCal->gain == NULL) {
+        fprintf(stderr, "buildCalibration: out of memory.\n");
+        freeCalibration(pCal);
+        return -1;
+    }
+    // normalize the dark-subtracted flat to its mean over lit pixels
+    double sum = 0.0;
+    size_t lit = 0;
+    for (size_t i = 0; i < num_pix; i++) {
+        int level = (int)flat[i] - (dark ? dark[i] : 0);
+        if (level > 0) {
+            sum += level;
+            lit++;
+        }
+    }
+    if (lit == 0) {
+        fprintf(stderr, "buildCalibration: the flat is no brighter than the "
+            "dark.\n");
+        freeCalibration(pCal);
+        return -1;
+    }
+    double mean = sum / lit;
+    for (size_t i = 0; i < num_pix; i++) {
+        int level = (int)flat[i] - (dark ? dark[i] : 0);
+        double gain = (level > 0) ? mean / level : 1.0;
+        long fixed = lround(gain * CALIBRATION_GAIN_ONE);
+        pCal->gain[i] = (fixed > INT16_MAX) ? INT16_MAX : (int16_t)fixed;
+    }
+    return 0;
+}
+
+
+void freeCalibration(struct calibration_t* pCal)
+{
+    free(pCal->dark);
+    free(pCal->gain);
+    memset(pCal, 0, sizeof(struct calibration_t));
+}
+
+
+/**
+ * @brief Average frames accumulated into sum, rounding to the nearest ADU.
+ * 
+ * @return int -1 if num_frames is 0, 0 otherwise
+ */
+int averageFrames(const uint32_t* sum, uint32_t num_frames, size_t num_pix,
+    uint16_t* average)
+{
+    if (num_frames == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < num_pix; i++) {
+        average[i] = (uint16_t)((sum[i] + num_frames / 2) / num_frames);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Calibrate pixels in place, in 32-bit integer arithmetic: subtract
+ * the dark, scale by the gain with rounding, add the pedestal and saturate
+ * to [0, 65535].
+ */
+void applyCalibrationScalar(const struct calibration_t* pCal, uint16_t* image,
+    size_t first, size_t count)
+{
+    const uint16_t* dark = pCal->dark ? pCal->dark + first : NULL;
+    const int16_t* gain = pCal->gain ? pCal->gain + first : NULL;
+    uint16_t* pixels = image + first;
+    int pedestal = pCal->pedestal;
+
+    for (size_t i = 0; i < count; i++) {
+        int32_t d = pixels[i];
+        if (dark) {
+            d -= dark[i];
+        }
+        if (gain) {
+            d = (d * gain[i] + (CALIBRATION_GAIN_ONE >> 1)) >>
+                CALIBRATION_GAIN_BITS;
+        }
+        d += pedestal;
+        pixels[i] = (d < 0) ? 0 : ((d > UINT16_MAX) ? UINT16_MAX : d);
+    }
+}
+
+
+#ifdef CALIBRATION_HAVE_X86_KERNELS
+/**
+ * @brief AVX2 version of applyCalibrationScalar(), 16 pixels at a time in
+ * two sets of 8 32-bit lanes.
+ */
+__attribute__((target("avx2")))
+void applyCalibrationAvx2(const struct calibration_t* pCal, uint16_t* image,
+    size_t first, size_t count)
+{
+    const uint16_t* dark = pCal->dark ? pCal->dark + first : NULL;
+    const int16_t* gain = pCal->gain ? pCal->gain + first : NULL;
+    uint16_t* pixels = image + first;
+    const __m256i pedestal = _mm256_set1_epi32(pCal->pedestal);
+    const __m256i half = _mm256_set1_epi32(CALIBRATION_GAIN_ONE >> 1);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i raw[2] = {
+            _mm_loadu_si128((const __m128i*)(pixels + i)),
+            _mm_loadu_si128((const __m128i*)(pixels + i + 8)),
+        };
+        __m256i d[2];
+        for (int h = 0; h < 2; h++) {
+            d[h] = _mm256_cvtepu16_epi32(raw[h]);
+            if (dark) {
+                d[h] = _mm256_sub_epi32(d[h], _mm256_cvtepu16_epi32(
+                    _mm_loadu_si128((const __m128i*)(dark + i + 8*h))));
+            }
+            if (gain) {
+                __m256i g = _mm256_cvtepi16_epi32(
+                    _mm_loadu_si128((const __m128i*)(gain + i + 8*h)));
+                d[h] = _mm256_srai_epi32(_mm256_add_epi32(
+                    _mm256_mullo_epi32(d[h], g), half), CALIBRATION_GAIN_BITS);
+            }
+            d[h] = _mm256_add_epi32(d[h], pedestal);
+        }
+        // saturating pack works within 128-bit lanes; put them back in order
+        __m256i packed = _mm256_packus_epi32(d[0], d[1]);
+        packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i*)(pixels + i), packed);
+    }
+    if (i < count) {
+        applyCalibrationScalar(pCal, image, first + i, count - i);
+    }
+}
+#endif
+
+
+/**
+ * @brief Calibrate pixels [first, first + count) of an image in place (see
+ * applyCalibrationScalar()) using the widest kernel the CPU supports. Does
+ * nothing without master frames.
+ */
+void applyCalibration(const struct calibration_t* pCal, uint16_t* image,
+    size_t first, size_t count)
+{
+    static void (*kernel)(const struct calibration_t*, uint16_t*, size_t,
+        size_t) = NULL;
+    if ((pCal->dark == NULL) && (pCal->gain == NULL)) {
+        return;
+    }
+    if (kernel == NULL) {
+        kernel = applyCalibrationScalar;
+#ifdef CALIBRATION_HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernel = applyCalibrationAvx2;
+        }
+#endif
+    }
+    kernel(pCal, image, first, count);
+}
@@ -0,0 +1,42 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// flat-field gains are fixed point with this many fractional bits, in 16
+// bits, so they range up to just under 8
+#define CALIBRATION_GAIN_BITS 12
+#define CALIBRATION_GAIN_ONE (1 << CALIBRATION_GAIN_BITS)
+
+/* Master calibration frames, resident for the life of the program. A
+** calibrated pixel is
+**     (raw - dark) * gain + pedestal
+** where the pedestal is the mean of the dark, so backgrounds keep about the
+** level they had before calibration and read noise is not clipped at 0. */
+struct calibration_t {
+    uint16_t* dark;     // master dark, or NULL for none
+    int16_t* gain;      // flat-field gain per pixel, or NULL for none
+    uint16_t pedestal;  // [ADU]
+    size_t num_pix;
+};
+
+int buildCalibration(uint16_t* dark, const uint16_t* flat, size_t num_pix,
+    struct calibration_t* pCal);
+void freeCalibration(struct calibration_t* pCal);
+void applyCalibration(const struct calibration_t* pCal, uint16_t* image,
+    size_t first, size_t count);
+int averageFrames(const uint32_t* sum, uint32_t num_frames, size_t num_pix,
+    uint16_t* average);
+
+// Individual kernels, exposed for testing and benchmarking. They calibrate
+// pixels [first, first + count) of image in place.
+void applyCalibrationScalar(const struct calibration_t* pCal, uint16_t* image,
+    size_t first, size_t count);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CALIBRATION_HAVE_X86_KERNELS
+void applyCalibrationAvx2(const struct calibration_t* pCal, uint16_t* image,
+    size_t first, size_t count);
+#endif
+
+#endif
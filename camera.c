@@ -9,6 +9,7 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <sys/mman.h>
 #include <sofa.h>
 
 #include "camera.h"
@@ -20,12 +21,20 @@
 #include "fits_utils.h"
 #include "timer.h"
 #include "convolve.h"
+#include "pipeline.h"
+#include "unpack.h"
+#include "camera_backend.h"
+#include "hotpix.h"
+#include "background.h"
+#include "calibration.h"
+#include "coadd.h"
+#include "fixed_pattern.h"
+#include "blob_index.h"
+#include "threadpool.h"
 
 
 #define AF_ALGORITHM_NEW
 
-void merge(double A[], int p, int q, int r, double X[],double Y[]);
-void part(double A[], int p, int r, double X[], double Y[]);
 
 #include <ids_peak_comfort_c/ids_peak_comfort_c.h>
 peak_camera_handle hCam = PEAK_INVALID_HANDLE;
@@ -81,7 +90,13 @@ struct fits_metadata_t default_metadata = {
     .bloffset = 0.0,
     .autogain = 0,
     .autoexp = 0,
-    .autoblk = 0
+    .autoblk = 0,
+
+    // Processing
+
+    .crhits = 0,
+    .rowpatt = 0.0,
+    .colpatt = 0.0
 };
 
 // global variables
@@ -93,6 +108,7 @@ int buffer_num, mem_id;
 uint16_t * memory, * mem_starting_ptr; //we want raw bytes
 unsigned char * mask;
 // some dedicated arrays for use in binned AF routine
+uint16_t binnedImage[CAMERA_NUM_PX / (CAMERA_FOCUS_BINFACTOR * CAMERA_FOCUS_BINFACTOR)] = {0};
 float imageFloatIn[CAMERA_NUM_PX / (CAMERA_FOCUS_BINFACTOR * CAMERA_FOCUS_BINFACTOR)] = {0.0};
 float sobelResult[CAMERA_NUM_PX / (CAMERA_FOCUS_BINFACTOR * CAMERA_FOCUS_BINFACTOR)] = {0.0};
 unsigned char binnedMask[CAMERA_NUM_PX / (CAMERA_FOCUS_BINFACTOR * CAMERA_FOCUS_BINFACTOR)] = {0};
@@ -103,7 +119,6 @@ double deltaT = 0.0;
 struct timespec tstart = {0,0};
 struct timespec tend = {0,0};
 
-uint16_t unpacked_image[CAMERA_NUM_PX] = {0};
 // for printing camera errors
 const char * cam_error;
 // 'curr' = current, 'pc' = pixel clock, 'fps' = frames per sec, 
@@ -133,12 +148,113 @@ struct blob_params all_blob_params = {
 
 /* Trigger parameters global structure (defined in camera.h) */
 struct trigger_params all_trigger_params = {
-    .trigger_timeout_us = 100, // 100 µs between checks
+    .trigger_timeout_us = 100, // unused, see setTrigger()
     .trigger = 0, // not starting off triggered
     .trigger_mode = 0, // default to 
 };
 
+// setTrigger() wakes the acquisition thread waiting in waitForTrigger()
+static pthread_mutex_t trigger_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trigger_cond = PTHREAD_COND_INITIALIZER;
+static struct timeval trigger_received_tv = {0, 0};
+// free-run frames discarded in favour of newer ones; only touched with
+// __atomic builtins, as the pipeline report reads it from another thread
+uint64_t frames_dropped = 0;
+// whether the backend was last switched to free-run by acquireFrame()
+static int free_running = 0;
+// if 1, follow the brightest stars in small windows between full frames
+int track_stars = 0;
+// Tracking windows, centred on stars in image memory coordinates. Only the
+// detection stage touches these.
+static int num_rois = 0;
+static double roi_x[TRACK_MAX_ROIS];
+static double roi_y[TRACK_MAX_ROIS];
+static int frames_since_full = 0;
+// stars of the last tracking frame, for telemetry; written by the detection
+// stage and read by the send threads
+static pthread_mutex_t tracked_lock = PTHREAD_MUTEX_INITIALIZER;
+static double tracked_time = 0.0;
+static int num_tracked = 0;
+static double tracked_x[TRACK_MAX_ROIS];
+static double tracked_y[TRACK_MAX_ROIS];
+// set by the solve stage; we only track stars from a solved field
+static volatile int last_solve_ok = 0;
+// frames averaged into each image (1: no co-adding), and whether to line
+// them up on the stars of the last detection first
+int coadd_frames = 1;
+int coadd_shift = 0;
+// cosmic ray rejection threshold in units of the pixel noise (0: off), the
+// hits masked in the frame being detected, and the running total (the
+// pipeline report reads it from another thread, so it is only touched with
+// __atomic builtins)
+float cosmic_ray_sigma = 0.0f;
+static int frame_cosmic_ray_hits = 0;
+uint64_t cosmic_ray_hits = 0;
+// hits masked in the frame behind the latest solution, for telemetry
+uint32_t solved_cosmic_ray_hits = 0;
+// Brightest stars of the last detection, in image memory coordinates. Set by
+// the detection stage and read by the acquisition stage.
+static pthread_mutex_t coadd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int num_coadd_stars = 0;
+static double coadd_star_x[COADD_SHIFT_STARS];
+static double coadd_star_y[COADD_SHIFT_STARS];
+// exposure being added into the co-add
+static uint16_t * coadd_image = NULL;
+// filtered image, shared by findBlobs() and trackBlobs() in the detect stage
+static float * ic = NULL;
+// sky background mesh for high_pass_filter == 2, reused between frames
+static struct background_mesh_t background_mesh = {0};
+// if 1, subtract row and column fixed pattern noise before blob finding;
+// the last estimate, and whether the frame being detected has had it removed
+// into the working copy, which is what gets filtered (the frame stays raw)
+int remove_fixed_pattern = 0;
+static struct fixed_pattern_t fixed_pattern = {0};
+static int fixed_pattern_removed = 0;
+static uint16_t * corrected_image = NULL;
+// the filtered image in ic from the last findBlobs(): its noise statistics
+// and the region to search, so that extractBlobs() can threshold it again
+// without filtering again
+struct filtered_image_t {
+    int valid;
+    int w, h;
+    int i0, j0, i1, j1;
+    double mean;
+    double sigma;
+};
+static struct filtered_image_t filtered = {0};
+// blobs kept by extractBlobs() so far, for the unique_star_spacing check and
+// to pick the brightest from
+static struct blob_index_t blob_index = {0};
+// master dark and flat, applied to every frame by imageTransfer()
+static struct calibration_t calibration = {0};
+
+/* Camera state cache (defined in camera.h). Until the first read back, assume
+** the startup settings. */
+struct camera_state_t camera_state = {
+    .exposure_time_ms = 100.0,
+    .analog_gain = 1.0,
+    .frame_rate = 10.0,
+    .binning = 1,
+};
+
 enum solveState_t solveState = UNINIT;
+// if 1, ask the camera for 12-bit packed pixels (25% less USB bandwidth)
+int use_packed_pixels = 0;
+// Acquisition buffers we announce to the driver ourselves (--buffers); 0 lets
+// the SDK allocate its default set
+int acquisition_buffer_count = 0;
+// back the announced buffers with huge pages if the kernel has some reserved
+int use_huge_pages = 0;
+static uint8_t* acq_buffer_region = NULL;
+static size_t acq_buffer_region_size = 0;
+// buffer metrics for the pipeline report, which reads and resets them from
+// another thread; only touched with __atomic builtins
+uint64_t frames_incomplete = 0;
+uint32_t max_buffers_awaiting = 0;
+static int peak_free_running = 0;
+static uint64_t peak_num_dropped = 0; // driver drop count at the last frame
+// pixel format the camera was actually set to
+static peak_pixel_format pixel_format = PEAK_PIXEL_FORMAT_MONO12;
 
 
 /* Helper function to determine if a year is a leap year (2020 is a leap year).
@@ -193,21 +309,6 @@ void verifyBlobParams(void)
 }
 
 
-/**
- * @brief function to take 16 bit pixel values which are filled with 12 bits and 
- * mask out the last 4 bits to ensure they are zero and not random garbage
- * @param packed pointer to array of pixel values from camera transfer
- * @param unpacked pointer to destination array for use by rest of code
- * @param num_pixels total number of pixels in image
- */
-void unpack_mono12(uint16_t* packed, uint16_t* unpacked, int num_pixels)
-{
-    for (int i = 0; i < num_pixels; i++) {
-        unpacked[i] = packed[i] & 0x0FFF; // this masks the last four pixels
-    }
-}
-
-
 /**
  * @brief Helper function to check return values of peak library calls and print
  * errors.
@@ -491,10 +592,12 @@ int setMonoAnalogGain(double analogGain)
         ret = -1;
     }
 
-    // Update metadata
-    double actualAnalogGain = 1.0;
-    getMonoAnalogGain(&actualAnalogGain);
-    default_metadata.gainfact = (float)actualAnalogGain;
+    // Update cache and metadata
+    double actualAnalogGain = camera_state.analog_gain;
+    if (getMonoAnalogGain(&actualAnalogGain) == 0) {
+        camera_state.analog_gain = actualAnalogGain;
+    }
+    default_metadata.gainfact = (float)camera_state.analog_gain;
 
     return ret;
 }
@@ -686,10 +789,12 @@ int setFps(double frameRateFps)
         ret = -1;
     }
 
-    // Update metadata
-    double currentFps = 10.0;;
-    getFps(&currentFps);
-    default_metadata.framerte = (float)currentFps;
+    // Update cache and metadata
+    double currentFps = camera_state.frame_rate;
+    if (getFps(&currentFps) == 0) {
+        camera_state.frame_rate = currentFps;
+    }
+    default_metadata.framerte = (float)camera_state.frame_rate;
 
     return ret;
 }
@@ -916,11 +1021,13 @@ int setExposureTime(double exposureTimeMs)
         ret = -1;
     }
 
-    // Update metadata
-    double actualExpTimeMs = -1.0;
-    getExposureTime(&actualExpTimeMs);
+    // Update cache and metadata
+    double actualExpTimeMs = camera_state.exposure_time_ms;
+    if (getExposureTime(&actualExpTimeMs) == 0) {
+        camera_state.exposure_time_ms = actualExpTimeMs;
+    }
     // FITS files want seconds, not ms
-    default_metadata.exptime = (float)(actualExpTimeMs / 1000.0);
+    default_metadata.exptime = (float)(camera_state.exposure_time_ms / 1000.0);
 
     return ret;
 }
@@ -1196,7 +1303,147 @@ int closeMessageQueue(void)
 }
 
 
-int initCamera(void)
+/**
+ * @brief Allocate the acquisition buffers once, from a single locked region so
+ * they can never be paged out, and announce them to the driver. Must be
+ * called after everything that affects the image size is set, and before
+ * acquisition starts.
+ * 
+ * @param count number of buffers; raised to the driver's minimum if needed
+ * @return int -1 if failed, 0 otherwise
+ */
+static int announceAcquisitionBuffers(size_t count)
+{
+    size_t buffer_size = 0;
+    size_t min_count = 0;
+    peak_status status = peak_Acquisition_Buffer_GetRequiredSize(hCam,
+        &buffer_size);
+    if (!checkForSuccess(status)) {
+        fprintf(stderr, "ERROR: Could not get the required buffer size.\n");
+        return -1;
+    }
+    status = peak_Acquisition_Buffer_GetRequiredCount(hCam, &min_count);
+    if (checkForSuccess(status) && (count < min_count)) {
+        printf("Raising acquisition buffer count from %zu to the required "
+            "%zu.\n", count, min_count);
+        count = min_count;
+    }
+
+    // keep each buffer cache line aligned
+    size_t stride = (buffer_size + 63) & ~(size_t)63;
+    size_t region_size = stride * count;
+    uint8_t* region = MAP_FAILED;
+    int huge = 0;
+#ifdef MAP_HUGETLB
+    if (use_huge_pages) {
+        size_t huge_page = 2 * 1024 * 1024;
+        size_t huge_size = (region_size + huge_page - 1) & ~(huge_page - 1);
+        region = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region == MAP_FAILED) {
+            fprintf(stderr, "Could not get %zu bytes of huge pages (%s), "
+                "using normal pages.\n", huge_size, strerror(errno));
+        } else {
+            region_size = huge_size;
+            huge = 1;
+        }
+    }
+#endif
+    if (region == MAP_FAILED) {
+        region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Could not allocate %zu bytes of acquisition "
+                "buffers: %s.\n", region_size, strerror(errno));
+            return -1;
+        }
+    }
+    // A page fault on a buffer mid-transfer costs more than the memory; but
+    // running without the lock is better than not running
+    if (mlock(region, region_size) < 0) {
+        fprintf(stderr, "WARNING: Could not lock acquisition buffers in memory "
+            "(%s). Check RLIMIT_MEMLOCK.\n", strerror(errno));
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        status = peak_Acquisition_Buffer_Announce(hCam, region + i * stride,
+            buffer_size, NULL);
+        if (!checkForSuccess(status)) {
+            fprintf(stderr, "ERROR: Could not announce acquisition buffer "
+                "%zu.\n", i);
+            // take back the buffers announced so far before unmapping them
+            if ((i > 0) &&
+                !checkForSuccess(peak_Acquisition_Buffer_RevokeAll(hCam))) {
+                fprintf(stderr, "ERROR: Failed to revoke acquisition "
+                    "buffers.\n");
+                // the driver may still write to them; keep them for
+                // revokeAcquisitionBuffers() to try again at shutdown
+                acq_buffer_region = region;
+                acq_buffer_region_size = region_size;
+                return -1;
+            }
+            munlock(region, region_size);
+            munmap(region, region_size);
+            return -1;
+        }
+    }
+    acq_buffer_region = region;
+    acq_buffer_region_size = region_size;
+    printf("Announced %zu acquisition buffers of %zu bytes%s.\n", count,
+        buffer_size, huge ? " in huge pages" : "");
+    return 0;
+}
+
+
+/**
+ * @brief Take back the buffers from announceAcquisitionBuffers(). Acquisition
+ * must be stopped.
+ */
+static void revokeAcquisitionBuffers(void)
+{
+    if (acq_buffer_region == NULL) {
+        return;
+    }
+    peak_status status = peak_Acquisition_Buffer_RevokeAll(hCam);
+    if (!checkForSuccess(status)) {
+        fprintf(stderr, "ERROR: Failed to revoke acquisition buffers.\n");
+        // the driver may still write to them; leak rather than unmap
+        return;
+    }
+    munlock(acq_buffer_region, acq_buffer_region_size);
+    munmap(acq_buffer_region, acq_buffer_region_size);
+    acq_buffer_region = NULL;
+    acq_buffer_region_size = 0;
+}
+
+
+/**
+ * @brief Buffer queue metrics. Backend getBufferStats for the peak backend.
+ * 
+ * @return int -1 if failed, 0 otherwise
+ */
+static int peakGetBufferStats(struct camera_buffer_stats_t* pStats)
+{
+    peak_acquisition_info info;
+    if (!PEAK_SUCCESS(peak_Acquisition_GetInfo(hCam, &info))) {
+        return -1;
+    }
+    pStats->announced = info.numAnnounced;
+    pStats->queued = info.numQueued;
+    pStats->awaiting_delivery = info.numAwaitDelivery;
+    pStats->dropped = info.numDropped;
+    pStats->incomplete = info.numIncomplete;
+    return 0;
+}
+
+
+/**
+ * @brief Open and configure the camera, then start acquisition. Backend init
+ * for the peak backend.
+ * 
+ * @return int -1 if failed, 0 otherwise
+ */
+static int peakInit(void)
 {
     // load the camera parameters
     if (loadCamera() < 0) {
@@ -1209,11 +1456,6 @@ int initCamera(void)
         return -1;
     }
 
-    // initialize astrometry
-    if (initAstrometry() < 0) {
-        return -1;
-    }
-
     // In place of logging all sensor parameters to a text file, save off the
     // camera parameter file.
     // This file is human-readable, and can be used to replicate the device
@@ -1234,13 +1476,36 @@ int initCamera(void)
     }
     // Only after all parameters that impact the image size are set, start
     // infinite image acquisition, will be triggered by software.
-    // Buffer is automatically allocated in the following call:
+    // Unless we announced our own, buffers are automatically allocated in the
+    // following call:
+    if ((acquisition_buffer_count > 0) &&
+        (announceAcquisitionBuffers((size_t)acquisition_buffer_count) < 0)) {
+        return -1;
+    }
     status = peak_Acquisition_Start(hCam, PEAK_INFINITE);
     if (!checkForSuccess(status)) {
         fprintf(stderr, "ERROR: Failed to start image acquisition. Exiting.\n");
         return -1;
     }
 
+    return 0;
+}
+
+
+int initCamera(void)
+{
+    if (verbose) {
+        printf("initCamera: using %s camera backend.\n", camera_backend->name);
+    }
+    if (camera_backend->init() < 0) {
+        return -1;
+    }
+
+    // initialize astrometry
+    if (initAstrometry() < 0) {
+        return -1;
+    }
+
     return 1;
 }
 
@@ -1259,7 +1524,7 @@ void clean(void)
 }
 
 
-void closeCamera(void)
+static void peakClose(void)
 {
     // Stop acquisition if ongoing
     if (PEAK_TRUE == peak_Acquisition_IsStarted(hCam)) {
@@ -1269,6 +1534,7 @@ void closeCamera(void)
                 "anyway.\n");
         }
     }
+    revokeAcquisitionBuffers();
 
     // Save off the parameters at shutdown
     char finalParameterFile[] = "/home/starcam/Desktop/TIMSC/parameters_last_shutdown.cset";
@@ -1291,6 +1557,12 @@ void closeCamera(void)
 }
 
 
+void closeCamera(void)
+{
+    camera_backend->close();
+}
+
+
 int setCameraParams(void)
 {
     if (setMinTriggerDelay() < 0) {
@@ -1386,14 +1658,26 @@ int loadCamera(void)
     }
     default_metadata.sensorid = (uint64_t)cameraId;
 
-    // Set pixel format to unpacked Mono12
+    // Set pixel format to packed Mono12p if requested, else unpacked Mono12
     accessStatus = peak_PixelFormat_GetAccessStatus(hCam);
     if (PEAK_IS_WRITEABLE(accessStatus)) {
-        status = peak_PixelFormat_Set(hCam,
-            PEAK_PIXEL_FORMAT_MONO12);
-        if (!checkForSuccess(status)) {
-            fprintf(stderr, "ERROR: Setting pixel format failed. Exiting.\n");
-            return -1;
+        pixel_format = PEAK_PIXEL_FORMAT_MONO12;
+        if (use_packed_pixels) {
+            status = peak_PixelFormat_Set(hCam, PEAK_PIXEL_FORMAT_MONO12P);
+            if (checkForSuccess(status)) {
+                pixel_format = PEAK_PIXEL_FORMAT_MONO12P;
+            } else {
+                fprintf(stderr, "WARNING: Packed pixel format unavailable, "
+                    "falling back to unpacked Mono12.\n");
+            }
+        }
+        if (pixel_format == PEAK_PIXEL_FORMAT_MONO12) {
+            status = peak_PixelFormat_Set(hCam,
+                PEAK_PIXEL_FORMAT_MONO12);
+            if (!checkForSuccess(status)) {
+                fprintf(stderr, "ERROR: Setting pixel format failed. Exiting.\n");
+                return -1;
+            }
         }
     }
     default_metadata.bitdepth = 12;
@@ -1499,9 +1783,12 @@ int saveImageToDisk(char* filename, peak_frame_handle hFrame)
  * in order to avoid solution latency to the flight control software.
  * 
  * @param pUnpackedImage pointer to array of image bytes
+ * @param pMetadata header values for this image; date and filename are filled
+ * in here
  * @return int -1 if failed, 0 otherwise
  */
-int saveFITStoDisk(uint16_t* pUnpackedImage)
+int saveFITStoDisk(uint16_t* pUnpackedImage,
+    struct fits_metadata_t* pMetadata)
 {
     int ret = 0;
     // Record file creation date as str
@@ -1523,7 +1810,7 @@ int saveFITStoDisk(uint16_t* pUnpackedImage)
         }
     }
     // Copy the creation date into the metadata struct
-    strftime(default_metadata.date, sizeof(default_metadata.date),
+    strftime(pMetadata->date, sizeof(pMetadata->date),
         "%Y-%m-%d_%H-%M-%S", tm_info);
 
     char FITSfilename[256] = "";
@@ -1532,12 +1819,12 @@ int saveFITStoDisk(uint16_t* pUnpackedImage)
         "/home/starcam/Desktop/TIMSC/img/"
         "saved_image_%Y-%m-%d_%H-%M-%S.fits.fz", tm_info);
 
-    snprintf(default_metadata.filename, sizeof(default_metadata.filename),
+    snprintf(pMetadata->filename, sizeof(pMetadata->filename),
         "%s", FITSfilename);
 
     // Write the FITS File
     int FITSstatus = writeImage(FITSfilename, pUnpackedImage, CAMERA_WIDTH,
-        CAMERA_HEIGHT, &default_metadata);
+        CAMERA_HEIGHT, pMetadata);
     if (0 != FITSstatus) {
         fprintf(stderr, "ERROR: writeImage failed.\n");
         ret = -1;
@@ -1546,58 +1833,111 @@ int saveFITStoDisk(uint16_t* pUnpackedImage)
 }
 
 
+// rows per task when unpacking and calibrating a frame
+#define TRANSFER_BAND_ROWS 64
+
+struct transfer_job_t {
+    const struct camera_frame_t* pFrame;
+    uint16_t* pImage;
+    int num_pixels;
+    const struct calibration_t* pCal;
+};
+
+
 /**
- * @brief Encapsulates the call to trigger an image capture. No image
- * acquisition or frame transfer logic.
- * @return int status: -1 if failed, 0 otherwise
+ * @brief parallelFor() task for unpackFrameBuffer(): unpack one band of rows
+ * and calibrate it while it is still in cache.
  */
-int imageCapture()
+static void unpackFrameBand(void* arg, int band)
 {
-    int ret = 0;
-    // Trigger the acquisition of an image
-    gettimeofday(&metadataTv, NULL);
-    peak_status status = peak_Trigger_Execute(hCam);
-    if (!checkForSuccess(status)) {
-        fprintf(stderr, "ERROR: Capture trigger failed.\n");
-        ret = -1;
+    struct transfer_job_t* job = (struct transfer_job_t*)arg;
+    // bands start on an even pixel, so on a whole Mono12p byte
+    int first = band * TRANSFER_BAND_ROWS * CAMERA_WIDTH;
+    int count = TRANSFER_BAND_ROWS * CAMERA_WIDTH;
+    if (count > job->num_pixels - first) {
+        count = job->num_pixels - first;
+    }
+    if (job->pFrame->packed) {
+        unpack_mono12p((uint8_t *)job->pFrame->memory +
+            MONO12P_NUM_BYTES(first), job->pImage + first, count);
+    } else {
+        unpack_mono12((uint16_t *)job->pFrame->memory + first,
+            job->pImage + first, count);
+    }
+    if (job->pCal != NULL) {
+        applyCalibration(job->pCal, job->pImage, first, count);
     }
-    return ret;
 }
 
 
 /**
- * @brief Transfer the captured image from the received camera frame buffer to a
- * 16-bit local buffer. This function encapsulates any bit unpacking required to
- * translate from the image capture format to the working format.
+ * @brief Expand a raw camera frame into 16-bit pixels, optionally applying
+ * the master calibration frames in the same pass, in bands of rows across
+ * the thread pool.
  * 
- * @param pUnpackedImage pointer to destination memory for the unpacked image.
- * IT IS THE CALLER'S RESPONSIBILITY TO PROVIDE ADEQUATE MEMORY ALLOCATION FOR
- * THE UNPACKED IMAGE.
- * @return int status: -1 for failure, 0 otherwise.
+ * @param pFrame frame from the camera backend
+ * @param pUnpackedImage destination for num_pixels pixels
+ * @param num_pixels number of pixels to unpack
+ * @param pCal calibration to apply, or NULL
+ * @return int -1 if the buffer is too small, 0 otherwise
  */
-int imageTransfer(uint16_t* pUnpackedImage)
+static int unpackFrameBuffer(struct camera_frame_t* pFrame,
+    uint16_t* pUnpackedImage, int num_pixels, const struct calibration_t* pCal)
 {
-    solveState = IMAGE_XFER;
-    int ret = 0;
-    peak_frame_handle hFrame = PEAK_INVALID_HANDLE;
-    double actualExpTimeMs = 1000.0; // if get fails, we'll wait 3s
-    getExposureTime(&actualExpTimeMs);
-    // Guard against truncation to 0. 0 is an invalid timeout.
-    actualExpTimeMs = fmax(1.0, actualExpTimeMs);
-    uint32_t three_frame_times_timeout_ms = (uint32_t)(3.0 * actualExpTimeMs + 0.5);
+    size_t expected = (pFrame->packed) ?
+        MONO12P_NUM_BYTES(num_pixels) : sizeof(uint16_t) * num_pixels;
+    if (pFrame->size < expected) {
+        fprintf(stderr, "ERROR: Frame buffer holds %zu bytes, expected %zu.\n",
+            pFrame->size, expected);
+        return -1;
+    }
+    struct transfer_job_t job = {
+        .pFrame = pFrame,
+        .pImage = pUnpackedImage,
+        .num_pixels = num_pixels,
+        .pCal = pCal,
+    };
+    int band_pixels = TRANSFER_BAND_ROWS * CAMERA_WIDTH;
+    parallelFor((num_pixels + band_pixels - 1) / band_pixels, unpackFrameBand,
+        &job);
+    return 0;
+}
 
-    if (verbose) {
-        printf("imageTransfer: Waiting for frame...\n");
+
+/**
+ * @brief Software-trigger one exposure. Backend trigger for the peak backend.
+ * 
+ * @return int -1 if failed, 0 otherwise
+ */
+static int peakTrigger(void)
+{
+    peak_status status = peak_Trigger_Execute(hCam);
+    if (!checkForSuccess(status)) {
+        return -1;
     }
+    return 0;
+}
 
-    // ---------------------------------------------------------------------- //
-    // Actual data transfer
-    // ---------------------------------------------------------------------- //
-    // wait for image transfer
-    peak_status status = peak_Acquisition_WaitForFrame(hCam,
-        three_frame_times_timeout_ms, &hFrame);
+
+/**
+ * @brief Wait for the next frame and get its buffer. Backend waitForFrame for
+ * the peak backend. On success the frame must be released with
+ * peakReleaseFrame().
+ * 
+ * @param timeout_ms how long to wait for the frame
+ * @param pFrame filled in with the frame buffer
+ * @return int -1 if failed, 0 otherwise
+ */
+static int peakWaitForFrame(uint32_t timeout_ms, struct camera_frame_t* pFrame)
+{
+    peak_frame_handle hFrame = PEAK_INVALID_HANDLE;
+    peak_status status = peak_Acquisition_WaitForFrame(hCam, timeout_ms,
+        &hFrame);
     if(status == PEAK_STATUS_TIMEOUT) {
-        fprintf(stderr, "ERROR: WaitForFrame timed out after 3 frame times.\n");
+        if (timeout_ms > 0) {
+            fprintf(stderr, "ERROR: WaitForFrame timed out after %u ms.\n",
+                timeout_ms);
+        }
         return -1;
     } else if(status == PEAK_STATUS_ABORTED) {
         fprintf(stderr, "ERROR: WaitForFrame aborted by camera.\n");
@@ -1609,107 +1949,471 @@ int imageTransfer(uint16_t* pUnpackedImage)
 
     // At this point we successfully got a frame handle. We need to release it
     // when done!
-    if(peak_Frame_IsComplete(hFrame) == PEAK_FALSE) {
-        printf("WARNING: Incomplete frame transfer.\n");
-    }
-
-    if (verbose) {
-        printf("imageTransfer: Got frame, unpacking...\n");
-    }
+    pFrame->handle = (void *)hFrame;
+    pFrame->complete = (peak_Frame_IsComplete(hFrame) != PEAK_FALSE);
 
     // get image from frame handle
     peak_buffer buffer = {NULL, 0, NULL};
     status = peak_Frame_Buffer_Get(hFrame, &buffer);
     if(!checkForSuccess(status)) {
         fprintf(stderr, "ERROR: Failed to get buffer from frame.\n");
+        status = peak_Frame_Release(hCam, hFrame);
+        if(!checkForSuccess(status)) {
+            fprintf(stderr, "ERROR: Frame_Release failed.\n");
+        }
         return -1;
     }
+    pFrame->memory = buffer.memoryAddress;
+    pFrame->size = buffer.memorySize;
+    pFrame->packed = (pixel_format == PEAK_PIXEL_FORMAT_MONO12P);
 
-    // If we want more image data, like the timestamp in camera
-    // time (since camera init), we could query here.
-    // This is also where we'd enable "chunks" for image metadata collection.
+    // In free-run, the driver drops frames when all its buffers are full of
+    // frames we have not picked up yet
+    pFrame->skipped = 0;
+    peak_acquisition_info info;
+    if (peak_free_running && PEAK_SUCCESS(peak_Acquisition_GetInfo(hCam, &info))) {
+        pFrame->skipped = (uint32_t)(info.numDropped - peak_num_dropped);
+        peak_num_dropped = info.numDropped;
+    }
+    return 0;
+}
 
-    // For the Mono12 unpacked format, each pixel occupies two bytes, and we can
-    // iterate after casting the memory pointer
-    if (verbose) {
-        printf("imageTransfer: Unpacking image bytes: %ld into local buffer of "
-            "size %ld\n", buffer.memorySize,
-            (sizeof(uint16_t) * CAMERA_NUM_PX));
+
+/**
+ * @brief Hand a frame buffer back to the camera. Backend releaseFrame for the
+ * peak backend.
+ * 
+ * @return int -1 if failed, 0 otherwise
+ */
+static int peakReleaseFrame(struct camera_frame_t* pFrame)
+{
+    peak_status status = peak_Frame_Release(hCam,
+        (peak_frame_handle)pFrame->handle);
+    if(!checkForSuccess(status)) {
+        fprintf(stderr, "ERROR: Frame_Release failed.\n");
+        return -1;
     }
+    return 0;
+}
 
-    unpack_mono12((uint16_t *)buffer.memoryAddress, pUnpackedImage,
-        CAMERA_NUM_PX);
 
-    // ---------------------------------------------------------------------- //
-    // Metadata handling
-    // ---------------------------------------------------------------------- //
+/**
+ * @brief Set or clear the pending software trigger, e.g. from a flight
+ * computer trigger packet, and wake the acquisition thread if it is waiting.
+ * 
+ * @param trigger 1 to request an exposure, 0 to cancel a pending request
+ */
+void setTrigger(int trigger)
+{
+    pthread_mutex_lock(&trigger_lock);
+    all_trigger_params.trigger = trigger;
+    if (trigger) {
+        gettimeofday(&trigger_received_tv, NULL);
+        pthread_cond_signal(&trigger_cond);
+    }
+    pthread_mutex_unlock(&trigger_lock);
+}
 
-    // Record the whole number and microsecond parts of the timestamp as the
-    // time of observation start
-    default_metadata.utcsec = (uint64_t)metadataTv.tv_sec;
-    default_metadata.utcusec = (uint64_t)metadataTv.tv_usec;
 
-    // Focus and aperture commands update this member after the command is
-    // issued. So it should be current, and we don't want to ask the lens again.
-    default_metadata.focus = (int16_t)all_camera_params.focus_position;
-    default_metadata.focusMin = (int16_t)all_camera_params.min_focus_pos;
-    default_metadata.focusMax = (int16_t)all_camera_params.max_focus_pos;
-    default_metadata.aperture = (int16_t)all_camera_params.current_aperture;
+/**
+ * @brief Block until setTrigger() requests an exposure, then consume the
+ * request. Wakes up every TRIGGER_SHUTDOWN_CHECK_MS to notice a shutdown,
+ * since the signal handler cannot signal the condition variable.
+ * 
+ * @param pReceivedTv filled in with the arrival time of the trigger
+ * @return int -1 if shutting down, 0 otherwise
+ */
+static int waitForTrigger(struct timeval* pReceivedTv)
+{
+    struct timespec deadline = {0, 0};
 
-    status = peak_Frame_Release(hCam, hFrame);
-    if(!checkForSuccess(status)) {
-        fprintf(stderr, "ERROR: Frame_Release failed.\n");
-        ret = -1;
+    pthread_mutex_lock(&trigger_lock);
+    while (all_trigger_params.trigger == 0 && !shutting_down) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRIGGER_SHUTDOWN_CHECK_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&trigger_cond, &trigger_lock, &deadline);
     }
-
-    return ret;
+    if (shutting_down) {
+        pthread_mutex_unlock(&trigger_lock);
+        return -1;
+    }
+    // set the trigger to 0 now that we are going to take an image
+    all_trigger_params.trigger = 0;
+    *pReceivedTv = trigger_received_tv;
+    pthread_mutex_unlock(&trigger_lock);
+    return 0;
 }
 
 
 /**
- * @brief Set the Binning Factor
- * @details In order to change binning, we must stop and re-start acquisition.
- * NOTE: binning will mess up GUI display of images, slightly. They should
- * be readable, but reading an image of half-width into a full-width
- * memory to send to the GUI will give two side-by-side images, where the
- * images consist of every other row, and the memory of the last full-size
- * image occupies the lower half of the memory.
- * The way to fix would be to keep track of the image size when transmitting
- * and receiving, extremely not worth it.
+ * @brief Switch between software triggering and free-running at the frame rate
+ * set by setFps(). Backend setFreeRun for the peak backend.
  * 
- * @param factor 
+ * @param enable 1 to free-run, 0 to go back to software triggers
  * @return int -1 if failed, 0 otherwise
  */
-int setBinningFactor(uint8_t factor)
+static int peakSetFreeRun(int enable)
 {
     int ret = 0;
     peak_status status = PEAK_STATUS_SUCCESS;
 
-    // Stop acquisition if ongoing.
-    // If we fail to stop image acquisition, binning will fail, so fail AF.
+    // The trigger configuration can only change while not acquiring
     if (PEAK_TRUE == peak_Acquisition_IsStarted(hCam)) {
         status = peak_Acquisition_Stop(hCam);
         if (!checkForSuccess(status)) {
-            fprintf(stderr, "ERROR: Failed to stop image acquisition."
-                "anyway.\n");
+            fprintf(stderr, "ERROR: Failed to stop image acquisition.\n");
             return -1;
         }
     }
 
-    // If we stopped acquisition, but we still don't have access to binning,
-    // attempt to restart acquisition but fail AF.
-    peak_access_status accessStatus = peak_BinningManual_GetAccessStatus(hCam,
-        PEAK_SUBSAMPLING_ENGINE_SENSOR);
-    if (PEAK_IS_WRITEABLE(accessStatus)) {
-        status = peak_BinningManual_Set(hCam, PEAK_SUBSAMPLING_ENGINE_FPGA,
-            (uint32_t)factor, (uint32_t)factor);
-        // If we could set binning, but it failed, attempt to restart
-        // acquisition but fail AF.
-        if(!checkForSuccess(status)) {
-            fprintf(stderr, "ERROR: setBinningFactor: setting factor %d "
-                "failed.\n", factor);
-            // Re-start acquisition. If we ever fail to re-start acquisition,
-            // exit.
+    status = peak_Trigger_Enable(hCam, enable ? PEAK_FALSE : PEAK_TRUE);
+    if (!checkForSuccess(status)) {
+        fprintf(stderr, "ERROR: peakSetFreeRun: %s the trigger failed.\n",
+            enable ? "Disabling" : "Enabling");
+        ret = -1;
+    } else {
+        peak_free_running = enable;
+    }
+
+    // Re-start acquisition. If we ever fail to re-start acquisition, exit.
+    status = peak_Acquisition_Start(hCam, PEAK_INFINITE);
+    if (!checkForSuccess(status)) {
+        fprintf(stderr, "ERROR: Failed to start image acquisition. Exiting.\n");
+        closeCamera();
+        clean();
+        return -1;
+    }
+    peak_acquisition_info info;
+    if (PEAK_SUCCESS(peak_Acquisition_GetInfo(hCam, &info))) {
+        peak_num_dropped = info.numDropped;
+    }
+    return ret;
+}
+
+
+/**
+ * @brief Replace a free-run frame with the newest one the camera has already
+ * delivered, releasing any stale ones in between, so processing never falls
+ * behind the camera. Drops are added to frames_dropped.
+ * 
+ * @param pFrame frame from waitForFrame(); replaced by the newest frame
+ */
+static void takeNewestFrame(struct camera_frame_t* pFrame)
+{
+    struct camera_frame_t newer = {0};
+    uint64_t dropped = pFrame->skipped;
+
+    while (camera_backend->waitForFrame(0, &newer) == 0) {
+        camera_backend->releaseFrame(pFrame);
+        *pFrame = newer;
+        dropped += 1 + newer.skipped;
+    }
+    uint64_t total = __atomic_add_fetch(&frames_dropped, dropped,
+        __ATOMIC_RELAXED);
+    if (verbose && (dropped > 0)) {
+        printf("takeNewestFrame: dropped %" PRIu64 " stale frames (%" PRIu64
+            " total).\n", dropped, total);
+    }
+}
+
+
+/**
+ * @brief Record how full the driver's buffer queue is after taking a frame,
+ * for sizing --buffers against bursts of triggers.
+ */
+static void reportBufferStats(void)
+{
+    struct camera_buffer_stats_t stats = {0};
+    if ((camera_backend->getBufferStats == NULL) ||
+        (camera_backend->getBufferStats(&stats) < 0)) {
+        return;
+    }
+    // the report may reset the maximum between our load and store
+    uint32_t seen = __atomic_load_n(&max_buffers_awaiting, __ATOMIC_RELAXED);
+    while ((stats.awaiting_delivery > seen) &&
+           !__atomic_compare_exchange_n(&max_buffers_awaiting, &seen,
+               stats.awaiting_delivery, 0, __ATOMIC_RELAXED,
+               __ATOMIC_RELAXED)) {
+        // seen now holds the current value; try again
+    }
+    if (verbose) {
+        printf("Buffers: %u of %u awaiting delivery, %u queued for capture; "
+            "%" PRIu64 " dropped, %" PRIu64 " incomplete so far.\n",
+            stats.awaiting_delivery, stats.announced, stats.queued,
+            stats.dropped, stats.incomplete);
+    }
+}
+
+
+/**
+ * @brief Encapsulates the call to trigger an image capture. No image
+ * acquisition or frame transfer logic.
+ * @return int status: -1 if failed, 0 otherwise
+ */
+int imageCapture()
+{
+    int ret = 0;
+    // Trigger the acquisition of an image
+    gettimeofday(&metadataTv, NULL);
+    if (camera_backend->trigger() < 0) {
+        fprintf(stderr, "ERROR: Capture trigger failed.\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+
+/**
+ * @brief Transfer the captured image from the received camera frame buffer to a
+ * 16-bit local buffer. This function encapsulates any bit unpacking required to
+ * translate from the image capture format to the working format, and applies
+ * the master dark and flat if they are loaded (see loadCalibrationFrames()).
+ * 
+ * @param pUnpackedImage pointer to destination memory for the unpacked image.
+ * IT IS THE CALLER'S RESPONSIBILITY TO PROVIDE ADEQUATE MEMORY ALLOCATION FOR
+ * THE UNPACKED IMAGE.
+ * @return int status: -1 for failure, 0 otherwise.
+ */
+int imageTransfer(uint16_t* pUnpackedImage)
+{
+    solveState = IMAGE_XFER;
+    int ret = 0;
+    struct camera_frame_t frame = {0};
+    // Guard against truncation to 0. 0 is an invalid timeout.
+    double actualExpTimeMs = fmax(1.0, camera_state.exposure_time_ms);
+    uint32_t three_frame_times_timeout_ms = (uint32_t)(3.0 * actualExpTimeMs + 0.5);
+    int free_run = (all_trigger_params.trigger_mode == 2);
+    if (free_run && (camera_state.frame_rate > 0.0)) {
+        // the next frame may not start until a frame period from now
+        three_frame_times_timeout_ms += (uint32_t)(3000.0 /
+            camera_state.frame_rate + 0.5);
+    }
+
+    if (verbose) {
+        printf("imageTransfer: Waiting for frame...\n");
+    }
+
+    // ---------------------------------------------------------------------- //
+    // Actual data transfer
+    // ---------------------------------------------------------------------- //
+    // wait for image transfer
+    if (camera_backend->waitForFrame(three_frame_times_timeout_ms, &frame) < 0) {
+        return -1;
+    }
+    if (free_run) {
+        takeNewestFrame(&frame);
+        // there is no trigger to stamp: the exposure ended about now
+        gettimeofday(&metadataTv, NULL);
+        double start = metadataTv.tv_sec + metadataTv.tv_usec / 1e6 -
+            actualExpTimeMs / 1000.0;
+        metadataTv.tv_sec = (time_t)start;
+        metadataTv.tv_usec = (suseconds_t)((start - metadataTv.tv_sec) * 1e6);
+    }
+
+    // At this point we successfully got a frame. We need to release it
+    // when done!
+    if (!frame.complete) {
+        printf("WARNING: Incomplete frame transfer.\n");
+        __atomic_add_fetch(&frames_incomplete, 1, __ATOMIC_RELAXED);
+    }
+    reportBufferStats();
+
+    if (verbose) {
+        printf("imageTransfer: Got frame, unpacking...\n");
+    }
+
+    // If we want more image data, like the timestamp in camera
+    // time (since camera init), we could query here.
+    // This is also where we'd enable "chunks" for image metadata collection.
+
+    // For the Mono12 unpacked format, each pixel occupies two bytes; Mono12p
+    // packs two pixels into three bytes
+    if (verbose) {
+        printf("imageTransfer: Unpacking image bytes: %ld into local buffer of "
+            "size %ld\n", frame.size,
+            (sizeof(uint16_t) * CAMERA_NUM_PX));
+    }
+
+    if (unpackFrameBuffer(&frame, pUnpackedImage, CAMERA_NUM_PX, 
+                          &calibration) < 0) {
+        ret = -1;
+    }
+
+    // ---------------------------------------------------------------------- //
+    // Metadata handling
+    // ---------------------------------------------------------------------- //
+
+    // Record the whole number and microsecond parts of the timestamp as the
+    // time of observation start
+    default_metadata.utcsec = (uint64_t)metadataTv.tv_sec;
+    default_metadata.utcusec = (uint64_t)metadataTv.tv_usec;
+
+    // Focus and aperture commands update this member after the command is
+    // issued. So it should be current, and we don't want to ask the lens again.
+    default_metadata.focus = (int16_t)all_camera_params.focus_position;
+    default_metadata.focusMin = (int16_t)all_camera_params.min_focus_pos;
+    default_metadata.focusMax = (int16_t)all_camera_params.max_focus_pos;
+    default_metadata.aperture = (int16_t)all_camera_params.current_aperture;
+
+    if (camera_backend->releaseFrame(&frame) < 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+
+/**
+ * @brief Load the master dark and flat (MASTER_DARK, MASTER_FLAT) that exist,
+ * to be applied to every frame from now on. They stay resident; either may
+ * be missing.
+ * 
+ * @return int -1 if failed, 0 otherwise (including when there are none)
+ */
+int loadCalibrationFrames(void)
+{
+    uint16_t * dark = NULL;
+    uint16_t * flat = NULL;
+
+    freeCalibration(&calibration);
+    if (access(MASTER_DARK, F_OK) == 0) {
+        dark = malloc(CAMERA_NUM_PX * sizeof(uint16_t));
+        if ((dark == NULL) || 
+            (readImage(MASTER_DARK, dark, CAMERA_WIDTH, CAMERA_HEIGHT) != 0)) {
+            fprintf(stderr, "Could not load master dark %s.\n", MASTER_DARK);
+            free(dark);
+            return -1;
+        }
+    }
+    if (access(MASTER_FLAT, F_OK) == 0) {
+        flat = malloc(CAMERA_NUM_PX * sizeof(uint16_t));
+        if ((flat == NULL) || 
+            (readImage(MASTER_FLAT, flat, CAMERA_WIDTH, CAMERA_HEIGHT) != 0)) {
+            fprintf(stderr, "Could not load master flat %s.\n", MASTER_FLAT);
+            free(dark);
+            free(flat);
+            return -1;
+        }
+    }
+    // calibration takes over the dark; the flat is only needed for gains
+    int ret = buildCalibration(dark, flat, CAMERA_NUM_PX, &calibration);
+    free(flat);
+    if (ret < 0) {
+        return -1;
+    }
+    if (verbose || calibration.dark || calibration.gain) {
+        printf("Calibration: %s dark (pedestal %u ADU), %s flat.\n", 
+               calibration.dark ? "master" : "no", calibration.pedestal, 
+               calibration.gain ? "master" : "no");
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Build a master calibration frame from the average of num_frames
+ * exposures at the current camera settings: lens capped for a dark, or an
+ * evenly lit field for a flat. Frames are averaged uncalibrated.
+ * 
+ * @param path file to write, e.g. MASTER_DARK or MASTER_FLAT
+ * @param num_frames number of exposures to average
+ * @return int -1 if failed, 0 otherwise
+ */
+int makeMasterFrame(char * path, int num_frames)
+{
+    uint32_t * sum = calloc(CAMERA_NUM_PX, sizeof(uint32_t));
+    uint16_t * image = malloc(CAMERA_NUM_PX * sizeof(uint16_t));
+    struct calibration_t loaded = calibration;
+    int ret = 0;
+
+    if ((sum == NULL) || (image == NULL)) {
+        fprintf(stderr, "makeMasterFrame: out of memory.\n");
+        free(sum);
+        free(image);
+        return -1;
+    }
+    memset(&calibration, 0, sizeof(calibration));
+    for (int k = 0; k < num_frames; k++) {
+        if ((imageCapture() < 0) || (imageTransfer(image) < 0)) {
+            fprintf(stderr, "makeMasterFrame: could not take frame %d.\n", 
+                    k + 1);
+            ret = -1;
+            break;
+        }
+        for (int i = 0; i < CAMERA_NUM_PX; i++) {
+            sum[i] += image[i];
+        }
+        if (verbose) {
+            printf("makeMasterFrame: frame %d of %d.\n", k + 1, num_frames);
+        }
+    }
+    calibration = loaded;
+
+    if ((ret == 0) && (averageFrames(sum, num_frames, CAMERA_NUM_PX, image) 
+                       == 0)) {
+        if (writeImage(path, image, CAMERA_WIDTH, CAMERA_HEIGHT, 
+                       &default_metadata) != 0) {
+            fprintf(stderr, "makeMasterFrame: could not write %s.\n", path);
+            ret = -1;
+        } else {
+            printf("Wrote the average of %d frames to %s.\n", num_frames, 
+                   path);
+        }
+    } else {
+        ret = -1;
+    }
+    free(sum);
+    free(image);
+    return ret;
+}
+
+
+/**
+ * @brief Set the Binning Factor
+ * @details In order to change binning, we must stop and re-start acquisition.
+ * NOTE: binning will mess up GUI display of images, slightly. They should
+ * be readable, but reading an image of half-width into a full-width
+ * memory to send to the GUI will give two side-by-side images, where the
+ * images consist of every other row, and the memory of the last full-size
+ * image occupies the lower half of the memory.
+ * The way to fix would be to keep track of the image size when transmitting
+ * and receiving, extremely not worth it.
+ * 
+ * @param factor 
+ * @return int -1 if failed, 0 otherwise
+ */
+int setBinningFactor(uint8_t factor)
+{
+    int ret = 0;
+    peak_status status = PEAK_STATUS_SUCCESS;
+
+    // Stop acquisition if ongoing.
+    // If we fail to stop image acquisition, binning will fail, so fail AF.
+    if (PEAK_TRUE == peak_Acquisition_IsStarted(hCam)) {
+        status = peak_Acquisition_Stop(hCam);
+        if (!checkForSuccess(status)) {
+            fprintf(stderr, "ERROR: Failed to stop image acquisition."
+                "anyway.\n");
+            return -1;
+        }
+    }
+
+    // If we stopped acquisition, but we still don't have access to binning,
+    // attempt to restart acquisition but fail AF.
+    peak_access_status accessStatus = peak_BinningManual_GetAccessStatus(hCam,
+        PEAK_SUBSAMPLING_ENGINE_SENSOR);
+    if (PEAK_IS_WRITEABLE(accessStatus)) {
+        status = peak_BinningManual_Set(hCam, PEAK_SUBSAMPLING_ENGINE_FPGA,
+            (uint32_t)factor, (uint32_t)factor);
+        // If we could set binning, but it failed, attempt to restart
+        // acquisition but fail AF.
+        if(!checkForSuccess(status)) {
+            fprintf(stderr, "ERROR: setBinningFactor: setting factor %d "
+                "failed.\n", factor);
+            // Re-start acquisition. If we ever fail to re-start acquisition,
+            // exit.
             status = peak_Acquisition_Start(hCam, PEAK_INFINITE);
             if (!checkForSuccess(status)) {
                 fprintf(stderr, "ERROR: Failed to start image acquisition. Exiting.\n");
@@ -1741,36 +2445,23 @@ int setBinningFactor(uint8_t factor)
         clean();
         return -1;
     }
+    camera_state.binning = factor;
+    default_metadata.ccdbin1 = factor;
+    default_metadata.ccdbin2 = factor;
 
     return 0;
 }
 
 
-/**
- * @brief set binning back to 1
- * 
- * @return int -1 if failed, 0 otherwise
- */
-int restoreBinningFactor(void)
-{
-    int ret = 0;
-    if (setBinningFactor(1U) < 0) {
-        // normal operation depends on correct binning factor set
-        fprintf(stderr, "FATAL ERROR: restoreBinningFactor: failed to return "
-            "binning factor to 1.\n");
-        ret = -1;
-    }
-    return ret;
-}
-
-
 /**
  * @brief Measure image sharpness using the our own methods
  * 
  * @param pSharpness to double to store sharpness value
+ * @param pImage memory for the unpacked full resolution image, which is binned
+ * by CAMERA_FOCUS_BINFACTOR on the host before measuring
  * @return int status: -1 for failure, 0 otherwise.
  */
-int measureSharpness(double* pSharpness)
+int measureSharpness(double* pSharpness, uint16_t* pImage)
 {
     START(tstart);
     int ret = 0;
@@ -1790,9 +2481,8 @@ int measureSharpness(double* pSharpness)
         firstTime = 0;
     }
 
-    peak_frame_handle hFrame = PEAK_INVALID_HANDLE;
-    double actualExpTimeMs = 1000.0; // if get fails, we'll wait 3s
-    getExposureTime(&actualExpTimeMs);
+    struct camera_frame_t frame = {0};
+    double actualExpTimeMs = fmax(1.0, camera_state.exposure_time_ms);
 
     // For short exposures (10 ms), it seems 3x is too short sometimes?
     uint32_t timeout_ms = (uint32_t)(10.0 * actualExpTimeMs + 0.5);
@@ -1805,47 +2495,36 @@ int measureSharpness(double* pSharpness)
     // Actual data transfer
     // ---------------------------------------------------------------------- //
     // wait for image transfer
-    peak_status status = peak_Acquisition_WaitForFrame(hCam,
-        timeout_ms, &hFrame);
-    if(status == PEAK_STATUS_TIMEOUT) {
-        fprintf(stderr, "ERROR: WaitForFrame timed out after 10 frame times.\n");
-        return -1;
-    } else if(status == PEAK_STATUS_ABORTED) {
-        fprintf(stderr, "ERROR: WaitForFrame aborted by camera.\n");
-        return -1;
-    } else if(!checkForSuccess(status)) {
-        fprintf(stderr, "ERROR: WaitForFrame failed.\n");
+    if (camera_backend->waitForFrame(timeout_ms, &frame) < 0) {
         return -1;
     }
 
-    // At this point we successfully got a frame handle. We need to release it
+    // At this point we successfully got a frame. We need to release it
     // when done!
-    if(peak_Frame_IsComplete(hFrame) == PEAK_FALSE) {
+    if (!frame.complete) {
         printf("WARNING: Incomplete frame transfer.\n");
     }
 
     if (verbose) {
-        printf("imageTransfer: Got frame, unpacking...\n");
+        printf("measureSharpness: Got frame, unpacking...\n");
     }
 
-    // get image from frame handle
-    peak_buffer buffer = {NULL, 0, NULL};
-    status = peak_Frame_Buffer_Get(hFrame, &buffer);
-    if(!checkForSuccess(status)) {
-        fprintf(stderr, "ERROR: Failed to get buffer from frame.\n");
-        status = peak_Frame_Release(hCam, hFrame);
-        if(!checkForSuccess(status)) {
-            fprintf(stderr, "ERROR: Frame_Release failed.\n");
-        }
+    int unpack_ret = unpackFrameBuffer(&frame, pImage, CAMERA_NUM_PX, NULL);
+    // the camera can have its buffer back as soon as we have a copy
+    if (camera_backend->releaseFrame(&frame) < 0) {
+        ret = -1;
+    }
+    if (unpack_ret < 0) {
         return -1;
     }
-    unpack_mono12((uint16_t *)buffer.memoryAddress, unpacked_image,
-        binnedImageNumPix);
+
+    binImage(pImage, CAMERA_WIDTH, CAMERA_HEIGHT, CAMERA_FOCUS_BINFACTOR,
+        binnedImage);
 
     // measure sharpness
     // convolution needs floats
     for (unsigned int i = 0; i < binnedImageNumPix; i++) {
-        imageFloatIn[i] = (float)unpacked_image[i];
+        imageFloatIn[i] = (float)binnedImage[i];
     }
 
     // Used for normalizing the contrast metric
@@ -1877,11 +2556,6 @@ int measureSharpness(double* pSharpness)
     // divide by # px because metric is usually quite high - better for display
     *pSharpness = sobelMetric / binnedImageNumPix;
 
-    status = peak_Frame_Release(hCam, hFrame);
-    if(!checkForSuccess(status)) {
-        fprintf(stderr, "ERROR: Frame_Release failed.\n");
-        ret = -1;
-    }
     STOP(tend);
     DISPLAY_DELTA("sharpness time", DELTA(tend, tstart));
 
@@ -1921,9 +2595,30 @@ int renewCameraHotPixels(void)
 }
 
 
+struct camera_backend_t peak_backend = {
+    .name = "peak",
+    .init = peakInit,
+    .close = peakClose,
+    .trigger = peakTrigger,
+    .waitForFrame = peakWaitForFrame,
+    .releaseFrame = peakReleaseFrame,
+    .setExposureTime = setExposureTime,
+    .setGain = setMonoAnalogGain,
+    .setBinning = setBinningFactor,
+    .setFreeRun = peakSetFreeRun,
+    .getBufferStats = peakGetBufferStats,
+    .renewHotPixels = renewCameraHotPixels,
+    .initMessages = initMessageQueue,
+    .pollMessages = pollMessageQueue,
+    .closeMessages = closeMessageQueue,
+};
+struct camera_backend_t* camera_backend = &peak_backend;
+
+
 /* Function to mask hot pixels accordinging to static and dynamic maps.
-** Input: The image bytes (ib), the image border indices (i0, j0, i1, j1), rest 
-** are 0.
+** Input: The image bytes (ib), the image border indices (i0, j0, i1, j1), x0 and
+** y0 are 0. subframe is 1 when (i0, j0, i1, j1) is a tracking window: only
+** that window is masked, and the static map is neither reloaded nor reported.
 ** Output: None (void). Makes the dynamic and static hot pixel masks for the 
 ** Star Camera image.
 */
@@ -1931,64 +2626,31 @@ void makeMask(uint16_t * ib, int i0, int j0, int i1, int j1, int x0, int y0,
               bool subframe)
 {
     static int first_time = 1;
-    static int * x_p = NULL, * y_p = NULL;
-    static int num_p = 0, num_alloc = 0;
+    static struct hot_pixel_map_t hp_map = {0};
 
-    if (first_time) {
-        mask = calloc(CAMERA_NUM_PX, 1);
-        x_p = calloc(100, sizeof(int));
-        y_p = calloc(100, sizeof(int));
-        num_alloc = 100;
-    }
-
-    // load static hot pixel mask
-    if (first_time || all_blob_params.make_static_hp_mask) {
-        // read from file with bright pixel coordinates in it
-        FILE * f = fopen(STATIC_HP_MASK, "r");
-        int i, j;
-        num_p = 0;
-
-        if (f) {
-            if (verbose) {
-                printf("\n+---------------------------------------------------------+\n");
-                printf("|\t\tLoading static hot pixel map...\t\t  |\n");
-                printf("|---------------------------------------------------------|\n");
-            }
-
-            char * line = NULL;
-            size_t len = 0;
-            int read = 0;
-
-            // read every line in the file
-            while ((read = getline(&line, &len, f)) != -1) {
-                sscanf(line, "%d,%d\n", &i, &j);
-
-                if (num_p >= num_alloc) {
-                    num_alloc += 100;
-                    x_p = realloc(x_p, sizeof(int) * num_alloc);
-                    y_p = realloc(y_p, sizeof(int) * num_alloc);
-                }
-
-                x_p[num_p] = i;
-                // map y coordinate to image in memory from Kst blob
-                y_p[num_p] = CAMERA_HEIGHT - j; 
-
-                // TODO(evanmayer) figure out a less annoying way to report this
-                // if (verbose) {
-                //     printf("|\tCoordinates read from hp file: [%4i, %4i]\t  |\n", 
-                //            i, j);
-                // }
+    // map static hot pixel mask. Subframes only reuse the map loaded for the
+    // last full frame.
+    if (first_time || (all_blob_params.make_static_hp_mask && !subframe)) {
+        if (verbose) {
+            printf("\n+---------------------------------------------------------+\n");
+            printf("|\t\tLoading static hot pixel map...\t\t  |\n");
+            printf("|---------------------------------------------------------|\n");
+        }
 
-                num_p++;
-            }
-            
-            if (verbose) {
-                printf("+---------------------------------------------------------+\n");
-            }
+        unloadHotPixelMap(&hp_map);
+        // carry over a map from the old text format the first time through
+        if ((access(STATIC_HP_MAP, F_OK) != 0) &&
+            (access(STATIC_HP_MASK, F_OK) == 0)) {
+            convertHotPixelText(STATIC_HP_MASK, STATIC_HP_MAP, CAMERA_WIDTH,
+                                CAMERA_HEIGHT);
+        }
+        if ((loadHotPixelMap(STATIC_HP_MAP, CAMERA_WIDTH, CAMERA_HEIGHT, 
+                             &hp_map) < 0) && verbose) {
+            printf("|\t\tNo static hot pixel map loaded.\t\t  |\n");
+        }
 
-            fflush(f);
-            fclose(f);
-            free(line);
+        if (verbose) {
+            printf("+---------------------------------------------------------+\n");
         }
 
         // do not want to recreate hp mask automatically, so set field to 0
@@ -1998,8 +2660,6 @@ void makeMask(uint16_t * ib, int i0, int j0, int i1, int j1, int x0, int y0,
     }
 
     int i, j;
-    int p0, p1, p2, p3, p4;
-    int a, b;
     
     int cutoff = all_blob_params.spike_limit*100.0;
 
@@ -2018,165 +2678,80 @@ void makeMask(uint16_t * ib, int i0, int j0, int i1, int j1, int x0, int y0,
     j1--;
   
     if (all_blob_params.dynamic_hot_pixels) {
-        int nhp = 0;
-
-        for (j = j0; j < j1; j++) {
-            for (i = i0; i < i1; i++) {
-                // pixels left/right, above/below
-                p0 = 100*ib[i + j*CAMERA_WIDTH]/cutoff;
-                p1 = ib[i - 1 + (j)*CAMERA_WIDTH];
-                p2 = ib[i + 1 + (j)*CAMERA_WIDTH];
-                p3 = ib[i + (j+1)*CAMERA_WIDTH];
-                p4 = ib[i + (j-1)*CAMERA_WIDTH];
-                a = p1 + p2 + p3 + p4 + 4;
-                // pixels on diagonal (upper left/right, lower left/right)
-                p1 = ib[i - 1 + (j-1)*CAMERA_WIDTH];
-                p2 = ib[i + 1 + (j+1)*CAMERA_WIDTH];
-                p3 = ib[i - 1 + (j+1)*CAMERA_WIDTH];
-                p4 = ib[i + 1 + (j-1)*CAMERA_WIDTH];
-                b = p1 + p2 + p3 + p4 + 4;
-                mask[i + j*CAMERA_WIDTH] = ((p0 < a) && (p0 < b));
-                if (p0 > a || p0 > b) nhp++;
-            }
-        }
+        // compare each pixel to its edge and corner neighbours
+        int nhp = maskDynamicHotPixels(ib, CAMERA_WIDTH, i0, j0, i1, j1, 
+                                       cutoff, mask);
 
-        if (verbose) {
+        if (verbose && !subframe) {
             printf("\n(*) Number of hot pixels found: %d.\n\n", nhp);
         }
     } else {
-        for (j = j0; j < j1; j++) {
-            for (i = i0; i < i1; i++) {
-                mask[i + j*CAMERA_WIDTH] = 1;
+        // a cutoff of 0 unmasks every pixel
+        maskDynamicHotPixels(ib, CAMERA_WIDTH, i0, j0, i1, j1, 0, mask);
+    }
+
+    if (cosmic_ray_sigma > 0.0f) {
+        // the test reads 2 px around each pixel
+        int ci0 = (i0 > 2) ? i0 : 2;
+        int cj0 = (j0 > 2) ? j0 : 2;
+        int ci1 = (i1 < CAMERA_WIDTH - 2) ? i1 : CAMERA_WIDTH - 2;
+        int cj1 = (j1 < CAMERA_HEIGHT - 2) ? j1 : CAMERA_HEIGHT - 2;
+        int hits = maskCosmicRays(ib, CAMERA_WIDTH, ci0, cj0, ci1, cj1,
+                                  cosmic_ray_sigma, mask);
+        if (subframe) {
+            frame_cosmic_ray_hits += hits;
+        } else {
+            frame_cosmic_ray_hits = hits;
+            if (verbose) {
+                printf("\n(*) Number of cosmic ray hits masked: %d.\n\n", 
+                       hits);
             }
         }
     }
 
     if (all_blob_params.use_static_hp_mask) {
-        if (verbose) {
+        if (verbose && !subframe) {
             printf("+---------------------------------------------------------+\n");
-            printf("|\t\tMasking %d pixels...\t\t\t  |\n", num_p);
+            printf("|\t\tMasking %u pixels...\t\t\t  |\n", hp_map.count);
             printf("|---------------------------------------------------------|\n");
         }
 
-        for (int i = 0; i < num_p; i++) {
-            // set all static hot pixels to 0
-            // if (verbose) {
-            //     printf("|\tCoordinates going into mask: [%4i, %4i]\t  |\n", 
-            //            x_p[i], CAMERA_HEIGHT - y_p[i]);
-            // }
-
-            int ind = CAMERA_WIDTH * y_p[i] + x_p[i];
-            mask[ind] = 0;
-        }
+        // set all static hot pixels inside the (sub)frame to 0
+        applyHotPixelMap(&hp_map, CAMERA_WIDTH, mask, i0, j0, i1, j1);
 
-        if (verbose) {
+        if (verbose && !subframe) {
             printf("+---------------------------------------------------------+\n");
         }
     }
 }
 
 
-/* Function to process the image with a filter to reduce noise.
-** Input:
-** Output:
-*/
-
-/**
- * @brief Function that will do a simple boxcar smoothing of an image.
- * 
- * @param ib "input buffer" the input image with 12 bit depth, stored in 16bit ints
- * @param i0 starting column for filtering
- * @param j0 starting row for filtering
- * @param i1 ending column for filtering
- * @param j1 ending row for filtering
- * @param r_f boxcar filter radius
- * @param filtered_image output image
- */
-void boxcarFilterImage(uint16_t * ib, int i0, int j0, int i1, int j1, int r_f, 
-                       double * filtered_image)
-{
-    static int first_time = 1;
-    static char * nc = NULL;
-    static uint64_t * ibc1 = NULL;
-
-    if (first_time) {
-        nc = calloc(CAMERA_NUM_PX, 1);
-        ibc1 = calloc(CAMERA_NUM_PX, sizeof(uint64_t));
-        first_time = 0;
-    }
-
-    int b = r_f;
-    int64_t isx;
-    int s, n;
-    double ds, dn;
-    double last_ds = 0;
-
-    for (int j = j0; j < j1; j++) {
-        n = 0;
-        isx = 0;
-        for (int i = i0; i < i0 + 2*r_f + 1; i++) {
-            n += mask[i + j*CAMERA_WIDTH];
-            isx += ib[i + j*CAMERA_WIDTH]*mask[i + j*CAMERA_WIDTH];
-        }
-
-        int idx = CAMERA_WIDTH*j + i0 + r_f;
-
-        for (int i = r_f + i0; i < i1 - r_f - 1; i++) {
-            ibc1[idx] = isx;
-            nc[idx] = n;
-            isx = isx + mask[idx + r_f + 1]*ib[idx + r_f + 1] - 
-                  mask[idx - r_f]*ib[idx - r_f];
-            n = n + mask[idx + r_f + 1] - mask[idx - r_f];
-            idx++;
-        }
-
-        ibc1[idx] = isx;
-        nc[idx] = n;
-    }
-
-    for (int j = j0+b; j < j1-b; j++) {
-        for (int i = i0+b; i < i1-b; i++) {
-            n = s = 0;
-            for (int jp =- r_f; jp <= r_f; jp++) {
-                int idx = i + (j+jp)*CAMERA_WIDTH;
-                s += ibc1[idx];
-                n += nc[idx];
-            }
-            ds = s;
-            dn = n;
-            if (dn > 0.0) {
-                ds /= dn;
-                last_ds = ds;
-            } else {
-                ds = last_ds;
-            }
-            filtered_image[i + j*CAMERA_WIDTH] = ds;
-        }
-    }
-}
-
-
 /* Function to find the blobs in an image.
 ** Inputs: The original image prior to processing (input_biffer), the dimensions
-** of the image (w & h) pointers to arrays for the x coordinates, y coordinates,
-** and magnitudes (pixel values) of the blobs, and an array for the bytes of the
-** image after processing (masking, filtering, et cetera).
-** Output: the number of blobs detected in the image.
+** of the image (w & h), arrays of max_blobs entries for the x coordinates, y 
+** coordinates, and magnitudes (fluxes) of the brightest blobs, where to
+** put the number of blobs found before keeping only the brightest, and an 
+** array for the bytes of the image after processing (masking, filtering, et 
+** cetera).
+** Output: the number of blobs kept, brightest first.
+** The filtered image is kept for extractBlobs() to threshold again.
 */
-int findBlobs(uint16_t * input_buffer, int w, int h, double ** star_x, 
-              double ** star_y, double ** star_mags, uint16_t * output_buffer)
+int findBlobs(uint16_t * input_buffer, int w, int h, double * star_x, 
+              double * star_y, double * star_mags, int max_blobs,
+              int * num_found, uint16_t * output_buffer)
 {
     static int first_time = 1;
-    static double * ic = NULL, * ic2 = NULL;
-    static int num_blobs_alloc = 0;
     FILE *fp;
+    *num_found = 0;
+    filtered.valid = 0;
     // test code to grab real filtered images if we want.
     // fp = fopen("/home/starcam/filtered.txt","w");
 
     // allocate the proper amount of storage space to start
     if (first_time) {
-        ic = calloc(CAMERA_NUM_PX, sizeof(double));
-        ic2 = calloc(CAMERA_NUM_PX, sizeof(double));
+        if (initAstrometryBuffers() < 0) {
+            return 0;
+        }
         first_time = 0;
     }
   
@@ -2202,44 +2777,76 @@ int findBlobs(uint16_t * input_buffer, int w, int h, double ** star_x,
                    "****************************\n");
         }
 
-        // make a file and write bright pixel coordinates to it
-        FILE * f = fopen(STATIC_HP_MASK, "w"); 
-
-        for (int yp = 0; yp < CAMERA_HEIGHT; yp++) {
-            for (int xp = 0; xp < CAMERA_WIDTH; xp++) {
-                // index in the array where we are
-                int ind = CAMERA_WIDTH*yp + xp; 
-                // check pixel value to see if it's above hot pixel threshold
-                if (input_buffer[ind] > all_blob_params.make_static_hp_mask) {
-                    int i = xp;
-                    // make this agree with blob coordinates in Kst
-                    int j = CAMERA_HEIGHT - yp; 
-                    fprintf(f, "%d,%d\n", i, j);
-                    if (verbose) {
-                        printf("Value of pixel (should be > %i): %d | "
-                               "Coordinates: [%d, %d]\n", 
-                               all_blob_params.make_static_hp_mask, 
-                               input_buffer[ind], i, j);
-                    }
-                }
+        // find pixels above the hot pixel threshold and save their indices
+        uint32_t * hp_indices = NULL;
+        uint32_t num_hp = 0;
+        if (findHotPixels(input_buffer, CAMERA_WIDTH, CAMERA_HEIGHT,
+                          all_blob_params.make_static_hp_mask, &hp_indices, 
+                          &num_hp) < 0) {
+            fprintf(stderr, "Error finding static hot pixels.\n");
+        } else {
+            if (verbose) {
+                printf("Found %u pixels above %i.\n", num_hp, 
+                       all_blob_params.make_static_hp_mask);
             }
+            writeHotPixelMap(STATIC_HP_MAP, hp_indices, num_hp, CAMERA_WIDTH,
+                             CAMERA_HEIGHT);
+            free(hp_indices);
         }
-
-        fflush(f);
-        fclose(f);
     }
 
     makeMask(input_buffer, i0, j0, i1, j1, 0, 0, 0);
 
-    double sx = 0, sx2 = 0;
-    // sum of non-highpass filtered field
-    double sx_raw = 0;                            
-    int num_pix = 0;
+    // take the sensor's row and column offsets out before the noise is
+    // measured, in a copy so that the frame archived and published stays
+    // raw; only once per frame, as a retry filters the same copy
+    if (remove_fixed_pattern && !fixed_pattern_removed) {
+        if (estimateFixedPattern(input_buffer, mask, CAMERA_WIDTH, i0, j0, 
+                                 i1, j1, &fixed_pattern) < 0) {
+            fprintf(stderr, "Error estimating the fixed pattern noise, not "
+                            "removing it.\n");
+        } else {
+            memcpy(corrected_image, input_buffer, 
+                   CAMERA_NUM_PX * sizeof(uint16_t));
+            removeFixedPattern(corrected_image, CAMERA_WIDTH, &fixed_pattern);
+            fixed_pattern_removed = 1;
+            if (verbose) {
+                printf("\n(*) Fixed pattern noise removed: rows %.2f ADU rms, "
+                       "columns %.2f ADU rms.\n\n", fixed_pattern.row_rms,
+                       fixed_pattern.col_rms);
+            }
+        }
+    }
+
+    uint16_t * image = fixed_pattern_removed ? corrected_image : input_buffer;
+    struct box_filter_stats_t stats;
 
     solveState = FILTERING;
-    // lowpass filter the image - reduce noise.
-    boxcarFilterImage(input_buffer, i0, j0, i1, j1, all_blob_params.r_smooth, 
-                      ic);
+    // lowpass filter the image to reduce noise, and (for full frames)
+    // subtract the background, in one pass: either a large boxcar high-pass
+    // or a mesh of sigma-clipped tile medians
+    struct background_mesh_t * background = NULL;
+    if (all_blob_params.high_pass_filter == 1) {
+        b += all_blob_params.r_high_pass_filter;
+    } else if (all_blob_params.high_pass_filter == 2) {
+        if (estimateBackgroundMesh(image, mask, CAMERA_WIDTH, i0, j0, 
+                                   i1, j1, BACKGROUND_MESH_SIZE, 
+                                   &background_mesh) < 0) {
+            fprintf(stderr, "Error estimating the background mesh, not "
+                            "subtracting a background.\n");
+        } else {
+            background = &background_mesh;
+        }
+    }
+    if (boxFilterImage(image, mask, CAMERA_WIDTH, i0, j0, i1, j1,
+                       all_blob_params.r_smooth, 
+                       (all_blob_params.high_pass_filter == 1) || 
+                       (background != NULL), 
+                       all_blob_params.r_high_pass_filter, background, b, ic, 
+                       &stats) < 0) {
+        fprintf(stderr, "Error filtering image for blob finding.\n");
+        return 0;
+    }
     // test code to grab real filtered images if we want.
     /* for (int j = 0; j < CAMERA_HEIGHT; j++)
     {
@@ -2261,35 +2868,10 @@ int findBlobs(uint16_t * input_buffer, int w, int h, double ** star_x,
     fflush(fp);
     fclose(fp); */
 
-
-    // only high-pass filter full frames
-    if (all_blob_params.high_pass_filter) {
-        b += all_blob_params.r_high_pass_filter;
-
-        boxcarFilterImage(input_buffer, i0, j0, i1, j1, 
-                          all_blob_params.r_high_pass_filter, ic2);
-
-        for (int j = j0+b; j < j1-b; j++) {
-            for (int i = i0+b; i < i1-b; i++) {
-                int idx = i + j*w;
-                sx_raw += ic[idx]*mask[idx];
-                ic[idx] -= ic2[idx];
-                sx += ic[idx]*mask[idx];
-                sx2 += ic[idx]*ic[idx]*mask[idx];
-                num_pix += mask[idx];
-            }
-        }
-    } else {
-        for (int j = j0+b; j < j1-b; j++) {
-            for (int i = i0+b; i < i1-b; i++) {
-                int idx = i + j*w;
-                sx += ic[idx]*mask[idx];
-                sx2 += ic[idx]*ic[idx]*mask[idx];
-                num_pix += mask[idx];
-            }
-        }
-        sx_raw = sx;
-    }
+    double sx = stats.sum, sx2 = stats.sum_sq;
+    // sum of non-highpass filtered field
+    double sx_raw = stats.sum_raw;
+    int num_pix = stats.num_pix;
 
     double mean = sx/num_pix;
     double mean_raw = sx_raw/num_pix;
@@ -2348,156 +2930,333 @@ int findBlobs(uint16_t * input_buffer, int w, int h, double ** star_x,
         }
     }
 
-    // FIXME(evanmayer): In new sensor testing, I found that there was a rare
-    // segfault in merge(). I think this might happen if a lot of blobs are
-    // present (e.g. lens cap on image).
-    // The recursive stack memory usage in merge() is my primary suspect.
-    // Legit real-time code would preallocate the max size one would ever need
-    // for this task, and then straight up fail gracefully or limit the number
-    // of blobs used when hitting the limit.
-    // Technically this could realloc until we run out, or force astrometry to
-    // deal with thousands and thousands of fake blobs, which are way worse.
-
-    // And really, when are we ever going to see thousands, or even hundreds of
-    // stars? And are those extra few hundred stars going to improve
-    // performance? No.
-
-    solveState = BLOB_FIND;
+    filtered = (struct filtered_image_t) {
+        .valid = 1,
+        .w = w, .h = h,
+        .i0 = i0 + b + 1, .j0 = j0 + b + 1,
+        .i1 = i1 - b - 2, .j1 = j1 - b - 2,
+        .mean = mean,
+        .sigma = sigma,
+    };
+    return extractBlobs(all_blob_params.n_sigma, star_x, star_y, star_mags, 
+                        max_blobs, num_found);
+}
 
-    // find the blobs 
-    double ic0;
-    int blob_count = 0;
-    for (int j = j0 + b + 1; j < j1-b-2; j++) {
-        for (int i = i0 + b + 1; i < i1-b-2; i++) {
-            // if pixel exceeds threshold
-            if ((double) ic[i + j*w] > mean + all_blob_params.n_sigma*sigma) {
-                ic0 = ic[i + j*w];
-                // if pixel is a local maximum or saturated
-                if (((ic0 >= ic[i-1 + (j-1)*w]) &&
-                     (ic0 >= ic[i   + (j-1)*w]) &&
-                     (ic0 >= ic[i+1 + (j-1)*w]) &&
-                     (ic0 >= ic[i-1 + (j  )*w]) &&
-                     (ic0 >  ic[i+1 + (j  )*w]) &&
-                     (ic0 >  ic[i-1 + (j+1)*w]) &&
-                     (ic0 >  ic[i   + (j+1)*w]) &&
-                     (ic0 >  ic[i+1 + (j+1)*w])) ||
-                     (ic0 > (CAMERA_MAX_PIXVAL - 1))) {
-
-                    int unique = 1;
-
-                    // realloc array if necessary (when the camera looks at a 
-                    // really bright image, this slows everything down severely)
-                    if (blob_count >= num_blobs_alloc) {
-                        num_blobs_alloc += 500;
-                        *star_x = realloc(*star_x, sizeof(double)*num_blobs_alloc);
-                        *star_y = realloc(*star_y, sizeof(double)*num_blobs_alloc);
-                        *star_mags = realloc(*star_mags, sizeof(double)*num_blobs_alloc);
-                    }
 
-                    (*star_x)[blob_count] = i;
-                    (*star_y)[blob_count] = j;
-                    (*star_mags)[blob_count] = 100*ic[i + j*CAMERA_WIDTH];
+/**
+ * @brief Find the blobs above mean + n_sigma * sigma in the image last
+ * filtered by findBlobs(), without filtering it again. Only the brightest 
+ * max_blobs are kept, in the caller's fixed arrays: thousands of blobs (e.g.
+ * lens cap on image) are never going to help astrometry.
+ * 
+ * @param[out] num_found number of blobs found before keeping the brightest
+ * @return int number of blobs kept, brightest first, with y flipped
+ */
+int extractBlobs(double n_sigma, double * star_x, double * star_y, 
+                 double * star_mags, int max_blobs, int * num_found)
+{
+    int w = filtered.w;
+    *num_found = 0;
+    if (!filtered.valid) {
+        fprintf(stderr, "No filtered image to find blobs in.\n");
+        return 0;
+    }
 
-                    // FIXME: not sure why this is necessary..
-                    if ((*star_mags)[blob_count] < 0) {
-                        (*star_mags)[blob_count] = UINT32_MAX;
-                    }
+    solveState = BLOB_FIND;
 
-                    // if we already found a blob within SPACING and this one is
-                    // bigger, replace it.
-                    int spacing = all_blob_params.unique_star_spacing;
-                    if ((*star_mags)[blob_count] > 25400) {
-                        spacing = spacing * 4;
-                    }
-                    for (int ib = 0; ib < blob_count; ib++) {
-                        if ((abs((*star_x)[blob_count]-(*star_x)[ib]) < spacing) &&
-                            (abs((*star_y)[blob_count]-(*star_y)[ib]) < spacing)) {
-                            unique = 0;
-                            // keep the brighter one
-                            if ((*star_mags)[blob_count] > (*star_mags)[ib]) {
-                                (*star_x)[ib] = (*star_x)[blob_count];
-                                (*star_y)[ib] = (*star_y)[blob_count];
-                                (*star_mags)[ib] = (*star_mags)[blob_count];
-                            }
-                        }
-                    }
-                    // if we didn't find a close one, it is unique.
-                    if (unique) {
-                        blob_count++;
-                    }
-                }
+    // find the blobs: connected groups of pixels above threshold, labelled
+    // in parallel over bands of rows, in scan order of their first pixel
+    struct component_scan_t scan = {
+        .pImage = ic,
+        .imageWidth = w,
+        .i0 = filtered.i0, .j0 = filtered.j0,
+        .i1 = filtered.i1, .j1 = filtered.j1,
+        .threshold = filtered.mean + n_sigma*filtered.sigma,
+        .background = filtered.mean,
+    };
+    if (findComponents(&scan) < 0) {
+        fprintf(stderr, "Error scanning the filtered image for blobs.\n");
+        return 0;
+    }
+    // blobs kept so far, by position, for the spacing check
+    if (resetBlobIndex(&blob_index, w, filtered.h,
+                       all_blob_params.unique_star_spacing) < 0) {
+        freeComponents(&scan);
+        return 0;
+    }
+    for (uint32_t k = 0; k < scan.num_blobs; k++) {
+        // a blob is placed on its flux weighted centroid over all of its
+        // pixels, and its brightness is its background subtracted flux
+        double x = scan.blobs[k].x;
+        double y = scan.blobs[k].y;
+        double mag = scan.blobs[k].flux;
+        int unique = 1;
+
+        // if we already found a blob within SPACING and this one is
+        // bigger, replace it. Near saturated stars spread further.
+        int spacing = all_blob_params.unique_star_spacing;
+        if (scan.blobs[k].peak > 254) {
+            spacing = spacing * 4;
+        }
+        const uint32_t * neighbours;
+        uint32_t num_neighbours = findNeighbours(&blob_index, x, y, spacing,
+                                                 &neighbours);
+        for (uint32_t n = 0; n < num_neighbours; n++) {
+            unique = 0;
+            // keep the brighter one
+            if (mag > blob_index.mag[neighbours[n]]) {
+                replaceBlob(&blob_index, neighbours[n], x, y, mag);
             }
         }
+        // if we didn't find a close one, it is unique.
+        if (unique && (insertBlob(&blob_index, x, y, mag) < 0)) {
+            break;
+        }
     }
-    // this loop flips vertical position of blobs back to their normal location
+    freeComponents(&scan);
+
+    // keep the brightest, brightest first, flipping vertical position of
+    // blobs back to their normal location
+    const uint32_t * brightest;
+    int blob_count = brightestBlobs(&blob_index, max_blobs, &brightest);
     for (int ibb = 0; ibb < blob_count; ibb++) {
-        (*star_y)[ibb] = CAMERA_HEIGHT - (*star_y)[ibb];
+        star_x[ibb] = blob_index.x[brightest[ibb]];
+        star_y[ibb] = CAMERA_HEIGHT - blob_index.y[brightest[ibb]];
+        star_mags[ibb] = blob_index.mag[brightest[ibb]];
     }
-
-    // merge sort
-    part(*star_mags, 0, blob_count - 1, *star_x, *star_y); 
+    *num_found = blob_index.count;
     if (verbose) {
-        printf("(*) Number of blobs found in image: %i\n\n", blob_count);
+        printf("(*) Number of blobs found in image at %.2f sigma: %i "
+               "(kept %i)\n\n", n_sigma, *num_found, blob_count);
     }
 
     return blob_count;
 }
 
 
-/* Function for sorting implementation.
-** Input: 
-** Output:
-*/
-void merge(double * A, int p, int q, int r, double * X, double * Y)
-{
-    int n1 = q - p + 1, n2 = r - q;
-    int lin = n1 + 1, rin = n2 + 1;
-    double LM[lin], LX[lin], LY[lin], RM[rin], RX[rin], RY[rin];
-    int i, j, k;
-    LM[n1] = 0;
-    RM[n2] = 0;
-
-    for (i = 0; i < n1; i++) {
-        LM[i] = A[p+i];
-        LX[i] = X[p+i];
-        LY[i] = Y[p+i];
-    }
-
-    for (j = 0; j < n2; j++) {
-        RM[j] = A[q+j+1];
-        RX[j] = X[q+j+1];
-        RY[j] = Y[q+j+1];
-    }
-
-    i = 0; j = 0;
-    for (k = p; k <= r; k++) {
-        if (LM[i] >= RM[j] ){
-            A[k] = LM[i];
-            X[k] = LX[i];
-            Y[k] = LY[i];
-            i++;
+/**
+ * @brief Threshold the filtered image of a frame again after findBlobs()
+ * found too few or too many blobs, bisecting n_sigma until the count is 
+ * between MIN_BLOBS and MAX_BLOBS. Each try only labels and sorts the blobs,
+ * so costs milliseconds where filtering again costs much more. The threshold
+ * tried first bounds the search on one side; the steps are geometric since a
+ * good n_sigma can be anything from a few to hundreds.
+ * 
+ * @param[in,out] num_found blobs found at all_blob_params.n_sigma, then at
+ * the last threshold tried
+ * @return int number of blobs kept in the frame's blob list
+ */
+static int rethresholdBlobs(struct frame_t * frame, int * num_found)
+{
+    double lo = RETHRESHOLD_MIN_N_SIGMA;
+    double hi = RETHRESHOLD_MAX_N_SIGMA;
+    double n_sigma = all_blob_params.n_sigma;
+    if (!filtered.valid) {
+        return frame->blob_count;
+    }
+    if (*num_found > MAX_BLOBS) {
+        lo = fmax(lo, n_sigma);
+    } else {
+        hi = fmin(hi, n_sigma);
+    }
+    for (int tries = 0; (tries < RETHRESHOLD_MAX_TRIES) && (lo < hi); 
+         tries++) {
+        n_sigma = sqrt(lo*hi);
+        frame->blob_count = extractBlobs(n_sigma, frame->star_x, 
+                                         frame->star_y, frame->star_mags, 
+                                         MAX_BLOBS, num_found);
+        if (*num_found > MAX_BLOBS) {
+            lo = n_sigma;
+        } else if (*num_found < MIN_BLOBS) {
+            hi = n_sigma;
         } else {
-            A[k] = RM[j];
-            X[k] = RX[j];
-            Y[k] = RY[j];
-            j++;
+            if (verbose) {
+                printf("Found %d blobs at %.2f sigma.\n", *num_found,
+                    n_sigma);
+            }
+            break;
         }
     }
+    return frame->blob_count;
 }
 
 
-/* Recursive part of sorting.
-** Input:
-** Output:
-*/
-void part(double * A, int p, int r, double * X, double * Y)
+/**
+ * @brief Start tracking the brightest blobs of a full frame. The blob list is
+ * sorted brightest first, with y flipped as in findBlobs().
+ */
+static void seedTrackingWindows(struct frame_t * frame)
+{
+    num_rois = (frame->blob_count < TRACK_MAX_ROIS) ? frame->blob_count :
+        TRACK_MAX_ROIS;
+    for (int k = 0; k < num_rois; k++) {
+        roi_x[k] = frame->star_x[k];
+        roi_y[k] = CAMERA_HEIGHT - frame->star_y[k];
+    }
+    frames_since_full = 0;
+}
+
+
+/**
+ * @brief Keep the stars of a tracking frame (brightest first, y flipped as in
+ * findBlobs()) for the astrometry telemetry, as tracking frames are not
+ * solved.
+ */
+static void rememberTrackedStars(struct frame_t * frame)
+{
+    int n = (frame->blob_count < TRACK_MAX_ROIS) ? frame->blob_count :
+        TRACK_MAX_ROIS;
+    pthread_mutex_lock(&tracked_lock);
+    for (int s = 0; s < n; s++) {
+        tracked_x[s] = frame->star_x[s];
+        tracked_y[s] = frame->star_y[s];
+    }
+    num_tracked = n;
+    tracked_time = frame->photo_time;
+    pthread_mutex_unlock(&tracked_lock);
+}
+
+
+/**
+ * @brief Copy out the stars of the last tracking frame.
+ * 
+ * @param[out] photo_time photo_time of that frame, 0 if none has been tracked
+ * @param[out] star_x, star_y centroids [px], brightest first, y flipped as in
+ * findBlobs(); room for max_stars each
+ * @return int number of stars copied
+ */
+int getTrackedStars(double * photo_time, double * star_x, double * star_y, 
+                    int max_stars)
 {
-    if (p < r) {
-        int q = (p + r)/2;
-        part(A, p, q, X, Y);
-        part(A, q + 1, r, X, Y);
-        merge(A, p, q, r, X, Y);
+    pthread_mutex_lock(&tracked_lock);
+    int n = (num_tracked < max_stars) ? num_tracked : max_stars;
+    for (int s = 0; s < n; s++) {
+        star_x[s] = tracked_x[s];
+        star_y[s] = tracked_y[s];
+    }
+    *photo_time = tracked_time;
+    pthread_mutex_unlock(&tracked_lock);
+    return n;
+}
+
+
+/**
+ * @brief Find the stars being tracked by filtering only a small window around
+ * each one, instead of the whole frame. Windows move with their star; a star
+ * that falls below the detection threshold is dropped.
+ * 
+ * @param frame frame whose image to search; its blob list is overwritten with
+ * the stars found, brightest first
+ * @return int number of stars still tracked
+ */
+static int trackBlobs(struct frame_t * frame)
+{
+    uint16_t * image = frame->image;
+    // the windows are filtered into ic over the last full frame
+    filtered.valid = 0;
+    int r_f = all_blob_params.r_smooth;
+    // the boxcar filter is only valid r_f + 1 px in from the window edge
+    int margin = r_f + 1;
+    int kept = 0;
+
+    for (int k = 0; k < num_rois; k++) {
+        int xc = (int)lround(roi_x[k]);
+        int yc = (int)lround(roi_y[k]);
+        int i0 = xc - TRACK_ROI_HALF_SIZE - margin;
+        int j0 = yc - TRACK_ROI_HALF_SIZE - margin;
+        int i1 = xc + TRACK_ROI_HALF_SIZE + margin + 1;
+        int j1 = yc + TRACK_ROI_HALF_SIZE + margin + 1;
+        i0 = (i0 > 0) ? i0 : 0;
+        j0 = (j0 > 0) ? j0 : 0;
+        i1 = (i1 < CAMERA_WIDTH) ? i1 : CAMERA_WIDTH;
+        j1 = (j1 < CAMERA_HEIGHT) ? j1 : CAMERA_HEIGHT;
+        // star ran off the edge of the sensor
+        if ((i1 - i0 <= 2*margin + 2) || (j1 - j0 <= 2*margin + 2)) {
+            continue;
+        }
+
+        makeMask(image, i0, j0, i1, j1, 0, 0, 1);
+        // smoothed window and its local background statistics
+        struct box_filter_stats_t stats;
+        if (boxFilterImage(image, mask, CAMERA_WIDTH, i0, j0, i1, j1, r_f,
+                           false, 0, NULL, margin, ic, &stats) < 0) {
+            continue;
+        }
+        if (stats.num_pix == 0) {
+            continue;
+        }
+
+        // brightest pixel in the window
+        double peak = -1.0;
+        int ip = 0, jp = 0;
+        for (int j = j0 + margin; j < j1 - margin; j++) {
+            for (int i = i0 + margin; i < i1 - margin; i++) {
+                int idx = i + j*CAMERA_WIDTH;
+                if (mask[idx] && (ic[idx] > peak)) {
+                    peak = ic[idx];
+                    ip = i;
+                    jp = j;
+                }
+            }
+        }
+        double mean = stats.sum/stats.num_pix;
+        double sigma = sqrt(fmax(0.0, (stats.sum_sq - 
+                                       stats.sum*stats.sum/stats.num_pix)/
+                                      stats.num_pix));
+        if (peak <= mean + all_blob_params.n_sigma*sigma) {
+            continue;
+        }
+
+        // 3x3 flux weighted centroid on the unfiltered image, with the
+        // window's background taken off so that the sky does not pull it
+        // onto the peak pixel, and hot pixels left out
+        double sum = 0, cx = 0, cy = 0;
+        for (int dj = -1; dj <= 1; dj++) {
+            for (int di = -1; di <= 1; di++) {
+                int idx = (ip + di) + (jp + dj)*CAMERA_WIDTH;
+                if (!mask[idx]) {
+                    continue;
+                }
+                double v = image[idx] - mean;
+                v = (v > 0) ? v : 0;
+                sum += v;
+                cx += (ip + di)*v;
+                cy += (jp + dj)*v;
+            }
+        }
+        if (sum <= 0) {
+            continue;
+        }
+        roi_x[kept] = cx/sum;
+        roi_y[kept] = cy/sum;
+        frame->star_x[kept] = roi_x[kept];
+        frame->star_y[kept] = CAMERA_HEIGHT - roi_y[kept];
+        // background subtracted flux, as extractBlobs() ranks full frames
+        frame->star_mags[kept] = sum;
+        kept++;
+    }
+    num_rois = kept;
+
+    // windows keep their seeding order, which can drift from brightest first;
+    // an insertion sort keeps equally bright stars in order
+    for (int k = 1; k < kept; k++) {
+        double x = frame->star_x[k];
+        double y = frame->star_y[k];
+        double m = frame->star_mags[k];
+        int n = k;
+        for (; (n > 0) && (frame->star_mags[n - 1] < m); n--) {
+            frame->star_x[n] = frame->star_x[n - 1];
+            frame->star_y[n] = frame->star_y[n - 1];
+            frame->star_mags[n] = frame->star_mags[n - 1];
+        }
+        frame->star_x[n] = x;
+        frame->star_y[n] = y;
+        frame->star_mags[n] = m;
+    }
+    if (verbose) {
+        printf("(*) Number of stars tracked: %i\n", kept);
     }
+    return kept;
 }
 
 
@@ -2529,7 +3288,7 @@ int makeTable(char * filename, double * star_mags, double * star_x,
 }
 
 
-int doContrastDetectAutoFocus(struct camera_params* all_camera_params, struct tm* tm_info, uint16_t* output_buffer) {
+int doContrastDetectAutoFocus(struct camera_params* all_camera_params, struct tm* tm_info, struct frame_t* scratch) {
     printf("Running contrast detection AF.\n");
 
     // Housekeeping
@@ -2606,16 +3365,6 @@ int doContrastDetectAutoFocus(struct camera_params* all_camera_params, struct tm
     bool hasGoneBackward = 0;
     bool atNearEnd = 0;
 
-    // Set binning to speed up sharpness measurement
-    // NOTE: any return statements between here and the end of the focusing loop
-    // must be guarded by a call to attempt to return the bin factor to 1.
-    // (restoreBinningFactor())
-    if (setBinningFactor(CAMERA_FOCUS_BINFACTOR) < 0) {
-        // focusing ROI in measureSharpness depends on correct binning factor
-        // set
-        return -1;
-    }
-
     while (remainingFocusPos > 0) {
         remainingFocusPos -= 1;
         atNearEnd = ((all_camera_params->focus_position < (all_camera_params->start_focus_pos + all_camera_params->focus_step)) || 
@@ -2636,25 +3385,23 @@ int doContrastDetectAutoFocus(struct camera_params* all_camera_params, struct tm
             fprintf(stderr, "Could not complete image capture: %s.\n", 
                 strerror(errno));
             all_camera_params->focus_mode = 0;
-            if (restoreBinningFactor() < 0) {
-                closeCamera();
-                clean();
-                return -1;
-            }
             return -1;
         }
         taking_image = 0;
 
         double sharpness = 0.0;
-        if (measureSharpness(&sharpness) < 0) {
+        // unpack into a spare frame so it can be shown to clients without a
+        // copy; fall back to the caller's frame if the pool is exhausted
+        struct frame_t* af_frame = frameTryGet();
+        uint16_t* af_image = (af_frame != NULL) ? af_frame->image :
+            scratch->image;
+        if (measureSharpness(&sharpness, af_image) < 0) {
             fprintf(stderr, "Could not complete sharpness measurement: %s.\n", 
             strerror(errno));
-            all_camera_params->focus_mode = 0;
-            if (restoreBinningFactor() < 0) {
-                closeCamera();
-                clean();
-                return -1;
+            if (af_frame != NULL) {
+                frameRelease(af_frame);
             }
+            all_camera_params->focus_mode = 0;
             return -1;
         };
 
@@ -2697,16 +3444,11 @@ int doContrastDetectAutoFocus(struct camera_params* all_camera_params, struct tm
         numFocusPos++;
         hasGoneBackward = 1;
 
-        // for kst display?
-        memcpy(output_buffer, unpacked_image, CAMERA_NUM_PX * sizeof(uint16_t));
         // pass off the image bytes for sending to clients
-        memcpy(camera_raw, output_buffer, CAMERA_NUM_PX * sizeof(uint16_t));
-    }
-
-    if (restoreBinningFactor() < 0) {
-        closeCamera();
-        clean();
-        return -1;
+        if (af_frame != NULL) {
+            publishFrame(af_frame);
+            frameRelease(af_frame);
+        }
     }
 
     if (verbose) {
@@ -2755,46 +3497,195 @@ int doContrastDetectAutoFocus(struct camera_params* all_camera_params, struct tm
     return 0;
 }
 
+/* Buffers shared across rounds of the capture/solve loop. Each is touched by
+** only one stage, so the pipeline stages may run concurrently. */
+static int * blob_mags = NULL;
 
-/* Function to take observing images and solve for pointing using Astrometry.
-** Main function for the Astrometry thread in commands.c.
-** Input: None.
-** Output: A flag indicating successful round of image + solution by the camera 
-** (e.g. if the camera can't open the observing file, the function will 
-** automatically return with -1).
-*/
-int doCameraAndAstrometry(void)
+
+/**
+ * @brief Allocate the buffers used by the stage functions, once. The
+ * full-frame blob finding buffers are written through, since calloc'd pages
+ * only become resident when touched and the startup memory report should
+ * include them.
+ * 
+ * @return int -1 if failed, 0 otherwise
+ */
+int initAstrometryBuffers(void)
+{
+    if (blob_mags == NULL) {
+        solveState = INIT;
+        blob_mags = calloc(default_focus_photos, sizeof(int));
+        if (blob_mags == NULL) {
+            fprintf(stderr, "Error allocating array for blob mags: %s.\n", 
+                    strerror(errno));
+            return -1;
+        }
+    }
+    if (mask == NULL) {
+        mask = malloc(CAMERA_NUM_PX);
+        if (mask == NULL) {
+            fprintf(stderr, "Error allocating hot pixel mask: %s.\n", 
+                    strerror(errno));
+            return -1;
+        }
+        memset(mask, 0, CAMERA_NUM_PX);
+    }
+    if (ic == NULL) {
+        ic = malloc(CAMERA_NUM_PX * sizeof(float));
+        if (ic == NULL) {
+            fprintf(stderr, "Error allocating filtered image: %s.\n", 
+                    strerror(errno));
+            return -1;
+        }
+        memset(ic, 0, CAMERA_NUM_PX * sizeof(float));
+    }
+    if ((coadd_frames > 1) && (coadd_image == NULL)) {
+        coadd_image = malloc(CAMERA_NUM_PX * sizeof(uint16_t));
+        if (coadd_image == NULL) {
+            fprintf(stderr, "Error allocating co-add frame: %s.\n", 
+                    strerror(errno));
+            return -1;
+        }
+    }
+    if (remove_fixed_pattern && (corrected_image == NULL)) {
+        corrected_image = malloc(CAMERA_NUM_PX * sizeof(uint16_t));
+        if (corrected_image == NULL) {
+            fprintf(stderr, "Error allocating fixed pattern corrected image: "
+                            "%s.\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Free the buffers used by the stage functions. Call only once no
+ * stage is running, i.e. on shutdown.
+ */
+void freeAstrometryBuffers(void)
+{
+    if (verbose) {
+        printf("\n> Freeing allocated variables in camera.c...\n");
+    }
+
+    free(blob_mags);
+    blob_mags = NULL;
+    free(mask);
+    mask = NULL;
+    free(ic);
+    ic = NULL;
+    freeBoxFilterScratch();
+    freeBackgroundMesh(&background_mesh);
+    freeFixedPattern(&fixed_pattern);
+    freeBlobIndex(&blob_index);
+    freeCalibration(&calibration);
+    free(coadd_image);
+    coadd_image = NULL;
+    free(corrected_image);
+    corrected_image = NULL;
+}
+
+
+/**
+ * @brief Co-add mode: take coadd_frames - 1 more exposures straight after the
+ * one in frame->image and average them all into it. With coadd_shift, each
+ * is first lined up with the first one using the centroids of the stars from
+ * the last detection.
+ * 
+ * @return int -1 if an exposure failed, 0 otherwise
+ */
+static int coaddExposures(struct frame_t * frame)
+{
+    double star_x[COADD_SHIFT_STARS], star_y[COADD_SHIFT_STARS];
+    double ref_x[COADD_SHIFT_STARS], ref_y[COADD_SHIFT_STARS];
+    int num_stars = 0, num_ref = 0;
+
+    if (coadd_shift) {
+        pthread_mutex_lock(&coadd_lock);
+        num_stars = num_coadd_stars;
+        memcpy(star_x, coadd_star_x, num_stars * sizeof(double));
+        memcpy(star_y, coadd_star_y, num_stars * sizeof(double));
+        pthread_mutex_unlock(&coadd_lock);
+        // the stars as they are in the first exposure
+        for (int s = 0; s < num_stars; s++) {
+            if (starCentroid(frame->image, CAMERA_WIDTH, CAMERA_HEIGHT, 
+                             star_x[s], star_y[s], COADD_SHIFT_HALF_SIZE, 
+                             &ref_x[num_ref], &ref_y[num_ref]) == 0) {
+                num_ref++;
+            }
+        }
+    }
+
+    for (int k = 1; k < coadd_frames; k++) {
+        if ((!free_running && (imageCapture() < 0)) || 
+            (imageTransfer(coadd_image) < 0)) {
+            fprintf(stderr, "Could not take co-add frame %d of %d.\n", k + 1, 
+                    coadd_frames);
+            return -1;
+        }
+        int dx = 0, dy = 0;
+        if (num_ref > 0) {
+            measureShift(coadd_image, CAMERA_WIDTH, CAMERA_HEIGHT, ref_x, 
+                         ref_y, num_ref, COADD_SHIFT_HALF_SIZE, &dx, &dy);
+            if (verbose) {
+                printf("Co-add frame %d is shifted by (%d, %d) px.\n", k + 1, 
+                       dx, dy);
+            }
+        }
+        coaddFrame(frame->image, coadd_image, CAMERA_WIDTH, CAMERA_HEIGHT, 
+                   -dx, -dy);
+    }
+    averageCoadd(frame->image, CAMERA_NUM_PX, coadd_frames);
+    return 0;
+}
+
+
+/**
+ * @brief Keep the brightest stars of a frame's blob list (brightest first,
+ * y flipped as in findBlobs()) for lining up the next co-add.
+ */
+static void rememberCoaddStars(struct frame_t * frame)
+{
+    int n = (frame->blob_count < COADD_SHIFT_STARS) ? frame->blob_count : 
+        COADD_SHIFT_STARS;
+    pthread_mutex_lock(&coadd_lock);
+    for (int s = 0; s < n; s++) {
+        coadd_star_x[s] = frame->star_x[s];
+        coadd_star_y[s] = CAMERA_HEIGHT - frame->star_y[s];
+    }
+    num_coadd_stars = n;
+    pthread_mutex_unlock(&coadd_lock);
+}
+
+
+/**
+ * @brief Acquisition stage: run any pending autofocus or hot pixel update,
+ * wait for a trigger if in triggered mode, expose, and transfer the image
+ * into the frame along with a snapshot of its metadata.
+ * 
+ * @param frame destination frame; its image must hold CAMERA_NUM_PX pixels
+ * @return int -1 if no image was acquired, 0 otherwise
+ */
+int acquireFrame(struct frame_t * frame)
 {
-    // these must be static since this function is called perpetually in 
-    // updateAstrometry thread
-    static double * star_x = NULL, * star_y = NULL, * star_mags = NULL;
-    static uint16_t * output_buffer = NULL;
-    static int first_time = 1, af_photo = 0;
-    static FILE * af_file = NULL;
-    static FILE * fptr = NULL;
-    static int num_focus_pos;
-    static int * blob_mags;
-    int blob_count;
     struct timeval tv;
-    double photo_time;
-    char datafile[100], buff[100], date[256];
-    // static: af_filename only defined on first autofocus pass, but in
-    // subsequent calls to doCameraAndAstrometry() gets passed to
-    // calculateOptimalFocus()
-    static char af_filename[256];
-    char filename[256] = "";
-    struct timespec camera_tp_beginning, camera_tp_end; 
-    time_t seconds = time(NULL);
+    struct timeval trigger_tv;
+    struct timespec wait_begin, wait_end;
     struct tm * tm_info;
-  
+
     // uncomment line below for testing the values of each field in the global 
     // structure for blob_params
     if (verbose) {
         verifyBlobParams();
     }
 
-    tm_info = gmtime(&seconds);
-    all_astro_params.rawtime = seconds;
+    if (initAstrometryBuffers() < 0) {
+        return -1;
+    }
+
+    frame->seconds = time(NULL);
+    tm_info = gmtime(&frame->seconds);
     // if it is a leap year, adjust tm_info accordingly before it is passed to 
     // calculations in lostInSpace
     if (isLeapYear(tm_info->tm_year)) {
@@ -2809,90 +3700,48 @@ int doCameraAndAstrometry(void)
             tm_info->tm_yday++;           
         }
     }
-
-    // data file to pass to lostInSpace
-    strftime(datafile, sizeof(datafile), 
-             "/home/starcam/Desktop/TIMSC/data_%b-%d.txt", tm_info);
-    
-    // set file descriptor for observing file to NULL in case of previous bad
-    // shutdown or termination of Astrometry
-    if (fptr != NULL) {
-        fclose(fptr);
-        fptr = NULL;
-    }
-    
-    if ((fptr = fopen(datafile, "a")) == NULL) {
-        fprintf(stderr, "Could not open obs. file %s: %s.\n", datafile,
-            strerror(errno));
-        return -1;
-    }
-
-    if (first_time) {
-        solveState = INIT;
-        output_buffer = calloc(CAMERA_NUM_PX, sizeof(uint16_t));
-        if (output_buffer == NULL) {
-            fprintf(stderr, "Error allocating output buffer: %s.\n", 
-                    strerror(errno));
-            return -1;
-        }
-
-        blob_mags = calloc(default_focus_photos, sizeof(int));
-        if (blob_mags == NULL) {
-            fprintf(stderr, "Error allocating array for blob mags: %s.\n", 
-                    strerror(errno));
-            return -1;
-        }
-
-        // NOTE(evanmayer): This info is also saved to FITS headers.
-        strftime(buff, sizeof(buff), "%B %d Observing Session - beginning "
-                                     "%H:%M:%S GMT", tm_info);
-        fprintf(fptr, "\n");
-        fprintf(fptr, "# ********************* %s *********************\n", buff);
-        fprintf(fptr, "# Camera model: %s\n", default_metadata.detector);
-        fprintf(fptr, "# ----------------------------------------------------\n");
-        fprintf(fptr, "# Exposure: %f milliseconds\n", default_metadata.exptime * 1000.0);
-        fprintf(fptr, "# Pixel clock: %f MHz\n", default_metadata.pixelclk);
-        fprintf(fptr, "# Frame rate achieved (desired is 10): %f\n", default_metadata.framerte);
-        fprintf(fptr, "# Trigger delay (microseconds): %f\n", default_metadata.trigdlay);
-        fprintf(fptr, "# Auto shutter: %i\n", default_metadata.autoexp);
-        fprintf(fptr, "# ----------------------------------------------------\n");
-        fprintf(fptr, "# Sensor ID/type: %lu\n", default_metadata.sensorid);
-        fprintf(fptr, "# Sensor bit depth %u\n", default_metadata.bitdepth);
-        fprintf(fptr, "# Maximum image width and height: %i, %i\n", 
-                       CAMERA_WIDTH, CAMERA_HEIGHT);
-        fprintf(fptr, "# Pixel size (micrometers): %.2f\n", 
-                      default_metadata.pixsize1);
-        fprintf(fptr, "# Mono gain setting: %.2fx base\n", default_metadata.gainfact);
-        fprintf(fptr, "# Auto gain (should be disabled): %i\n", (int) default_metadata.autogain);
-        fprintf(fptr, "# Auto exposure (should be disabled): %i\n", (int) default_metadata.autoexp);
-        fprintf(fptr, "# Auto black level (should be disabled): %i\n", (int) default_metadata.autoblk);
-        fprintf(fptr, "# Black level offset (desired is 50): %u\n", default_metadata.bloffset);
-
-        // write header to data file
-        if (fprintf(fptr, "C time,GMT,Blob #,RA (deg),DEC (deg),RA_OBS (deg),DEC_OBS (deg),FR (deg),PS,"
-                          "ALT (deg),AZ (deg),IR (deg),Astrom. solve time "
-                          "(msec),Solution Uncertainty (arcsec),Camera time (msec)\n") < 0) {
-            fprintf(stderr, "Error writing header to observing file: %s.\n", 
-                    strerror(errno));
-        }
-
-        fflush(fptr);
-        first_time = 0;
-    }
+    frame->tm_info = *tm_info;
 
     // if we are at the start of auto-focusing (either when camera first runs or 
     // user re-enters auto-focusing mode)
     if (all_camera_params.begin_auto_focus && all_camera_params.focus_mode) {
+        // auto-focus needs each frame exposed after the lens has moved
+        if (free_running) {
+            camera_backend->setFreeRun(0);
+            free_running = 0;
+        }
         solveState = AUTOFOCUS;
-        doContrastDetectAutoFocus(&all_camera_params, tm_info, output_buffer);
+        doContrastDetectAutoFocus(&all_camera_params, &frame->tm_info, frame);
         all_camera_params.focus_mode = 0;
     }
 
+    // Follow trigger mode changes from the flight computers
+    int want_free_run = (all_trigger_params.trigger_mode == 2);
+    if (want_free_run && (camera_backend->setFreeRun == NULL)) {
+        fprintf(stderr, "The %s camera cannot free-run, falling back to auto "
+            "trigger mode.\n", camera_backend->name);
+        all_trigger_params.trigger_mode = 0;
+        want_free_run = 0;
+    }
+    if (want_free_run != free_running) {
+        if (camera_backend->setFreeRun(want_free_run) < 0) {
+            fprintf(stderr, "Could not %s free-run acquisition.\n",
+                want_free_run ? "start" : "stop");
+            return -1;
+        }
+        free_running = want_free_run;
+        if (verbose) {
+            printf("Camera is now %s.\n", free_running ? "free-running" :
+                "software triggered");
+        }
+    }
+
     // If the user has triggered a new hot pixel mask, or want to be using 
     // dynamic hot pixel masking, re-make the mask internal hot pixel list
     // before capture.
-    if (all_blob_params.make_static_hp_mask || all_blob_params.dynamic_hot_pixels) {
-        if (renewCameraHotPixels() < 0) {
+    if ((all_blob_params.make_static_hp_mask || all_blob_params.dynamic_hot_pixels)
+        && (camera_backend->renewHotPixels != NULL)) {
+        if (camera_backend->renewHotPixels() < 0) {
             fprintf(stderr, "Could not re-make internal hot pixel mask.\n");
         }
     }
@@ -2900,141 +3749,240 @@ int doCameraAndAstrometry(void)
     solveState = IMAGE_CAP;
     taking_image = 1;
     // Ian Lowe, 1/9/24, adding new logic to look for a trigger from a FC or sleep instead
+    frame->trigger_time = 0.0;
+    frame->trigger_latency = 0.0;
     if (all_trigger_params.trigger_mode == 1) {
-        while (all_trigger_params.trigger == 0 && shutting_down != 1)
-        {
-            usleep(all_trigger_params.trigger_timeout_us); // default sleep 100µs while we wait for triggers
-        }
-        all_trigger_params.trigger = 0; // set the trigger to 0 now that we are going to take an image
-        if (imageCapture() < 0) {
-            fprintf(stderr, "Could not complete image capture: %s.\n", 
-                strerror(errno));
-        }
-    } else {
-        if (imageCapture() < 0) {
-            fprintf(stderr, "Could not complete image capture: %s.\n", 
-                strerror(errno));
+        clock_gettime(CLOCK_MONOTONIC, &wait_begin);
+        int wait_ret = waitForTrigger(&trigger_tv);
+        clock_gettime(CLOCK_MONOTONIC, &wait_end);
+        frame->trigger_wait_s += (wait_end.tv_sec - wait_begin.tv_sec) +
+            (wait_end.tv_nsec - wait_begin.tv_nsec) * 1e-9;
+        if (wait_ret < 0) {
+            taking_image = 0;
+            return -1;
         }
     }
+    // a free-running camera exposes on its own
+    if (!free_running && (imageCapture() < 0)) {
+        fprintf(stderr, "Could not complete image capture: %s.\n", 
+            strerror(errno));
+    }
     taking_image = 0;
+    if (all_trigger_params.trigger_mode == 1) {
+        // imageCapture() stamps metadataTv just before starting the exposure
+        frame->trigger_time = trigger_tv.tv_sec + trigger_tv.tv_usec / 1e6;
+        frame->trigger_latency = (metadataTv.tv_sec - trigger_tv.tv_sec) +
+            (metadataTv.tv_usec - trigger_tv.tv_usec) / 1e6;
+        if (verbose) {
+            printf("Trigger to exposure start latency: %.3f ms\n",
+                1000.0 * frame->trigger_latency);
+        }
+    }
 
     gettimeofday(&tv, NULL);
-    photo_time = tv.tv_sec + ((double) tv.tv_usec)/1000000.;
-    all_astro_params.photo_time = photo_time;
+    frame->photo_time = tv.tv_sec + ((double) tv.tv_usec)/1000000.;
 
-    if (imageTransfer(unpacked_image) < 0) {
+    if (imageTransfer(frame->image) < 0) {
         fprintf(stderr, "Could not complete image transfer: %s.\n", 
            strerror(errno));
         return -1;
     }
+    // imageTransfer() stamps the shared metadata; keep this exposure's copy
+    frame->metadata = default_metadata;
+    if ((coadd_frames > 1) && (coaddExposures(frame) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
 
+/**
+ * @brief Copy what preprocessing found in the frame just detected into its
+ * FITS header, and add its cosmic ray hits to the running total.
+ */
+static void recordDetectionStats(struct frame_t * frame)
+{
+    frame->metadata.crhits = frame_cosmic_ray_hits;
+    __atomic_add_fetch(&cosmic_ray_hits, frame_cosmic_ray_hits,
+        __ATOMIC_RELAXED);
+    frame->metadata.rowpatt = fixed_pattern_removed ? 
+        (float)fixed_pattern.row_rms : 0.0f;
+    frame->metadata.colpatt = fixed_pattern_removed ? 
+        (float)fixed_pattern.col_rms : 0.0f;
+}
+
+
+/**
+ * @brief Detection stage: find and centroid blobs in the frame image and
+ * publish the frame to display clients.
+ * 
+ * @param frame
+ * @return int number of blobs found
+ */
+int detectFrame(struct frame_t * frame)
+{
+    frame->blob_count = 0;
+    frame->tracking = 0;
+    frame_cosmic_ray_hits = 0;
+    fixed_pattern_removed = 0;
     #ifndef TEST_FLIGHT
-    // TODO(evanmayer): implement a FITS image loader
-    // testing pictures that have already been taken
-    // if you uncomment this for testing, you may need to change the path.
-    // if (loadDummyPicture(L"/home/starcam/saved_image_2022-07-06_08-31-30.bmp", //L"/home/starcam/Desktop/TIMSC/img/load_image.bmp", 
-    //                      (char **) &memory) == 1) {
-    //     if (verbose) {
-    //         printf("Successfully loaded test picture.\n");
-    //     }
-    // } else {
-    //     fprintf(stderr, "Error loading test picture: %s.\n", strerror(errno));
-    //     // can't solve without a picture to solve on!
-    //     usleep(1000000);
-    //     return -1;
-    // }
+    uint16_t * image = frame->image;
+
+    // Between periodic full frames, only look near the stars we already know
+    if (track_stars && last_solve_ok && (num_rois > 0) &&
+        (++frames_since_full < TRACK_FULL_FRAME_PERIOD)) {
+        solveState = BLOB_FIND;
+        frame->blob_count = trackBlobs(frame);
+        if (frame->blob_count >= TRACK_MIN_STARS) {
+            frame->tracking = 1;
+            if (coadd_shift) {
+                rememberCoaddStars(frame);
+            }
+            // tracking frames are not solved, so send their centroids with
+            // the last solution
+            rememberTrackedStars(frame);
+            image_solved[0] = 1;
+            image_solved[1] = 1;
+            recordDetectionStats(frame);
+            publishFrame(frame);
+            send_data = 1;
+            return frame->blob_count;
+        }
+        printf("Lost track of stars, searching the full frame...\n");
+    }
 
     // find the blobs in the image
-    blob_count = findBlobs(unpacked_image, CAMERA_WIDTH, CAMERA_HEIGHT, &star_x, 
-                           &star_y, &star_mags, output_buffer);
+    int num_found = 0;
+    frame->blob_count = findBlobs(image, CAMERA_WIDTH, CAMERA_HEIGHT,
+        frame->star_x, frame->star_y, frame->star_mags, MAX_BLOBS,
+        &num_found, NULL);
     // Add some logic to automatically try filtering the image
     // if the number of blobs found is not in some nice passband
     
-    if (blob_count < MIN_BLOBS || blob_count > MAX_BLOBS)
+    if (num_found < MIN_BLOBS || num_found > MAX_BLOBS)
+    {
+        printf("Couldn't find an appropriate number of blobs, "
+               "re-thresholding image...\n");
+        frame->blob_count = rethresholdBlobs(frame, &num_found);
+    }
+    if ((num_found < MIN_BLOBS || num_found > MAX_BLOBS) && 
+        !all_blob_params.high_pass_filter)
     {
         printf("Couldn't find an appropriate number of blobs, filtering image...\n");
         all_blob_params.high_pass_filter = 1;
-        blob_count = findBlobs(unpacked_image, CAMERA_WIDTH, CAMERA_HEIGHT, &star_x, 
-                           &star_y, &star_mags, output_buffer);
+        frame->blob_count = findBlobs(image, CAMERA_WIDTH, CAMERA_HEIGHT,
+            frame->star_x, frame->star_y, frame->star_mags, MAX_BLOBS,
+            &num_found, NULL);
         all_blob_params.high_pass_filter = 0;
     }
-    // New 3x3 flux weighted centroiding algorithm from 2023 added below
-    // temp variable to store the position of each blob in the flattened array
-    int image_locs[9];
-    // arrays of positions to centroid with
-    double x_locs[9];
-    double y_locs[9];
-    // nowq we loop over blobcount to grab positions 
-    for (int i = 0; i < blob_count; i++)
-    {   
-        // printf("made it in on iteration %d of %d\n", i+1, blob_count);
-        double sum = 0; // variable to store total flux
-        double new_x = 0; // new centroided locations 
-        double new_y = 0;
-        // grab the locations on the unfiltered map
-        image_locs[0] = (int) ((star_x[i]-1)+CAMERA_WIDTH*(CAMERA_HEIGHT-star_y[i]+1));
-        image_locs[1] = (int) ((star_x[i]  )+CAMERA_WIDTH*(CAMERA_HEIGHT-star_y[i]+1));
-        image_locs[2] = (int) ((star_x[i]+1)+CAMERA_WIDTH*(CAMERA_HEIGHT-star_y[i]+1));
-        image_locs[3] = (int) ((star_x[i]-1)+CAMERA_WIDTH*(CAMERA_HEIGHT-star_y[i]  ));
-        image_locs[4] = (int) ((star_x[i]  )+CAMERA_WIDTH*(CAMERA_HEIGHT-star_y[i]  ));
-        image_locs[5] = (int) ((star_x[i]+1)+CAMERA_WIDTH*(CAMERA_HEIGHT-star_y[i]  ));
-        image_locs[6] = (int) ((star_x[i]-1)+CAMERA_WIDTH*(CAMERA_HEIGHT-star_y[i]-1));
-        image_locs[7] = (int) ((star_x[i]  )+CAMERA_WIDTH*(CAMERA_HEIGHT-star_y[i]-1));
-        image_locs[8] = (int) ((star_x[i]+1)+CAMERA_WIDTH*(CAMERA_HEIGHT-star_y[i]-1));
-        for (int j = 0; j < 9; j++)
-        {
-            sum += (double) unpacked_image[image_locs[j]]; // get the total flux in the 3x3
-        }
-        // grab the actual x + y positions in 2d instead of flattened
-        x_locs[0] = x_locs[3] = x_locs[6] = star_x[i]-1;
-        x_locs[1] = x_locs[4] = x_locs[7] = star_x[i]  ;
-        x_locs[2] = x_locs[5] = x_locs[8] = star_x[i]+1;
-        y_locs[0] = y_locs[1] = y_locs[2] = star_y[i]+1;
-        y_locs[3] = y_locs[4] = y_locs[5] = star_y[i]  ;
-        y_locs[6] = y_locs[7] = y_locs[8] = star_y[i]-1;
-        // flux weight the locations
-        for (int j2 = 0; j2 < 9; j2++)
-        {
-            x_locs[j2] = x_locs[j2]*unpacked_image[image_locs[j2]]/sum;
-            y_locs[j2] = y_locs[j2]*unpacked_image[image_locs[j2]]/sum;
-        }
-        for (int j3 = 0; j3 < 9; j3++)
-        {
-            new_x += x_locs[j3];
-            new_y += y_locs[j3];
-        }
-        star_x[i] = new_x;
-        star_y[i] = new_y;
+    if (track_stars) {
+        seedTrackingWindows(frame);
+    }
+    if (coadd_shift) {
+        rememberCoaddStars(frame);
     }
+    #endif
+    recordDetectionStats(frame);
+
+    // pass off the image for sending to clients; it is read-only from here on
+    publishFrame(frame);
+    send_data = 1;
+
+    return frame->blob_count;
+}
+
+
+/**
+ * @brief Solve stage: run lostInSpace on the frame's blobs and log the result
+ * to the observing file and the Kst blob table.
+ * 
+ * @param frame
+ * @return int -1 if the observing file could not be opened, 0 otherwise
+ */
+int solveFrame(struct frame_t * frame)
+{
+    #ifndef TEST_FLIGHT
+    static int first_time = 1;
+    static FILE * fptr = NULL;
+    char datafile[100], buff[100];
+    struct timespec camera_tp_beginning, camera_tp_end; 
+    struct tm * tm_info = &frame->tm_info;
+    double start, end, camera_time;
+
+    // a handful of tracked stars is not worth a lost-in-space solve
+    if (frame->tracking) {
+        return 0;
+    }
+
+    // data file to pass to lostInSpace
+    strftime(datafile, sizeof(datafile), 
+             "/home/starcam/Desktop/TIMSC/data_%b-%d.txt", tm_info);
+    
+    // set file descriptor for observing file to NULL in case of previous bad
+    // shutdown or termination of Astrometry
+    if (fptr != NULL) {
+        fclose(fptr);
+        fptr = NULL;
+    }
+    
+    if ((fptr = fopen(datafile, "a")) == NULL) {
+        fprintf(stderr, "Could not open obs. file %s: %s.\n", datafile,
+            strerror(errno));
+        return -1;
+    }
+
+    if (first_time) {
+        // NOTE(evanmayer): This info is also saved to FITS headers.
+        strftime(buff, sizeof(buff), "%B %d Observing Session - beginning "
+                                     "%H:%M:%S GMT", tm_info);
+        fprintf(fptr, "\n");
+        fprintf(fptr, "# ********************* %s *********************\n", buff);
+        fprintf(fptr, "# Camera model: %s\n", frame->metadata.detector);
+        fprintf(fptr, "# ----------------------------------------------------\n");
+        fprintf(fptr, "# Exposure: %f milliseconds\n", frame->metadata.exptime * 1000.0);
+        fprintf(fptr, "# Pixel clock: %f MHz\n", frame->metadata.pixelclk);
+        fprintf(fptr, "# Frame rate achieved (desired is 10): %f\n", frame->metadata.framerte);
+        fprintf(fptr, "# Trigger delay (microseconds): %f\n", frame->metadata.trigdlay);
+        fprintf(fptr, "# Auto shutter: %i\n", frame->metadata.autoexp);
+        fprintf(fptr, "# ----------------------------------------------------\n");
+        fprintf(fptr, "# Sensor ID/type: %lu\n", frame->metadata.sensorid);
+        fprintf(fptr, "# Sensor bit depth %u\n", frame->metadata.bitdepth);
+        fprintf(fptr, "# Maximum image width and height: %i, %i\n", 
+                       CAMERA_WIDTH, CAMERA_HEIGHT);
+        fprintf(fptr, "# Pixel size (micrometers): %.2f\n", 
+                      frame->metadata.pixsize1);
+        fprintf(fptr, "# Mono gain setting: %.2fx base\n", frame->metadata.gainfact);
+        fprintf(fptr, "# Auto gain (should be disabled): %i\n", (int) frame->metadata.autogain);
+        fprintf(fptr, "# Auto exposure (should be disabled): %i\n", (int) frame->metadata.autoexp);
+        fprintf(fptr, "# Auto black level (should be disabled): %i\n", (int) frame->metadata.autoblk);
+        fprintf(fptr, "# Black level offset (desired is 50): %u\n", frame->metadata.bloffset);
 
-    // make kst display the filtered image 
-    memcpy(output_buffer, unpacked_image, CAMERA_NUM_PX * sizeof(uint16_t));
+        // write header to data file
+        if (fprintf(fptr, "C time,GMT,Blob #,RA (deg),DEC (deg),RA_OBS (deg),DEC_OBS (deg),FR (deg),PS,"
+                          "ALT (deg),AZ (deg),IR (deg),Astrom. solve time "
+                          "(msec),Solution Uncertainty (arcsec),Camera time (msec)\n") < 0) {
+            fprintf(stderr, "Error writing header to observing file: %s.\n", 
+                    strerror(errno));
+        }
 
-    // pass off the image bytes for sending to clients
-    memcpy(camera_raw, output_buffer, CAMERA_NUM_PX * sizeof(uint16_t));
+        fflush(fptr);
+        first_time = 0;
+    }
 
     // get current time right after exposure
     if (clock_gettime(CLOCK_REALTIME, &camera_tp_beginning) == -1) {
         fprintf(stderr, "Error starting camera timer: %s.\n", strerror(errno));
     }
 
-    double start, end, camera_time;
-    send_data = 1;
-
     if (verbose) {
         printf(">> Not currently auto-focusing!\n");
     }
 
-    strftime(date, sizeof(date), "/home/starcam/Desktop/TIMSC/img/"
-                                    "saved_image_%Y-%m-%d_%H-%M-%S.png", 
-                                    tm_info);
-    snprintf(filename, 256, "%s", date);
-
     // write blob and time information to data file
     strftime(buff, sizeof(buff), "%b %d %H:%M:%S", tm_info); 
     printf("\nTime going into Astrometry.net: %s\n", buff);
 
-    if (fprintf(fptr, "%li,%s,", seconds, buff) < 0) {
+    if (fprintf(fptr, "%li,%s,", frame->seconds, buff) < 0) {
         fprintf(stderr, "Unable to write time and blob count to observing "
                         "file: %s.\n", strerror(errno));
     }
@@ -3045,14 +3993,23 @@ int doCameraAndAstrometry(void)
         printf("\n> Trying to solve astrometry...\n");
     }
 
+    // the solution describes this frame, not the one being exposed now
+    all_astro_params.rawtime = frame->seconds;
+    all_astro_params.photo_time = frame->photo_time;
+    all_trigger_params.trigger_time = frame->trigger_time;
+    all_trigger_params.trigger_latency = frame->trigger_latency;
+    solved_cosmic_ray_hits = frame->metadata.crhits;
+
     solveState = ASTROMETRY;
-    if (lostInSpace(star_x, star_y, star_mags, blob_count, tm_info, 
-                    datafile) != 1) {
+    if (lostInSpace(frame->star_x, frame->star_y, frame->star_mags,
+                    frame->blob_count, tm_info, datafile) != 1) {
         printf("\n(*) Could not solve Astrometry.\n");
+        last_solve_ok = 0;
     } else {
         // let the astro thread know to send data
         image_solved[0] = 1;
         image_solved[1] = 1;
+        last_solve_ok = 1;
     }
 
     // get current time right after solving
@@ -3078,55 +4035,65 @@ int doCameraAndAstrometry(void)
     fclose(fptr);
     fptr = NULL;
 
-    // printf("Saving captured frame to \"%s\"\n", filename);
-    // unlink whatever the latest saved image was linked to before
-    // unlink("/home/starcam/Desktop/TIMSC/imh/latest_saved_image.png");
-    // sym link current date to latest image for live Kst updates
-    // symlink(date, "/home/starcam/Desktop/TIMSC/img/latest_saved_image.png");
-
     // make a table of blobs for Kst
-    if (makeTable("makeTable.txt", star_mags, star_x, star_y, blob_count) != 1) {
+    if (makeTable("makeTable.txt", frame->star_mags, frame->star_x,
+                  frame->star_y, frame->blob_count) != 1) {
         printf("Error (above) writing blob table for Kst.\n");
     }
     #else
-    // make kst display the filtered image 
-    memcpy(output_buffer, unpacked_image, CAMERA_NUM_PX * sizeof(uint16_t));
-    // pass off the image bytes for sending to clients
-    memcpy(camera_raw, output_buffer, CAMERA_NUM_PX * sizeof(uint16_t));
-    send_data = 1;
+    (void)frame;
     #endif
+    return 0;
+}
 
-    saveFITStoDisk(unpacked_image);
-
-    // free alloc'd variables when we are shutting down
-    if (shutting_down) {
-        if (verbose) {
-            printf("\n> Freeing allocated variables in camera.c...\n");
-        }
-
-        if (output_buffer != NULL) {
-            free(output_buffer);
-        }
 
-        if (mask != NULL) {
-            free(mask);
-        }
+/**
+ * @brief Archive stage: write the frame image and its metadata to disk.
+ * 
+ * @param frame
+ * @return int -1 if failed, 0 otherwise
+ */
+int archiveFrame(struct frame_t * frame)
+{
+    // only full frames are kept; tracking runs far faster than we can write
+    if (frame->tracking) {
+        return 0;
+    }
+    return saveFITStoDisk(frame->image, &frame->metadata);
+}
 
-        if (blob_mags != NULL) {
-            free(blob_mags);
-        }
 
-        if (star_x != NULL) {
-            free(star_x);
-        }
+/* Function to take observing images and solve for pointing using Astrometry.
+** Runs the pipeline stages back to back on a single frame; used when the
+** stages are not run concurrently (see runPipeline()).
+** Input: None.
+** Output: A flag indicating successful round of image + solution by the camera 
+** (e.g. if the camera can't open the observing file, the function will 
+** automatically return with -1).
+*/
+int doCameraAndAstrometry(void)
+{
+    int ret = 1;
+    struct frame_t * frame = frameGet();
+    if (frame == NULL) {
+        return -1;
+    }
 
-        if (star_y != NULL) {
-            free(star_y);
+    frame->trigger_wait_s = 0.0;
+    if (acquireFrame(frame) < 0) {
+        ret = -1;
+    } else {
+        detectFrame(frame);
+        if (solveFrame(frame) < 0) {
+            ret = -1;
         }
+        archiveFrame(frame);
+    }
+    frameRelease(frame);
 
-        if (star_mags != NULL) {
-            free(star_mags);
-        }
+    // free alloc'd variables when we are shutting down
+    if (shutting_down) {
+        freeAstrometryBuffers();
     }
-    return 1;
+    return ret;
 }
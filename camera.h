@@ -5,6 +5,8 @@
 #include <ids_peak_comfort_c/ids_peak_comfort_c.h>
 extern peak_camera_handle hCam;
 
+struct frame_t;
+
 
 // TIMSC is IMX542
 // Datasheet says array is 5328 x 3040, but this includes overscan. The number
@@ -16,14 +18,36 @@ extern peak_camera_handle hCam;
 #define MAX_PS         7.0  // [arcsec/px]
 
 #define CAMERA_NUM_PX (CAMERA_WIDTH * CAMERA_HEIGHT)
-// higher than 2 requires FPGA binning. I noticed no speed gains from on-sensor
-// vs. FPGA, or even vs. on host. FPGA binning default.
+// Auto-focus bins on the host (binImage()), which unlike sensor or FPGA
+// binning does not need acquisition stopped and restarted
 #define CAMERA_FOCUS_BINFACTOR 4
 #define CAMERA_MARGIN 0 // [px]
 #define CAMERA_MAX_PIXVAL 4095 //  2**12
 #define MIN_BLOBS 4
 #define MAX_BLOBS 300
+// when a frame has too few or too many blobs, the filtered image is
+// thresholded again, bisecting n_sigma (geometrically) within these limits
+// for at most this many tries
+#define RETHRESHOLD_MIN_N_SIGMA 4.0
+#define RETHRESHOLD_MAX_N_SIGMA 1000.0
+#define RETHRESHOLD_MAX_TRIES 10
+// Star tracking between full frames (--track): number of stars followed,
+// half-width of the window searched around each [px], frames between full
+// frame searches, and stars needed to keep tracking
+#define TRACK_MAX_ROIS 8
+#define TRACK_ROI_HALF_SIZE 24
+#define TRACK_FULL_FRAME_PERIOD 50
+#define TRACK_MIN_STARS MIN_BLOBS
+// how often a thread waiting on a software trigger checks for shutdown
+#define TRIGGER_SHUTDOWN_CHECK_MS 100
+// static hot pixel map (hotpix.h), and the old text list it is converted from
+#define STATIC_HP_MAP  "/home/starcam/Desktop/TIMSC/static_hp_mask.bin"
 #define STATIC_HP_MASK "/home/starcam/Desktop/TIMSC/static_hp_mask.txt"
+// master calibration frames (calibration.h), made with --make-dark/--make-flat
+#define MASTER_DARK    "/home/starcam/Desktop/TIMSC/master_dark.fits.fz"
+#define MASTER_FLAT    "/home/starcam/Desktop/TIMSC/master_flat.fits.fz"
+// tile size of the background mesh (high_pass_filter == 2) [px]
+#define BACKGROUND_MESH_SIZE 128
 #define dut1           -0.23
 
 extern int shutting_down;
@@ -34,9 +58,27 @@ extern int image_solved[2];
 /* triggering parameters */
 struct trigger_params
 {
-    int trigger_mode; // 0 is auto triggered with a sleep, 1 waits for a trigger
+    // 0 is auto triggered with a sleep, 1 waits for a trigger, 2 free-runs and
+    // always processes the newest frame
+    int trigger_mode;
     int trigger; // 1 to take image if trigger mode is 1
-    int trigger_timeout_us; // time in µs to wait between checks for a trigger
+    // unused since trigger waits wake on setTrigger(); still set by command
+    int trigger_timeout_us;
+    // for the latest solution: when its trigger packet arrived (UNIX time, 0 if
+    // untriggered) and the delay from then to the start of the exposure [s]
+    double trigger_time;
+    double trigger_latency;
+};
+
+/* Camera settings as last read back after being written. Setters keep this
+** and default_metadata current, so nothing on the per-frame path has to ask
+** the camera. */
+struct camera_state_t
+{
+    double exposure_time_ms;
+    double analog_gain;
+    double frame_rate;  // [Hz] free-run rate
+    uint8_t binning;
 };
 
 enum solveState_t
@@ -61,7 +103,7 @@ struct blob_params {
     int spike_limit;            // where dynamic hot pixel will designate as hp
     int dynamic_hot_pixels;     // (bool) search for dynamic hot pixels
     int r_smooth;               // image smooth filter radius [px]
-    int high_pass_filter;       // 0 == off, 1 == on
+    int high_pass_filter;       // 0 == off, 1 == boxcar, 2 == mesh
     int r_high_pass_filter;     // image high pass filter radius [px]
     int centroid_search_border; // px dist from image edge to start star search
     int filter_return_image;    // 1 == true; 0 = false
@@ -74,7 +116,21 @@ struct blob_params {
 
 extern struct blob_params all_blob_params;
 extern struct trigger_params all_trigger_params;
+extern int use_packed_pixels;
+extern uint64_t frames_dropped;
+extern int track_stars;
+extern int coadd_frames;
+extern int coadd_shift;
+extern float cosmic_ray_sigma;
+extern int remove_fixed_pattern;
+extern uint64_t cosmic_ray_hits;
+extern uint32_t solved_cosmic_ray_hits;
+extern int acquisition_buffer_count;
+extern int use_huge_pages;
+extern uint64_t frames_incomplete;
+extern uint32_t max_buffers_awaiting;
 extern struct camera_params all_camera_params;
+extern struct camera_state_t camera_state;
 
 int setCameraParams();
 void setSaveImage();
@@ -87,11 +143,20 @@ int getNumberOfCameras(int* pNumCams);
 int setExposureTime(double exposureTimeMs);
 
 int imageCapture(void);
+void setTrigger(int trigger);
 int getFps(double* pCurrentFps);
 int imageTransfer(uint16_t* pUnpackedImage);
+int loadCalibrationFrames(void);
+int makeMasterFrame(char * path, int num_frames);
 int saveImageToDisk(char* filename, peak_frame_handle hFrame);
 int setMonoAnalogGain(double analogGain);
 int doCameraAndAstrometry();
+int acquireFrame(struct frame_t * frame);
+int detectFrame(struct frame_t * frame);
+int solveFrame(struct frame_t * frame);
+int archiveFrame(struct frame_t * frame);
+int initAstrometryBuffers(void);
+void freeAstrometryBuffers(void);
 void clean();
 void closeCamera();
 const char * printCameraError();
@@ -99,11 +164,12 @@ int isLeapYear(int year);
 void verifyBlobParams();
 int makeTable(char * filename, double * star_mags, double * star_x, 
               double * star_y, int blob_count);
-int findBlobs(uint16_t * input_buffer, int w, int h, double ** star_x, 
-              double ** star_y, double ** star_mags, uint16_t * output_buffer);
-void unpack_mono12(uint16_t * packed, uint16_t * unpacked, int num_pixels);
-
-void boxcarFilterImage(uint16_t * ib, int i0, int j0, int i1, int j1, int r_f, 
-                       double * filtered_image);
+int findBlobs(uint16_t * input_buffer, int w, int h, double * star_x, 
+              double * star_y, double * star_mags, int max_blobs,
+              int * num_found, uint16_t * output_buffer);
+int extractBlobs(double n_sigma, double * star_x, double * star_y, 
+                 double * star_mags, int max_blobs, int * num_found);
+int getTrackedStars(double * photo_time, double * star_x, double * star_y, 
+                    int max_stars);
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef CAMERA_BACKEND_H
+#define CAMERA_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* One raw frame as delivered by a backend, before unpacking */
+struct camera_frame_t {
+    void* memory;     // pixel data
+    size_t size;      // bytes at memory
+    int packed;       // 1: 12-bit packed (Mono12p), 0: 12 bits in 16
+    int complete;     // 0 if the transfer was incomplete
+    void* handle;     // backend-private handle, passed back to releaseFrame
+    uint32_t skipped; // free-run: newer frames the backend discarded before this
+};
+
+/* State of the driver's acquisition buffer queue */
+struct camera_buffer_stats_t {
+    uint32_t announced;         // buffers the driver can fill
+    uint32_t queued;            // empty, waiting for a frame
+    uint32_t awaiting_delivery; // filled, waiting for waitForFrame()
+    uint64_t dropped;           // frames lost because no buffer was free
+    uint64_t incomplete;        // frames delivered with missing data
+};
+
+/* Everything the capture code needs from a camera. The peak backend drives the
+** real camera; the others let the capture and solve path run without one.
+** Setters must keep camera_state (camera.h) current.
+** Optional hooks may be NULL. A waitForFrame timeout of 0 polls for a frame
+** that has already arrived and fails quietly if there is none. */
+struct camera_backend_t {
+    const char* name;
+    int (*init)(void);
+    void (*close)(void);
+    int (*trigger)(void);
+    int (*waitForFrame)(uint32_t timeout_ms, struct camera_frame_t* frame);
+    int (*releaseFrame)(struct camera_frame_t* frame);
+    int (*setExposureTime)(double exposureTimeMs);
+    int (*setGain)(double analogGain);
+    int (*setBinning)(uint8_t factor);
+    // optional
+    int (*setFreeRun)(int enable); // 1: expose continuously at the frame rate
+    int (*getBufferStats)(struct camera_buffer_stats_t* stats);
+    int (*renewHotPixels)(void);
+    int (*initMessages)(void);
+    int (*pollMessages)(void);
+    int (*closeMessages)(void);
+};
+
+extern struct camera_backend_t* camera_backend;
+extern struct camera_backend_t peak_backend;
+extern struct camera_backend_t replay_backend;
+extern struct camera_backend_t synthetic_backend;
+
+// stand-in backend configuration, set before init()
+int setReplayDirectory(const char* dir);
+void setSimFrameRate(double fps);
+void setSyntheticSeed(uint32_t seed);
+
+#endif
@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "camera_backend.h"
+#include "camera.h"
+#include "commands.h"
+#include "fits_utils.h"
+#include "lens_adapter.h"
+
+/* Stand-in camera backends: replay of saved FITS images and synthetic star
+** fields. Both deliver unpacked 16-bit frames, honour binning by averaging
+** on the host, and pace frames to the exposure time and sim_fps. */
+
+#define REPLAY_PREFIX "saved_image_"
+#define REPLAY_SUFFIX ".fits.fz"
+#define SYNTHETIC_NUM_STARS 300
+#define SYNTHETIC_NUM_HOT_PIXELS 100
+#define SYNTHETIC_PSF_SIGMA 1.3    // [px]
+#define SYNTHETIC_PSF_RADIUS 5     // [px] render stars out to this radius
+#define SYNTHETIC_BLACK_LEVEL 50.0 // [ADU]
+#define SYNTHETIC_SKY_RATE 0.5     // [ADU/ms]
+#define SYNTHETIC_READ_NOISE 2.5   // [ADU]
+#define SYNTHETIC_DRIFT 0.7        // [px/frame] apparent sky motion in x
+
+static double sim_fps = 1.0;
+static double sim_exposure_ms = 100.0;
+static double sim_gain = 1.0;
+static uint8_t sim_binning = 1;
+static int trigger_pending = 0;
+static struct timespec trigger_time = {0, 0};
+static struct timespec last_frame_time = {0, 0};
+// free-run: frame k finishes exposing (k + 1) / sim_fps after free_run_start
+static int sim_free_running = 0;
+static struct timespec free_run_start = {0, 0};
+static int64_t last_free_run_frame = -1;
+// full-resolution frame as rendered or loaded
+static uint16_t* sim_image = NULL;
+// frame handed out by waitForFrame(); sim_image itself when not binned
+static uint16_t* sim_output = NULL;
+
+static char replay_dir[256] = "";
+static char** replay_files = NULL;
+static int replay_num_files = 0;
+static int replay_next = 0;
+
+static uint32_t synthetic_seed = 1;
+static uint32_t rng_state = 1;
+static uint64_t synthetic_frame_count = 0;
+static double star_x[SYNTHETIC_NUM_STARS];
+static double star_y[SYNTHETIC_NUM_STARS];
+static double star_flux[SYNTHETIC_NUM_STARS]; // [ADU/ms] total
+static int hot_pixel_idx[SYNTHETIC_NUM_HOT_PIXELS];
+
+
+/**
+ * @brief Set the maximum frame rate of the stand-in backends.
+ *
+ * @param fps frames per second; values <= 0 leave the rate unchanged
+ */
+void setSimFrameRate(double fps)
+{
+    if (fps > 0.0) {
+        sim_fps = fps;
+    }
+}
+
+
+/**
+ * @brief Choose the directory the replay backend reads images from.
+ *
+ * @param dir path to a directory of saved_image_*.fits.fz files
+ * @return int -1 if the path is too long, 0 otherwise
+ */
+int setReplayDirectory(const char* dir)
+{
+    if (strlen(dir) >= sizeof(replay_dir)) {
+        fprintf(stderr, "setReplayDirectory: path too long: %s\n", dir);
+        return -1;
+    }
+    snprintf(replay_dir, sizeof(replay_dir), "%s", dir);
+    return 0;
+}
+
+
+/**
+ * @brief Seed the star field of the synthetic backend.
+ */
+void setSyntheticSeed(uint32_t seed)
+{
+    synthetic_seed = (seed == 0) ? 1 : seed;
+}
+
+
+static double elapsedSec(struct timespec* t0, struct timespec* t1)
+{
+    return ((double)t1->tv_sec + 1.0e-9*t1->tv_nsec) -
+        ((double)t0->tv_sec + 1.0e-9*t0->tv_nsec);
+}
+
+
+/* xorshift32: fast, and good enough for noise */
+static uint32_t nextRandom(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+
+static double uniformRandom(void)
+{
+    return (double)nextRandom() / 4294967296.0;
+}
+
+
+/* Approximately normal, mean 0 and variance 1 (Irwin-Hall, n = 4) */
+static double normalRandom(void)
+{
+    return (uniformRandom() + uniformRandom() + uniformRandom() +
+        uniformRandom() - 2.0) * 1.7320508;
+}
+
+
+static int simAllocImages(void)
+{
+    if (sim_image == NULL) {
+        sim_image = calloc(CAMERA_NUM_PX, sizeof(uint16_t));
+    }
+    if (sim_output == NULL) {
+        sim_output = calloc(CAMERA_NUM_PX, sizeof(uint16_t));
+    }
+    if ((sim_image == NULL) || (sim_output == NULL)) {
+        fprintf(stderr, "Error allocating stand-in camera images: %s.\n",
+            strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+static void simClose(void)
+{
+    free(sim_image);
+    sim_image = NULL;
+    free(sim_output);
+    sim_output = NULL;
+    for (int i = 0; i < replay_num_files; i++) {
+        free(replay_files[i]);
+    }
+    free(replay_files);
+    replay_files = NULL;
+    replay_num_files = 0;
+}
+
+
+static int simTrigger(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &trigger_time);
+    trigger_pending = 1;
+    return 0;
+}
+
+
+static int simSetExposureTime(double exposureTimeMs)
+{
+    sim_exposure_ms = exposureTimeMs;
+    camera_state.exposure_time_ms = exposureTimeMs;
+    default_metadata.exptime = (float)(exposureTimeMs / 1000.0);
+    return 0;
+}
+
+
+static int simSetGain(double analogGain)
+{
+    sim_gain = analogGain;
+    camera_state.analog_gain = analogGain;
+    default_metadata.gainfact = (float)analogGain;
+    return 0;
+}
+
+
+static int simSetBinning(uint8_t factor)
+{
+    if (factor < 1) {
+        return -1;
+    }
+    sim_binning = factor;
+    camera_state.binning = factor;
+    default_metadata.ccdbin1 = factor;
+    default_metadata.ccdbin2 = factor;
+    return 0;
+}
+
+
+static int simReleaseFrame(struct camera_frame_t* frame)
+{
+    (void)frame;
+    return 0;
+}
+
+
+static int simSetFreeRun(int enable)
+{
+    sim_free_running = enable;
+    if (enable) {
+        clock_gettime(CLOCK_MONOTONIC, &free_run_start);
+        last_free_run_frame = -1;
+    }
+    return 0;
+}
+
+
+static void sleepSec(double seconds)
+{
+    if (seconds > 0.0) {
+        usleep((useconds_t)(seconds * 1e6));
+    }
+}
+
+
+static int simTimedOut(uint32_t timeout_ms)
+{
+    usleep(timeout_ms * 1000);
+    fprintf(stderr, "ERROR: WaitForFrame timed out after %u ms.\n",
+        timeout_ms);
+    return -1;
+}
+
+
+/**
+ * @brief Free-run: wait for the next frame the simulated camera finishes, or
+ * jump to the newest one if we have fallen behind.
+ *
+ * @param pSkipped filled in with the number of frames jumped over
+ * @return int -1 if no new frame arrives within timeout_ms
+ */
+static int simWaitForFreeRun(uint32_t timeout_ms, uint32_t* pSkipped)
+{
+    struct timespec now = {0, 0};
+    double period = 1.0 / sim_fps;
+
+    // The blocking wait always returns the newest frame; frames finished while
+    // rendering it are counted as skipped by the next wait instead.
+    if (timeout_ms == 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t newest = (int64_t)floor(elapsedSec(&free_run_start, &now) /
+        period) - 1;
+    if (newest > last_free_run_frame) {
+        *pSkipped = (uint32_t)(newest - last_free_run_frame - 1);
+    } else {
+        newest = last_free_run_frame + 1;
+        double wait_s = (newest + 1) * period -
+            elapsedSec(&free_run_start, &now);
+        if (wait_s > timeout_ms / 1000.0) {
+            return simTimedOut(timeout_ms);
+        }
+        sleepSec(wait_s);
+        *pSkipped = 0;
+    }
+    last_free_run_frame = newest;
+    return 0;
+}
+
+
+/**
+ * @brief Sleep until a triggered exposure would have been read out, honouring
+ * both the exposure time and the frame rate limit. In free-run, wait for the
+ * next frame instead.
+ *
+ * @param pSkipped filled in with the number of free-run frames jumped over
+ * @return int -1 if the frame would not arrive within timeout_ms
+ */
+static int simWaitForReadout(uint32_t timeout_ms, uint32_t* pSkipped)
+{
+    struct timespec now = {0, 0};
+
+    *pSkipped = 0;
+    if (sim_free_running) {
+        return simWaitForFreeRun(timeout_ms, pSkipped);
+    }
+    if (!trigger_pending) {
+        return (timeout_ms > 0) ? simTimedOut(timeout_ms) : -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double wait_s = sim_exposure_ms / 1000.0 - elapsedSec(&trigger_time, &now);
+    if (last_frame_time.tv_sec != 0) {
+        wait_s = fmax(wait_s,
+            1.0 / sim_fps - elapsedSec(&last_frame_time, &now));
+    }
+    if (wait_s > timeout_ms / 1000.0) {
+        return (timeout_ms > 0) ? simTimedOut(timeout_ms) : -1;
+    }
+    sleepSec(wait_s);
+    clock_gettime(CLOCK_MONOTONIC, &last_frame_time);
+    trigger_pending = 0;
+    return 0;
+}
+
+
+/**
+ * @brief Fill in the frame from sim_image, averaging bins on the host the way
+ * the camera FPGA would.
+ */
+static void simDeliverFrame(struct camera_frame_t* frame, uint32_t skipped)
+{
+    uint16_t* out = sim_image;
+    int w = CAMERA_WIDTH / sim_binning;
+    int h = CAMERA_HEIGHT / sim_binning;
+    if (sim_binning > 1) {
+        int n = sim_binning * sim_binning;
+        for (int j = 0; j < h; j++) {
+            for (int i = 0; i < w; i++) {
+                uint32_t sum = 0;
+                for (int dj = 0; dj < sim_binning; dj++) {
+                    uint16_t* row = sim_image +
+                        (j * sim_binning + dj) * CAMERA_WIDTH + i * sim_binning;
+                    for (int di = 0; di < sim_binning; di++) {
+                        sum += row[di];
+                    }
+                }
+                sim_output[j * w + i] = (uint16_t)(sum / n);
+            }
+        }
+        out = sim_output;
+    }
+    frame->memory = out;
+    frame->size = (size_t)w * h * sizeof(uint16_t);
+    frame->packed = 0;
+    frame->complete = 1;
+    frame->handle = NULL;
+    frame->skipped = skipped;
+}
+
+
+static int compareStrings(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+static int replayInit(void)
+{
+    DIR* dir = opendir(replay_dir);
+    struct dirent* entry = NULL;
+
+    if (dir == NULL) {
+        fprintf(stderr, "replayInit: could not open %s: %s.\n", replay_dir,
+            strerror(errno));
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if ((strncmp(entry->d_name, REPLAY_PREFIX, strlen(REPLAY_PREFIX)) != 0)
+            || (len < strlen(REPLAY_SUFFIX)) ||
+            (strcmp(entry->d_name + len - strlen(REPLAY_SUFFIX),
+                REPLAY_SUFFIX) != 0)) {
+            continue;
+        }
+        char** grown = realloc(replay_files,
+            (replay_num_files + 1) * sizeof(char*));
+        if (grown == NULL) {
+            closedir(dir);
+            return -1;
+        }
+        replay_files = grown;
+        size_t path_len = strlen(replay_dir) + len + 2;
+        replay_files[replay_num_files] = malloc(path_len);
+        if (replay_files[replay_num_files] == NULL) {
+            closedir(dir);
+            return -1;
+        }
+        snprintf(replay_files[replay_num_files], path_len, "%s/%s",
+            replay_dir, entry->d_name);
+        replay_num_files++;
+    }
+    closedir(dir);
+
+    if (replay_num_files == 0) {
+        fprintf(stderr, "replayInit: no %s*%s files in %s.\n", REPLAY_PREFIX,
+            REPLAY_SUFFIX, replay_dir);
+        return -1;
+    }
+    // file names sort by capture time
+    qsort(replay_files, replay_num_files, sizeof(char*), compareStrings);
+    printf("Replaying %d images from %s at up to %.2f fps.\n",
+        replay_num_files, replay_dir, sim_fps);
+
+    snprintf(default_metadata.detector, sizeof(default_metadata.detector),
+        "replay");
+    simSetExposureTime(all_camera_params.exposure_time);
+    camera_state.frame_rate = sim_fps;
+    default_metadata.framerte = (float)sim_fps;
+    replay_next = 0;
+    return simAllocImages();
+}
+
+
+static int replayWaitForFrame(uint32_t timeout_ms, struct camera_frame_t* frame)
+{
+    uint32_t skipped = 0;
+    if (simWaitForReadout(timeout_ms, &skipped) < 0) {
+        return -1;
+    }
+    replay_next = (replay_next + skipped) % replay_num_files;
+    char* file = replay_files[replay_next];
+    replay_next = (replay_next + 1) % replay_num_files;
+    if (verbose) {
+        printf("replayWaitForFrame: loading %s\n", file);
+    }
+    if (readImage(file, sim_image, CAMERA_WIDTH, CAMERA_HEIGHT) != 0) {
+        fprintf(stderr, "ERROR: could not read replay image %s.\n", file);
+        return -1;
+    }
+    simDeliverFrame(frame, skipped);
+    return 0;
+}
+
+
+static int syntheticInit(void)
+{
+    rng_state = synthetic_seed;
+    // brightness roughly follows a power law: many faint stars, few bright
+    for (int i = 0; i < SYNTHETIC_NUM_STARS; i++) {
+        star_x[i] = uniformRandom() * CAMERA_WIDTH;
+        star_y[i] = uniformRandom() * CAMERA_HEIGHT;
+        star_flux[i] = 20.0 / pow(uniformRandom() * 0.99 + 0.01, 1.5);
+    }
+    for (int i = 0; i < SYNTHETIC_NUM_HOT_PIXELS; i++) {
+        hot_pixel_idx[i] = (int)(nextRandom() % CAMERA_NUM_PX);
+    }
+    synthetic_frame_count = 0;
+
+    snprintf(default_metadata.detector, sizeof(default_metadata.detector),
+        "synthetic");
+    simSetExposureTime(all_camera_params.exposure_time);
+    camera_state.frame_rate = sim_fps;
+    default_metadata.framerte = (float)sim_fps;
+    printf("Rendering synthetic star fields at up to %.2f fps.\n", sim_fps);
+    return simAllocImages();
+}
+
+
+/**
+ * @brief Render one exposure: black level, sky, read noise, gaussian stars
+ * drifting across the field, and a fixed set of hot pixels.
+ */
+static void syntheticRender(void)
+{
+    double exposure = sim_exposure_ms * sim_gain;
+    double sky = SYNTHETIC_BLACK_LEVEL + SYNTHETIC_SKY_RATE * exposure;
+    // shot noise of the sky dominates the read noise for long exposures
+    double noise = sqrt(SYNTHETIC_READ_NOISE * SYNTHETIC_READ_NOISE +
+        SYNTHETIC_SKY_RATE * exposure);
+    double drift = SYNTHETIC_DRIFT * synthetic_frame_count;
+    double two_sigma2 = 2.0 * SYNTHETIC_PSF_SIGMA * SYNTHETIC_PSF_SIGMA;
+
+    for (int i = 0; i < CAMERA_NUM_PX; i++) {
+        double v = sky + noise * normalRandom();
+        sim_image[i] = (uint16_t)fmin(fmax(v, 0.0), CAMERA_MAX_PIXVAL);
+    }
+
+    for (int s = 0; s < SYNTHETIC_NUM_STARS; s++) {
+        double x = fmod(star_x[s] + drift, CAMERA_WIDTH);
+        double y = star_y[s];
+        double peak = star_flux[s] * exposure / (M_PI * two_sigma2);
+        int i0 = (int)x - SYNTHETIC_PSF_RADIUS;
+        int j0 = (int)y - SYNTHETIC_PSF_RADIUS;
+        for (int j = j0; j <= j0 + 2 * SYNTHETIC_PSF_RADIUS; j++) {
+            if ((j < 0) || (j >= CAMERA_HEIGHT)) {
+                continue;
+            }
+            for (int i = i0; i <= i0 + 2 * SYNTHETIC_PSF_RADIUS; i++) {
+                if ((i < 0) || (i >= CAMERA_WIDTH)) {
+                    continue;
+                }
+                double r2 = (i - x) * (i - x) + (j - y) * (j - y);
+                double v = sim_image[j * CAMERA_WIDTH + i] +
+                    peak * exp(-r2 / two_sigma2);
+                sim_image[j * CAMERA_WIDTH + i] =
+                    (uint16_t)fmin(v, CAMERA_MAX_PIXVAL);
+            }
+        }
+    }
+
+    for (int i = 0; i < SYNTHETIC_NUM_HOT_PIXELS; i++) {
+        sim_image[hot_pixel_idx[i]] = CAMERA_MAX_PIXVAL;
+    }
+    synthetic_frame_count++;
+}
+
+
+static int syntheticWaitForFrame(uint32_t timeout_ms,
+    struct camera_frame_t* frame)
+{
+    uint32_t skipped = 0;
+    if (simWaitForReadout(timeout_ms, &skipped) < 0) {
+        return -1;
+    }
+    // skipped frames still move the sky
+    synthetic_frame_count += skipped;
+    syntheticRender();
+    simDeliverFrame(frame, skipped);
+    return 0;
+}
+
+
+struct camera_backend_t replay_backend = {
+    .name = "replay",
+    .init = replayInit,
+    .close = simClose,
+    .trigger = simTrigger,
+    .waitForFrame = replayWaitForFrame,
+    .releaseFrame = simReleaseFrame,
+    .setExposureTime = simSetExposureTime,
+    .setGain = simSetGain,
+    .setBinning = simSetBinning,
+    .setFreeRun = simSetFreeRun,
+};
+
+struct camera_backend_t synthetic_backend = {
+    .name = "synthetic",
+    .init = syntheticInit,
+    .close = simClose,
+    .trigger = simTrigger,
+    .waitForFrame = syntheticWaitForFrame,
+    .releaseFrame = simReleaseFrame,
+    .setExposureTime = simSetExposureTime,
+    .setGain = simSetGain,
+    .setBinning = simSetBinning,
+    .setFreeRun = simSetFreeRun,
+};
@@ -0,0 +1,253 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coadd.h"
+#include "threadpool.h"
+
+#ifdef COADD_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// rows per coaddFrame() task
+#define COADD_BAND_ROWS 64
+
+
+void addSaturateScalar(uint16_t* sum, const uint16_t* image, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t s = (uint32_t)sum[i] + image[i];
+        sum[i] = (s > UINT16_MAX) ? UINT16_MAX : s;
+    }
+}
+
+
+#ifdef COADD_HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+void addSaturateAvx2(uint16_t* sum, const uint16_t* image, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(sum + i));
+        __m256i v = _mm256_loadu_si256((const __m256i*)(image + i));
+        _mm256_storeu_si256((__m256i*)(sum + i), _mm256_adds_epu16(s, v));
+    }
+    addSaturateScalar(sum + i, image + i, count - i);
+}
+#endif
+
+
+struct coadd_job_t {
+    void (*kernel)(uint16_t*, const uint16_t*, size_t);
+    uint16_t* sum;
+    const uint16_t* image;
+    int width, height;
+    int dx, dy;
+};
+
+
+/**
+ * @brief parallelFor() task for coaddFrame(): add one band of rows.
+ */
+static void coaddBand(void* arg, int band)
+{
+    struct coadd_job_t* job = (struct coadd_job_t*)arg;
+    int w = job->width;
+    int j0 = band * COADD_BAND_ROWS;
+    int j1 = (j0 + COADD_BAND_ROWS < job->height) ? j0 + COADD_BAND_ROWS :
+        job->height;
+
+    // columns whose source pixel, i - dx, is on the sensor
+    int i0 = (job->dx > 0) ? job->dx : 0;
+    int i1 = (job->dx < 0) ? w + job->dx : w;
+    for (int j = j0; j < j1; j++) {
+        int src = j - job->dy;
+        src = (src < 0) ? 0 : ((src >= job->height) ? job->height - 1 : src);
+        uint16_t* pSum = job->sum + (size_t)j * w;
+        const uint16_t* pRow = job->image + (size_t)src * w;
+        if (i1 <= i0) {
+            continue;
+        }
+        job->kernel(pSum + i0, pRow + i0 - job->dx, i1 - i0);
+        // repeat the edge column for the part shifted in from off the sensor
+        for (int i = 0; i < i0; i++) {
+            uint32_t s = (uint32_t)pSum[i] + pRow[0];
+            pSum[i] = (s > UINT16_MAX) ? UINT16_MAX : s;
+        }
+        for (int i = i1; i < w; i++) {
+            uint32_t s = (uint32_t)pSum[i] + pRow[w - 1];
+            pSum[i] = (s > UINT16_MAX) ? UINT16_MAX : s;
+        }
+    }
+}
+
+
+/**
+ * @brief Add a frame into a running co-add, shifted so that pixel (i, j) of
+ * the sum gets pixel (i - dx, j - dy) of the frame. The part of the sum with
+ * no source pixel gets the nearest edge pixel instead, so every pixel sums
+ * the same number of frames. Sums saturate at 65535.
+ * 
+ * @param sum co-add so far, width x height; the first frame is copied in
+ * @param image frame to add
+ * @param dx, dy shift to apply [px]
+ */
+void coaddFrame(uint16_t* sum, const uint16_t* image, int width, int height,
+    int dx, int dy)
+{
+    static void (*kernel)(uint16_t*, const uint16_t*, size_t) = NULL;
+    if (kernel == NULL) {
+        kernel = addSaturateScalar;
+#ifdef COADD_HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernel = addSaturateAvx2;
+        }
+#endif
+    }
+    struct coadd_job_t job = {
+        .kernel = kernel,
+        .sum = sum,
+        .image = image,
+        .width = width,
+        .height = height,
+        .dx = dx,
+        .dy = dy,
+    };
+    parallelFor((height + COADD_BAND_ROWS - 1) / COADD_BAND_ROWS, coaddBand,
+        &job);
+}
+
+
+/**
+ * @brief Turn a co-add of num_frames frames into their average in place,
+ * rounding to the nearest ADU, so thresholds in ADU keep their meaning.
+ * Division is by an exact fixed-point reciprocal.
+ */
+void averageCoadd(uint16_t* sum, size_t num_pix, int num_frames)
+{
+    if (num_frames <= 1) {
+        return;
+    }
+    // floor(n * m >> 32) == n / k for all 17-bit n when m = ceil(2^32 / k)
+    uint64_t m = ((1ULL << 32) + num_frames - 1) / num_frames;
+    uint32_t half = num_frames / 2;
+    for (size_t i = 0; i < num_pix; i++) {
+        sum[i] = (uint16_t)(((sum[i] + half) * m) >> 32);
+    }
+}
+
+
+/**
+ * @brief Flux-weighted centroid of the pixels in a window that are more
+ * than 3 sigma above the window's edge, both estimated from the edge pixels.
+ */
+static int windowCentroid(const uint16_t* image, int width, int i0, int j0,
+    int half, double* pX, double* pY)
+{
+    int i1 = i0 + 2*half, j1 = j0 + 2*half;
+    int num_edge = 8 * half;
+    uint16_t edge[num_edge];
+    int n = 0;
+    for (int i = i0; i < i1; i++) {
+        edge[n++] = image[i + j0 * width];
+        edge[n++] = image[i + 1 + j1 * width];
+    }
+    for (int j = j0; j < j1; j++) {
+        edge[n++] = image[i1 + j * width];
+        edge[n++] = image[i0 + (j + 1) * width];
+    }
+    for (int k = 1; k < n; k++) {
+        uint16_t v = edge[k];
+        int m = k;
+        while ((m > 0) && (edge[m - 1] > v)) {
+            edge[m] = edge[m - 1];
+            m--;
+        }
+        edge[m] = v;
+    }
+    // median, and sigma from the 16th to 84th percentiles
+    double background = edge[n / 2];
+    double sigma = 0.5 * (edge[(84 * n) / 100] - edge[(16 * n) / 100]);
+    double threshold = background + 3.0 * sigma;
+
+    double sum = 0.0, sx = 0.0, sy = 0.0;
+    for (int j = j0 + 1; j < j1; j++) {
+        for (int i = i0 + 1; i < i1; i++) {
+            double v = image[i + j * width];
+            if (v > threshold) {
+                sum += v - background;
+                sx += (v - background) * i;
+                sy += (v - background) * j;
+            }
+        }
+    }
+    if (sum <= 0.0) {
+        return -1;
+    }
+    *pX = sx / sum;
+    *pY = sy / sum;
+    return 0;
+}
+
+
+/**
+ * @brief Centroid of a star near a position: the flux-weighted centroid of
+ * the pixels well above the background of a window, recentred once on the
+ * first estimate.
+ * 
+ * @param x, y position to search around, image memory coordinates
+ * @param half window half-size [px]
+ * @param pX, pY centroid, if found
+ * @return int -1 if the window is off the image or holds no star, 0
+ * otherwise
+ */
+int starCentroid(const uint16_t* image, int width, int height, double x,
+    double y, int half, double* pX, double* pY)
+{
+    for (int pass = 0; pass < 2; pass++) {
+        int i0 = (int)lround(x) - half, j0 = (int)lround(y) - half;
+        if ((i0 < 0) || (j0 < 0) || (i0 + 2*half >= width) ||
+            (j0 + 2*half >= height)) {
+            return -1;
+        }
+        if (windowCentroid(image, width, i0, j0, half, &x, &y) < 0) {
+            return -1;
+        }
+    }
+    *pX = x;
+    *pY = y;
+    return 0;
+}
+
+
+/**
+ * @brief Shift of a frame relative to known star positions: the mean offset
+ * of each star's centroid in the frame from its position, rounded to whole
+ * pixels. Add the frame with coaddFrame(..., -dx, -dy) to line it up.
+ * 
+ * @param x, y star centroids in the reference frame
+ * @param half window half-size for centroiding; stars must move less
+ * @param pDx, pDy shift, 0 if no star was found
+ * @return int number of stars found
+ */
+int measureShift(const uint16_t* image, int width, int height,
+    const double* x, const double* y, int num_stars, int half, int* pDx,
+    int* pDy)
+{
+    double sdx = 0.0, sdy = 0.0;
+    int found = 0;
+    for (int s = 0; s < num_stars; s++) {
+        double cx, cy;
+        if (starCentroid(image, width, height, x[s], y[s], half, &cx, &cy) ==
+            0) {
+            sdx += cx - x[s];
+            sdy += cy - y[s];
+            found++;
+        }
+    }
+    *pDx = found ? (int)lround(sdx / found) : 0;
+    *pDy = found ? (int)lround(sdy / found) : 0;
+    return found;
+}
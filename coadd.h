@@ -0,0 +1,31 @@
+#ifndef COADD_H
+#define COADD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Frames are summed in the 16-bit image itself: 16 12-bit frames fit exactly
+#define COADD_MAX_FRAMES 16
+// stars centroided to measure the shift between co-added frames
+#define COADD_SHIFT_STARS 8
+// half-size of the window each star is centroided in [px]
+#define COADD_SHIFT_HALF_SIZE 12
+
+void coaddFrame(uint16_t* sum, const uint16_t* image, int width, int height,
+    int dx, int dy);
+void averageCoadd(uint16_t* sum, size_t num_pix, int num_frames);
+int starCentroid(const uint16_t* image, int width, int height, double x,
+    double y, int half, double* pX, double* pY);
+int measureShift(const uint16_t* image, int width, int height,
+    const double* x, const double* y, int num_stars, int half, int* pDx,
+    int* pDy);
+
+// Individual kernels, exposed for testing and benchmarking: sum[i] +=
+// image[i] for count pixels, saturating
+void addSaturateScalar(uint16_t* sum, const uint16_t* image, size_t count);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COADD_HAVE_X86_KERNELS
+void addSaturateAvx2(uint16_t* sum, const uint16_t* image, size_t count);
+#endif
+
+#endif
@@ -20,6 +20,11 @@
 #include "commands.h"
 #include "sc_listen.h"
 #include "sc_send.h"
+#include "pipeline.h"
+#include "camera_backend.h"
+#include "hotpix.h"
+#include "coadd.h"
+#include "threadpool.h"
 
 
 #pragma pack(push, 1)
@@ -82,7 +87,23 @@ static const struct option long_options[] = {
     { "valid",     no_argument,       NULL,  3  },
     { "number",    no_argument,       NULL,  4  },
     { "network",   no_argument,       NULL,  5  },
+    { "sequential", no_argument,      NULL,  6  },
+    { "packed",    no_argument,       NULL,  7  },
+    { "replay",    required_argument, NULL,  8  },
+    { "synthetic", no_argument,       NULL,  9  },
+    { "sim-fps",   required_argument, NULL, 10  },
+    { "track",     no_argument,       NULL, 11  },
+    { "buffers",   required_argument, NULL, 12  },
+    { "hugepages", no_argument,       NULL, 13  },
+    { "convert-hp-map", required_argument, NULL, 14 },
+    { "make-dark", required_argument, NULL, 15 },
+    { "make-flat", required_argument, NULL, 16 },
+    { "coadd",     required_argument, NULL, 17 },
+    { "coadd-shift", no_argument,     NULL, 18 },
+    { "cosmic-rays", required_argument, NULL, 19 },
+    { "fixed-pattern", no_argument,   NULL, 20 },
     { "verbose",   no_argument,       NULL, 'v' },
+    { "threads",   required_argument, NULL, 't' },
     { "help",      no_argument,       NULL, 'h' },
     { "camhandle", required_argument, NULL, 'c' },
     { "serial",    required_argument, NULL, 's' },
@@ -113,9 +134,10 @@ int command_lock = 0;
 int cancelling_auto_focus = 0;
 // assume non-verbose output
 int verbose = 0;
-uint16_t camera_raw[CAMERA_WIDTH * CAMERA_HEIGHT] = {0};
 // if 0, then camera is not closing, so keep solving astrometry
 int shutting_down = 0;
+// if 1, run the capture/solve stages back to back instead of pipelined
+int sequential_stages = 0;
 // return values for terminating the threads
 int astro_thread_ret;
 int message_thread_ret;
@@ -150,8 +172,41 @@ void displayUsage() {
            "control.\n\t\tRequired.\n\n\t-s, --serial\n\t\tLens descriptor. "
            "Required.\n\n\t-p, --port\n\t\tPort to bind this camera server "
            "socket to. Required.\n\n\t-v, --verbose\n\t\tIncrease output "
-           "verbosity.\n\n\t--network\n\t\tShow the Star Camera computer IP "
-           "address and the size of the\n\t\ttelemetry package.\n\n\t--number"
+           "verbosity.\n\n\t-t, --threads <count>\n\t\tThreads to split "
+           "image processing over (default: one per\n\t\tCPU, 1 for a single "
+           "thread).\n\n\t--network\n\t\tShow the Star Camera computer IP "
+           "address and the size of the\n\t\ttelemetry package.\n\n\t--sequential"
+           "\n\t\tRun capture, blob finding, solving and saving one after "
+           "another\n\t\tinstead of as concurrent pipeline stages.\n\n\t--packed"
+           "\n\t\tTransfer 12-bit packed pixels from the camera (25%% less "
+           "USB\n\t\tbandwidth than the default 16-bit container).\n\n\t--replay"
+           " <directory>\n\t\tReplay the saved_image_*.fits.fz files in a "
+           "directory instead\n\t\tof using the camera. No camera handle is "
+           "needed.\n\n\t--synthetic\n\t\tRender synthetic star fields "
+           "instead of using the camera.\n\n\t--sim-fps <rate>\n\t\tMaximum "
+           "frame rate of --replay and --synthetic.\n\n\t--track\n\t\tOnce "
+           "the field is solved, follow the brightest stars in\n\t\tsmall "
+           "windows, searching the full frame only periodically.\n\n\t--coadd "
+           "<count>\n\t\tAverage this many back-to-back exposures (up to 16) "
+           "into\n\t\teach image, for fainter stars at short exposures.\n\n"
+           "\t--coadd-shift\n\t\tLine co-added exposures up on the stars of "
+           "the last\n\t\tdetection before adding them.\n\n\t--cosmic-rays "
+           "<sigma>\n\t\tMask cosmic ray hits sharper than any star and "
+           "this many\n\t\ttimes the noise above their neighbours (e.g. 5)."
+           "\n\n\t--fixed-pattern\n\t\tSubtract the sensor's row and "
+           "column offsets from each\n\t\tfull frame before finding "
+           "blobs.\n\n\t--buffers"
+           " <count>\n\t\tAllocate this many camera acquisition buffers once, "
+           "locked in\n\t\tmemory, instead of the SDK default.\n\n\t"
+           "--hugepages\n\t\tBack --buffers with huge pages if any are "
+           "reserved.\n\n\t--convert-hp-map <file>\n\t\tConvert a text "
+           "static hot pixel list (x,y per line) to\n\t\tthe binary map "
+           "loaded at startup, then exit.\n\n\t--make-dark <count>\n\t\tAverage "
+           "this many exposures into the master dark, then\n\t\texit. Cap "
+           "the lens first.\n\n\t--make-flat <count>\n\t\tAverage this "
+           "many exposures of an evenly lit field into\n\t\tthe master flat, "
+           "then exit. Master frames found at startup\n\t\tare applied to "
+           "every camera frame.\n\n\t--number"
            "\n\t\tSee the current number of cameras connected to the computer."
            "\n\n\t--valid\n\t\tSee the valid combinations of the necessary "
            "input argument\n\t\t(handle + lens descriptor + socket port). "
@@ -228,6 +283,15 @@ void verifyTelemetryData() {
 ** Output: None (void). 
 */
 void * updateAstrometry() {
+    if (!sequential_stages) {
+        // overlap capture of the next frame with solving the previous ones
+        if (runPipeline() < 0) {
+            fprintf(stderr, "Capture pipeline failed, falling back to "
+                "sequential stages.\n");
+        } else {
+            freeAstrometryBuffers();
+        }
+    }
     // solve astrometry perpetually when the camera is not shutting down
     while (!shutting_down) {
         if (doCameraAndAstrometry() < 1) {
@@ -260,7 +324,12 @@ void * updateAstrometry() {
  * (temperature) is only available as messages.
  */
 void * updateMessages() {
-    if (initMessageQueue() < 0) {
+    // only the real camera has a message queue
+    if (camera_backend->initMessages == NULL) {
+        message_thread_ret = 0;
+        pthread_exit(&message_thread_ret);
+    }
+    if (camera_backend->initMessages() < 0) {
         fprintf(stderr, "updateMessages: failed to init message queue. Thread "
             "exiting.\n");
         message_thread_ret = -1;
@@ -268,7 +337,7 @@ void * updateMessages() {
     }
 
     while (!shutting_down) {
-        if (pollMessageQueue() < 0) {
+        if (camera_backend->pollMessages() < 0) {
             if (verbose) {
                 printf("Failed to poll message queue.\n");
             }
@@ -278,7 +347,7 @@ void * updateMessages() {
     }
 
     message_thread_ret = 0;
-    if (closeMessageQueue() < 0) {
+    if (camera_backend->closeMessages() < 0) {
         fprintf(stderr, "updateMessages: failed to close message queue. Thread "
             "exiting.\n");
         message_thread_ret = -1;
@@ -453,8 +522,17 @@ void * processClient(void * for_client_thread) {
             break;
         } 
 
-        if (send(socket, camera_raw, sizeof(camera_raw), 
-                 MSG_NOSIGNAL) <= 0) {
+        // send the latest published frame; holding a reference keeps the
+        // pipeline from reusing it mid-send
+        struct frame_t * latest = getPublishedFrame();
+        if (latest == NULL) {
+            fprintf(stderr, "No frame available to send to client.\n");
+            break;
+        }
+        int image_sent = send(socket, latest->image,
+            CAMERA_NUM_PX * sizeof(uint16_t), MSG_NOSIGNAL);
+        frameRelease(latest);
+        if (image_sent <= 0) {
             printf("Client dropped the connection.\n");
             break;
         }
@@ -611,6 +689,9 @@ int main(int argc, char * argv[]) {
     char * port = NULL;              // port to bind socket to
     char * lens_desc = NULL;         // file descriptor for Birger lens adapter
     char * handle = NULL;            // will be passed to camera_handle
+    int num_threads = 0;             // image processing threads, 0 == auto
+    char * master_path = NULL;       // master calibration frame to make
+    int master_frames = 0;           // exposures to average into it
     int test_handle, test_port;      // for testing the values of user input
     int sockfd;                      // to create socket
     int newsockfd;                   // to accept new connection(s)
@@ -629,7 +710,7 @@ int main(int argc, char * argv[]) {
     int ret;                         // return status of main()
 
     // parse command-line options
-    while ((opt = getopt_long(argc, argv, ":c:s:p:vh?", long_options, 
+    while ((opt = getopt_long(argc, argv, ":c:s:p:vt:h?", long_options, 
                               &long_index)) != -1) {
         switch (opt) {
             // we will check the essential arguments after
@@ -646,6 +727,14 @@ int main(int argc, char * argv[]) {
                 // turn on verbose output
                 verbose = 1;
                 break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) {
+                    printHeader();
+                    fprintf(stderr, "Thread count must be at least 1.\n");
+                    return 0;
+                }
+                break;
             case 'h':
                 displayUsage();
                 return 1;
@@ -673,6 +762,77 @@ int main(int argc, char * argv[]) {
                 printf("Size of data packet that gets sent to user: "
                        "%lu bytes\n", sizeof(all_data));
                 break;
+            case 6:
+                sequential_stages = 1;
+                break;
+            case 7:
+                use_packed_pixels = 1;
+                break;
+            case 8:
+                // replay saved images instead of using the camera
+                if (setReplayDirectory(optarg) < 0) {
+                    return 0;
+                }
+                camera_backend = &replay_backend;
+                break;
+            case 9:
+                // render synthetic star fields instead of using the camera
+                camera_backend = &synthetic_backend;
+                break;
+            case 10:
+                setSimFrameRate(atof(optarg));
+                break;
+            case 11:
+                track_stars = 1;
+                break;
+            case 12:
+                acquisition_buffer_count = atoi(optarg);
+                break;
+            case 13:
+                use_huge_pages = 1;
+                break;
+            case 14:
+                // one-off conversion of an old text hot pixel list
+                if (convertHotPixelText(optarg, STATIC_HP_MAP, CAMERA_WIDTH,
+                                        CAMERA_HEIGHT) < 0) {
+                    return EXIT_FAILURE;
+                }
+                return EXIT_SUCCESS;
+            case 15:
+            case 16:
+                master_path = (opt == 15) ? MASTER_DARK : MASTER_FLAT;
+                master_frames = atoi(optarg);
+                if (master_frames < 1) {
+                    printHeader();
+                    fprintf(stderr, "Need at least 1 frame for a master "
+                                    "frame.\n");
+                    return 0;
+                }
+                break;
+            case 17:
+                coadd_frames = atoi(optarg);
+                if ((coadd_frames < 1) || (coadd_frames > COADD_MAX_FRAMES)) {
+                    printHeader();
+                    fprintf(stderr, "Can co-add 1 to %d frames.\n", 
+                            COADD_MAX_FRAMES);
+                    return 0;
+                }
+                break;
+            case 18:
+                coadd_shift = 1;
+                break;
+            case 19:
+                cosmic_ray_sigma = atof(optarg);
+                if (cosmic_ray_sigma < 0.0f) {
+                    printHeader();
+                    fprintf(stderr, "Cosmic ray threshold must be positive, "
+                                    "or 0 for off.\n");
+                    return 0;
+                }
+                break;
+            case 20:
+                remove_fixed_pattern = 1;
+                break;
             case ':':
                 // missing arguments (but option itself is given)
                 printHeader();
@@ -687,7 +847,7 @@ int main(int argc, char * argv[]) {
     }
 
     // make sure we have all the essential arguments
-    if (handle == NULL) {
+    if (handle == NULL && camera_backend == &peak_backend) {
         printHeader();
         printf("\nMissing camera handle. Run ./commands --help for details.\n");
         return 0;
@@ -706,7 +866,10 @@ int main(int argc, char * argv[]) {
     }
 
     printHeader();
-    printf("|     \tCamera handle: %s     \t\t\t\t  |\n", handle);
+    if (handle != NULL) {
+        printf("|     \tCamera handle: %s     \t\t\t\t  |\n", handle);
+    }
+    printf("|     \tCamera backend: %s     \t\t\t  |\n", camera_backend->name);
     printf("|     \tSerial Port: %s     \t  |\n", lens_desc);
     printf("|     \tSocket Port: %s     \t\t\t\t  |\n", port);
     printf("+---------------------------------------------------------+\n");
@@ -796,18 +959,41 @@ int main(int argc, char * argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // worker threads for splitting image passes across cores
+    if (initThreadPool(num_threads) < 0) {
+        printf("Could not start worker threads; image processing will use a "
+               "single core.\n");
+    }
+    if (verbose) {
+        printf("Image processing on %d thread(s).\n", threadPoolSize());
+    }
+
     // initialize the first available camera
     if (initCamera() < 0) {
         printf("Could not initialize camera due to above error. Could be that "
                "you specified a handle for a camera already in use.\n");
         // if camera was already initialized, close it before exiting
-        if (hCam > 0) {
+        if (hCam > 0 || camera_backend != &peak_backend) {
             closeCamera();
         }
         close(sockfd);
         exit(EXIT_FAILURE);
     }
 
+    // one-off master calibration frame
+    if (master_frames > 0) {
+        ret = makeMasterFrame(master_path, master_frames);
+        closeCamera();
+        close(sockfd);
+        exit((ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    // master dark and flat for the camera; replayed and synthetic frames are
+    // already calibrated or have nothing to calibrate
+    if ((camera_backend == &peak_backend) && (loadCalibrationFrames() < 0)) {
+        printf("Could not load the master calibration frames; frames will "
+               "not be calibrated.\n");
+    }
+
     // initialize the lens adapter
     if (initLensAdapter(lens_desc) < 0) {
         printf("Could not initialize lens adapter due to above error.\n");
@@ -816,6 +1002,19 @@ int main(int argc, char * argv[]) {
         // exit(EXIT_FAILURE);
     }
 
+    // allocate all full-size image buffers up front
+    if ((initFramePool() < 0) || (initAstrometryBuffers() < 0)) {
+        fprintf(stderr, "Could not allocate the image buffers.\n");
+        closeCamera();
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+    long peak_kb, current_kb;
+    if (getResidentSetKb(&peak_kb, &current_kb) == 0) {
+        printf("Peak resident memory after startup: %ld MB.\n", 
+               peak_kb / 1024);
+    }
+
     // create a thread separate from all client thread(s) to solve Astrometry 
     if (pthread_create(&astro_thread_id, NULL, updateAstrometry, NULL) != 0) {
         fprintf(stderr, "Error creating Astrometry thread: %s.\n", 
@@ -914,7 +1113,9 @@ int main(int argc, char * argv[]) {
         free(client_args);
     }
 
+    freeFramePool();
     closeCamera();
+    closeThreadPool();
     shutdown(sockfd, SHUT_RDWR);
     close(sockfd);
 
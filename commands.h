@@ -8,7 +8,6 @@ extern int num_clients;
 extern int telemetry_sent;
 extern int cancelling_auto_focus;
 extern int verbose;
-extern uint16_t camera_raw[CAMERA_WIDTH * CAMERA_HEIGHT];
 void * processClient(void * arg);
 
 #endif
\ No newline at end of file
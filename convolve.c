@@ -1,6 +1,13 @@
+#include "background.h"
 #include "convolve.h"
+#include "threadpool.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
+
+#ifdef CONVOLVE_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 /**
  * @brief calculates various stats that require looping over the whole image
@@ -256,4 +263,873 @@ void doConvolution3x3(
         getNeighborhood3x3(pImageBuffer, i, imageWidth, imageNumPix, pNeighborhood);
         pImageResult[i] = convolve9(pNeighborhood, pKernel) * (float)(pMask[i]);
     }
-}
\ No newline at end of file
+}
+
+
+// output rows per boxFilterImage() band
+#define BOX_FILTER_BAND_ROWS 128
+
+/* Working memory of one boxFilterImage() thread, sized for the widest call
+** so far: the summed-area table rings and the filtered rows of the band it is
+** working on. */
+struct box_filter_scratch_t {
+    void* pMem;
+    size_t size;
+};
+
+// kept from one boxFilterImage() call to the next, so that filtering a frame
+// does not allocate
+static struct box_filter_scratch_t box_filter_scratch[THREAD_POOL_MAX_THREADS];
+static struct box_filter_stats_t* box_filter_band_stats = NULL;
+static int box_filter_num_band_stats = 0;
+
+struct box_filter_job_t {
+    const uint16_t* pImage;
+    const uint8_t* pMask;
+    uint16_t imageWidth;
+    int i0, j0, i1, j1;
+    int rSmooth;
+    bool highPass;
+    int rHighPass;
+    const struct background_mesh_t* pBackground;
+    int border;
+    float* pFiltered;
+    struct box_filter_stats_t* pBandStats;
+    int numBands;
+    int numSlots;           // threads, each with its own scratch
+};
+
+
+/**
+ * @brief One row of a masked box filter of radius r, from the differences of
+ * two rows of the summed-area tables: the box average of unmasked pixels, or
+ * the last average computed when every pixel in the box is masked.
+ * 
+ * @param pSumLo, pCountLo table rows just above the box
+ * @param pSumHi, pCountHi table rows at the bottom of the box
+ * @param satWidth entries per table row; entry x covers columns [i0, i0 + x)
+ * @param[out] pOut filtered pixels of columns [i0 + r, i1 - r), indexed by
+ * column
+ * @param pLast carry for fully masked boxes, updated
+ */
+static void boxFilterRow(const uint32_t* pSumLo, const uint32_t* pSumHi,
+    const uint32_t* pCountLo, const uint32_t* pCountHi, int satWidth, int r,
+    int i0, int i1, uint32_t* pColSum, uint32_t* pColCount, double* pOut,
+    double* pLast)
+{
+    // unsigned differences are exact even where the tables have wrapped
+    for (int x = 0; x < satWidth; x++) {
+        pColSum[x] = pSumHi[x] - pSumLo[x];
+        pColCount[x] = pCountHi[x] - pCountLo[x];
+    }
+    double last = *pLast;
+    for (int i = i0 + r; i < i1 - r; i++) {
+        int x = i - i0;
+        uint32_t s = pColSum[x + r + 1] - pColSum[x - r];
+        uint32_t n = pColCount[x + r + 1] - pColCount[x - r];
+        if (n > 0) {
+            last = (double)s / (double)n;
+        }
+        pOut[i] = last;
+    }
+    *pLast = last;
+}
+
+
+/**
+ * @brief Scratch bytes boxFilterBand() needs: 2 filtered rows and 2 rings of
+ * 2 R + 2 table rows, plus 2 column sum rows.
+ */
+static size_t boxFilterScratchSize(const struct box_filter_job_t* job)
+{
+    int rS = job->rSmooth;
+    int rH = (job->highPass && !job->pBackground) ? job->rHighPass : 0;
+    int R = (rS > rH) ? rS : rH;
+    size_t satWidth = job->i1 - job->i0 + 1;
+    return 2 * (size_t)job->imageWidth * sizeof(double) +
+        (2 * (size_t)(2*R + 2) + 2) * satWidth * sizeof(uint32_t);
+}
+
+
+/**
+ * @brief Filter one band of rows for boxFilterImage(), keeping only the
+ * 2 r + 2 rows of the summed-area tables the filters need in a ring, so the
+ * working set stays in cache.
+ *
+ * @param pScratch at least boxFilterScratchSize() bytes
+ */
+static void boxFilterBand(struct box_filter_job_t* job, int band,
+    void* pScratch)
+{
+    int rS = job->rSmooth;
+    int rH = (job->highPass && !job->pBackground) ? job->rHighPass : 0;
+    int R = (rS > rH) ? rS : rH;
+    int w = job->imageWidth;
+    int satWidth = job->i1 - job->i0 + 1;
+    int ringRows = 2*R + 2;
+    struct box_filter_stats_t stats = {0};
+
+    // output rows of this band, within the smoothed region
+    int jb0 = job->j0 + rS + band*BOX_FILTER_BAND_ROWS;
+    int jb1 = jb0 + BOX_FILTER_BAND_ROWS;
+    if (jb1 > job->j1 - rS) {
+        jb1 = job->j1 - rS;
+    }
+    // first table row; the tables of each band start from zero here
+    int y0 = (jb0 - R > job->j0) ? jb0 - R : job->j0;
+
+    double* pSmooth = (double*)pScratch;
+    double* pHighPass = pSmooth + w;
+    uint32_t* pSum = (uint32_t*)(pHighPass + w);
+    uint32_t* pCount = pSum + (size_t)ringRows * satWidth;
+    uint32_t* pColSum = pCount + (size_t)ringRows * satWidth;
+    uint32_t* pColCount = pColSum + satWidth;
+#define RING(p, y) ((p) + (size_t)(((y) - y0 + 1) % ringRows) * satWidth)
+    memset(RING(pSum, y0 - 1), 0, satWidth * sizeof(uint32_t));
+    memset(RING(pCount, y0 - 1), 0, satWidth * sizeof(uint32_t));
+
+    double lastSmooth = 0.0, lastHighPass = 0.0;
+    int yDone = y0 - 1;
+    int b = job->border;
+    for (int j = jb0; j < jb1; j++) {
+        // extend the tables down to the bottom row of the widest box
+        int yNeed = (j + R < job->j1 - 1) ? j + R : job->j1 - 1;
+        for (; yDone < yNeed; yDone++) {
+            int y = yDone + 1;
+            const uint16_t* pRow = job->pImage + (size_t)y * w;
+            const uint8_t* pMaskRow = job->pMask + (size_t)y * w;
+            const uint32_t* pSumAbove = RING(pSum, y - 1);
+            const uint32_t* pCountAbove = RING(pCount, y - 1);
+            uint32_t* pSumRow = RING(pSum, y);
+            uint32_t* pCountRow = RING(pCount, y);
+            uint32_t rowSum = 0, rowCount = 0;
+            pSumRow[0] = pCountRow[0] = 0;
+            for (int x = 1; x < satWidth; x++) {
+                int i = job->i0 + x - 1;
+                rowSum += pMaskRow[i] * pRow[i];
+                rowCount += pMaskRow[i];
+                pSumRow[x] = pSumAbove[x] + rowSum;
+                pCountRow[x] = pCountAbove[x] + rowCount;
+            }
+        }
+
+        boxFilterRow(RING(pSum, j - rS - 1), RING(pSum, j + rS),
+            RING(pCount, j - rS - 1), RING(pCount, j + rS), satWidth, rS,
+            job->i0, job->i1, pColSum, pColCount, pSmooth, &lastSmooth);
+
+        bool inBorder = (j >= job->j0 + b) && (j < job->j1 - b);
+        bool inHighPass = job->highPass && (j >= job->j0 + rH) &&
+            (j < job->j1 - rH);
+        if (job->highPass && job->pBackground && inBorder) {
+            backgroundMeshRow(job->pBackground, j, job->i0 + b, job->i1 - b,
+                pHighPass);
+        } else if (inHighPass && !job->pBackground) {
+            boxFilterRow(RING(pSum, j - rH - 1), RING(pSum, j + rH),
+                RING(pCount, j - rH - 1), RING(pCount, j + rH), satWidth, rH,
+                job->i0, job->i1, pColSum, pColCount, pHighPass,
+                &lastHighPass);
+        }
+
+        float* pOut = job->pFiltered + (size_t)j * w;
+        for (int i = job->i0 + rS; i < job->i1 - rS; i++) {
+            pOut[i] = (float)pSmooth[i];
+        }
+        // subtract the background and accumulate statistics in the search
+        // region, in double precision; only the stored image is rounded
+        if (!inBorder) {
+            continue;
+        }
+        const uint8_t* pMaskRow = job->pMask + (size_t)j * w;
+        for (int i = job->i0 + b; i < job->i1 - b; i++) {
+            double m = pMaskRow[i];
+            double d = pSmooth[i];
+            if (job->highPass) {
+                stats.sum_raw += d*m;
+                d -= pHighPass[i];
+                pOut[i] = (float)d;
+            }
+            stats.sum += d*m;
+            stats.sum_sq += d*d*m;
+            stats.num_pix += pMaskRow[i];
+        }
+    }
+#undef RING
+    if (!job->highPass) {
+        stats.sum_raw = stats.sum;
+    }
+    job->pBandStats[band] = stats;
+}
+
+
+/**
+ * @brief parallelFor() task for boxFilterImage(): filter every numSlots-th
+ * band, starting from band slot, in the scratch of that slot.
+ */
+static void boxFilterSlot(void* arg, int slot)
+{
+    struct box_filter_job_t* job = (struct box_filter_job_t*)arg;
+    for (int band = slot; band < job->numBands; band += job->numSlots) {
+        boxFilterBand(job, band, box_filter_scratch[slot].pMem);
+    }
+}
+
+
+/**
+ * @brief Masked box filtering for blob finding in one streaming pass: smooth
+ * with radius rSmooth, optionally subtract a radius rHighPass background or
+ * an interpolated background mesh, and gather the statistics of the result.
+ * 
+ * @details Both filters come from one summed-area table of the masked pixels
+ * (and one of the mask), so each box sum is four lookups whatever its radius.
+ * The frame is split into bands of rows across the thread pool; each band
+ * keeps a ring of table rows in 32-bit unsigned arithmetic, which stays exact
+ * because box sums are differences and fit in 32 bits. The rings are kept
+ * per thread between calls, so only the first call at a given size
+ * allocates, and calls must not overlap. Averages, the
+ * background subtraction and the statistics are computed in double
+ * precision, matching the two-pass boxcar filter this replaces; only the
+ * filtered image is stored as float. Where every pixel in a box is masked,
+ * the previous average in the band is repeated.
+ * 
+ * @param[in] pImage image, imageWidth pixels per row
+ * @param[in] pMask 1 for pixels to use, 0 for masked ones
+ * @param i0, j0, i1, j1 region to filter; columns [i0, i1), rows [j0, j1)
+ * @param rSmooth radius of the smoothing box
+ * @param highPass subtract a background: pBackground if given, otherwise the
+ * average over a box of radius rHighPass
+ * @param pBackground background mesh covering the region, or NULL
+ * @param border statistics cover the region shrunk by this much on each side;
+ * raised to the filter radii if smaller
+ * @param[out] pFiltered filtered image, written for pixels at least rSmooth
+ * inside the region; high-pass filtered only inside the border
+ * @param[out] pStats statistics inside the border
+ * @return int -1 if failed, 0 otherwise
+ */
+int boxFilterImage(
+    const uint16_t* pImage,
+    const uint8_t* pMask,
+    uint16_t imageWidth,
+    int i0,
+    int j0,
+    int i1,
+    int j1,
+    int rSmooth,
+    bool highPass,
+    int rHighPass,
+    const struct background_mesh_t* pBackground,
+    int border,
+    float* pFiltered,
+    struct box_filter_stats_t* pStats)
+{
+    memset(pStats, 0, sizeof(struct box_filter_stats_t));
+    if (highPass && pBackground) {
+        rHighPass = 0;
+    }
+    if ((rSmooth < 0) || (highPass && (rHighPass < 0))) {
+        return -1;
+    }
+    if (border < rSmooth) {
+        border = rSmooth;
+    }
+    if (highPass && (border < rHighPass)) {
+        border = rHighPass;
+    }
+    int numRows = (j1 - j0) - 2*rSmooth;
+    if ((numRows <= 0) || ((i1 - i0) - 2*rSmooth <= 0)) {
+        return 0;
+    }
+
+    int numBands = (numRows + BOX_FILTER_BAND_ROWS - 1) / BOX_FILTER_BAND_ROWS;
+    int numSlots = threadPoolSize();
+    if (numSlots > numBands) {
+        numSlots = numBands;
+    }
+    struct box_filter_job_t job = {
+        .pImage = pImage,
+        .pMask = pMask,
+        .imageWidth = imageWidth,
+        .i0 = i0, .j0 = j0, .i1 = i1, .j1 = j1,
+        .rSmooth = rSmooth,
+        .highPass = highPass,
+        .rHighPass = rHighPass,
+        .pBackground = pBackground,
+        .border = border,
+        .pFiltered = pFiltered,
+        .numBands = numBands,
+        .numSlots = numSlots,
+    };
+
+    if (numBands > box_filter_num_band_stats) {
+        struct box_filter_stats_t* pBandStats = realloc(box_filter_band_stats,
+            numBands * sizeof(struct box_filter_stats_t));
+        if (pBandStats == NULL) {
+            fprintf(stderr, "boxFilterImage: out of memory.\n");
+            return -1;
+        }
+        box_filter_band_stats = pBandStats;
+        box_filter_num_band_stats = numBands;
+    }
+    job.pBandStats = box_filter_band_stats;
+    size_t scratchSize = boxFilterScratchSize(&job);
+    for (int slot = 0; slot < numSlots; slot++) {
+        struct box_filter_scratch_t* pScratch = &box_filter_scratch[slot];
+        if (pScratch->size >= scratchSize) {
+            continue;
+        }
+        free(pScratch->pMem);
+        pScratch->pMem = malloc(scratchSize);
+        if (pScratch->pMem == NULL) {
+            pScratch->size = 0;
+            fprintf(stderr, "boxFilterImage: out of memory.\n");
+            return -1;
+        }
+        pScratch->size = scratchSize;
+    }
+    parallelFor(numSlots, boxFilterSlot, &job);
+
+    // combine in band order so the result does not depend on thread count
+    for (int band = 0; band < numBands; band++) {
+        pStats->sum += box_filter_band_stats[band].sum;
+        pStats->sum_sq += box_filter_band_stats[band].sum_sq;
+        pStats->sum_raw += box_filter_band_stats[band].sum_raw;
+        pStats->num_pix += box_filter_band_stats[band].num_pix;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Free the working memory boxFilterImage() keeps between calls.
+ */
+void freeBoxFilterScratch(void)
+{
+    for (int slot = 0; slot < THREAD_POOL_MAX_THREADS; slot++) {
+        free(box_filter_scratch[slot].pMem);
+        box_filter_scratch[slot].pMem = NULL;
+        box_filter_scratch[slot].size = 0;
+    }
+    free(box_filter_band_stats);
+    box_filter_band_stats = NULL;
+    box_filter_num_band_stats = 0;
+}
+
+
+// rows per findComponents() task
+#define COMPONENT_BAND_ROWS 64
+
+
+/* A run of consecutive pixels above threshold in one row, with its sums */
+struct run_t {
+    int i0, i1;            // columns [i0, i1)
+    int j;
+    uint32_t parent;       // union-find link, global run index once merged
+    double sum;            // sum of (pixel - background)
+    double sum_x;          // and weighted by column
+    float peak;
+    uint32_t peak_pixel;
+};
+
+struct run_band_t {
+    struct run_t* runs;    // in scan order
+    uint32_t count;
+    uint32_t alloc;
+    uint32_t first_row_end;  // runs [0, first_row_end) lie in the first row
+    uint32_t last_row_start; // runs [last_row_start, count) in the last row
+};
+
+struct component_job_t {
+    struct component_scan_t* pScan;
+    struct run_band_t* bands;
+    void (*threshold_row)(const float*, int, float, uint64_t*);
+    float threshold;       // pScan->threshold as a float, see findComponents()
+    int failed;
+};
+
+
+/**
+ * @brief Set bit k of pBits for each pixel pRow[k] above threshold, for k in
+ * [0, n). Bits past n in the last word are cleared.
+ */
+void thresholdRowScalar(const float* pRow, int n, float threshold,
+    uint64_t* pBits)
+{
+    for (int w = 0; w < (n + 63) / 64; w++) {
+        pBits[w] = 0;
+    }
+    for (int k = 0; k < n; k++) {
+        if (pRow[k] > threshold) {
+            pBits[k / 64] |= (uint64_t)1 << (k % 64);
+        }
+    }
+}
+
+
+#ifdef CONVOLVE_HAVE_X86_KERNELS
+/**
+ * @brief AVX2 version of thresholdRowScalar(): one compare and movemask
+ * gives the bits of 8 pixels.
+ */
+__attribute__((target("avx2")))
+void thresholdRowAvx2(const float* pRow, int n, float threshold,
+    uint64_t* pBits)
+{
+    const __m256 t = _mm256_set1_ps(threshold);
+    int k = 0;
+    for (; k + 64 <= n; k += 64) {
+        uint64_t word = 0;
+        for (int m = 0; m < 64; m += 8) {
+            __m256 v = _mm256_loadu_ps(pRow + k + m);
+            uint64_t bits = (uint32_t)_mm256_movemask_ps(
+                _mm256_cmp_ps(v, t, _CMP_GT_OQ));
+            word |= bits << m;
+        }
+        pBits[k / 64] = word;
+    }
+    if (k < n) {
+        thresholdRowScalar(pRow + k, n - k, threshold, pBits + k / 64);
+    }
+}
+#endif
+
+
+/**
+ * @brief First set bit at or after bit k, or n if there is none. Whole
+ * words of empty sky are skipped at once.
+ */
+static int nextSetBit(const uint64_t* pBits, int k, int n)
+{
+    if (k >= n) {
+        return n;
+    }
+    int w = k / 64;
+    uint64_t word = (k % 64) ? pBits[w] & (~(uint64_t)0 << (k % 64)) :
+        pBits[w];
+    while (word == 0) {
+        if (++w >= (n + 63) / 64) {
+            return n;
+        }
+        word = pBits[w];
+    }
+    return w*64 + __builtin_ctzll(word);
+}
+
+
+/**
+ * @brief First clear bit at or after bit k, or n if there is none.
+ */
+static int nextClearBit(const uint64_t* pBits, int k, int n)
+{
+    int w = k / 64;
+    uint64_t word = ~pBits[w] & (~(uint64_t)0 << (k % 64));
+    while (word == 0) {
+        if (++w >= (n + 63) / 64) {
+            return n;
+        }
+        word = ~pBits[w];
+    }
+    int p = w*64 + __builtin_ctzll(word);
+    return (p < n) ? p : n;
+}
+
+
+/**
+ * @brief Root of run k, halving the path on the way. Roots are always the
+ * lowest index of their component, i.e. its first run in scan order.
+ */
+static uint32_t findRoot(struct run_t* runs, uint32_t k)
+{
+    while (runs[k].parent != k) {
+        runs[k].parent = runs[runs[k].parent].parent;
+        k = runs[k].parent;
+    }
+    return k;
+}
+
+
+static void unionRuns(struct run_t* runs, uint32_t a, uint32_t b)
+{
+    a = findRoot(runs, a);
+    b = findRoot(runs, b);
+    if (a < b) {
+        runs[b].parent = a;
+    } else if (b < a) {
+        runs[a].parent = b;
+    }
+}
+
+
+/**
+ * @brief Join the runs [a0, a1) of one row to the overlapping or diagonally
+ * touching runs [b0, b1) of the next. Both lists are sorted by column, so
+ * one sweep finds every pair.
+ */
+static void joinRows(struct run_t* runs, uint32_t a0, uint32_t a1,
+    uint32_t b0, uint32_t b1)
+{
+    uint32_t a = a0, b = b0;
+    while ((a < a1) && (b < b1)) {
+        // 8-connected: [i0, i1) touches [i0', i1') if i0 <= i1' and i0' <= i1
+        if ((runs[a].i0 <= runs[b].i1) && (runs[b].i0 <= runs[a].i1)) {
+            unionRuns(runs, a, b);
+        }
+        if (runs[a].i1 < runs[b].i1) {
+            a++;
+        } else {
+            b++;
+        }
+    }
+}
+
+
+/**
+ * @brief parallelFor() task for findComponents(): collect the runs above
+ * threshold in one band of rows and join those in adjacent rows, with
+ * indices local to the band.
+ */
+static void findComponentsBand(void* arg, int band)
+{
+    struct component_job_t* job = (struct component_job_t*)arg;
+    const struct component_scan_t* pScan = job->pScan;
+    struct run_band_t* pBand = &job->bands[band];
+    int w = pScan->imageWidth;
+    int jb0 = pScan->j0 + band*COMPONENT_BAND_ROWS;
+    int jb1 = (jb0 + COMPONENT_BAND_ROWS < pScan->j1) ?
+        jb0 + COMPONENT_BAND_ROWS : pScan->j1;
+    uint32_t prev_start = 0, prev_end = 0;
+    int n = pScan->i1 - pScan->i0;
+    uint64_t bits[(n + 63) / 64];
+
+    for (int j = jb0; j < jb1; j++) {
+        const float* row = pScan->pImage + (size_t)j*w;
+        uint32_t row_start = pBand->count;
+        // pixels above threshold, so runs are found a word of bits at a time
+        job->threshold_row(row + pScan->i0, n, job->threshold, bits);
+        int k = 0;
+        while ((k = nextSetBit(bits, k, n)) < n) {
+            int i = pScan->i0 + k;
+            k = nextClearBit(bits, k, n);
+            if (pBand->count == pBand->alloc) {
+                uint32_t alloc = pBand->alloc ? 2*pBand->alloc : 256;
+                struct run_t* runs = realloc(pBand->runs,
+                    alloc * sizeof(struct run_t));
+                if (runs == NULL) {
+                    job->failed = 1;
+                    return;
+                }
+                pBand->runs = runs;
+                pBand->alloc = alloc;
+            }
+            struct run_t* run = &pBand->runs[pBand->count];
+            run->i0 = i;
+            run->j = j;
+            run->parent = pBand->count;
+            run->sum = 0.0;
+            run->sum_x = 0.0;
+            run->peak = row[i];
+            run->peak_pixel = i + j*w;
+            for (; i < pScan->i0 + k; i++) {
+                double v = row[i] - pScan->background;
+                run->sum += v;
+                run->sum_x += v * i;
+                if (row[i] > run->peak) {
+                    run->peak = row[i];
+                    run->peak_pixel = i + j*w;
+                }
+            }
+            run->i1 = i;
+            pBand->count++;
+        }
+        if (j > jb0) {
+            joinRows(pBand->runs, prev_start, prev_end, row_start,
+                pBand->count);
+        } else {
+            pBand->first_row_end = pBand->count;
+        }
+        prev_start = row_start;
+        prev_end = pBand->count;
+    }
+    pBand->last_row_start = prev_start;
+}
+
+
+/**
+ * @brief Label the 8-connected groups of pixels above a threshold in a
+ * filtered image and measure each one, in time linear in the number of
+ * pixels. Each band of rows is reduced to runs of consecutive pixels above
+ * threshold, joined with union-find; bands are then joined at their edges.
+ * Blobs come out in the scan order of their first pixel whatever the number
+ * of threads.
+ *
+ * @param pScan image, region and threshold; blobs and num_blobs are set on
+ * return and must be released with freeComponents()
+ * @return int -1 if failed, 0 otherwise
+ */
+int findComponents(struct component_scan_t* pScan)
+{
+    int numRows = pScan->j1 - pScan->j0;
+    int numBands = ((numRows > 0) && (pScan->i1 > pScan->i0)) ?
+        (numRows + COMPONENT_BAND_ROWS - 1) / COMPONENT_BAND_ROWS : 0;
+    pScan->blobs = NULL;
+    pScan->num_blobs = 0;
+    static void (*threshold_row)(const float*, int, float, uint64_t*) = NULL;
+    if (threshold_row == NULL) {
+        threshold_row = thresholdRowScalar;
+#ifdef CONVOLVE_HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            threshold_row = thresholdRowAvx2;
+        }
+#endif
+    }
+    // the largest float not above the threshold, which float pixels are
+    // above exactly when they are above the threshold itself
+    float threshold = (float)pScan->threshold;
+    if ((double)threshold > pScan->threshold) {
+        threshold = nextafterf(threshold, -INFINITY);
+    }
+    struct component_job_t job = {
+        .pScan = pScan,
+        .bands = calloc(numBands + 1, sizeof(struct run_band_t)),
+        .threshold_row = threshold_row,
+        .threshold = threshold,
+        .failed = 0,
+    };
+    if (job.bands == NULL) {
+        return -1;
+    }
+    parallelFor(numBands, findComponentsBand, &job);
+
+    // all runs in one array, so links can cross bands
+    uint32_t total = 0;
+    for (int band = 0; band < numBands; band++) {
+        total += job.bands[band].count;
+    }
+    struct run_t* runs = job.failed ? NULL :
+        malloc((total + 1) * sizeof(struct run_t));
+    uint32_t* label = job.failed ? NULL : malloc((total + 1) * sizeof(uint32_t));
+    if ((runs == NULL) || (label == NULL)) {
+        job.failed = 1;
+    } else {
+        uint32_t offset = 0;
+        for (int band = 0; band < numBands; band++) {
+            struct run_band_t* pBand = &job.bands[band];
+            for (uint32_t k = 0; k < pBand->count; k++) {
+                runs[offset + k] = pBand->runs[k];
+                runs[offset + k].parent += offset;
+            }
+            // the last row of the previous band against this band's first
+            if ((band > 0) && (pBand->first_row_end > 0)) {
+                struct run_band_t* pPrev = &job.bands[band - 1];
+                uint32_t prev_offset = offset - pPrev->count;
+                joinRows(runs, prev_offset + pPrev->last_row_start,
+                    offset, offset, offset + pBand->first_row_end);
+            }
+            offset += pBand->count;
+        }
+    }
+    for (int band = 0; band < numBands; band++) {
+        free(job.bands[band].runs);
+    }
+    free(job.bands);
+
+    if (!job.failed) {
+        uint32_t count = 0;
+        for (uint32_t k = 0; k < total; k++) {
+            count += (findRoot(runs, k) == k);
+        }
+        pScan->blobs = malloc((count + 1) * sizeof(struct blob_t));
+        job.failed = (pScan->blobs == NULL);
+    }
+    if (!job.failed) {
+        // a root is its component's first run, so comes before the rest
+        double* sum_y = malloc((total + 1) * sizeof(double));
+        job.failed = (sum_y == NULL);
+        for (uint32_t k = 0; (k < total) && !job.failed; k++) {
+            struct run_t* run = &runs[k];
+            uint32_t root = findRoot(runs, k);
+            struct blob_t* blob;
+            if (root == k) {
+                label[k] = pScan->num_blobs++;
+                blob = &pScan->blobs[label[k]];
+                memset(blob, 0, sizeof(struct blob_t));
+                blob->peak = run->peak;
+                blob->peak_pixel = run->peak_pixel;
+                sum_y[label[k]] = 0.0;
+            } else {
+                label[k] = label[root];
+                blob = &pScan->blobs[label[k]];
+            }
+            blob->flux += run->sum;
+            blob->x += run->sum_x;
+            sum_y[label[k]] += run->sum * run->j;
+            blob->area += run->i1 - run->i0;
+            if (run->peak > blob->peak) {
+                blob->peak = run->peak;
+                blob->peak_pixel = run->peak_pixel;
+            }
+        }
+        for (uint32_t n = 0; (n < pScan->num_blobs) && !job.failed; n++) {
+            struct blob_t* blob = &pScan->blobs[n];
+            if (blob->flux > 0.0) {
+                blob->x /= blob->flux;
+                blob->y = sum_y[n] / blob->flux;
+            } else {
+                blob->x = blob->peak_pixel % pScan->imageWidth;
+                blob->y = blob->peak_pixel / pScan->imageWidth;
+            }
+        }
+        free(sum_y);
+    }
+    free(runs);
+    free(label);
+    if (job.failed) {
+        fprintf(stderr, "findComponents: out of memory.\n");
+        freeComponents(pScan);
+        return -1;
+    }
+    return 0;
+}
+
+
+void freeComponents(struct component_scan_t* pScan)
+{
+    free(pScan->blobs);
+    pScan->blobs = NULL;
+    pScan->num_blobs = 0;
+}
+
+
+/**
+ * @brief Average factor x factor blocks of pixels into one, like the camera's
+ * FPGA binning. Partial blocks at the right and bottom edges are dropped.
+ * 
+ * @param[in] pImage full resolution image, imageWidth x imageHeight
+ * @param factor bin size in both axes
+ * @param[out] pBinned (imageWidth / factor) x (imageHeight / factor) image
+ */
+void binImageScalar(const uint16_t* pImage, uint16_t imageWidth,
+    uint16_t imageHeight, uint8_t factor, uint16_t* pBinned)
+{
+    uint16_t binnedWidth = imageWidth / factor;
+    uint16_t binnedHeight = imageHeight / factor;
+    uint32_t n = (uint32_t)factor * factor;
+    for (uint32_t jj = 0; jj < binnedHeight; jj++) {
+        for (uint32_t ii = 0; ii < binnedWidth; ii++) {
+            uint32_t sum = 0;
+            for (uint32_t dj = 0; dj < factor; dj++) {
+                const uint16_t* pRow = pImage +
+                    (jj * factor + dj) * imageWidth + ii * factor;
+                for (uint32_t di = 0; di < factor; di++) {
+                    sum += pRow[di];
+                }
+            }
+            pBinned[jj * binnedWidth + ii] = (uint16_t)(sum / n);
+        }
+    }
+}
+
+
+#ifdef CONVOLVE_HAVE_X86_KERNELS
+/**
+ * @brief AVX2 version of binImageScalar() for factors 2 and 4; other factors
+ * fall back to the scalar kernel.
+ * 
+ * @details The rows of each block are summed into 32-bit column sums, 8
+ * columns per instruction. Adjacent column sums are then added with hadd,
+ * which works within 128-bit lanes, so each hadd is followed by a permute to
+ * put the results back in column order.
+ */
+__attribute__((target("avx2")))
+void binImageAvx2(const uint16_t* pImage, uint16_t imageWidth,
+    uint16_t imageHeight, uint8_t factor, uint16_t* pBinned)
+{
+    if ((factor != 2) && (factor != 4)) {
+        binImageScalar(pImage, imageWidth, imageHeight, factor, pBinned);
+        return;
+    }
+    uint16_t binnedWidth = imageWidth / factor;
+    uint16_t binnedHeight = imageHeight / factor;
+    uint32_t usedWidth = (uint32_t)binnedWidth * factor;
+    int shift = (factor == 2) ? 2 : 4;
+    uint32_t columnSums[usedWidth + 32];
+
+    for (uint32_t jj = 0; jj < binnedHeight; jj++) {
+        const uint16_t* pRow = pImage + jj * factor * imageWidth;
+        uint32_t ii = 0;
+        for (; ii + 8 <= usedWidth; ii += 8) {
+            __m256i sum = _mm256_setzero_si256();
+            for (int dj = 0; dj < factor; dj++) {
+                __m128i px = _mm_loadu_si128((const __m128i*)(pRow +
+                    dj * imageWidth + ii));
+                sum = _mm256_add_epi32(sum, _mm256_cvtepu16_epi32(px));
+            }
+            _mm256_storeu_si256((__m256i*)(columnSums + ii), sum);
+        }
+        for (; ii < usedWidth; ii++) {
+            columnSums[ii] = 0;
+            for (int dj = 0; dj < factor; dj++) {
+                columnSums[ii] += pRow[dj * imageWidth + ii];
+            }
+        }
+
+        uint16_t* pOut = pBinned + jj * binnedWidth;
+        uint32_t oo = 0;
+        // 8 binned pixels per iteration
+        for (; (oo + 8) * factor <= usedWidth; oo += 8) {
+            const __m256i* pSums = (const __m256i*)(columnSums + oo * factor);
+            __m256i binned = _mm256_permute4x64_epi64(_mm256_hadd_epi32(
+                _mm256_loadu_si256(pSums), _mm256_loadu_si256(pSums + 1)),
+                0xD8);
+            if (factor == 4) {
+                __m256i upper = _mm256_permute4x64_epi64(_mm256_hadd_epi32(
+                    _mm256_loadu_si256(pSums + 2),
+                    _mm256_loadu_si256(pSums + 3)), 0xD8);
+                binned = _mm256_permute4x64_epi64(_mm256_hadd_epi32(binned,
+                    upper), 0xD8);
+            }
+            binned = _mm256_srli_epi32(binned, shift);
+            // narrow to 16 bits; packus also works per 128-bit lane
+            binned = _mm256_permute4x64_epi64(_mm256_packus_epi32(binned,
+                binned), 0x08);
+            _mm_storeu_si128((__m128i*)(pOut + oo),
+                _mm256_castsi256_si128(binned));
+        }
+        for (; oo < binnedWidth; oo++) {
+            uint32_t sum = 0;
+            for (int di = 0; di < factor; di++) {
+                sum += columnSums[oo * factor + di];
+            }
+            pOut[oo] = (uint16_t)(sum >> shift);
+        }
+    }
+}
+#endif
+
+
+/**
+ * @brief Bin an image on the host using the widest kernel the CPU supports.
+ * Replaces FPGA binning for auto-focus, which needs acquisition stopped to
+ * change. See binImageScalar().
+ * 
+ * @return int -1 on an invalid factor, 0 otherwise
+ */
+int binImage(const uint16_t* pImage, uint16_t imageWidth, uint16_t imageHeight,
+    uint8_t factor, uint16_t* pBinned)
+{
+    static void (*kernel)(const uint16_t*, uint16_t, uint16_t, uint8_t,
+        uint16_t*) = NULL;
+    if (factor < 1) {
+        return -1;
+    }
+    if (kernel == NULL) {
+        kernel = binImageScalar;
+#ifdef CONVOLVE_HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernel = binImageAvx2;
+        }
+#endif
+    }
+    kernel(pImage, imageWidth, imageHeight, factor, pBinned);
+    return 0;
+}
@@ -21,4 +21,74 @@ void doConvolution3x3(
     float* pKernel,
     float* pImageResult);
 
+struct background_mesh_t;
+
+// Masked statistics of the filtered image over its search region
+struct box_filter_stats_t {
+    double sum;      // sum of filtered pixels under the mask
+    double sum_sq;   // sum of their squares
+    double sum_raw;  // sum of the smoothed pixels before high-pass filtering
+    uint32_t num_pix;
+};
+
+int boxFilterImage(
+    const uint16_t* pImage,
+    const uint8_t* pMask,
+    uint16_t imageWidth,
+    int i0,
+    int j0,
+    int i1,
+    int j1,
+    int rSmooth,
+    bool highPass,
+    int rHighPass,
+    const struct background_mesh_t* pBackground,
+    int border,
+    float* pFiltered,
+    struct box_filter_stats_t* pStats);
+void freeBoxFilterScratch(void);
+// One 8-connected group of pixels above threshold, found by findComponents()
+struct blob_t {
+    double x, y;          // centroid, weighted by pixel - background [px]
+    double flux;          // sum of pixel - background
+    float peak;           // brightest pixel value
+    uint32_t peak_pixel;  // its image index, row * imageWidth + column
+    uint32_t area;        // number of pixels
+};
+
+struct component_scan_t {
+    const float* pImage;
+    uint16_t imageWidth;
+    int i0, j0, i1, j1;   // pixels to label
+    double threshold;     // pixels must be above this
+    double background;    // subtracted from pixels for flux and centroids
+    struct blob_t* blobs; // set by findComponents()
+    uint32_t num_blobs;
+};
+
+int findComponents(struct component_scan_t* pScan);
+void freeComponents(struct component_scan_t* pScan);
+
+// Threshold pre-scan kernels for findComponents(), exposed for testing and
+// benchmarking
+void thresholdRowScalar(const float* pRow, int n, float threshold,
+    uint64_t* pBits);
+int binImage(
+    const uint16_t* pImage,
+    uint16_t imageWidth,
+    uint16_t imageHeight,
+    uint8_t factor,
+    uint16_t* pBinned);
+
+// Individual binning kernels, exposed for testing and benchmarking
+void binImageScalar(const uint16_t* pImage, uint16_t imageWidth,
+    uint16_t imageHeight, uint8_t factor, uint16_t* pBinned);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVOLVE_HAVE_X86_KERNELS
+void binImageAvx2(const uint16_t* pImage, uint16_t imageWidth,
+    uint16_t imageHeight, uint8_t factor, uint16_t* pBinned);
+void thresholdRowAvx2(const float* pRow, int n, float threshold,
+    uint64_t* pBits);
+#endif
+
 #endif
\ No newline at end of file
@@ -125,6 +125,12 @@ int writeMetadata(fitsfile* fptr, struct fits_metadata_t* pMetadata)
         "automatic exposure control on (1) off (0)", &status);
     fits_update_key(fptr, TLOGICAL, "AUTOBLK", &(pMetadata->autoblk),
         "automatic black level control on (1) off (0)", &status);
+    fits_update_key(fptr, TUINT, "CRHITS", &(pMetadata->crhits),
+        "cosmic ray hits masked before blob finding", &status);
+    fits_update_key(fptr, TFLOAT, "ROWPATT", &(pMetadata->rowpatt),
+        "row fixed pattern noise removed (ADU rms)", &status);
+    fits_update_key(fptr, TFLOAT, "COLPATT", &(pMetadata->colpatt),
+        "column fixed pattern noise removed (ADU rms)", &status);
 
     fits_report_error(stderr, status);
     return status;
@@ -229,85 +235,63 @@ int writeImage(char* fileName, uint16_t* imageMem, uint16_t imageWidth,
 }
 
 
-// /**
-//  * @brief read a FITS image into the given memory
-//  * @details for the purposes of this code, get just the image data, not any
-//  * header data.
-//  * 
-//  */
-// int readImage(char* fileName, uint16_t* imageMem, uint16_t imageWidth,
-//     uint16_t imageHeight)
-// {
-//     fitsfile *fptr; // pointer to the FITS file, defined in fitsio.h
-//     int status;
-//     int nfound;
-//     int anynull;
-//     long naxes[2];
-//     long fpixel;
-//     long nbuffer;
-//     long npixels;
-//     long ii;
-
-//     float datamin;
-//     float datamax;
-//     float nullval;
-//     // TODO(evanmayer): change buffer type to uint16_t
-//     float buffer[FITS_BUFF_SIZE];
-
-//     status = 0;
-
-//     if (fits_open_file(&fptr, fileName, READONLY, &status)) {
-//         fits_report_error(stderr, status);
-//         return status;
-//     }
-
-//     // read the NAXIS1 and NAXIS2 keyword to get image size
-//     if (fits_read_keys_lng(fptr, "NAXIS", 1, 2, naxes, &nfound, &status)) {
-//         fits_report_error(stderr, status);
-//         return status;
-//     }
-
-//     npixels  = naxes[0] * naxes[1]; // number of pixels in the image
-//     fpixel   = 1;
-//     nullval  = 0; // don't check for null values in the image
-//     datamin  = 1.0E30f;
-//     datamax  = -1.0E30f;
+/**
+ * @brief read a FITS image into the given memory
+ * @details for the purposes of this code, get just the image data, not any
+ * header data. Tile-compressed (.fits.fz) files, as written by writeImage(),
+ * are read from their first image extension.
+ * 
+ * @param fileName path of the file to read
+ * @param imageMem destination for imageWidth * imageHeight pixels
+ * @param imageWidth expected image width
+ * @param imageHeight expected image height
+ * @return int cfitsio status: 0 on success, nonzero otherwise
+ */
+int readImage(char* fileName, uint16_t* imageMem, uint16_t imageWidth,
+    uint16_t imageHeight)
+{
+    fitsfile *fptr; // pointer to the FITS file, defined in fitsio.h
+    int status = 0;
+    int bitpix = 0;
+    int naxis = 0;
+    int anynull = 0;
+    long naxes[2] = {0, 0};
+    uint16_t nullval = 0; // don't check for null values in the image
 
-//     while (npixels > 0) {
-//         nbuffer = npixels;
-//         // read as many pixels as will fit in buffer
-//         if (npixels > FITS_BUFF_SIZE) {
-//             nbuffer = FITS_BUFF_SIZE;
-//         }
+    if (fits_open_image(&fptr, fileName, READONLY, &status)) {
+        fits_report_error(stderr, status);
+        return status;
+    }
 
-//         /* Note that even though the FITS images contains unsigned integer */
-//         /* pixel values (or more accurately, signed integer pixels with    */
-//         /* a bias of 32768),  this routine is reading the values into a    */
-//         /* float array.   Cfitsio automatically performs the datatype      */
-//         /* conversion in cases like this.                                  */
+    // read the NAXIS1 and NAXIS2 keyword to get image size
+    if (fits_get_img_param(fptr, 2, &bitpix, &naxis, naxes, &status)) {
+        fits_report_error(stderr, status);
+        fits_close_file(fptr, &status);
+        return status;
+    }
+    if ((naxis != 2) || (naxes[0] != imageWidth) || (naxes[1] != imageHeight)) {
+        fprintf(stderr, "readImage: %s is %ldx%ld, expected %dx%d.\n", fileName,
+            naxes[0], naxes[1], imageWidth, imageHeight);
+        status = BAD_DIMEN;
+        int closeStatus = 0;
+        fits_close_file(fptr, &closeStatus);
+        return status;
+    }
 
-//         if (fits_read_img(fptr, TFLOAT, fpixel, nbuffer, &nullval,
-//             buffer, &anynull, &status)) {
-//             fits_report_error(stderr, status);
-//             return status;
-//         }
-//         // TODO(evanmayer): replace processing logic with reading
-//         for (ii = 0; ii < nbuffer; ii++) {
-//             if (buffer[ii] < datamin) {
-//                 datamin = buffer[ii];
-//             }
-//             if (buffer[ii] > datamax) {
-//                 datamax = buffer[ii];
-//             }
-//         }
-//         npixels -= nbuffer; // increment remaining number of pixels
-//         fpixel += nbuffer; // next pixel to be read in image
-//     }
+    // Cfitsio converts the stored signed 16-bit pixels (with BZERO = 32768)
+    // back to unsigned on read
+    if (fits_read_img(fptr, TUSHORT, 1, naxes[0] * naxes[1], &nullval,
+        imageMem, &anynull, &status)) {
+        fits_report_error(stderr, status);
+        int closeStatus = 0;
+        fits_close_file(fptr, &closeStatus);
+        return status;
+    }
 
-//     if (fits_close_file(fptr, &status)) {
-//         fits_report_error(stderr, status);
-//         return status;
-//     }
+    if (fits_close_file(fptr, &status)) {
+        fits_report_error(stderr, status);
+        return status;
+    }
 
-//     return status;
-// }
+    return status;
+}
@@ -69,6 +69,12 @@ struct fits_metadata_t {
     int8_t autoexp; // AUTOEXP: automatic exposure control on (1) off (0)
     int8_t autoblk; // AUTOBLK: automatic black level offset on (1) off (0)
 
+    // Processing
+
+    uint32_t crhits; // CRHITS: cosmic ray hits masked before blob finding
+    float rowpatt; // ROWPATT: row fixed pattern noise removed (ADU rms)
+    float colpatt; // COLPATT: column fixed pattern noise removed (ADU rms)
+
     // TODO(evanmayer): add more WCS info fields?
     // Pointing data (to be added on plate solve?)
 
@@ -0,0 +1,398 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixed_pattern.h"
+#include "threadpool.h"
+
+#ifdef FIXED_PATTERN_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// columns per task when taking column medians
+#define FIXED_PATTERN_COLUMN_BLOCK 256
+// rows per task when subtracting the pattern
+#define FIXED_PATTERN_BAND_ROWS 64
+#define FIXED_PATTERN_BINS (2 * FIXED_PATTERN_RANGE)
+
+
+/**
+ * @brief Median of integer values from their histogram, interpolated within
+ * the bin it falls in (each value v spreading over [v - 0.5, v + 0.5)), so a
+ * small offset still shows when most values are equal.
+ *
+ * @param pHist counts of each value, zero outside [lo, hi]
+ * @param n total count, at least 1
+ */
+static double interpolatedMedian(const uint32_t* pHist, int lo, int hi,
+    uint64_t n)
+{
+    uint64_t below = 0;
+    for (int v = lo; v <= hi; v++) {
+        if (2 * (below + pHist[v]) >= n) {
+            return v - 0.5 + (0.5 * n - below) / pHist[v];
+        }
+        below += pHist[v];
+    }
+    return hi;
+}
+
+
+/**
+ * @brief Insert x into, or remove it from, a sorted window of m values
+ */
+static void insertSorted(float* window, int* m, float x)
+{
+    int s = (*m)++;
+    for (; (s > 0) && (window[s - 1] > x); s--) {
+        window[s] = window[s - 1];
+    }
+    window[s] = x;
+}
+
+static void removeSorted(float* window, int* m, float x)
+{
+    int s = 0;
+    while ((s < *m - 1) && (window[s] != x)) {
+        s++;
+    }
+    (*m)--;
+    memmove(window + s, window + s + 1, (*m - s) * sizeof(float));
+}
+
+
+/**
+ * @brief Subtract a running median over 2 * FIXED_PATTERN_SMOOTH + 1 entries
+ * from a profile, leaving only its row-to-row (or column-to-column)
+ * structure. Entries without a measurement (NAN) are skipped and get an
+ * offset of 0.
+ *
+ * @return double rms of the offsets
+ */
+static double highPassProfile(const float* pProfile, int n, float* pOffset)
+{
+    float window[2 * FIXED_PATTERN_SMOOTH + 1];
+    int m = 0;
+    double sum2 = 0.0;
+    int count = 0;
+
+    for (int w = 0; (w < FIXED_PATTERN_SMOOTH) && (w < n); w++) {
+        if (!isnan(pProfile[w])) {
+            insertSorted(window, &m, pProfile[w]);
+        }
+    }
+    for (int k = 0; k < n; k++) {
+        // slide the window on to [k - SMOOTH, k + SMOOTH]
+        int in = k + FIXED_PATTERN_SMOOTH;
+        int out = k - FIXED_PATTERN_SMOOTH - 1;
+        if ((in < n) && !isnan(pProfile[in])) {
+            insertSorted(window, &m, pProfile[in]);
+        }
+        if ((out >= 0) && !isnan(pProfile[out])) {
+            removeSorted(window, &m, pProfile[out]);
+        }
+        if (isnan(pProfile[k])) {
+            pOffset[k] = 0.0f;
+            continue;
+        }
+        float median = (m & 1) ? window[m / 2] :
+            0.5f * (window[m / 2 - 1] + window[m / 2]);
+        pOffset[k] = pProfile[k] - median;
+        sum2 += (double)pOffset[k] * pOffset[k];
+        count++;
+    }
+    return (count > 0) ? sqrt(sum2 / count) : 0.0;
+}
+
+
+struct pattern_job_t {
+    const uint16_t* pImage;
+    const uint8_t* pMask;
+    uint16_t imageWidth;
+    int i0, j0, i1, j1;
+    int num_chunks;
+    float* row_profile;   // row medians, NAN for fully masked rows
+    float* col_profile;   // column medians of residuals from the row median
+    uint16_t** col_hist;  // per chunk of rows: FIXED_PATTERN_BINS per column
+    int failed;
+};
+
+
+/**
+ * @brief parallelFor() task: for one chunk of rows, in a single pass over
+ * each row, take the row's median and histogram every unmasked pixel's
+ * residual from it into the chunk's column histograms.
+ */
+static void measureRows(void* arg, int chunk)
+{
+    struct pattern_job_t* job = (struct pattern_job_t*)arg;
+    int width = job->i1 - job->i0;
+    int rows = job->j1 - job->j0;
+    int cj0 = job->j0 + (int)((int64_t)chunk * rows / job->num_chunks);
+    int cj1 = job->j0 + (int)((int64_t)(chunk + 1) * rows / job->num_chunks);
+    uint32_t* pHist = calloc(UINT16_MAX + 1, sizeof(uint32_t));
+    uint16_t* pColHist = calloc((size_t)width * FIXED_PATTERN_BINS,
+        sizeof(uint16_t));
+    job->col_hist[chunk] = pColHist;
+    if ((pHist == NULL) || (pColHist == NULL)) {
+        free(pHist);
+        job->failed = 1;
+        return;
+    }
+
+    for (int j = cj0; j < cj1; j++) {
+        const uint16_t* pRow = job->pImage + (size_t)j * job->imageWidth +
+            job->i0;
+        const uint8_t* pMaskRow = job->pMask + (size_t)j * job->imageWidth +
+            job->i0;
+        int n = 0;
+        int lo = UINT16_MAX, hi = 0;
+        for (int i = 0; i < width; i++) {
+            if (pMaskRow[i]) {
+                uint16_t v = pRow[i];
+                pHist[v]++;
+                lo = (v < lo) ? v : lo;
+                hi = (v > hi) ? v : hi;
+                n++;
+            }
+        }
+        if (n == 0) {
+            job->row_profile[j - job->j0] = NAN;
+            continue;
+        }
+        double median = interpolatedMedian(pHist, lo, hi, n);
+        memset(pHist + lo, 0, (hi - lo + 1) * sizeof(uint32_t));
+        job->row_profile[j - job->j0] = (float)median;
+
+        // the row is still in cache
+        int ref = (int)lround(median) - FIXED_PATTERN_RANGE;
+        for (int i = 0; i < width; i++) {
+            if (pMaskRow[i]) {
+                int b = pRow[i] - ref;
+                b = (b < 0) ? 0 : ((b >= FIXED_PATTERN_BINS) ?
+                    FIXED_PATTERN_BINS - 1 : b);
+                pColHist[i * FIXED_PATTERN_BINS + b]++;
+            }
+        }
+    }
+    free(pHist);
+}
+
+
+/**
+ * @brief parallelFor() task: median residual of each column in one block,
+ * summing the histograms of every chunk of rows.
+ */
+static void measureColumns(void* arg, int block)
+{
+    struct pattern_job_t* job = (struct pattern_job_t*)arg;
+    int width = job->i1 - job->i0;
+    int c0 = block * FIXED_PATTERN_COLUMN_BLOCK;
+    int c1 = c0 + FIXED_PATTERN_COLUMN_BLOCK;
+    c1 = (c1 < width) ? c1 : width;
+
+    for (int c = c0; c < c1; c++) {
+        uint32_t hist[FIXED_PATTERN_BINS] = {0};
+        uint64_t n = 0;
+        for (int k = 0; k < job->num_chunks; k++) {
+            const uint16_t* pBins = job->col_hist[k] + c * FIXED_PATTERN_BINS;
+            for (int b = 0; b < FIXED_PATTERN_BINS; b++) {
+                hist[b] += pBins[b];
+                n += pBins[b];
+            }
+        }
+        job->col_profile[c] = (n == 0) ? NAN : (float)(interpolatedMedian(
+            hist, 0, FIXED_PATTERN_BINS - 1, n) - FIXED_PATTERN_RANGE);
+    }
+}
+
+
+/**
+ * @brief Estimate the row and column fixed pattern noise of a region from
+ * its unmasked pixels, in one pass over the image: each row's median, then
+ * each column's median residual from the row medians. The slowly varying
+ * part of both profiles is sky and is left alone; what remains is the
+ * pattern.
+ *
+ * @param pImage image to measure
+ * @param pMask 0 for pixels to ignore (hot pixels, cosmic rays)
+ * @param imageWidth row stride of pImage and pMask [px]
+ * @param i0, j0, i1, j1 region [i0, i1) x [j0, j1), at most 65535 rows
+ * @param pPattern filled in; keep it between frames to reuse its memory
+ * @return int -1 if failed, 0 otherwise
+ */
+int estimateFixedPattern(
+    const uint16_t* pImage,
+    const uint8_t* pMask,
+    uint16_t imageWidth,
+    int i0,
+    int j0,
+    int i1,
+    int j1,
+    struct fixed_pattern_t* pPattern)
+{
+    if ((i1 <= i0) || (j1 <= j0) || (j1 - j0 > UINT16_MAX)) {
+        return -1;
+    }
+    if ((pPattern->row_offset == NULL) || (pPattern->i0 != i0) ||
+        (pPattern->j0 != j0) || (pPattern->i1 != i1) || (pPattern->j1 != j1)) {
+        freeFixedPattern(pPattern);
+        pPattern->row_offset = malloc((size_t)(j1 - j0) * sizeof(float));
+        pPattern->col_offset = malloc((size_t)(i1 - i0) * sizeof(float));
+        if (!pPattern->row_offset || !pPattern->col_offset) {
+            fprintf(stderr, "estimateFixedPattern: out of memory.\n");
+            freeFixedPattern(pPattern);
+            return -1;
+        }
+        pPattern->i0 = i0;
+        pPattern->j0 = j0;
+        pPattern->i1 = i1;
+        pPattern->j1 = j1;
+    }
+
+    // one chunk of rows per thread, each with its own column histograms
+    int num_chunks = threadPoolSize();
+    num_chunks = (num_chunks < j1 - j0) ? num_chunks : j1 - j0;
+    struct pattern_job_t job = {
+        .pImage = pImage,
+        .pMask = pMask,
+        .imageWidth = imageWidth,
+        .i0 = i0, .j0 = j0, .i1 = i1, .j1 = j1,
+        .num_chunks = num_chunks,
+        .row_profile = malloc((size_t)(j1 - j0) * sizeof(float)),
+        .col_profile = malloc((size_t)(i1 - i0) * sizeof(float)),
+        .col_hist = calloc(num_chunks, sizeof(uint16_t*)),
+        .failed = 0,
+    };
+    if (job.row_profile && job.col_profile && job.col_hist) {
+        parallelFor(num_chunks, measureRows, &job);
+    } else {
+        job.failed = 1;
+    }
+    if (!job.failed) {
+        parallelFor((i1 - i0 + FIXED_PATTERN_COLUMN_BLOCK - 1) /
+            FIXED_PATTERN_COLUMN_BLOCK, measureColumns, &job);
+        pPattern->row_rms = highPassProfile(job.row_profile, j1 - j0,
+            pPattern->row_offset);
+        pPattern->col_rms = highPassProfile(job.col_profile, i1 - i0,
+            pPattern->col_offset);
+    }
+
+    if (job.col_hist != NULL) {
+        for (int k = 0; k < num_chunks; k++) {
+            free(job.col_hist[k]);
+        }
+    }
+    free(job.col_hist);
+    free(job.row_profile);
+    free(job.col_profile);
+    if (job.failed) {
+        fprintf(stderr, "estimateFixedPattern: out of memory.\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Subtract row and column offsets from n pixels of one row, rounding
+ * to the nearest value and clamping to [0, 65535].
+ */
+void removeFixedPatternRowScalar(uint16_t* pRow, const float* pColOffset,
+    float rowOffset, int n)
+{
+    for (int i = 0; i < n; i++) {
+        long v = lrintf((float)pRow[i] - (rowOffset + pColOffset[i]));
+        pRow[i] = (v < 0) ? 0 : ((v > UINT16_MAX) ? UINT16_MAX : v);
+    }
+}
+
+
+#ifdef FIXED_PATTERN_HAVE_X86_KERNELS
+/**
+ * @brief AVX2 version of removeFixedPatternRowScalar(), 8 pixels per step,
+ * with identical results.
+ */
+__attribute__((target("avx2")))
+void removeFixedPatternRowAvx2(uint16_t* pRow, const float* pColOffset,
+    float rowOffset, int n)
+{
+    const __m256 row = _mm256_set1_ps(rowOffset);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i*)(pRow + i))));
+        __m256 offset = _mm256_add_ps(row, _mm256_loadu_ps(pColOffset + i));
+        // rounds to nearest like lrintf(); packus clamps to [0, 65535]
+        __m256i d = _mm256_cvtps_epi32(_mm256_sub_ps(v, offset));
+        _mm_storeu_si128((__m128i*)(pRow + i), _mm_packus_epi32(
+            _mm256_castsi256_si128(d), _mm256_extracti128_si256(d, 1)));
+    }
+    removeFixedPatternRowScalar(pRow + i, pColOffset + i, rowOffset, n - i);
+}
+#endif
+
+
+struct remove_pattern_job_t {
+    void (*kernel)(uint16_t*, const float*, float, int);
+    uint16_t* pImage;
+    uint16_t imageWidth;
+    const struct fixed_pattern_t* pPattern;
+};
+
+
+static void removePatternBand(void* arg, int band)
+{
+    struct remove_pattern_job_t* job = (struct remove_pattern_job_t*)arg;
+    const struct fixed_pattern_t* p = job->pPattern;
+    int j0 = p->j0 + band * FIXED_PATTERN_BAND_ROWS;
+    int j1 = j0 + FIXED_PATTERN_BAND_ROWS;
+    j1 = (j1 < p->j1) ? j1 : p->j1;
+    for (int j = j0; j < j1; j++) {
+        job->kernel(job->pImage + (size_t)j * job->imageWidth + p->i0,
+            p->col_offset, p->row_offset[j - p->j0], p->i1 - p->i0);
+    }
+}
+
+
+/**
+ * @brief Subtract an estimated fixed pattern from its region of an image,
+ * with bands of rows split across the thread pool.
+ */
+void removeFixedPattern(
+    uint16_t* pImage,
+    uint16_t imageWidth,
+    const struct fixed_pattern_t* pPattern)
+{
+    static void (*fast_kernel)(uint16_t*, const float*, float, int) = NULL;
+    if (pPattern->row_offset == NULL) {
+        return;
+    }
+    if (fast_kernel == NULL) {
+        fast_kernel = removeFixedPatternRowScalar;
+#ifdef FIXED_PATTERN_HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            fast_kernel = removeFixedPatternRowAvx2;
+        }
+#endif
+    }
+    struct remove_pattern_job_t job = {
+        .kernel = fast_kernel,
+        .pImage = pImage,
+        .imageWidth = imageWidth,
+        .pPattern = pPattern,
+    };
+    parallelFor((pPattern->j1 - pPattern->j0 + FIXED_PATTERN_BAND_ROWS - 1) /
+        FIXED_PATTERN_BAND_ROWS, removePatternBand, &job);
+}
+
+
+void freeFixedPattern(struct fixed_pattern_t* pPattern)
+{
+    free(pPattern->row_offset);
+    free(pPattern->col_offset);
+    memset(pPattern, 0, sizeof(struct fixed_pattern_t));
+}
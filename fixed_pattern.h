@@ -0,0 +1,49 @@
+#ifndef FIXED_PATTERN_H
+#define FIXED_PATTERN_H
+
+#include <stdint.h>
+
+// Pixels are histogrammed per column as residuals from their row's median,
+// over [-FIXED_PATTERN_RANGE, FIXED_PATTERN_RANGE) ADU. Stars and other
+// outliers pile up in the end bins, which does not move a median inside.
+#define FIXED_PATTERN_RANGE 32
+// half-width of the running median along the row and column profiles that
+// is taken to be sky rather than pattern [rows or columns]
+#define FIXED_PATTERN_SMOOTH 64
+
+/* Offsets of each row and column of a region from a smooth sky: the
+** sensor's row and column fixed pattern noise, for removeFixedPattern(). */
+struct fixed_pattern_t {
+    int i0, j0;         // image position of the region's corner
+    int i1, j1;         // end of the region
+    float* row_offset;  // j1 - j0 per-row offsets [ADU]
+    float* col_offset;  // i1 - i0 per-column offsets [ADU]
+    double row_rms;     // pattern amplitudes [ADU]
+    double col_rms;
+};
+
+int estimateFixedPattern(
+    const uint16_t* pImage,
+    const uint8_t* pMask,
+    uint16_t imageWidth,
+    int i0,
+    int j0,
+    int i1,
+    int j1,
+    struct fixed_pattern_t* pPattern);
+void removeFixedPattern(
+    uint16_t* pImage,
+    uint16_t imageWidth,
+    const struct fixed_pattern_t* pPattern);
+void freeFixedPattern(struct fixed_pattern_t* pPattern);
+
+// Individual correction kernels, exposed for testing and benchmarking
+void removeFixedPatternRowScalar(uint16_t* pRow, const float* pColOffset,
+    float rowOffset, int n);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FIXED_PATTERN_HAVE_X86_KERNELS
+void removeFixedPatternRowAvx2(uint16_t* pRow, const float* pColOffset,
+    float rowOffset, int n);
+#endif
+
+#endif
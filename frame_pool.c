@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "frame_pool.h"
+#include "camera.h"
+
+
+static struct frame_t frames[FRAME_POOL_SIZE];
+static int pool_ready = 0;
+static int pool_closed = 0;
+// the frame clients should display; the pool holds one reference to it
+static struct frame_t* published = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frame_freed = PTHREAD_COND_INITIALIZER;
+
+
+/**
+ * @brief Allocate the memory owned by a frame.
+ *
+ * @param frame
+ * @return int -1 if failed, 0 otherwise
+ */
+int initFrame(struct frame_t* frame)
+{
+    memset(frame, 0, sizeof(struct frame_t));
+    frame->image = calloc(CAMERA_NUM_PX, sizeof(uint16_t));
+    if (frame->image == NULL) {
+        fprintf(stderr, "initFrame: Error allocating frame image: %s.\n",
+            strerror(errno));
+        return -1;
+    }
+    frame->star_x = malloc(MAX_BLOBS * sizeof(double));
+    frame->star_y = malloc(MAX_BLOBS * sizeof(double));
+    frame->star_mags = malloc(MAX_BLOBS * sizeof(double));
+    if (!frame->star_x || !frame->star_y || !frame->star_mags) {
+        fprintf(stderr, "initFrame: Error allocating blob list: %s.\n",
+            strerror(errno));
+        freeFrame(frame);
+        return -1;
+    }
+    frame->metadata = default_metadata;
+    return 0;
+}
+
+
+/**
+ * @brief Release the memory owned by a frame.
+ *
+ * @param frame
+ */
+void freeFrame(struct frame_t* frame)
+{
+    free(frame->image);
+    free(frame->star_x);
+    free(frame->star_y);
+    free(frame->star_mags);
+    memset(frame, 0, sizeof(struct frame_t));
+}
+
+
+/**
+ * @brief Allocate every frame buffer up front, so that no full-size image is
+ * allocated or copied per exposure. A blank frame is published so that clients
+ * always have an image to send.
+ *
+ * @return int -1 if failed, 0 otherwise
+ */
+int initFramePool(void)
+{
+    for (int i = 0; i < FRAME_POOL_SIZE; i++) {
+        if (initFrame(&frames[i]) < 0) {
+            for (int j = 0; j < i; j++) {
+                freeFrame(&frames[j]);
+            }
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_closed = 0;
+    frames[0].refcount = 1;
+    published = &frames[0];
+    pool_ready = 1;
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+
+/**
+ * @brief Let frameGet() hand out frames again after closeFramePool().
+ */
+void openFramePool(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_closed = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/**
+ * @brief Wake any thread blocked in frameGet(); it and all later calls
+ * return NULL.
+ */
+void closeFramePool(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_closed = 1;
+    pthread_cond_broadcast(&frame_freed);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/**
+ * @brief Free all frame buffers. Call only once no thread holds a frame.
+ */
+void freeFramePool(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_ready = 0;
+    published = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < FRAME_POOL_SIZE; i++) {
+        freeFrame(&frames[i]);
+    }
+}
+
+
+static struct frame_t* findFreeFrame(void)
+{
+    for (int i = 0; i < FRAME_POOL_SIZE; i++) {
+        if (frames[i].refcount == 0) {
+            frames[i].refcount = 1;
+            return &frames[i];
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Take an unused frame from the pool, blocking until one is released.
+ * The caller owns the single reference to the returned frame.
+ *
+ * @return struct frame_t* NULL if the pool is closed
+ */
+struct frame_t* frameGet(void)
+{
+    struct frame_t* frame = NULL;
+    pthread_mutex_lock(&pool_lock);
+    while (pool_ready && !pool_closed && (frame = findFreeFrame()) == NULL) {
+        pthread_cond_wait(&frame_freed, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return frame;
+}
+
+
+/**
+ * @brief Take an unused frame from the pool if one is available right now.
+ *
+ * @return struct frame_t* NULL if every frame is in use
+ */
+struct frame_t* frameTryGet(void)
+{
+    struct frame_t* frame = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (pool_ready && !pool_closed) {
+        frame = findFreeFrame();
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return frame;
+}
+
+
+/**
+ * @brief Add a reference to a frame the caller already holds a reference to.
+ */
+void frameRetain(struct frame_t* frame)
+{
+    pthread_mutex_lock(&pool_lock);
+    frame->refcount++;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/**
+ * @brief Drop a reference. The frame returns to the pool with the last one.
+ */
+void frameRelease(struct frame_t* frame)
+{
+    pthread_mutex_lock(&pool_lock);
+    if (--frame->refcount <= 0) {
+        frame->refcount = 0;
+        pthread_cond_signal(&frame_freed);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/**
+ * @brief Make `frame` the image sent to clients. The pool takes its own
+ * reference, so the caller keeps (and must still release) its reference.
+ * The image must not be modified after it is published.
+ */
+void publishFrame(struct frame_t* frame)
+{
+    pthread_mutex_lock(&pool_lock);
+    frame->refcount++;
+    struct frame_t* old = published;
+    published = frame;
+    if ((old != NULL) && (--old->refcount <= 0)) {
+        old->refcount = 0;
+        pthread_cond_signal(&frame_freed);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/**
+ * @brief Get a reference to the latest published frame. Release it with
+ * frameRelease() once done reading.
+ *
+ * @return struct frame_t* NULL if the pool is not initialized
+ */
+struct frame_t* getPublishedFrame(void)
+{
+    struct frame_t* frame = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (pool_ready && (published != NULL)) {
+        frame = published;
+        frame->refcount++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return frame;
+}
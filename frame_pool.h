@@ -0,0 +1,47 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "fits_utils.h"
+
+// Frames allocated once at startup. The pipeline keeps up to one per stage in
+// flight; one more is held as the latest published image, and one more covers
+// a client that is still sending the previously published image.
+#define FRAME_POOL_SIZE 6
+
+/* Everything belonging to one exposure, carried from stage to stage */
+struct frame_t {
+    uint64_t frame_id;
+    uint16_t* image;                 // CAMERA_NUM_PX working (unpacked) image
+    double* star_x;                  // MAX_BLOBS blob list, brightest first
+    double* star_y;
+    double* star_mags;
+    int blob_count;
+    int tracking;                    // 1: only windows around known stars searched
+    time_t seconds;                  // wall clock time the round began
+    struct tm tm_info;               // leap-year-adjusted UTC time of `seconds`
+    double photo_time;               // time right after exposure trigger
+    double trigger_wait_s;           // part of acquisition spent idle on a trigger
+    double trigger_time;             // arrival of the trigger packet, 0 if none
+    double trigger_latency;          // [s] trigger arrival to exposure start
+    struct fits_metadata_t metadata; // FITS header snapshot for this exposure
+    int refcount;                    // owners of this frame; 0 means free
+};
+
+int initFrame(struct frame_t* frame);
+void freeFrame(struct frame_t* frame);
+
+int initFramePool(void);
+void openFramePool(void);
+void closeFramePool(void);
+void freeFramePool(void);
+struct frame_t* frameGet(void);
+struct frame_t* frameTryGet(void);
+void frameRetain(struct frame_t* frame);
+void frameRelease(struct frame_t* frame);
+void publishFrame(struct frame_t* frame);
+struct frame_t* getPublishedFrame(void);
+
+#endif
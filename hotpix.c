@@ -0,0 +1,793 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hotpix.h"
+#include "threadpool.h"
+
+#ifdef HOTPIX_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// rows per task when scanning or masking hot pixels
+#define HOT_PIXEL_SCAN_ROWS 64
+
+
+/**
+ * @brief Map a static hot pixel map file into memory.
+ *
+ * @param path map file written by writeHotPixelMap()
+ * @param width expected sensor width; a map for another geometry is rejected
+ * @param height expected sensor height
+ * @param pMap filled in on success; release with unloadHotPixelMap()
+ * @return int -1 if failed, 0 otherwise
+ */
+int loadHotPixelMap(const char* path, uint32_t width, uint32_t height,
+    struct hot_pixel_map_t* pMap)
+{
+    struct stat st;
+    struct hot_pixel_map_header_t header;
+
+    memset(pMap, 0, sizeof(struct hot_pixel_map_t));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if ((fstat(fd, &st) < 0) ||
+        ((size_t)st.st_size < sizeof(struct hot_pixel_map_header_t))) {
+        fprintf(stderr, "loadHotPixelMap: %s is too short.\n", path);
+        close(fd);
+        return -1;
+    }
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "loadHotPixelMap: could not map %s: %s.\n", path,
+            strerror(errno));
+        return -1;
+    }
+
+    memcpy(&header, mapping, sizeof(header));
+    size_t expected_size = sizeof(header) + (size_t)header.count *
+        sizeof(uint32_t);
+    if ((memcmp(header.magic, HOT_PIXEL_MAP_MAGIC, sizeof(header.magic)) != 0)
+        || (header.version != HOT_PIXEL_MAP_VERSION)) {
+        fprintf(stderr, "loadHotPixelMap: %s is not a hot pixel map.\n", path);
+    } else if ((header.width != width) || (header.height != height)) {
+        fprintf(stderr, "loadHotPixelMap: %s is for a %u x %u sensor, not "
+            "%u x %u.\n", path, header.width, header.height, width, height);
+    } else if ((size_t)st.st_size != expected_size) {
+        fprintf(stderr, "loadHotPixelMap: %s should hold %u pixels but is %ld "
+            "bytes.\n", path, header.count, (long)st.st_size);
+    } else {
+        pMap->indices = (const uint32_t*)((const char*)mapping + sizeof(header));
+        pMap->count = header.count;
+        pMap->mapping = mapping;
+        pMap->mapping_size = st.st_size;
+        return 0;
+    }
+    munmap(mapping, st.st_size);
+    return -1;
+}
+
+
+void unloadHotPixelMap(struct hot_pixel_map_t* pMap)
+{
+    if (pMap->mapping != NULL) {
+        munmap(pMap->mapping, pMap->mapping_size);
+    }
+    memset(pMap, 0, sizeof(struct hot_pixel_map_t));
+}
+
+
+/**
+ * @brief Write a static hot pixel map. The file is replaced atomically, so a
+ * reader never maps a half-written map.
+ *
+ * @param indices hot pixel indices, sorted ascending
+ * @return int -1 if failed, 0 otherwise
+ */
+int writeHotPixelMap(const char* path, const uint32_t* indices, uint32_t count,
+    uint32_t width, uint32_t height)
+{
+    struct hot_pixel_map_header_t header = {
+        .version = HOT_PIXEL_MAP_VERSION,
+        .width = width,
+        .height = height,
+        .count = count,
+    };
+    char tmp_path[512];
+
+    memcpy(header.magic, HOT_PIXEL_MAP_MAGIC, sizeof(header.magic));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "writeHotPixelMap: could not open %s: %s.\n", tmp_path,
+            strerror(errno));
+        return -1;
+    }
+    int ok = (fwrite(&header, sizeof(header), 1, f) == 1) &&
+        (fwrite(indices, sizeof(uint32_t), count, f) == count);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || (rename(tmp_path, path) < 0)) {
+        fprintf(stderr, "writeHotPixelMap: could not write %s: %s.\n", path,
+            strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int compareIndices(const void* a, const void* b)
+{
+    uint32_t ia = *(const uint32_t*)a;
+    uint32_t ib = *(const uint32_t*)b;
+    return (ia > ib) - (ia < ib);
+}
+
+
+/**
+ * @brief Convert an old text hot pixel list ("x,y" per line, y counted up from
+ * the bottom of the image as in Kst) into a binary map.
+ *
+ * @return int -1 if failed, 0 otherwise
+ */
+int convertHotPixelText(const char* text_path, const char* map_path,
+    uint32_t width, uint32_t height)
+{
+    FILE* f = fopen(text_path, "r");
+    uint32_t* indices = NULL;
+    uint32_t count = 0, alloc = 0;
+    int x, y;
+
+    if (f == NULL) {
+        fprintf(stderr, "convertHotPixelText: could not open %s: %s.\n",
+            text_path, strerror(errno));
+        return -1;
+    }
+    while (fscanf(f, "%d,%d\n", &x, &y) == 2) {
+        // map y coordinate to image in memory from Kst blob
+        int row = (int)height - y;
+        if ((x < 0) || (x >= (int)width) || (row < 0) || (row >= (int)height)) {
+            continue;
+        }
+        if (count >= alloc) {
+            alloc = (alloc == 0) ? 1024 : 2 * alloc;
+            uint32_t* grown = realloc(indices, alloc * sizeof(uint32_t));
+            if (grown == NULL) {
+                free(indices);
+                fclose(f);
+                return -1;
+            }
+            indices = grown;
+        }
+        indices[count++] = (uint32_t)row * width + (uint32_t)x;
+    }
+    fclose(f);
+
+    qsort(indices, count, sizeof(uint32_t), compareIndices);
+    // drop duplicates
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((unique == 0) || (indices[i] != indices[unique - 1])) {
+            indices[unique++] = indices[i];
+        }
+    }
+
+    int ret = writeHotPixelMap(map_path, indices, unique, width, height);
+    if (ret == 0) {
+        printf("Converted %u hot pixels from %s to %s.\n", unique, text_path,
+            map_path);
+    }
+    free(indices);
+    return ret;
+}
+
+
+struct hot_pixel_scan_t {
+    const uint16_t* image;
+    uint32_t width;
+    uint32_t height;
+    uint16_t threshold;
+    uint32_t** band_indices; // per band, in row order
+    uint32_t* band_counts;
+    int failed;
+};
+
+
+/**
+ * @brief parallelFor() task: collect pixels above threshold in one band of
+ * rows. Blocks of 8 pixels with none above threshold, by far the common case,
+ * are skipped with one vector compare.
+ */
+static void scanHotPixelBand(void* arg, int band)
+{
+    struct hot_pixel_scan_t* scan = (struct hot_pixel_scan_t*)arg;
+    uint32_t row0 = band * HOT_PIXEL_SCAN_ROWS;
+    uint32_t row1 = row0 + HOT_PIXEL_SCAN_ROWS;
+    uint32_t count = 0, alloc = 0;
+    uint32_t* indices = NULL;
+
+    if (row1 > scan->height) {
+        row1 = scan->height;
+    }
+    uint32_t begin = row0 * scan->width;
+    uint32_t end = row1 * scan->width;
+    uint32_t i = begin;
+    while (i < end) {
+#ifdef __SSE2__
+        if (i + 8 <= end) {
+            // unsigned v > threshold <=> saturating v - threshold != 0
+            __m128i v = _mm_loadu_si128((const __m128i*)(scan->image + i));
+            __m128i over = _mm_subs_epu16(v,
+                _mm_set1_epi16((short)scan->threshold));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(over,
+                _mm_setzero_si128())) == 0xFFFF) {
+                i += 8;
+                continue;
+            }
+        }
+#endif
+        uint32_t block_end = (i + 8 <= end) ? i + 8 : end;
+        for (; i < block_end; i++) {
+            if (scan->image[i] <= scan->threshold) {
+                continue;
+            }
+            if (count >= alloc) {
+                alloc = (alloc == 0) ? 256 : 2 * alloc;
+                uint32_t* grown = realloc(indices, alloc * sizeof(uint32_t));
+                if (grown == NULL) {
+                    scan->failed = 1;
+                    free(indices);
+                    return;
+                }
+                indices = grown;
+            }
+            indices[count++] = i;
+        }
+    }
+    scan->band_indices[band] = indices;
+    scan->band_counts[band] = count;
+}
+
+
+/**
+ * @brief Find every pixel brighter than threshold, splitting the frame into
+ * bands of rows across the thread pool.
+ *
+ * @param pIndices set to a malloc'd, ascending list of pixel indices; the
+ * caller frees it
+ * @param pCount set to the number of hot pixels found
+ * @return int -1 if failed, 0 otherwise
+ */
+int findHotPixels(const uint16_t* image, uint32_t width, uint32_t height,
+    uint16_t threshold, uint32_t** pIndices, uint32_t* pCount)
+{
+    int num_bands = (height + HOT_PIXEL_SCAN_ROWS - 1) / HOT_PIXEL_SCAN_ROWS;
+    struct hot_pixel_scan_t scan = {
+        .image = image,
+        .width = width,
+        .height = height,
+        .threshold = threshold,
+        .band_indices = calloc(num_bands, sizeof(uint32_t*)),
+        .band_counts = calloc(num_bands, sizeof(uint32_t)),
+        .failed = 0,
+    };
+    int ret = 0;
+
+    *pIndices = NULL;
+    *pCount = 0;
+    if ((scan.band_indices == NULL) || (scan.band_counts == NULL)) {
+        free(scan.band_indices);
+        free(scan.band_counts);
+        return -1;
+    }
+    parallelFor(num_bands, scanHotPixelBand, &scan);
+
+    // bands cover increasing rows, so concatenating keeps the list sorted
+    uint32_t total = 0;
+    for (int b = 0; b < num_bands; b++) {
+        total += scan.band_counts[b];
+    }
+    uint32_t* indices = malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+    if ((indices == NULL) || scan.failed) {
+        free(indices);
+        ret = -1;
+    } else {
+        uint32_t n = 0;
+        for (int b = 0; b < num_bands; b++) {
+            memcpy(indices + n, scan.band_indices[b],
+                scan.band_counts[b] * sizeof(uint32_t));
+            n += scan.band_counts[b];
+        }
+        *pIndices = indices;
+        *pCount = total;
+    }
+    for (int b = 0; b < num_bands; b++) {
+        free(scan.band_indices[b]);
+    }
+    free(scan.band_indices);
+    free(scan.band_counts);
+    return ret;
+}
+
+
+/**
+ * @brief Find the first entry of a sorted index list that is >= value.
+ */
+static uint32_t lowerBound(const uint32_t* indices, uint32_t count,
+    uint32_t value)
+{
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (indices[mid] < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/**
+ * @brief Clear the mask at every hot pixel inside columns [i0, i1) and rows
+ * [j0, j1). Because the list is sorted, only the entries for rows j0 to j1 are
+ * visited, so small windows cost little more than a binary search.
+ *
+ * @param width image width the mask is laid out with
+ */
+void applyHotPixelMap(const struct hot_pixel_map_t* pMap, uint32_t width,
+    uint8_t* mask, int i0, int j0, int i1, int j1)
+{
+    uint32_t begin = (uint32_t)j0 * width;
+    uint32_t end = (uint32_t)j1 * width;
+    for (uint32_t k = lowerBound(pMap->indices, pMap->count, begin);
+        (k < pMap->count) && (pMap->indices[k] < end); k++) {
+        uint32_t column = pMap->indices[k] % width;
+        if ((column >= (uint32_t)i0) && (column < (uint32_t)i1)) {
+            mask[pMap->indices[k]] = 0;
+        }
+    }
+}
+
+
+/**
+ * @brief Mark pixels that stand out from both their edge and their corner
+ * neighbours as hot, for the interior [i0, i1) x [j0, j1) of an image (every
+ * pixel read must have all 8 neighbours). This is the original makeMask() test
+ *
+ *     p0 = 100 * v / cutoff;   a = sum of 4 edge neighbours + 4;
+ *     b = sum of 4 corner neighbours + 4;
+ *     mask = (p0 < a) && (p0 < b);   hot if (p0 > a) || (p0 > b)
+ *
+ * without the division: for cutoff > 0 and integer a, floor(100 v / cutoff)
+ * < a exactly when 100 v < a * cutoff, and > a exactly when 100 v >=
+ * (a + 1) * cutoff.
+ *
+ * @param cutoff spike limit * 100; when <= 0 no pixel is masked
+ * @param mask set to 1 for usable pixels, 0 for hot ones
+ * @return int number of hot pixels found
+ */
+int maskDynamicHotPixelsScalar(const uint16_t* image, uint32_t width, int i0,
+    int j0, int i1, int j1, int cutoff, uint8_t* mask)
+{
+    int nhp = 0;
+
+    for (int j = j0; j < j1; j++) {
+        const uint16_t* above = image + (j - 1) * width;
+        const uint16_t* row = image + j * width;
+        const uint16_t* below = image + (j + 1) * width;
+        uint8_t* pMask = mask + j * width;
+
+        if (cutoff <= 0) {
+            memset(pMask + i0, 1, i1 - i0);
+            continue;
+        }
+        if (cutoff <= HOTPIX_MAX_INT32_CUTOFF) {
+            for (int i = i0; i < i1; i++) {
+                int32_t v = 100 * (int32_t)row[i];
+                int32_t a = row[i - 1] + row[i + 1] + below[i] + above[i] + 4;
+                int32_t b = above[i - 1] + below[i + 1] + below[i - 1] +
+                    above[i + 1] + 4;
+                pMask[i] = (v < a * cutoff) & (v < b * cutoff);
+                nhp += (v >= (a + 1) * cutoff) | (v >= (b + 1) * cutoff);
+            }
+            continue;
+        }
+        for (int i = i0; i < i1; i++) {
+            int64_t v = 100 * (int64_t)row[i];
+            int64_t a = row[i - 1] + row[i + 1] + below[i] + above[i] + 4;
+            int64_t b = above[i - 1] + below[i + 1] + below[i - 1] +
+                above[i + 1] + 4;
+            pMask[i] = (v < a * cutoff) & (v < b * cutoff);
+            nhp += (v >= (a + 1) * cutoff) | (v >= (b + 1) * cutoff);
+        }
+    }
+    return nhp;
+}
+
+
+#ifdef HOTPIX_HAVE_X86_KERNELS
+/**
+ * @brief AVX2 version of maskDynamicHotPixelsScalar(), 8 pixels per step in
+ * 32-bit lanes. Cutoffs above HOTPIX_MAX_INT32_CUTOFF go to the scalar
+ * kernel.
+ */
+__attribute__((target("avx2")))
+int maskDynamicHotPixelsAvx2(const uint16_t* image, uint32_t width, int i0,
+    int j0, int i1, int j1, int cutoff, uint8_t* mask)
+{
+    const __m256i c = _mm256_set1_epi32(cutoff);
+    const __m256i four = _mm256_set1_epi32(4);
+    const __m256i hundred = _mm256_set1_epi32(100);
+    const __m128i one = _mm_set1_epi8(1);
+    int nhp = 0;
+
+    if ((cutoff <= 0) || (cutoff > HOTPIX_MAX_INT32_CUTOFF)) {
+        return maskDynamicHotPixelsScalar(image, width, i0, j0, i1, j1, cutoff,
+            mask);
+    }
+    for (int j = j0; j < j1; j++) {
+        const uint16_t* above = image + (j - 1) * width;
+        const uint16_t* row = image + j * width;
+        const uint16_t* below = image + (j + 1) * width;
+        uint8_t* pMask = mask + j * width;
+        int i = i0;
+
+#define LOAD8(p) _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p)))
+        for (; i + 8 <= i1; i += 8) {
+            __m256i v = _mm256_mullo_epi32(LOAD8(row + i), hundred);
+            __m256i a = _mm256_add_epi32(
+                _mm256_add_epi32(LOAD8(row + i - 1), LOAD8(row + i + 1)),
+                _mm256_add_epi32(LOAD8(below + i), LOAD8(above + i)));
+            __m256i b = _mm256_add_epi32(
+                _mm256_add_epi32(LOAD8(above + i - 1), LOAD8(below + i + 1)),
+                _mm256_add_epi32(LOAD8(below + i - 1), LOAD8(above + i + 1)));
+            __m256i ac = _mm256_mullo_epi32(_mm256_add_epi32(a, four), c);
+            __m256i bc = _mm256_mullo_epi32(_mm256_add_epi32(b, four), c);
+
+            __m256i keep = _mm256_and_si256(_mm256_cmpgt_epi32(ac, v),
+                _mm256_cmpgt_epi32(bc, v));
+            // not hot: 100 v < (a + 1) c and 100 v < (b + 1) c
+            __m256i cool = _mm256_and_si256(
+                _mm256_cmpgt_epi32(_mm256_add_epi32(ac, c), v),
+                _mm256_cmpgt_epi32(_mm256_add_epi32(bc, c), v));
+            nhp += 8 - __builtin_popcount(_mm256_movemask_ps(
+                _mm256_castsi256_ps(cool)));
+
+            // narrow the 8 lane masks to bytes; packs works per 128-bit lane
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(keep,
+                _mm256_setzero_si256()), 0x08);
+            __m128i bytes = _mm_packs_epi16(_mm256_castsi256_si128(packed),
+                _mm_setzero_si128());
+            _mm_storel_epi64((__m128i*)(pMask + i), _mm_and_si128(bytes, one));
+        }
+#undef LOAD8
+        if (i < i1) {
+            nhp += maskDynamicHotPixelsScalar(image, width, i, j, i1, j + 1,
+                cutoff, mask);
+        }
+    }
+    return nhp;
+}
+#endif
+
+
+struct dynamic_hot_pixel_job_t {
+    int (*kernel)(const uint16_t*, uint32_t, int, int, int, int, int,
+        uint8_t*);
+    const uint16_t* image;
+    uint32_t width;
+    int i0, j0, i1, j1;
+    int cutoff;
+    uint8_t* mask;
+    int* band_hot;
+};
+
+
+static void maskDynamicHotPixelBand(void* arg, int band)
+{
+    struct dynamic_hot_pixel_job_t* job = (struct dynamic_hot_pixel_job_t*)arg;
+    int j0 = job->j0 + band * HOT_PIXEL_SCAN_ROWS;
+    int j1 = j0 + HOT_PIXEL_SCAN_ROWS;
+    if (j1 > job->j1) {
+        j1 = job->j1;
+    }
+    job->band_hot[band] = job->kernel(job->image, job->width, job->i0, j0,
+        job->i1, j1, job->cutoff, job->mask);
+}
+
+
+/**
+ * @brief Dynamic hot pixel mask (see maskDynamicHotPixelsScalar()) using the
+ * widest kernel the CPU supports, with bands of rows split across the thread
+ * pool.
+ *
+ * @return int number of hot pixels found
+ */
+int maskDynamicHotPixels(const uint16_t* image, uint32_t width, int i0, int j0,
+    int i1, int j1, int cutoff, uint8_t* mask)
+{
+    static int (*fast_kernel)(const uint16_t*, uint32_t, int, int, int, int,
+        int, uint8_t*) = NULL;
+    if ((i1 <= i0) || (j1 <= j0)) {
+        return 0;
+    }
+    if (fast_kernel == NULL) {
+        fast_kernel = maskDynamicHotPixelsScalar;
+#ifdef HOTPIX_HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            fast_kernel = maskDynamicHotPixelsAvx2;
+        }
+#endif
+    }
+
+    int num_bands = (j1 - j0 + HOT_PIXEL_SCAN_ROWS - 1) / HOT_PIXEL_SCAN_ROWS;
+    int band_hot[num_bands];
+    struct dynamic_hot_pixel_job_t job = {
+        .kernel = fast_kernel,
+        .image = image,
+        .width = width,
+        .i0 = i0, .j0 = j0, .i1 = i1, .j1 = j1,
+        .cutoff = cutoff,
+        .mask = mask,
+        .band_hot = band_hot,
+    };
+    parallelFor(num_bands, maskDynamicHotPixelBand, &job);
+
+    int nhp = 0;
+    for (int b = 0; b < num_bands; b++) {
+        nhp += band_hot[b];
+    }
+    return nhp;
+}
+
+
+// one compare-exchange of the median-of-9 network in medianOf9()
+#define SORT2(a, b) { uint16_t lo = (a < b) ? a : b; b = (a < b) ? b : a; \
+    a = lo; }
+
+
+/**
+ * @brief Median of 9 values with a 19 step compare-exchange network (Paeth),
+ * which maps directly onto vector min and max.
+ */
+static inline uint16_t medianOf9(uint16_t p0, uint16_t p1, uint16_t p2,
+    uint16_t p3, uint16_t p4, uint16_t p5, uint16_t p6, uint16_t p7,
+    uint16_t p8)
+{
+    SORT2(p1, p2); SORT2(p4, p5); SORT2(p7, p8);
+    SORT2(p0, p1); SORT2(p3, p4); SORT2(p6, p7);
+    SORT2(p1, p2); SORT2(p4, p5); SORT2(p7, p8);
+    SORT2(p0, p3); SORT2(p5, p8); SORT2(p4, p7);
+    SORT2(p3, p6); SORT2(p1, p4); SORT2(p2, p5);
+    SORT2(p4, p7); SORT2(p4, p2); SORT2(p6, p4);
+    SORT2(p4, p2);
+    return p4;
+}
+#undef SORT2
+
+
+/**
+ * @brief Unmask cosmic ray hits in [i0, i1) x [j0, j1), which must lie at
+ * least 2 pixels inside the image. With L the Laplacian (v minus the mean of
+ * its 4 edge neighbours), M the median of its 3 x 3 neighbourhood and S the
+ * lowest of the 4 pixels 2 px out along the rows and columns, a pixel v is a
+ * hit when
+ *
+ *     L > 0,   L^2 > sigma^2 * 1.25 (rn^2 + M / gain),   L > objlim (M - S)
+ *
+ * 1.25 being the variance of L relative to one pixel's. M - S is the fine
+ * structure: a star's PSF lifts the median of its core well above the sky,
+ * while a single pixel hit or a track (at most 3 or 4 of the 9 pixels) leaves
+ * it at the sky level.
+ *
+ * @param sigma detection threshold in units of the pixel noise
+ * @param mask hits are set to 0, other pixels left as they are
+ * @return int number of hits found
+ */
+int maskCosmicRaysScalar(const uint16_t* image, uint32_t width, int i0,
+    int j0, int i1, int j1, float sigma, uint8_t* mask)
+{
+    const float k2 = 1.25f * sigma * sigma;
+    const float rn2 = COSMIC_RAY_READ_NOISE * COSMIC_RAY_READ_NOISE;
+    const float inv_gain = 1.0f / COSMIC_RAY_GAIN;
+    int hits = 0;
+
+    for (int j = j0; j < j1; j++) {
+        const uint16_t* above2 = image + (j - 2) * width;
+        const uint16_t* above = image + (j - 1) * width;
+        const uint16_t* row = image + j * width;
+        const uint16_t* below = image + (j + 1) * width;
+        const uint16_t* below2 = image + (j + 2) * width;
+        uint8_t* pMask = mask + j * width;
+
+        for (int i = i0; i < i1; i++) {
+            uint16_t median = medianOf9(above[i - 1], above[i], above[i + 1],
+                row[i - 1], row[i], row[i + 1], below[i - 1], below[i],
+                below[i + 1]);
+            uint16_t sky = row[i - 2];
+            sky = (row[i + 2] < sky) ? row[i + 2] : sky;
+            sky = (above2[i] < sky) ? above2[i] : sky;
+            sky = (below2[i] < sky) ? below2[i] : sky;
+
+            float l = (float)row[i] - 0.25f * (float)(row[i - 1] +
+                row[i + 1] + above[i] + below[i]);
+            float t = k2 * (rn2 + (float)median * inv_gain);
+            float f = (float)median - (float)sky;
+
+            if ((l > 0.0f) & (l * l > t) & (l > COSMIC_RAY_OBJLIM * f)) {
+                pMask[i] = 0;
+                hits++;
+            }
+        }
+    }
+    return hits;
+}
+
+
+#ifdef HOTPIX_HAVE_X86_KERNELS
+/**
+ * @brief AVX2 version of maskCosmicRaysScalar(), 8 pixels per step: the
+ * median network runs on 16-bit lanes, the rest in float, with the same
+ * operations in the same order so both find the same hits.
+ */
+__attribute__((target("avx2")))
+int maskCosmicRaysAvx2(const uint16_t* image, uint32_t width, int i0,
+    int j0, int i1, int j1, float sigma, uint8_t* mask)
+{
+    const __m256 k2 = _mm256_set1_ps(1.25f * sigma * sigma);
+    const __m256 rn2 = _mm256_set1_ps(COSMIC_RAY_READ_NOISE *
+        COSMIC_RAY_READ_NOISE);
+    const __m256 inv_gain = _mm256_set1_ps(1.0f / COSMIC_RAY_GAIN);
+    const __m256 objlim = _mm256_set1_ps(COSMIC_RAY_OBJLIM);
+    const __m256 quarter = _mm256_set1_ps(0.25f);
+    const __m256 zero = _mm256_setzero_ps();
+    int hits = 0;
+
+    for (int j = j0; j < j1; j++) {
+        const uint16_t* above2 = image + (j - 2) * width;
+        const uint16_t* above = image + (j - 1) * width;
+        const uint16_t* row = image + j * width;
+        const uint16_t* below = image + (j + 1) * width;
+        const uint16_t* below2 = image + (j + 2) * width;
+        uint8_t* pMask = mask + j * width;
+        int i = i0;
+
+#define LOAD8(p) _mm_loadu_si128((const __m128i*)(p))
+#define WIDEN(x) _mm256_cvtepu16_epi32(x)
+#define SORT2(a, b) { __m128i lo = _mm_min_epu16(a, b); \
+            b = _mm_max_epu16(a, b); a = lo; }
+        for (; i + 8 <= i1; i += 8) {
+            __m128i p0 = LOAD8(above + i - 1), p1 = LOAD8(above + i);
+            __m128i p2 = LOAD8(above + i + 1), p3 = LOAD8(row + i - 1);
+            __m128i p4 = LOAD8(row + i), p5 = LOAD8(row + i + 1);
+            __m128i p6 = LOAD8(below + i - 1), p7 = LOAD8(below + i);
+            __m128i p8 = LOAD8(below + i + 1);
+            __m128i v = p4;
+            __m256i edges = _mm256_add_epi32(
+                _mm256_add_epi32(WIDEN(p3), WIDEN(p5)),
+                _mm256_add_epi32(WIDEN(p1), WIDEN(p7)));
+            __m128i sky = _mm_min_epu16(
+                _mm_min_epu16(LOAD8(row + i - 2), LOAD8(row + i + 2)),
+                _mm_min_epu16(LOAD8(above2 + i), LOAD8(below2 + i)));
+
+            SORT2(p1, p2); SORT2(p4, p5); SORT2(p7, p8);
+            SORT2(p0, p1); SORT2(p3, p4); SORT2(p6, p7);
+            SORT2(p1, p2); SORT2(p4, p5); SORT2(p7, p8);
+            SORT2(p0, p3); SORT2(p5, p8); SORT2(p4, p7);
+            SORT2(p3, p6); SORT2(p1, p4); SORT2(p2, p5);
+            SORT2(p4, p7); SORT2(p4, p2); SORT2(p6, p4);
+            SORT2(p4, p2);
+            __m256 median = _mm256_cvtepi32_ps(WIDEN(p4));
+
+            __m256 l = _mm256_sub_ps(_mm256_cvtepi32_ps(WIDEN(v)),
+                _mm256_mul_ps(quarter, _mm256_cvtepi32_ps(edges)));
+            __m256 t = _mm256_mul_ps(k2, _mm256_add_ps(rn2,
+                _mm256_mul_ps(median, inv_gain)));
+            __m256 f = _mm256_sub_ps(median,
+                _mm256_cvtepi32_ps(WIDEN(sky)));
+            __m256 hit = _mm256_and_ps(_mm256_and_ps(
+                _mm256_cmp_ps(l, zero, _CMP_GT_OQ),
+                _mm256_cmp_ps(_mm256_mul_ps(l, l), t, _CMP_GT_OQ)),
+                _mm256_cmp_ps(l, _mm256_mul_ps(objlim, f), _CMP_GT_OQ));
+
+            // hits are rare: clear them one by one
+            unsigned bits = (unsigned)_mm256_movemask_ps(hit);
+            hits += __builtin_popcount(bits);
+            while (bits) {
+                pMask[i + __builtin_ctz(bits)] = 0;
+                bits &= bits - 1;
+            }
+        }
+#undef SORT2
+#undef WIDEN
+#undef LOAD8
+        if (i < i1) {
+            hits += maskCosmicRaysScalar(image, width, i, j, i1, j + 1,
+                sigma, mask);
+        }
+    }
+    return hits;
+}
+#endif
+
+
+struct cosmic_ray_job_t {
+    int (*kernel)(const uint16_t*, uint32_t, int, int, int, int, float,
+        uint8_t*);
+    const uint16_t* image;
+    uint32_t width;
+    int i0, j0, i1, j1;
+    float sigma;
+    uint8_t* mask;
+    int* band_hits;
+};
+
+
+static void maskCosmicRayBand(void* arg, int band)
+{
+    struct cosmic_ray_job_t* job = (struct cosmic_ray_job_t*)arg;
+    int j0 = job->j0 + band * HOT_PIXEL_SCAN_ROWS;
+    int j1 = j0 + HOT_PIXEL_SCAN_ROWS;
+    if (j1 > job->j1) {
+        j1 = job->j1;
+    }
+    job->band_hits[band] = job->kernel(job->image, job->width, job->i0, j0,
+        job->i1, j1, job->sigma, job->mask);
+}
+
+
+/**
+ * @brief Cosmic ray rejection (see maskCosmicRaysScalar()) over the same
+ * bands of rows as maskDynamicHotPixels(), using the widest kernel the CPU
+ * supports.
+ *
+ * @return int number of hits masked
+ */
+int maskCosmicRays(const uint16_t* image, uint32_t width, int i0, int j0,
+    int i1, int j1, float sigma, uint8_t* mask)
+{
+    static int (*fast_kernel)(const uint16_t*, uint32_t, int, int, int, int,
+        float, uint8_t*) = NULL;
+    if ((i1 <= i0) || (j1 <= j0) || (sigma <= 0.0f)) {
+        return 0;
+    }
+    if (fast_kernel == NULL) {
+        fast_kernel = maskCosmicRaysScalar;
+#ifdef HOTPIX_HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            fast_kernel = maskCosmicRaysAvx2;
+        }
+#endif
+    }
+
+    int num_bands = (j1 - j0 + HOT_PIXEL_SCAN_ROWS - 1) / HOT_PIXEL_SCAN_ROWS;
+    int band_hits[num_bands];
+    struct cosmic_ray_job_t job = {
+        .kernel = fast_kernel,
+        .image = image,
+        .width = width,
+        .i0 = i0, .j0 = j0, .i1 = i1, .j1 = j1,
+        .sigma = sigma,
+        .mask = mask,
+        .band_hits = band_hits,
+    };
+    parallelFor(num_bands, maskCosmicRayBand, &job);
+
+    int hits = 0;
+    for (int b = 0; b < num_bands; b++) {
+        hits += band_hits[b];
+    }
+    return hits;
+}
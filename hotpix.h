@@ -0,0 +1,71 @@
+#ifndef HOTPIX_H
+#define HOTPIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Static hot pixel map file: this header, then `count` pixel indices
+** (row * width + column, image memory order), sorted ascending. */
+#define HOT_PIXEL_MAP_MAGIC "BCHPMAP1"
+#define HOT_PIXEL_MAP_VERSION 1
+
+struct hot_pixel_map_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;  // sensor geometry the map was made for [px]
+    uint32_t height;
+    uint32_t count;  // number of hot pixels following the header
+};
+
+/* A loaded map. indices points into a read-only mapping of the file. */
+struct hot_pixel_map_t {
+    const uint32_t* indices;
+    uint32_t count;
+    void* mapping;
+    size_t mapping_size;
+};
+
+int loadHotPixelMap(const char* path, uint32_t width, uint32_t height,
+    struct hot_pixel_map_t* pMap);
+void unloadHotPixelMap(struct hot_pixel_map_t* pMap);
+int writeHotPixelMap(const char* path, const uint32_t* indices, uint32_t count,
+    uint32_t width, uint32_t height);
+int convertHotPixelText(const char* text_path, const char* map_path,
+    uint32_t width, uint32_t height);
+int findHotPixels(const uint16_t* image, uint32_t width, uint32_t height,
+    uint16_t threshold, uint32_t** pIndices, uint32_t* pCount);
+void applyHotPixelMap(const struct hot_pixel_map_t* pMap, uint32_t width,
+    uint8_t* mask, int i0, int j0, int i1, int j1);
+int maskDynamicHotPixels(const uint16_t* image, uint32_t width, int i0, int j0,
+    int i1, int j1, int cutoff, uint8_t* mask);
+
+// Individual dynamic hot pixel kernels, exposed for testing and benchmarking.
+// Up to this cutoff, (a + 1) * cutoff fits 32-bit products for any 16-bit
+// pixel values
+#define HOTPIX_MAX_INT32_CUTOFF 8191
+int maskDynamicHotPixelsScalar(const uint16_t* image, uint32_t width, int i0,
+    int j0, int i1, int j1, int cutoff, uint8_t* mask);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HOTPIX_HAVE_X86_KERNELS
+int maskDynamicHotPixelsAvx2(const uint16_t* image, uint32_t width, int i0,
+    int j0, int i1, int j1, int cutoff, uint8_t* mask);
+#endif
+
+/* Cosmic ray rejection (maskCosmicRays()). A hit is a pixel whose Laplacian
+** exceeds sigma times its noise, and COSMIC_RAY_OBJLIM times the fine
+** structure around it, which stays large for stars however sharp their core.
+** The noise model is read noise plus shot noise of the local level, in ADU. */
+#define COSMIC_RAY_OBJLIM 3.0f
+#define COSMIC_RAY_GAIN 2.4f        // [e-/ADU]
+#define COSMIC_RAY_READ_NOISE 1.0f  // [ADU]
+
+int maskCosmicRays(const uint16_t* image, uint32_t width, int i0, int j0,
+    int i1, int j1, float sigma, uint8_t* mask);
+int maskCosmicRaysScalar(const uint16_t* image, uint32_t width, int i0,
+    int j0, int i1, int j1, float sigma, uint8_t* mask);
+#ifdef HOTPIX_HAVE_X86_KERNELS
+int maskCosmicRaysAvx2(const uint16_t* image, uint32_t width, int i0,
+    int j0, int i1, int j1, float sigma, uint8_t* mask);
+#endif
+
+#endif
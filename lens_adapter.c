@@ -67,6 +67,7 @@
 
 #include "lens_adapter.h"
 #include "camera.h"
+#include "camera_backend.h"
 #include "commands.h"
 #include "matrix.h"
 
@@ -683,14 +684,14 @@ int adjustCameraHardware() {
         // change boolean to 0 so exposure isn't adjusted again until user sends
         //  another command
         all_camera_params.change_exposure_bool = 0;
-        ret = setExposureTime(all_camera_params.exposure_time);
+        ret = camera_backend->setExposureTime(all_camera_params.exposure_time);
     }
 
     if (all_camera_params.change_gainfact_bool) {
         // change boolean to 0 so gain isn't adjusted again until user sends
         // another command
         all_camera_params.change_gainfact_bool = 0;
-        ret = setMonoAnalogGain(all_camera_params.gainfact);
+        ret = camera_backend->setGain(all_camera_params.gainfact);
     }
 
     return ret;
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "pipeline.h"
+#include "camera.h"
+#include "commands.h"
+
+
+/* One pipeline stage: a thread that pops a frame, works on it, and hands it on */
+struct pipeline_stage_t {
+    const char* name;
+    int (*process)(struct frame_t* frame);
+    struct frame_queue_t* in;  // NULL: take new frames from the frame pool
+    struct frame_queue_t* out; // NULL: release frames back to the pool
+    // drop a frame the stage failed on instead of passing it on
+    int release_on_fail;
+    struct stage_stats_t stats;
+    pthread_mutex_t stats_lock;
+    pthread_t thread;
+};
+
+enum pipelineStage_t {
+    STAGE_ACQUIRE,
+    STAGE_DETECT,
+    STAGE_SOLVE,
+    STAGE_ARCHIVE,
+    NUM_STAGES
+};
+
+static struct frame_queue_t detect_queue;
+static struct frame_queue_t solve_queue;
+static struct frame_queue_t archive_queue;
+static struct pipeline_stage_t stages[NUM_STAGES];
+static uint64_t next_frame_id = 0;
+// set to stop the pipeline without shutting down the program
+static volatile int pipeline_stopping = 0;
+
+
+static double elapsedSec(struct timespec* t0, struct timespec* t1)
+{
+    return ((double)t1->tv_sec + 1.0e-9*t1->tv_nsec) -
+        ((double)t0->tv_sec + 1.0e-9*t0->tv_nsec);
+}
+
+
+static void frameQueueInit(struct frame_queue_t* queue, int capacity)
+{
+    memset(queue, 0, sizeof(struct frame_queue_t));
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+}
+
+
+static void frameQueueDestroy(struct frame_queue_t* queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+
+/**
+ * @brief Append a frame, blocking while the queue is full.
+ */
+static void frameQueuePush(struct frame_queue_t* queue, struct frame_t* frame)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count >= queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = frame;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+/**
+ * @brief Remove the oldest frame, blocking while the queue is empty.
+ *
+ * @return struct frame_t* NULL once the queue is closed and drained
+ */
+static struct frame_t* frameQueuePop(struct frame_queue_t* queue)
+{
+    struct frame_t* frame = NULL;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count > 0) {
+        frame = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return frame;
+}
+
+
+static void frameQueueClose(struct frame_queue_t* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+static int frameQueueDepth(struct frame_queue_t* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    int depth = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return depth;
+}
+
+
+/**
+ * @brief Acquisition stage wrapper. In auto-trigger mode, paces exposures so
+ * that they start no more often than PIPELINE_AUTO_TRIGGER_PERIOD_S.
+ */
+static int acquireStage(struct frame_t* frame)
+{
+    static struct timespec last_start = {0, 0};
+    struct timespec now = {0, 0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double paced_s = 0.0;
+    if (all_trigger_params.trigger_mode == 0 && last_start.tv_sec != 0) {
+        paced_s = PIPELINE_AUTO_TRIGGER_PERIOD_S - elapsedSec(&last_start, &now);
+        if (paced_s > 0.0) {
+            usleep((useconds_t)(paced_s * 1e6));
+        } else {
+            paced_s = 0.0;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &last_start);
+
+    frame->frame_id = next_frame_id++;
+    int ret = acquireFrame(frame);
+    // Waiting on the clock counts as waiting for input, not as work
+    frame->trigger_wait_s += paced_s;
+    return ret;
+}
+
+
+static void* stageThread(void* arg)
+{
+    struct pipeline_stage_t* stage = (struct pipeline_stage_t*)arg;
+    struct timespec t_wait = {0, 0};
+    struct timespec t_got = {0, 0};
+    struct timespec t_done = {0, 0};
+    struct timespec t_sent = {0, 0};
+
+    while (1) {
+        // Only the acquisition stage originates frames; stop making new ones
+        // on shutdown and let the rest of the pipeline drain.
+        if (stage->in == NULL && (shutting_down || pipeline_stopping)) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t_wait);
+        struct frame_t* frame = (stage->in == NULL) ? frameGet() :
+            frameQueuePop(stage->in);
+        if (frame == NULL) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t_got);
+
+        frame->trigger_wait_s = 0.0;
+        int ret = stage->process(frame);
+        clock_gettime(CLOCK_MONOTONIC, &t_done);
+        double trigger_wait_s = frame->trigger_wait_s;
+
+        if ((stage->out == NULL) || ((ret < 0) && stage->release_on_fail)) {
+            frameRelease(frame);
+        } else {
+            frameQueuePush(stage->out, frame);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t_sent);
+
+        pthread_mutex_lock(&stage->stats_lock);
+        stage->stats.frames++;
+        stage->stats.busy_s += elapsedSec(&t_got, &t_done) - trigger_wait_s;
+        stage->stats.starved_s += elapsedSec(&t_wait, &t_got) + trigger_wait_s;
+        stage->stats.blocked_s += elapsedSec(&t_done, &t_sent);
+        pthread_mutex_unlock(&stage->stats_lock);
+    }
+
+    if (stage->out != NULL) {
+        frameQueueClose(stage->out);
+    }
+    if (verbose) {
+        printf("Pipeline stage %s exiting.\n", stage->name);
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Read the peak and current resident set size of this process.
+ *
+ * @param pPeakKb VmHWM [kB]
+ * @param pCurrentKb VmRSS [kB]
+ * @return int -1 if failed, 0 otherwise
+ */
+int getResidentSetKb(long* pPeakKb, long* pCurrentKb)
+{
+    char line[256];
+    int found = 0;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        found += (sscanf(line, "VmHWM: %ld kB", pPeakKb) == 1);
+        found += (sscanf(line, "VmRSS: %ld kB", pCurrentKb) == 1);
+    }
+    fclose(f);
+    return (found == 2) ? 0 : -1;
+}
+
+
+/**
+ * @brief Print the fraction of wall time each stage spent working, waiting
+ * for input, and waiting on the next stage, then reset the counters. The
+ * stage with the highest busy fraction is the one limiting the solve cadence.
+ *
+ * @param window_s wall time covered by the counters
+ */
+static void reportStageOccupancy(double window_s)
+{
+    struct frame_queue_t* queues[NUM_STAGES] = {
+        NULL, &detect_queue, &solve_queue, &archive_queue
+    };
+    int bottleneck = 0;
+    double max_busy = -1.0;
+
+    printf("\n+---------------------------------------------------------+\n");
+    printf("|\t\tPipeline stage occupancy\t\t  |\n");
+    printf("|---------------------------------------------------------|\n");
+    for (int i = 0; i < NUM_STAGES; i++) {
+        pthread_mutex_lock(&stages[i].stats_lock);
+        struct stage_stats_t stats = stages[i].stats;
+        memset(&stages[i].stats, 0, sizeof(struct stage_stats_t));
+        pthread_mutex_unlock(&stages[i].stats_lock);
+
+        double avg_ms = (stats.frames > 0) ?
+            1000.0 * stats.busy_s / stats.frames : 0.0;
+        printf("|  %-8s %4" PRIu64 " fr  busy %5.1f%%  starved %5.1f%%  "
+            "blocked %5.1f%%  avg %8.1f ms  in-queue %d\n", stages[i].name,
+            stats.frames, 100.0 * stats.busy_s / window_s,
+            100.0 * stats.starved_s / window_s,
+            100.0 * stats.blocked_s / window_s, avg_ms,
+            (queues[i] != NULL) ? frameQueueDepth(queues[i]) : 0);
+        if (stats.busy_s > max_busy) {
+            max_busy = stats.busy_s;
+            bottleneck = i;
+        }
+    }
+    printf("|---------------------------------------------------------|\n");
+    printf("|\tBottleneck stage: %s\t\t\t\t  |\n", stages[bottleneck].name);
+    static uint64_t last_incomplete = 0;
+    uint32_t most_awaiting = __atomic_exchange_n(&max_buffers_awaiting, 0,
+        __ATOMIC_RELAXED);
+    uint64_t incomplete = __atomic_load_n(&frames_incomplete, __ATOMIC_RELAXED);
+    if (most_awaiting > 0 || incomplete > 0) {
+        printf("|\tMost buffers awaiting delivery: %-3u incomplete: %-6" PRIu64
+            "|\n", most_awaiting, incomplete - last_incomplete);
+        last_incomplete = incomplete;
+    }
+    if (all_trigger_params.trigger_mode == 2) {
+        static uint64_t last_dropped = 0;
+        uint64_t dropped = __atomic_load_n(&frames_dropped, __ATOMIC_RELAXED);
+        printf("|\tStale frames dropped: %-8" PRIu64 "\t\t\t  |\n",
+            dropped - last_dropped);
+        last_dropped = dropped;
+    }
+    if (cosmic_ray_sigma > 0.0f) {
+        static uint64_t last_cosmic_ray_hits = 0;
+        uint64_t hits = __atomic_load_n(&cosmic_ray_hits, __ATOMIC_RELAXED);
+        printf("|\tCosmic ray hits masked: %-8" PRIu64 "\t\t\t  |\n",
+            hits - last_cosmic_ray_hits);
+        last_cosmic_ray_hits = hits;
+    }
+    long peak_kb, current_kb;
+    if (getResidentSetKb(&peak_kb, &current_kb) == 0) {
+        printf("|\tResident memory: %6ld MB (peak %6ld MB)\t\t  |\n",
+            current_kb / 1024, peak_kb / 1024);
+    }
+    printf("+---------------------------------------------------------+\n\n");
+}
+
+
+/**
+ * @brief Run the capture/solve loop as four concurrent stages (acquire,
+ * detect, solve, archive) joined by bounded queues, so the camera exposes the
+ * next frame while earlier ones are still being processed. Blocks until
+ * shutdown, then drains in-flight frames.
+ *
+ * @return int -1 if the pipeline could not be started, 0 otherwise
+ */
+int runPipeline(void)
+{
+    pipeline_stopping = 0;
+    frameQueueInit(&detect_queue, PIPELINE_QUEUE_DEPTH);
+    frameQueueInit(&solve_queue, PIPELINE_QUEUE_DEPTH);
+    frameQueueInit(&archive_queue, PIPELINE_QUEUE_DEPTH);
+
+    struct pipeline_stage_t stage_defs[NUM_STAGES] = {
+        {.name = "acquire", .process = acquireStage, .in = NULL,
+         .out = &detect_queue, .release_on_fail = 1},
+        {.name = "detect", .process = detectFrame, .in = &detect_queue,
+         .out = &solve_queue, .release_on_fail = 0},
+        {.name = "solve", .process = solveFrame, .in = &solve_queue,
+         .out = &archive_queue, .release_on_fail = 0},
+        {.name = "archive", .process = archiveFrame, .in = &archive_queue,
+         .out = NULL, .release_on_fail = 0},
+    };
+
+    int num_started = 0;
+    for (num_started = 0; num_started < NUM_STAGES; num_started++) {
+        stages[num_started] = stage_defs[num_started];
+        pthread_mutex_init(&stages[num_started].stats_lock, NULL);
+        if (pthread_create(&stages[num_started].thread, NULL, stageThread,
+            (void*)&stages[num_started]) != 0) {
+            fprintf(stderr, "runPipeline: Error creating %s stage thread: "
+                "%s.\n", stages[num_started].name, strerror(errno));
+            pipeline_stopping = 1;
+            break;
+        }
+    }
+
+    struct timespec t_report = {0, 0};
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &t_report);
+    while (!shutting_down && !pipeline_stopping) {
+        usleep(100000);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double window_s = elapsedSec(&t_report, &now);
+        if (window_s >= PIPELINE_REPORT_PERIOD_S) {
+            reportStageOccupancy(window_s);
+            t_report = now;
+        }
+    }
+
+    // wake the acquisition stage if it is waiting for a free frame
+    closeFramePool();
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(stages[i].thread, NULL);
+        pthread_mutex_destroy(&stages[i].stats_lock);
+    }
+
+    // return frames stranded in front of stages that never started
+    struct frame_queue_t* queues[] = {&detect_queue, &solve_queue,
+        &archive_queue};
+    for (int i = 0; i < (int)(sizeof(queues) / sizeof(queues[0])); i++) {
+        struct frame_t* frame = NULL;
+        frameQueueClose(queues[i]);
+        while ((frame = frameQueuePop(queues[i])) != NULL) {
+            frameRelease(frame);
+        }
+    }
+    if (!shutting_down) {
+        openFramePool();
+    }
+
+    frameQueueDestroy(&detect_queue);
+    frameQueueDestroy(&solve_queue);
+    frameQueueDestroy(&archive_queue);
+    return (num_started == NUM_STAGES) ? 0 : -1;
+}
@@ -0,0 +1,41 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "frame_pool.h"
+
+// Max frames waiting between two adjacent stages
+#define PIPELINE_QUEUE_DEPTH 2
+// How often to print per-stage occupancy
+#define PIPELINE_REPORT_PERIOD_S 30.0
+// In auto-trigger mode, minimum time between the start of two exposures. This
+// replaces the fixed sleep between serial rounds in updateAstrometry().
+#define PIPELINE_AUTO_TRIGGER_PERIOD_S 1.0
+
+/* Bounded, blocking FIFO of frames joining two stages */
+struct frame_queue_t {
+    struct frame_t* items[PIPELINE_QUEUE_DEPTH];
+    int capacity;
+    int head;
+    int count;
+    int closed; // no more pushes expected; pops drain then return NULL
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+/* Timing counters for one stage, reset after every report */
+struct stage_stats_t {
+    uint64_t frames;
+    double busy_s;    // time spent in the stage function
+    double starved_s; // time waiting for input
+    double blocked_s; // time waiting for room downstream
+};
+
+int runPipeline(void);
+int getResidentSetKb(long* pPeakKb, long* pCurrentKb);
+
+#endif
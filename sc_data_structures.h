@@ -16,6 +16,8 @@
 #define FC1_IP_ADDR "127.0.0.1"
 #endif
 #define FC2_IP_ADDR "192.168.1.4"
+// stars of the last tracking frame sent in each astrometry packet
+#define MCP_TRACKED_STARS 8
 
 
 struct socket_errors {
@@ -45,6 +47,13 @@ struct mcp_astrometry {
     double az;
     double photo_time;
     unsigned int numBlobsFound; // number of blobs found in image
+    double trigger_time; // arrival of the trigger packet, 0 if not triggered
+    double trigger_latency; // [s] trigger arrival to start of exposure
+    unsigned int cosmicRayHits; // cosmic ray hits masked in image
+    double trackTime; // photo_time of the last tracking frame, 0 if none
+    unsigned int numTracked; // stars tracked in that frame
+    double trackX[MCP_TRACKED_STARS]; // their centroids [px], brightest first
+    double trackY[MCP_TRACKED_STARS];
 };
 
 struct comms_data {
@@ -130,9 +139,9 @@ struct star_cam_capture {
     // min. pixel spacing between stars [px]
     // float deltaFocus; // how far to move the focus from current pos (maybe)
     int update_trigger_mode;
-    int trigger_mode; // 0 for auto, 1 for software triggered
+    int trigger_mode; // 0 for auto, 1 for software triggered, 2 for free-run
     int update_trigger_timeout_us;
-    int trigger_timeout_us; // timeout between trigger checks in µs default 100
+    int trigger_timeout_us; // unused: triggers wake the camera thread directly
 };
 
 struct star_cam_return {
@@ -158,8 +167,8 @@ struct star_cam_return {
     int makeHP; // set to 20 to do it, makes a new static hot pixel map
     int useHP; // use the hot pixel map to mask bad pixels
     float blobParams[9]; // blobfinding parameters...
-    int trigger_mode; // 0 for auto, 1 for software triggered
-    int trigger_timeout_us; // timeout between trigger checks in µs default 100
+    int trigger_mode; // 0 for auto, 1 for software triggered, 2 for free-run
+    int trigger_timeout_us; // unused: triggers wake the camera thread directly
 };
 
 struct socket_data {
@@ -461,7 +461,7 @@ void *listen_thread(void *args){
 void process_trigger_packet(struct star_cam_trigger data){
     if (data.incharge == 1)
     {
-        all_trigger_params.trigger = data.trigger; // set the trigger value to the packet trigger value
+        setTrigger(data.trigger); // set the trigger value to the packet trigger value and wake the capture
     }
     else
     {
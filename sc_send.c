@@ -33,6 +33,13 @@ static int populate_astrometry_packet(struct mcp_astrometry * packet_data) {
     packet_data->ra_observed = all_astro_params.ra;
     packet_data->rawtime = all_astro_params.rawtime;
     packet_data->numBlobsFound = all_astro_params.numBlobsFound;
+    packet_data->trigger_time = all_trigger_params.trigger_time;
+    packet_data->trigger_latency = all_trigger_params.trigger_latency;
+    packet_data->cosmicRayHits = solved_cosmic_ray_hits;
+    packet_data->numTracked = getTrackedStars(&packet_data->trackTime, 
+                                              packet_data->trackX, 
+                                              packet_data->trackY, 
+                                              MCP_TRACKED_STARS);
     return 1;
 }
 
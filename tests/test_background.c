@@ -0,0 +1,200 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../background.h"
+#include "../convolve.h"
+#include "../threadpool.h"
+
+#define IMAGE_WIDTH 2048
+#define IMAGE_HEIGHT 1536
+#define IMAGE_NUM_PX (IMAGE_WIDTH * IMAGE_HEIGHT)
+#define TILE_SIZE 128
+#define NUM_STARS 300
+
+uint16_t image[IMAGE_NUM_PX] = {0};
+uint8_t mask[IMAGE_NUM_PX] = {0};
+float filtered[IMAGE_NUM_PX] = {0};
+double row[IMAGE_WIDTH] = {0};
+
+
+/**
+ * @brief The sky: a gradient with some curvature, like scattered light.
+ */
+double sky(int i, int j)
+{
+    double x = (double)i / IMAGE_WIDTH;
+    double y = (double)j / IMAGE_HEIGHT;
+    return 600.0 + 150.0*x + 80.0*y + 60.0*x*x - 40.0*x*y;
+}
+
+
+/**
+ * @brief Sky plus read noise of about 10 ADU, a field of stars, and a
+ * masked block large enough to leave whole tiles without pixels.
+ */
+void reset(void)
+{
+    srand(42);
+    for (int j = 0; j < IMAGE_HEIGHT; j++) {
+        for (int i = 0; i < IMAGE_WIDTH; i++) {
+            double noise = 0.0;
+            for (int k = 0; k < 4; k++) {
+                noise += (rand() & 0xFF) - 127.5;
+            }
+            image[j*IMAGE_WIDTH + i] = (uint16_t)(sky(i, j) + noise / 14.8);
+            mask[j*IMAGE_WIDTH + i] = 1;
+        }
+    }
+    for (int s = 0; s < NUM_STARS; s++) {
+        int xc = rand() % IMAGE_WIDTH;
+        int yc = rand() % IMAGE_HEIGHT;
+        for (int j = yc - 6; j <= yc + 6; j++) {
+            for (int i = xc - 6; i <= xc + 6; i++) {
+                if ((i < 0) || (i >= IMAGE_WIDTH) || (j < 0) ||
+                    (j >= IMAGE_HEIGHT)) {
+                    continue;
+                }
+                double r2 = (i - xc)*(i - xc) + (j - yc)*(j - yc);
+                double v = image[j*IMAGE_WIDTH + i] + 3000.0*exp(-r2 / 8.0);
+                image[j*IMAGE_WIDTH + i] = (v > 65535.0) ? 65535 : (uint16_t)v;
+            }
+        }
+    }
+    for (int j = 300; j < 700; j++) {
+        memset(mask + j*IMAGE_WIDTH + 900, 0, 400);
+    }
+}
+
+
+void test_estimateBackgroundMesh(void) {
+    printf("\ntest_estimateBackgroundMesh\n");
+    struct background_mesh_t mesh = {0};
+    int i0 = 0, j0 = 0, i1 = IMAGE_WIDTH, j1 = IMAGE_HEIGHT;
+
+    assert(estimateBackgroundMesh(image, mask, IMAGE_WIDTH, i0, j0, i1, j1,
+        TILE_SIZE, &mesh) == 0);
+    assert(mesh.nx == IMAGE_WIDTH / TILE_SIZE);
+    assert(mesh.ny == IMAGE_HEIGHT / TILE_SIZE);
+
+    // stars and noise should not pull the background off the sky, including
+    // in the corners and under the masked block
+    double worst = 0.0;
+    for (int j = j0; j < j1; j++) {
+        backgroundMeshRow(&mesh, j, i0, i1, row);
+        for (int i = i0; i < i1; i++) {
+            double error = fabs(row[i] - sky(i, j));
+            if (error > worst) {
+                worst = error;
+            }
+        }
+    }
+    printf("largest background error %.2f ADU\n", worst);
+    assert(worst < 3.0);
+
+    // a sub-region clear of the masked block that the tile size does not
+    // divide, reusing the mesh
+    i0 = 37, j0 = 11, i1 = 880, j1 = 777;
+    assert(estimateBackgroundMesh(image, mask, IMAGE_WIDTH, i0, j0, i1, j1,
+        TILE_SIZE, &mesh) == 0);
+    assert(mesh.nx == 7);
+    assert(mesh.ny == 6);
+    worst = 0.0;
+    for (int j = j0; j < j1; j++) {
+        backgroundMeshRow(&mesh, j, i0, i1, row);
+        for (int i = i0; i < i1; i++) {
+            double error = fabs(row[i] - sky(i, j));
+            if (error > worst) {
+                worst = error;
+            }
+        }
+    }
+    printf("largest background error in sub-region %.2f ADU\n", worst);
+    assert(worst < 3.0);
+
+    // nothing to estimate from
+    memset(mask, 0, IMAGE_NUM_PX);
+    assert(estimateBackgroundMesh(image, mask, IMAGE_WIDTH, i0, j0, i1, j1,
+        TILE_SIZE, &mesh) < 0);
+    freeBackgroundMesh(&mesh);
+    assert(mesh.values == NULL);
+}
+
+
+void test_boxFilterImage_mesh(void) {
+    printf("\ntest_boxFilterImage_mesh\n");
+    struct background_mesh_t mesh = {0};
+    struct box_filter_stats_t stats;
+    int border = 5;
+
+    assert(estimateBackgroundMesh(image, mask, IMAGE_WIDTH, 0, 0, IMAGE_WIDTH,
+        IMAGE_HEIGHT, TILE_SIZE, &mesh) == 0);
+    assert(boxFilterImage(image, mask, IMAGE_WIDTH, 0, 0, IMAGE_WIDTH,
+        IMAGE_HEIGHT, 1, true, 0, &mesh, border, filtered, &stats) == 0);
+
+    // the filtered image is the smoothed image less the mesh background
+    double mean = stats.sum / stats.num_pix;
+    double sigma = sqrt(stats.sum_sq / stats.num_pix - mean*mean);
+    printf("background-subtracted mean %.3f, sigma %.3f\n", mean, sigma);
+    assert(fabs(mean) < 10.0);
+    assert(stats.sum_raw / stats.num_pix > 600.0);
+    int j = IMAGE_HEIGHT / 2;
+    backgroundMeshRow(&mesh, j, border, IMAGE_WIDTH - border, row);
+    for (int i = border; i < IMAGE_WIDTH - border; i++) {
+        double smooth = 0.0;
+        int n = 0;
+        for (int y = j - 1; y <= j + 1; y++) {
+            for (int x = i - 1; x <= i + 1; x++) {
+                smooth += mask[y*IMAGE_WIDTH + x] * image[y*IMAGE_WIDTH + x];
+                n += mask[y*IMAGE_WIDTH + x];
+            }
+        }
+        assert(fabs(filtered[j*IMAGE_WIDTH + i] - (smooth / n - row[i]))
+            < 1e-3);
+    }
+    freeBackgroundMesh(&mesh);
+}
+
+
+void test_perf(void) {
+    printf("\ntest_perf\n");
+    struct background_mesh_t mesh = {0};
+    struct box_filter_stats_t stats;
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    boxFilterImage(image, mask, IMAGE_WIDTH, 0, 0, IMAGE_WIDTH, IMAGE_HEIGHT,
+        1, true, 10, NULL, 11, filtered, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    printf("boxcar background took %.3f ms\n", 1e3 *
+        (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+         ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)));
+
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    estimateBackgroundMesh(image, mask, IMAGE_WIDTH, 0, 0, IMAGE_WIDTH,
+        IMAGE_HEIGHT, TILE_SIZE, &mesh);
+    boxFilterImage(image, mask, IMAGE_WIDTH, 0, 0, IMAGE_WIDTH, IMAGE_HEIGHT,
+        1, true, 0, &mesh, 1, filtered, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    printf("mesh background took %.3f ms\n", 1e3 *
+        (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+         ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)));
+    freeBackgroundMesh(&mesh);
+}
+
+
+int main(int argc, char* argv[]) {
+    initThreadPool(4);
+    reset();
+    test_boxFilterImage_mesh();
+    test_perf();
+    test_estimateBackgroundMesh();
+    closeThreadPool();
+    freeBoxFilterScratch();
+    return 0;
+}
@@ -0,0 +1,270 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../blob_index.h"
+
+#define IMAGE_WIDTH 5320
+#define IMAGE_HEIGHT 3032
+#define MAX_CANDIDATES 20000
+
+
+double cand_x[MAX_CANDIDATES], cand_y[MAX_CANDIDATES];
+double cand_mags[MAX_CANDIDATES];
+double ref_x[MAX_CANDIDATES], ref_y[MAX_CANDIDATES];
+double ref_mags[MAX_CANDIDATES];
+
+
+/**
+ * @brief Candidates at sub-pixel centroids, as findBlobs() makes them,
+ * clustered so that many fall within the spacing of another. About 1 in 10
+ * is bright enough for 4x the spacing.
+ */
+void makeCandidates(int n)
+{
+    for (int k = 0; k < n; k++) {
+        if ((k > 0) && (rand() % 3 == 0)) {
+            int m = rand() % k;
+            cand_x[k] = cand_x[m] + (rand() % 41) - 20;
+            cand_y[k] = cand_y[m] + (rand() % 41) - 20;
+        } else {
+            cand_x[k] = rand() % IMAGE_WIDTH + 0.125 * (rand() % 8);
+            cand_y[k] = rand() % IMAGE_HEIGHT + 0.125 * (rand() % 8);
+        }
+        cand_mags[k] = 100 * (rand() % 280);
+    }
+}
+
+
+/**
+ * @brief The spacing check findBlobs() had before the index, checking every
+ * blob kept so far.
+ */
+int referenceUnique(int n, int spacing0)
+{
+    int blob_count = 0;
+    for (int k = 0; k < n; k++) {
+        int unique = 1;
+        ref_x[blob_count] = cand_x[k];
+        ref_y[blob_count] = cand_y[k];
+        ref_mags[blob_count] = cand_mags[k];
+        int spacing = (ref_mags[blob_count] > 25400) ? 4*spacing0 : spacing0;
+        for (int ib = 0; ib < blob_count; ib++) {
+            if ((fabs(ref_x[blob_count] - ref_x[ib]) < spacing) &&
+                (fabs(ref_y[blob_count] - ref_y[ib]) < spacing)) {
+                unique = 0;
+                if (ref_mags[blob_count] > ref_mags[ib]) {
+                    ref_x[ib] = ref_x[blob_count];
+                    ref_y[ib] = ref_y[blob_count];
+                    ref_mags[ib] = ref_mags[blob_count];
+                }
+            }
+        }
+        if (unique) {
+            blob_count++;
+        }
+    }
+    return blob_count;
+}
+
+
+/**
+ * @brief The same check through the index, as findBlobs() now does it. The
+ * blobs are left in the index.
+ */
+int indexedUnique(struct blob_index_t * pIndex, int n, int spacing0)
+{
+    assert(resetBlobIndex(pIndex, IMAGE_WIDTH, IMAGE_HEIGHT, spacing0) == 0);
+    for (int k = 0; k < n; k++) {
+        int unique = 1;
+        int spacing = (cand_mags[k] > 25400) ? 4*spacing0 : spacing0;
+        const uint32_t * neighbours;
+        uint32_t num_neighbours = findNeighbours(pIndex, cand_x[k], cand_y[k],
+            spacing, &neighbours);
+        for (uint32_t m = 0; m < num_neighbours; m++) {
+            unique = 0;
+            if (cand_mags[k] > pIndex->mag[neighbours[m]]) {
+                replaceBlob(pIndex, neighbours[m], cand_x[k], cand_y[k],
+                    cand_mags[k]);
+            }
+        }
+        if (unique) {
+            int id = pIndex->count;
+            assert(insertBlob(pIndex, cand_x[k], cand_y[k], cand_mags[k]) ==
+                id);
+        }
+    }
+    return pIndex->count;
+}
+
+
+double elapsed(struct timespec * tstart, struct timespec * tend)
+{
+    return ((double)tend->tv_sec + 1.0e-9*tend->tv_nsec) -
+        ((double)tstart->tv_sec + 1.0e-9*tstart->tv_nsec);
+}
+
+
+void test_uniqueSpacing(void) {
+    printf("\ntest_uniqueSpacing\n");
+    struct blob_index_t index = {0};
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+    int spacings[] = {0, 1, 15, 40};
+    int sizes[] = {0, 1, 300, MAX_CANDIDATES};
+
+    srand(3);
+    for (int s = 0; s < 4; s++) {
+        for (int z = 0; z < 4; z++) {
+            makeCandidates(sizes[z]);
+            clock_gettime(CLOCK_MONOTONIC, &tstart);
+            int expected = referenceUnique(sizes[z], spacings[s]);
+            clock_gettime(CLOCK_MONOTONIC, &tend);
+            double dt_ref = elapsed(&tstart, &tend);
+            clock_gettime(CLOCK_MONOTONIC, &tstart);
+            int found = indexedUnique(&index, sizes[z], spacings[s]);
+            clock_gettime(CLOCK_MONOTONIC, &tend);
+            double dt = elapsed(&tstart, &tend);
+
+            assert(found == expected);
+            for (int k = 0; k < found; k++) {
+                assert(index.x[k] == ref_x[k]);
+                assert(index.y[k] == ref_y[k]);
+                assert(index.mag[k] == ref_mags[k]);
+            }
+            if (sizes[z] == MAX_CANDIDATES) {
+                printf("spacing %d: %d candidates -> %d blobs, %.3f ms "
+                    "(every blob: %.3f ms)\n", spacings[s], sizes[z], found,
+                    dt * 1e3, dt_ref * 1e3);
+            }
+        }
+    }
+    freeBlobIndex(&index);
+    assert(index.head == NULL);
+    printf("PASS\n");
+}
+
+
+void test_nearestBlob(void) {
+    printf("\ntest_nearestBlob\n");
+    struct blob_index_t index = {0};
+    int n = 2000;
+
+    srand(5);
+    makeCandidates(n);
+    assert(resetBlobIndex(&index, IMAGE_WIDTH, IMAGE_HEIGHT, 20) == 0);
+    assert(nearestBlob(&index, 100.0, 100.0, 50.0) == -1);
+    for (int k = 0; k < n; k++) {
+        assert(insertBlob(&index, cand_x[k], cand_y[k], cand_mags[k]) == k);
+    }
+    for (int q = 0; q < 5000; q++) {
+        // including points off the edges of the grid
+        double x = (rand() % (IMAGE_WIDTH + 200)) - 100 + 0.25;
+        double y = (rand() % (IMAGE_HEIGHT + 200)) - 100 + 0.5;
+        double radius = 1 + rand() % 100;
+        int expected = -1;
+        double best = radius * radius;
+        uint32_t expected_neighbours = 0;
+        for (int k = 0; k < n; k++) {
+            double dx = cand_x[k] - x, dy = cand_y[k] - y;
+            if (dx*dx + dy*dy < best) {
+                best = dx*dx + dy*dy;
+                expected = k;
+            }
+            expected_neighbours += (fabs(dx) < radius) && (fabs(dy) < radius);
+        }
+        assert(nearestBlob(&index, x, y, radius) == expected);
+
+        const uint32_t * ids;
+        uint32_t num = findNeighbours(&index, x, y, radius, &ids);
+        assert(num == expected_neighbours);
+        for (uint32_t m = 0; m < num; m++) {
+            assert(fabs(cand_x[ids[m]] - x) < radius);
+            assert(fabs(cand_y[ids[m]] - y) < radius);
+        }
+    }
+
+    // moved blobs are found at their new position only
+    replaceBlob(&index, 7, 10.0, 10.0, 0.0);
+    assert(nearestBlob(&index, 10.0, 10.0, 0.5) == 7);
+    replaceBlob(&index, 7, IMAGE_WIDTH - 3.0, 12.0, 0.0);
+    assert(nearestBlob(&index, 10.0, 10.0, 0.5) == -1);
+    assert(nearestBlob(&index, IMAGE_WIDTH - 3.0, 12.0, 0.5) == 7);
+
+    // reset empties it, and a smaller grid reuses the memory
+    assert(resetBlobIndex(&index, 100, 100, 1) == 0);
+    assert(index.cell_size == BLOB_INDEX_MIN_CELL);
+    assert(nearestBlob(&index, IMAGE_WIDTH - 3.0, 12.0, 0.5) == -1);
+    freeBlobIndex(&index);
+    printf("PASS\n");
+}
+
+
+/**
+ * @brief Order of blobs brightest first, equally bright ones in the order
+ * they came, by a stable insertion sort.
+ */
+void referenceBrightest(const double * mags, int n, uint32_t * order)
+{
+    for (int k = 0; k < n; k++) {
+        int m = k;
+        for (; (m > 0) && (mags[order[m - 1]] < mags[k]); m--) {
+            order[m] = order[m - 1];
+        }
+        order[m] = k;
+    }
+}
+
+
+void test_brightestBlobs(void) {
+    printf("\ntest_brightestBlobs\n");
+    struct blob_index_t index = {0};
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+    uint32_t * expected = malloc(MAX_CANDIDATES * sizeof(uint32_t));
+    int sizes[] = {0, 1, 7, 300, 301, 5000, MAX_CANDIDATES};
+    uint32_t ks[] = {0, 1, 8, 300, MAX_CANDIDATES + 1};
+
+    srand(11);
+    for (int z = 0; z < 7; z++) {
+        // coarse magnitudes, so that ties are common
+        makeCandidates(sizes[z]);
+        assert(resetBlobIndex(&index, IMAGE_WIDTH, IMAGE_HEIGHT, 15) == 0);
+        for (int k = 0; k < sizes[z]; k++) {
+            assert(insertBlob(&index, cand_x[k], cand_y[k], cand_mags[k]) ==
+                k);
+        }
+        referenceBrightest(cand_mags, sizes[z], expected);
+        for (int q = 0; q < 5; q++) {
+            const uint32_t * ids;
+            clock_gettime(CLOCK_MONOTONIC, &tstart);
+            uint32_t n = brightestBlobs(&index, ks[q], &ids);
+            clock_gettime(CLOCK_MONOTONIC, &tend);
+            uint32_t want = (ks[q] < (uint32_t)sizes[z]) ? ks[q] :
+                (uint32_t)sizes[z];
+            assert(n == want);
+            for (uint32_t k = 0; k < n; k++) {
+                assert(ids[k] == expected[k]);
+            }
+            if ((sizes[z] == MAX_CANDIDATES) && (ks[q] == 300)) {
+                printf("brightest 300 of %d: %.3f ms\n", sizes[z],
+                    elapsed(&tstart, &tend) * 1e3);
+            }
+        }
+    }
+    freeBlobIndex(&index);
+    free(expected);
+    printf("PASS\n");
+}
+
+
+int main(void) {
+    test_uniqueSpacing();
+    test_nearestBlob();
+    test_brightestBlobs();
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../calibration.h"
+
+#define IMAGE_WIDTH 5320
+#define IMAGE_HEIGHT 3032
+#define IMAGE_NUM_PX (IMAGE_WIDTH * IMAGE_HEIGHT)
+
+uint16_t raw[IMAGE_NUM_PX] = {0};
+uint16_t flat[IMAGE_NUM_PX] = {0};
+uint16_t expected[IMAGE_NUM_PX] = {0};
+uint16_t result[IMAGE_NUM_PX] = {0};
+
+
+/**
+ * @brief Dark level with a ramp across the sensor, as dark current does.
+ */
+uint16_t darkLevel(int i)
+{
+    return 100 + (i % IMAGE_WIDTH) / 200 + (rand() & 0x7);
+}
+
+
+/**
+ * @brief Flat with vignetting: 3000 ADU in the centre, falling to half that
+ * in the corners.
+ */
+double vignetting(int i)
+{
+    double x = (double)(i % IMAGE_WIDTH) / IMAGE_WIDTH - 0.5;
+    double y = (double)(i / IMAGE_WIDTH) / IMAGE_HEIGHT - 0.5;
+    return 1.0 - (x*x + y*y);
+}
+
+
+void test_buildCalibration(void) {
+    printf("\ntest_buildCalibration\n");
+    struct calibration_t cal;
+    uint16_t * dark = malloc(IMAGE_NUM_PX * sizeof(uint16_t));
+
+    srand(3);
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        dark[i] = darkLevel(i);
+        flat[i] = dark[i] + (uint16_t)lround(3000.0 * vignetting(i));
+    }
+    assert(buildCalibration(dark, flat, IMAGE_NUM_PX, &cal) == 0);
+    assert(cal.dark == dark);
+    assert(cal.gain != NULL);
+    assert(abs((int)cal.pedestal - 117) <= 1);
+
+    // calibrating the flat itself gives a flat field at the mean level
+    memcpy(result, flat, sizeof(result));
+    applyCalibration(&cal, result, 0, IMAGE_NUM_PX);
+    double sum = 0.0;
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        sum += result[i];
+    }
+    double mean = sum / IMAGE_NUM_PX;
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        assert(fabs(result[i] - mean) <= 2.0);
+    }
+    freeCalibration(&cal);
+    assert((cal.dark == NULL) && (cal.gain == NULL));
+
+    // a flat no brighter than its dark is useless
+    dark = calloc(IMAGE_NUM_PX, sizeof(uint16_t));
+    memset(flat, 0, sizeof(flat));
+    assert(buildCalibration(dark, flat, IMAGE_NUM_PX, &cal) < 0);
+    assert(cal.dark == NULL);
+    printf("PASS\n");
+}
+
+
+void test_applyCalibration_kernels(void) {
+    printf("\ntest_applyCalibration_kernels\n");
+    struct calibration_t cal;
+    uint16_t * dark = malloc(IMAGE_NUM_PX * sizeof(uint16_t));
+
+    srand(4);
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        dark[i] = darkLevel(i);
+        flat[i] = dark[i] + (uint16_t)lround(3000.0 * vignetting(i));
+        // full range, so both ends saturate
+        raw[i] = rand() & 0xFFFF;
+    }
+    raw[0] = 0;
+    raw[1] = UINT16_MAX;
+    assert(buildCalibration(dark, flat, IMAGE_NUM_PX, &cal) == 0);
+
+    // against floating point
+    memcpy(expected, raw, sizeof(raw));
+    applyCalibrationScalar(&cal, expected, 0, IMAGE_NUM_PX);
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        double v = ((double)raw[i] - cal.dark[i]) * cal.gain[i] /
+            CALIBRATION_GAIN_ONE + cal.pedestal;
+        v = fmin(fmax(v, 0.0), 65535.0);
+        assert(fabs(expected[i] - v) <= 0.5 + 1e-9);
+    }
+
+#ifdef CALIBRATION_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        // bit exact, including partial blocks at odd offsets
+        size_t offsets[][2] = {{0, IMAGE_NUM_PX}, {3, 37}, {17, 15},
+            {IMAGE_NUM_PX - 21, 21}};
+        for (int k = 0; k < 4; k++) {
+            memcpy(expected, raw, sizeof(raw));
+            memcpy(result, raw, sizeof(raw));
+            applyCalibrationScalar(&cal, expected, offsets[k][0],
+                offsets[k][1]);
+            applyCalibrationAvx2(&cal, result, offsets[k][0], offsets[k][1]);
+            assert(memcmp(expected, result, sizeof(raw)) == 0);
+        }
+
+        // dark only, and flat only
+        int16_t * gain = cal.gain;
+        cal.gain = NULL;
+        memcpy(expected, raw, sizeof(raw));
+        memcpy(result, raw, sizeof(raw));
+        applyCalibrationScalar(&cal, expected, 0, IMAGE_NUM_PX);
+        applyCalibrationAvx2(&cal, result, 0, IMAGE_NUM_PX);
+        assert(memcmp(expected, result, sizeof(raw)) == 0);
+        assert(expected[1000] == (uint16_t)(raw[1000] - cal.dark[1000] +
+            cal.pedestal));
+        cal.gain = gain;
+        uint16_t * saved_dark = cal.dark;
+        cal.dark = NULL;
+        cal.pedestal = 0;
+        memcpy(expected, raw, sizeof(raw));
+        memcpy(result, raw, sizeof(raw));
+        applyCalibrationScalar(&cal, expected, 0, IMAGE_NUM_PX);
+        applyCalibrationAvx2(&cal, result, 0, IMAGE_NUM_PX);
+        assert(memcmp(expected, result, sizeof(raw)) == 0);
+        cal.dark = saved_dark;
+
+        struct timespec tstart = {0,0};
+        struct timespec tend = {0,0};
+        memcpy(result, raw, sizeof(raw));
+        clock_gettime(CLOCK_MONOTONIC, &tstart);
+        applyCalibrationScalar(&cal, result, 0, IMAGE_NUM_PX);
+        clock_gettime(CLOCK_MONOTONIC, &tend);
+        printf("scalar calibration took %.3f ms\n", 1e3 *
+            (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+             ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)));
+        memcpy(result, raw, sizeof(raw));
+        clock_gettime(CLOCK_MONOTONIC, &tstart);
+        applyCalibrationAvx2(&cal, result, 0, IMAGE_NUM_PX);
+        clock_gettime(CLOCK_MONOTONIC, &tend);
+        printf("AVX2 calibration took %.3f ms\n", 1e3 *
+            (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+             ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)));
+    }
+#endif
+
+    // nothing to apply
+    struct calibration_t none = {0};
+    memcpy(result, raw, sizeof(raw));
+    applyCalibration(&none, result, 0, IMAGE_NUM_PX);
+    assert(memcmp(result, raw, sizeof(raw)) == 0);
+    freeCalibration(&cal);
+    printf("PASS\n");
+}
+
+
+void test_averageFrames(void) {
+    printf("\ntest_averageFrames\n");
+    uint32_t sum[4] = {0, 5, 6, 3 * 4095};
+    uint16_t average[4];
+
+    assert(averageFrames(sum, 3, 4, average) == 0);
+    assert(average[0] == 0);
+    assert(average[1] == 2);
+    assert(average[2] == 2);
+    assert(average[3] == 4095);
+    assert(averageFrames(sum, 0, 4, average) < 0);
+    printf("PASS\n");
+}
+
+
+int main(int argc, char* argv[]) {
+    test_averageFrames();
+    test_buildCalibration();
+    test_applyCalibration_kernels();
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../coadd.h"
+#include "../threadpool.h"
+
+#define IMAGE_WIDTH 5320
+#define IMAGE_HEIGHT 3032
+#define IMAGE_NUM_PX (IMAGE_WIDTH * IMAGE_HEIGHT)
+#define NUM_STARS 20
+
+uint16_t frame[IMAGE_NUM_PX] = {0};
+uint16_t sum[IMAGE_NUM_PX] = {0};
+uint16_t expected[IMAGE_NUM_PX] = {0};
+double star_x[NUM_STARS];
+double star_y[NUM_STARS];
+
+
+/**
+ * @brief A star field shifted by (dx, dy) px on a noisy 200 ADU background.
+ */
+void render(uint16_t * image, double dx, double dy)
+{
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        image[i] = 200 + (rand() % 21) - 10;
+    }
+    for (int s = 0; s < NUM_STARS; s++) {
+        double xc = star_x[s] + dx, yc = star_y[s] + dy;
+        for (int j = (int)yc - 5; j <= (int)yc + 5; j++) {
+            for (int i = (int)xc - 5; i <= (int)xc + 5; i++) {
+                double r2 = (i - xc)*(i - xc) + (j - yc)*(j - yc);
+                image[i + j*IMAGE_WIDTH] += (uint16_t)(1500.0*exp(-r2 / 4.0));
+            }
+        }
+    }
+}
+
+
+void test_coaddFrame(void) {
+    printf("\ntest_coaddFrame\n");
+    srand(5);
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        frame[i] = rand() & 0xFFF;
+        sum[i] = expected[i] = rand() & 0xFFFF;
+    }
+
+    // saturating kernels agree
+    addSaturateScalar(expected, frame, IMAGE_NUM_PX);
+    for (int i = 0; i < 1000; i++) {
+        uint32_t s = (uint32_t)sum[i] + frame[i];
+        assert(expected[i] == ((s > UINT16_MAX) ? UINT16_MAX : s));
+    }
+#ifdef COADD_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        uint16_t * copy = malloc(IMAGE_NUM_PX * sizeof(uint16_t));
+        memcpy(copy, sum, IMAGE_NUM_PX * sizeof(uint16_t));
+        addSaturateAvx2(copy, frame, IMAGE_NUM_PX - 5);
+        assert(memcmp(copy, expected, (IMAGE_NUM_PX - 5) * sizeof(uint16_t))
+            == 0);
+        free(copy);
+    }
+#endif
+
+    // shifted add, with the edges filled from the nearest source pixel
+    memset(sum, 0, sizeof(sum));
+    int dx = 3, dy = -2;
+    coaddFrame(sum, frame, IMAGE_WIDTH, IMAGE_HEIGHT, dx, dy);
+    for (int j = 0; j < IMAGE_HEIGHT; j++) {
+        for (int i = 0; i < IMAGE_WIDTH; i++) {
+            int si = i - dx, sj = j - dy;
+            si = (si < 0) ? 0 : ((si >= IMAGE_WIDTH) ? IMAGE_WIDTH - 1 : si);
+            sj = (sj < 0) ? 0 : ((sj >= IMAGE_HEIGHT) ? IMAGE_HEIGHT - 1 : sj);
+            assert(sum[i + j*IMAGE_WIDTH] == frame[si + sj*IMAGE_WIDTH]);
+        }
+    }
+    printf("PASS\n");
+}
+
+
+void test_averageCoadd(void) {
+    printf("\ntest_averageCoadd\n");
+    for (int k = 2; k <= COADD_MAX_FRAMES; k++) {
+        for (uint32_t n = 0; n <= UINT16_MAX; n++) {
+            uint16_t v = n;
+            averageCoadd(&v, 1, k);
+            assert(v == (n + k / 2) / k);
+        }
+    }
+    printf("PASS\n");
+}
+
+
+void test_shiftAndAdd(void) {
+    printf("\ntest_shiftAndAdd\n");
+    srand(6);
+    for (int s = 0; s < NUM_STARS; s++) {
+        star_x[s] = 100 + rand() % (IMAGE_WIDTH - 200) + 0.3;
+        star_y[s] = 100 + rand() % (IMAGE_HEIGHT - 200) + 0.6;
+    }
+
+    // the reference: centroids in the first frame, found from rough
+    // positions
+    double ref_x[NUM_STARS], ref_y[NUM_STARS];
+    render(sum, 0.0, 0.0);
+    for (int s = 0; s < NUM_STARS; s++) {
+        assert(starCentroid(sum, IMAGE_WIDTH, IMAGE_HEIGHT, star_x[s] + 2,
+            star_y[s] - 3, COADD_SHIFT_HALF_SIZE, &ref_x[s], &ref_y[s]) == 0);
+        assert(fabs(ref_x[s] - star_x[s]) < 0.2);
+        assert(fabs(ref_y[s] - star_y[s]) < 0.2);
+    }
+    // off the sensor
+    double x, y;
+    assert(starCentroid(sum, IMAGE_WIDTH, IMAGE_HEIGHT, 3, 3,
+        COADD_SHIFT_HALF_SIZE, &x, &y) < 0);
+
+    // drifting frames line up again
+    double drift[3][2] = {{2.1, -1.2}, {4.0, -2.9}, {-5.8, 7.2}};
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+    double add_ms = 0.0;
+    for (int k = 0; k < 3; k++) {
+        render(frame, drift[k][0], drift[k][1]);
+        int dx, dy;
+        assert(measureShift(frame, IMAGE_WIDTH, IMAGE_HEIGHT, ref_x, ref_y,
+            NUM_STARS, COADD_SHIFT_HALF_SIZE, &dx, &dy) == NUM_STARS);
+        assert(dx == (int)lround(drift[k][0]));
+        assert(dy == (int)lround(drift[k][1]));
+        clock_gettime(CLOCK_MONOTONIC, &tstart);
+        coaddFrame(sum, frame, IMAGE_WIDTH, IMAGE_HEIGHT, -dx, -dy);
+        clock_gettime(CLOCK_MONOTONIC, &tend);
+        add_ms += 1e3 * (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+            ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec));
+    }
+    printf("co-adding a frame took %.3f ms\n", add_ms / 3);
+    averageCoadd(sum, IMAGE_NUM_PX, 4);
+
+    // stars stay sharp and in place; the background noise drops
+    for (int s = 0; s < NUM_STARS; s++) {
+        assert(starCentroid(sum, IMAGE_WIDTH, IMAGE_HEIGHT, ref_x[s], ref_y[s],
+            COADD_SHIFT_HALF_SIZE, &x, &y) == 0);
+        assert(fabs(x - ref_x[s]) < 0.5);
+        assert(fabs(y - ref_y[s]) < 0.5);
+    }
+    double s1 = 0.0, s2 = 0.0;
+    int n = 0;
+    for (int i = 0; i < IMAGE_WIDTH; i++) {
+        double v = sum[i + 50*IMAGE_WIDTH];
+        s1 += v;
+        s2 += v*v;
+        n++;
+    }
+    double sigma = sqrt(s2/n - (s1/n)*(s1/n));
+    printf("background sigma %.2f ADU, one frame ~6.1\n", sigma);
+    assert(fabs(s1/n - 200.0) < 1.0);
+    assert(sigma < 4.0);
+    printf("PASS\n");
+}
+
+
+int main(int argc, char* argv[]) {
+    test_averageCoadd();
+    test_coaddFrame();
+    test_shiftAndAdd();
+    initThreadPool(4);
+    test_coaddFrame();
+    test_shiftAndAdd();
+    closeThreadPool();
+    return 0;
+}
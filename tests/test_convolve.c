@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -8,6 +9,7 @@
 #include <time.h>
 
 #include "../convolve.h"
+#include "../threadpool.h"
 
 #define CLOSE 1e-6
 bool verbose = 1;
@@ -107,7 +109,7 @@ int saveArrayDumb(char* fname, float* imageResult, uint16_t imageWidth, uint32_t
             fname, strerror(errno));
         return -1;
     }
-    for (int i = 0; i < imageNumPix; i++)
+    for (uint32_t i = 0; i < imageNumPix; i++)
     {
         isRight = (0 == ((i + 1) % imageWidth));
         fprintf(fp, "%.6f", imageResult[i]);
@@ -188,14 +190,9 @@ void test_doConvolution3x3_perf(void) {
     uint32_t imageNumPix = imageWidth * imageHeight;
 
     float gaussianKernel[9] = {1./16., 2./16., 1./16., 2./16., 4./16., 2./16., 1./16., 2./16., 1./16.}; // gaussian
-    // technically, sobel takes G = (G_x^2 + G_y^2)^.5 as an approximation of
-    // the gradient, but stars are round, so any stars (or indeed other
-    // features) will be sharp in x,y, or any other direction.
-    float sobelKernel[9] = {-1., 0., 1., -2., 0., 2., -1., 0., 1.}; // sobel x
 
     struct timespec tstart = {0,0};
     struct timespec tconv = {0,0};
-    struct timespec tend = {0,0};
 
     int nCalls = 10;
     while (nCalls > 0) {
@@ -305,16 +302,16 @@ void test_boxcarFilterImage_edge(void) {
     // ========================================================================
     reset();
 
-    imageBufferB[imageNumPix * 2] = 101.0;
+    imageBufferB[imageWidth * 2] = 101.0;
 
     boxcarFilterImage(imageBufferB, 0, 0, imageWidth, imageHeight, radius, 
             imageResultB);
 
     double Lanswers[81] = {
         0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
-        0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
-        0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
-        0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
+        0.00, 101./9., 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
+        0.00, 101./9., 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
+        0.00, 101./9., 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
         0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
         0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
         0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
@@ -469,12 +466,480 @@ void test_boxcarFilterImage_edge(void) {
 }
 
 
-int main(int argc, char* argv[]) {
+// Host binning: known answer on a small image, then every kernel against the
+// scalar one on a full frame, including widths that leave a partial block.
+void test_binImage(void) {
+    printf("\ntest_binImage\n");
+
+    uint16_t small[4 * 6] = {
+        1, 3, 10, 10, 7, 100,
+        5, 7, 20, 20, 7, 100,
+        0, 0, 4095, 4095, 1, 1,
+        0, 4, 4095, 4094, 1, 1,
+    };
+    uint16_t smallAnswers[2 * 3] = {4, 15, 53, 1, 4094, 1};
+    uint16_t smallBinned[2 * 3] = {0};
+    assert(binImage(small, 6, 4, 2, smallBinned) == 0);
+    for (int i = 0; i < 2 * 3; i++) {
+        assert(smallBinned[i] == smallAnswers[i]);
+    }
+
+    uint16_t widths[3] = {IMAGE_WIDTH, IMAGE_WIDTH - 5, 37};
+    uint8_t factors[3] = {2, 3, 4};
+    uint16_t* image = malloc(IMAGE_WIDTH * IMAGE_HEIGHT * sizeof(uint16_t));
+    uint16_t* expected = malloc(IMAGE_WIDTH * IMAGE_HEIGHT * sizeof(uint16_t));
+    uint16_t* binned = malloc(IMAGE_WIDTH * IMAGE_HEIGHT * sizeof(uint16_t));
+    srand(1);
+    for (int i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+        image[i] = rand() % 4096;
+    }
+    for (int w = 0; w < 3; w++) {
+        for (int f = 0; f < 3; f++) {
+            uint32_t n = (widths[w] / factors[f]) *
+                (IMAGE_HEIGHT / factors[f]);
+            binImageScalar(image, widths[w], IMAGE_HEIGHT, factors[f],
+                expected);
+            memset(binned, 0, n * sizeof(uint16_t));
+            assert(binImage(image, widths[w], IMAGE_HEIGHT, factors[f],
+                binned) == 0);
+            assert(memcmp(binned, expected, n * sizeof(uint16_t)) == 0);
+#ifdef CONVOLVE_HAVE_X86_KERNELS
+            if (__builtin_cpu_supports("avx2")) {
+                memset(binned, 0, n * sizeof(uint16_t));
+                binImageAvx2(image, widths[w], IMAGE_HEIGHT, factors[f],
+                    binned);
+                assert(memcmp(binned, expected, n * sizeof(uint16_t)) == 0);
+            }
+#endif
+        }
+    }
+
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tstart);
+    binImageScalar(image, IMAGE_WIDTH, IMAGE_HEIGHT, 4, binned);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tend);
+    printf("binImageScalar 4x4 took %.3f ms\n", 1e3 *
+        (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+         ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)));
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tstart);
+    binImage(image, IMAGE_WIDTH, IMAGE_HEIGHT, 4, binned);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tend);
+    printf("binImage 4x4 took %.3f ms\n", 1e3 *
+        (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+         ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)));
+
+    free(image);
+    free(expected);
+    free(binned);
+    printf("\nPASS\n");
+}
+
+
+/**
+ * @brief boxcarFilterImage() for any image width, on a caller's mask.
+ */
+void referenceBoxcar(uint16_t * ib, uint8_t * pMask, int width, int i0, int j0,
+                     int i1, int j1, int r_f, double * filtered_image)
+{
+    char * nc = calloc(width * j1, 1);
+    uint64_t * ibc1 = calloc(width * j1, sizeof(uint64_t));
+
+    int b = r_f;
+    int64_t isx;
+    int s, n;
+    double ds, dn;
+    double last_ds = 0;
+
+    for (int j = j0; j < j1; j++) {
+        n = 0;
+        isx = 0;
+        for (int i = i0; i < i0 + 2*r_f + 1; i++) {
+            n += pMask[i + j*width];
+            isx += ib[i + j*width]*pMask[i + j*width];
+        }
+
+        int idx = width*j + i0 + r_f;
+
+        for (int i = r_f + i0; i < i1 - r_f - 1; i++) {
+            ibc1[idx] = isx;
+            nc[idx] = n;
+            isx = isx + pMask[idx + r_f + 1]*ib[idx + r_f + 1] - 
+                  pMask[idx - r_f]*ib[idx - r_f];
+            n = n + pMask[idx + r_f + 1] - pMask[idx - r_f];
+            idx++;
+        }
+
+        ibc1[idx] = isx;
+        nc[idx] = n;
+    }
+
+    for (int j = j0+b; j < j1-b; j++) {
+        for (int i = i0+b; i < i1-b; i++) {
+            n = s = 0;
+            for (int jp =- r_f; jp <= r_f; jp++) {
+                int idx = i + (j+jp)*width;
+                s += ibc1[idx];
+                n += nc[idx];
+            }
+            ds = s;
+            dn = n;
+            if (dn > 0.0) {
+                ds /= dn;
+                last_ds = ds;
+            } else {
+                ds = last_ds;
+            }
+            filtered_image[i + j*width] = ds;
+        }
+    }
+    free(nc);
+    free(ibc1);
+}
+
+
+/**
+ * @brief The filtering and statistics findBlobs() used to do in three passes,
+ * as a reference for boxFilterImage().
+ */
+void referenceFilterStats(uint16_t * ib, uint8_t * pMask, int w, int h,
+    int r_smooth, bool high_pass, int r_hp, int b, double * ic,
+    struct box_filter_stats_t * pStats)
+{
+    double * ic2 = calloc(w * h, sizeof(double));
+    double sx = 0, sx2 = 0, sx_raw = 0;
+    int num_pix = 0;
+
+    referenceBoxcar(ib, pMask, w, 0, 0, w, h, r_smooth, ic);
+    if (high_pass) {
+        b += r_hp;
+        referenceBoxcar(ib, pMask, w, 0, 0, w, h, r_hp, ic2);
+        for (int j = b; j < h-b; j++) {
+            for (int i = b; i < w-b; i++) {
+                int idx = i + j*w;
+                sx_raw += ic[idx]*pMask[idx];
+                ic[idx] -= ic2[idx];
+                sx += ic[idx]*pMask[idx];
+                sx2 += ic[idx]*ic[idx]*pMask[idx];
+                num_pix += pMask[idx];
+            }
+        }
+    } else {
+        for (int j = b; j < h-b; j++) {
+            for (int i = b; i < w-b; i++) {
+                int idx = i + j*w;
+                sx += ic[idx]*pMask[idx];
+                sx2 += ic[idx]*ic[idx]*pMask[idx];
+                num_pix += pMask[idx];
+            }
+        }
+        sx_raw = sx;
+    }
+    pStats->sum = sx;
+    pStats->sum_sq = sx2;
+    pStats->sum_raw = sx_raw;
+    pStats->num_pix = num_pix;
+    free(ic2);
+}
+
+
+bool closeRel(double a, double b) {
+    return fabs(a - b) <= 1e-9 * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+
+// Fused filter: every filtered pixel must equal the old two-pass boxcar
+// rounded to float, and the statistics must agree to rounding.
+void test_boxFilterImage(void) {
+    printf("\ntest_boxFilterImage (%d threads)\n", threadPoolSize());
+    int w = IMAGE_WIDTH, h = IMAGE_HEIGHT;
+    uint16_t* image = malloc(w * h * sizeof(uint16_t));
+    uint8_t* pMask = malloc(w * h);
+    double* expected = calloc(w * h, sizeof(double));
+    float* filtered = calloc(w * h, sizeof(float));
+    struct box_filter_stats_t expectedStats, stats;
+
+    srand(3);
+    for (int i = 0; i < w * h; i++) {
+        image[i] = 100 + rand() % 300;
+        pMask[i] = (rand() % 50) != 0;
+    }
+    // a few stars, and a masked block wide enough to empty whole boxes
+    for (int k = 0; k < 200; k++) {
+        image[rand() % (w * h)] = 4095;
+    }
+    for (int j = 300; j < 340; j++) {
+        memset(pMask + j * w + 1000, 0, 40);
+    }
+    // masked border, as makeMask() leaves it
+    memset(pMask, 0, w);
+    memset(pMask + (h - 1) * w, 0, w);
+    for (int j = 0; j < h; j++) {
+        pMask[j * w] = pMask[j * w + w - 1] = 0;
+    }
+
+    // a fully masked box repeats the last average of its band rather than of
+    // the frame, so radius 0, which the masked border empties at the start
+    // of every row, is left out
+    int radii[][3] = {{1, 1, 10}, {1, 0, 10}, {2, 1, 10}, {2, 1, 1}, {3, 5, 2}};
+    for (int k = 0; k < 5; k++) {
+        int r_smooth = radii[k][0], high_pass = radii[k][1];
+        int r_hp = radii[k][2], border = 1;
+        memset(expected, 0, w * h * sizeof(double));
+        memset(filtered, 0, w * h * sizeof(float));
+        referenceFilterStats(image, pMask, w, h, r_smooth, high_pass, r_hp,
+            border, expected, &expectedStats);
+        assert(boxFilterImage(image, pMask, w, 0, 0, w, h, r_smooth,
+            high_pass, r_hp, NULL, border + (high_pass ? r_hp : 0), filtered,
+            &stats) == 0);
+        for (int i = 0; i < w * h; i++) {
+            if (filtered[i] != (float)expected[i]) {
+                printf("radii %d/%d: pixel (%d, %d) is %f, expected %f\n",
+                    r_smooth, r_hp, i % w, i / w, filtered[i], expected[i]);
+            }
+            assert(filtered[i] == (float)expected[i]);
+        }
+        assert(stats.num_pix == expectedStats.num_pix);
+        assert(closeRel(stats.sum, expectedStats.sum));
+        assert(closeRel(stats.sum_sq, expectedStats.sum_sq));
+        assert(closeRel(stats.sum_raw, expectedStats.sum_raw));
+    }
+
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    referenceFilterStats(image, pMask, w, h, 1, 1, 10, 1, expected,
+        &expectedStats);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    printf("boxcar x2 + statistics took %.3f ms\n", 1e3 *
+        (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+         ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)));
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    boxFilterImage(image, pMask, w, 0, 0, w, h, 1, 1, 10, NULL, 11, filtered,
+        &stats);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    printf("boxFilterImage took %.3f ms\n", 1e3 *
+        (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+         ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)));
+
+    free(image);
+    free(pMask);
+    free(expected);
+    free(filtered);
+    printf("\nPASS\n");
+}
+
+
+/**
+ * @brief Flood fill labelling of the 8-connected groups of pixels above
+ * threshold, as a reference for findComponents(). Blobs are in scan order of
+ * their first pixel, with the first of equally bright pixels as the peak.
+ */
+uint32_t referenceComponents(float * ic, int w, int i0, int j0, int i1, int j1,
+    double threshold, double background, struct blob_t * blobs)
+{
+    uint8_t * seen = calloc(w * j1, 1);
+    uint32_t * stack = malloc(w * j1 * sizeof(uint32_t));
+    uint32_t count = 0;
+    for (int j = j0; j < j1; j++) {
+        for (int i = i0; i < i1; i++) {
+            if (seen[i + j*w] || ((double) ic[i + j*w] <= threshold)) {
+                continue;
+            }
+            struct blob_t * blob = &blobs[count++];
+            memset(blob, 0, sizeof(struct blob_t));
+            blob->peak = ic[i + j*w];
+            blob->peak_pixel = i + j*w;
+            uint32_t top = 0;
+            stack[top++] = i + j*w;
+            seen[i + j*w] = 1;
+            while (top > 0) {
+                uint32_t p = stack[--top];
+                int x = p % w, y = p / w;
+                double v = ic[p] - background;
+                blob->flux += v;
+                blob->x += v * x;
+                blob->y += v * y;
+                blob->area++;
+                if ((ic[p] > blob->peak) ||
+                    ((ic[p] == blob->peak) && (p < blob->peak_pixel))) {
+                    blob->peak = ic[p];
+                    blob->peak_pixel = p;
+                }
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int xx = x + dx, yy = y + dy;
+                        if ((xx < i0) || (xx >= i1) || (yy < j0) ||
+                            (yy >= j1) || seen[xx + yy*w] ||
+                            ((double) ic[xx + yy*w] <= threshold)) {
+                            continue;
+                        }
+                        seen[xx + yy*w] = 1;
+                        stack[top++] = xx + yy*w;
+                    }
+                }
+            }
+            blob->x /= blob->flux;
+            blob->y /= blob->flux;
+        }
+    }
+    free(seen);
+    free(stack);
+    return count;
+}
+
+
+void test_findComponents(void) {
+    printf("\ntest_findComponents\n");
+    int w = 1000, h = 700;
+    // coarse values so that ties between pixels are common, and about a
+    // quarter of pixels above threshold so groups are all sizes and shapes
+    srand(7);
+    for (int i = 0; i < w * h; i++) {
+        imageBuffer[i] = (float)(rand() % 8);
+    }
+    // a diagonal line, connected only through corners, across band edges
+    for (int k = 0; k < 200; k++) {
+        imageBuffer[(300 + k) + (20 + k)*w] = 20.0f;
+        imageBuffer[(300 + k) + (21 + k)*w] = 0.0f;
+        imageBuffer[(301 + k) + (20 + k)*w] = 0.0f;
+    }
+    struct blob_t * expected = malloc(w * h * sizeof(struct blob_t));
+    // thresholds on and just below a pixel value, which a float rounds up
+    double thresholds[] = {4.9999999999, 5.5, 5.0};
+    struct component_scan_t scan = {
+        .pImage = imageBuffer,
+        .imageWidth = w,
+        .i0 = 3, .j0 = 4, .i1 = w - 5, .j1 = h - 2,
+        .background = 1.5,
+    };
+    uint32_t count = 0;
+    for (int t = 0; t < 3; t++) {
+        count = referenceComponents(imageBuffer, w, 3, 4, w - 5, h - 2,
+            thresholds[t], 1.5, expected);
+        scan.threshold = thresholds[t];
+        assert(findComponents(&scan) == 0);
+        assert(scan.num_blobs == count);
+        for (uint32_t k = 0; k < count; k++) {
+            assert(scan.blobs[k].area == expected[k].area);
+            assert(scan.blobs[k].peak_pixel == expected[k].peak_pixel);
+        }
+        freeComponents(&scan);
+    }
+    assert(count > 0);
+    assert(findComponents(&scan) == 0);
+    assert(scan.num_blobs == count);
+    uint32_t largest = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        assert(scan.blobs[k].area == expected[k].area);
+        assert(scan.blobs[k].peak == expected[k].peak);
+        assert(scan.blobs[k].peak_pixel == expected[k].peak_pixel);
+        assert(fabs(scan.blobs[k].flux - expected[k].flux) < CLOSE);
+        assert(fabs(scan.blobs[k].x - expected[k].x) < CLOSE);
+        assert(fabs(scan.blobs[k].y - expected[k].y) < CLOSE);
+        if (scan.blobs[k].area > scan.blobs[largest].area) {
+            largest = k;
+        }
+    }
+    // the diagonal line is one blob
+    assert(scan.blobs[largest].area >= 200);
+    assert(scan.blobs[largest].peak == 20.0f);
+    if (verbose) {
+        printf("%u blobs, largest %u px\n", count, scan.blobs[largest].area);
+    }
+    freeComponents(&scan);
+    assert(scan.blobs == NULL);
+
+    // an empty region
+    scan.j1 = scan.j0;
+    assert(findComponents(&scan) == 0);
+    assert(scan.num_blobs == 0);
+    freeComponents(&scan);
+    free(expected);
+    printf("PASS\n");
+}
+
+
+void test_thresholdRow(void) {
+    printf("\ntest_thresholdRow\n");
+    int n = IMAGE_WIDTH;
+    uint64_t expected[(IMAGE_WIDTH + 63) / 64 + 1];
+    uint64_t bits[(IMAGE_WIDTH + 63) / 64 + 1];
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+
+    srand(9);
+    for (int i = 0; i < n; i++) {
+        imageBuffer[i] = (float)(rand() % 100) / 10.0f;
+    }
+    imageBuffer[17] = NAN;
+    // every length and alignment near the word and vector sizes
+    for (int offset = 0; offset < 9; offset++) {
+        for (int len = 0; len < 200; len++) {
+            thresholdRowScalar(imageBuffer + offset, len, 5.0f, expected);
+            for (int k = 0; k < len; k++) {
+                int above = (expected[k / 64] >> (k % 64)) & 1;
+                assert(above == (imageBuffer[offset + k] > 5.0f));
+            }
+            if (len % 64) {
+                assert((expected[len / 64] >> (len % 64)) == 0);
+            }
+#ifdef CONVOLVE_HAVE_X86_KERNELS
+            if (__builtin_cpu_supports("avx2")) {
+                memset(bits, 0xff, sizeof(bits));
+                thresholdRowAvx2(imageBuffer + offset, len, 5.0f, bits);
+                for (int w = 0; w < (len + 63) / 64; w++) {
+                    assert(bits[w] == expected[w]);
+                }
+            }
+#endif
+        }
+    }
+
+    int reps = 1000;
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (int r = 0; r < reps; r++) {
+        thresholdRowScalar(imageBuffer, n, 5.0f, expected);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    printf("thresholdRowScalar: %.3f us per row\n",
+        (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+         ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)) * 1e6 / reps);
+#ifdef CONVOLVE_HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        clock_gettime(CLOCK_MONOTONIC, &tstart);
+        for (int r = 0; r < reps; r++) {
+            thresholdRowAvx2(imageBuffer, n, 5.0f, bits);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &tend);
+        printf("thresholdRowAvx2: %.3f us per row\n",
+            (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+             ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)) * 1e6 / reps);
+        assert(memcmp(bits, expected, sizeof(uint64_t) * ((n + 63) / 64)) ==
+            0);
+    }
+#endif
+    printf("PASS\n");
+}
+
+
+int main(void) {
     test_doConvolution3x3_Gaussian();
     // test_doConvolution3x3_perf();
 
     test_boxcarFilterImage_3x3();
     test_boxcarFilterImage_edge();
 
+    test_binImage();
+
+    test_thresholdRow();
+    test_boxFilterImage();
+    test_findComponents();
+    initThreadPool(4);
+    test_boxFilterImage();
+    test_findComponents();
+    closeThreadPool();
+    freeBoxFilterScratch();
+
     return 0;
 }
@@ -1,3 +1,5 @@
+#include <assert.h>
+
 #include "../fits_utils.h"
 
 #define TEST_FITS_IMG_WIDTH 1200
@@ -63,4 +65,12 @@ int main(int argc, int* argv)
 
     writeImage(fileName, imageMem, TEST_FITS_IMG_WIDTH, TEST_FITS_IMG_HEIGHT,
         &default_metadata);
+
+    // the replay camera backend reads images back with readImage()
+    static uint16_t readMem[TEST_FITS_IMG_WIDTH * TEST_FITS_IMG_HEIGHT] = {0};
+    assert(readImage(fileName, readMem, TEST_FITS_IMG_WIDTH,
+        TEST_FITS_IMG_HEIGHT) == 0);
+    assert(memcmp(readMem, imageMem, sizeof(readMem)) == 0);
+    assert(readImage(fileName, readMem, TEST_FITS_IMG_WIDTH / 2,
+        TEST_FITS_IMG_HEIGHT) != 0);
 }
\ No newline at end of file
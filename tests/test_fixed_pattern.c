@@ -0,0 +1,235 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../fixed_pattern.h"
+#include "../threadpool.h"
+
+#define IMAGE_WIDTH 5320
+#define IMAGE_HEIGHT 3032
+#define IMAGE_NUM_PX (IMAGE_WIDTH * IMAGE_HEIGHT)
+#define NUM_STARS 1000
+
+uint16_t image[IMAGE_NUM_PX] = {0};
+uint16_t reference[IMAGE_NUM_PX] = {0};
+uint8_t mask[IMAGE_NUM_PX] = {0};
+float row_pattern[IMAGE_HEIGHT] = {0};
+float col_pattern[IMAGE_WIDTH] = {0};
+
+
+/**
+ * @brief Approximately normal deviate (sum of 12 uniforms)
+ */
+double gaussian_noise(void)
+{
+    double sum = -6.0;
+    for (int k = 0; k < 12; k++) {
+        sum += rand() / (RAND_MAX + 1.0);
+    }
+    return sum;
+}
+
+
+/**
+ * @brief Sky gradient with 8 ADU of noise and stars, plus row offsets of 2
+ * ADU rms and column offsets of 1 ADU rms, and a masked block.
+ */
+void reset(void)
+{
+    srand(5);
+    for (int j = 0; j < IMAGE_HEIGHT; j++) {
+        row_pattern[j] = 2.0 * gaussian_noise();
+    }
+    for (int i = 0; i < IMAGE_WIDTH; i++) {
+        col_pattern[i] = 1.0 * gaussian_noise();
+    }
+    for (int j = 0; j < IMAGE_HEIGHT; j++) {
+        for (int i = 0; i < IMAGE_WIDTH; i++) {
+            double sky = 300.0 + 60.0 * i / IMAGE_WIDTH + 40.0 * j /
+                IMAGE_HEIGHT;
+            image[j * IMAGE_WIDTH + i] = (uint16_t)lround(sky +
+                row_pattern[j] + col_pattern[i] + 8.0 * gaussian_noise());
+            mask[j * IMAGE_WIDTH + i] = 1;
+        }
+    }
+    for (int s = 0; s < NUM_STARS; s++) {
+        int xc = 10 + rand() % (IMAGE_WIDTH - 20);
+        int yc = 10 + rand() % (IMAGE_HEIGHT - 20);
+        double amplitude = 200.0 + rand() % 3000;
+        for (int dy = -5; dy <= 5; dy++) {
+            for (int dx = -5; dx <= 5; dx++) {
+                int idx = (yc + dy) * IMAGE_WIDTH + xc + dx;
+                double v = image[idx] + amplitude *
+                    exp(-0.5 * (dx * dx + dy * dy) / 1.5);
+                image[idx] = (v > 4095.0) ? 4095 : (uint16_t)v;
+            }
+        }
+    }
+    // a saturated block, masked like hot pixels would be
+    for (int j = 1000; j < 1100; j++) {
+        for (int i = 2000; i < 2200; i++) {
+            image[j * IMAGE_WIDTH + i] = 4095;
+            mask[j * IMAGE_WIDTH + i] = 0;
+        }
+    }
+}
+
+
+/**
+ * @brief rms difference between the estimated and injected offsets, after
+ * taking out the mean of both (a constant is sky, not pattern)
+ */
+double offset_error(const float* estimated, const float* injected, int n)
+{
+    double mean = 0.0;
+    for (int k = 0; k < n; k++) {
+        mean += estimated[k] - injected[k];
+    }
+    mean /= n;
+    double sum2 = 0.0;
+    for (int k = 0; k < n; k++) {
+        double d = estimated[k] - injected[k] - mean;
+        sum2 += d * d;
+    }
+    return sqrt(sum2 / n);
+}
+
+
+/**
+ * @brief rms row to row scatter of the sky in rows away from the stars'
+ * influence: the mean of each row, less the mean of its neighbours
+ */
+double row_scatter(void)
+{
+    static double means[IMAGE_HEIGHT];
+    for (int j = 0; j < IMAGE_HEIGHT; j++) {
+        double sum = 0.0;
+        for (int i = 0; i < IMAGE_WIDTH; i++) {
+            uint16_t v = image[j * IMAGE_WIDTH + i];
+            sum += (v < 1000) ? v : 330.0;
+        }
+        means[j] = sum / IMAGE_WIDTH;
+    }
+    double sum2 = 0.0;
+    for (int j = 1; j < IMAGE_HEIGHT - 1; j++) {
+        double d = means[j] - 0.5 * (means[j - 1] + means[j + 1]);
+        sum2 += d * d;
+    }
+    return sqrt(sum2 / (IMAGE_HEIGHT - 2));
+}
+
+
+void test_estimate(void) {
+    printf("\ntest_estimate (%d threads)\n", threadPoolSize());
+    struct fixed_pattern_t pattern = {0};
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+
+    reset();
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    assert(estimateFixedPattern(image, mask, IMAGE_WIDTH, 0, 0, IMAGE_WIDTH,
+        IMAGE_HEIGHT, &pattern) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    double dt = ((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+        ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec);
+
+    double row_error = offset_error(pattern.row_offset, row_pattern,
+        IMAGE_HEIGHT);
+    double col_error = offset_error(pattern.col_offset, col_pattern,
+        IMAGE_WIDTH);
+    printf("estimateFixedPattern: %.3f ms, row rms %.2f (error %.2f), "
+        "column rms %.2f (error %.2f) ADU\n", dt * 1e3, pattern.row_rms,
+        row_error, pattern.col_rms, col_error);
+    assert(fabs(pattern.row_rms - 2.0) < 0.2);
+    assert(fabs(pattern.col_rms - 1.0) < 0.2);
+    // noise on a median of ~5300 or ~3000 pixels of 8 ADU noise, and the
+    // running median's share of the injected pattern
+    assert(row_error < 0.4);
+    assert(col_error < 0.4);
+
+    double before = row_scatter();
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    removeFixedPattern(image, IMAGE_WIDTH, &pattern);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    dt = ((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+        ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec);
+    double after = row_scatter();
+    printf("removeFixedPattern: %.3f ms, row scatter %.2f -> %.2f ADU\n",
+        dt * 1e3, before, after);
+    assert(after < 0.3 * before);
+
+    // a second pass finds next to nothing left
+    assert(estimateFixedPattern(image, mask, IMAGE_WIDTH, 0, 0, IMAGE_WIDTH,
+        IMAGE_HEIGHT, &pattern) == 0);
+    printf("after removal: row rms %.2f, column rms %.2f ADU\n",
+        pattern.row_rms, pattern.col_rms);
+    assert(pattern.row_rms < 0.5);
+    assert(pattern.col_rms < 0.5);
+
+    // sub-region: offsets only cover it, pixels outside are untouched
+    memcpy(reference, image, sizeof(image));
+    assert(estimateFixedPattern(image, mask, IMAGE_WIDTH, 100, 200, 1100,
+        700, &pattern) == 0);
+    removeFixedPattern(image, IMAGE_WIDTH, &pattern);
+    for (int j = 0; j < IMAGE_HEIGHT; j++) {
+        if ((j >= 200) && (j < 700)) {
+            assert(memcmp(image + j * IMAGE_WIDTH, reference + j * IMAGE_WIDTH,
+                100 * sizeof(uint16_t)) == 0);
+            assert(memcmp(image + j * IMAGE_WIDTH + 1100,
+                reference + j * IMAGE_WIDTH + 1100,
+                (IMAGE_WIDTH - 1100) * sizeof(uint16_t)) == 0);
+        } else {
+            assert(memcmp(image + j * IMAGE_WIDTH, reference + j * IMAGE_WIDTH,
+                IMAGE_WIDTH * sizeof(uint16_t)) == 0);
+        }
+    }
+    freeFixedPattern(&pattern);
+}
+
+
+void test_kernels(void) {
+    printf("\ntest_kernels\n");
+#ifdef FIXED_PATTERN_HAVE_X86_KERNELS
+    if (!__builtin_cpu_supports("avx2")) {
+        return;
+    }
+    srand(9);
+    // the whole range, including values the offsets push past the ends, and
+    // offsets that land exactly on .5
+    for (int n = 0; n < 37; n++) {
+        uint16_t a[64], b[64];
+        float offsets[64];
+        for (int i = 0; i < 64; i++) {
+            a[i] = b[i] = (i & 1) ? rand() % 8 : UINT16_MAX - rand() % 8;
+            offsets[i] = (rand() % 33 - 16) * 0.5f;
+        }
+        float row = (rand() % 17 - 8) * 0.25f;
+        removeFixedPatternRowScalar(a, offsets, row, n);
+        removeFixedPatternRowAvx2(b, offsets, row, n);
+        assert(memcmp(a, b, sizeof(a)) == 0);
+    }
+    reset();
+    memcpy(reference, image, sizeof(image));
+    for (int j = 0; j < IMAGE_HEIGHT; j++) {
+        removeFixedPatternRowScalar(reference + j * IMAGE_WIDTH, col_pattern,
+            row_pattern[j], IMAGE_WIDTH);
+        removeFixedPatternRowAvx2(image + j * IMAGE_WIDTH, col_pattern,
+            row_pattern[j], IMAGE_WIDTH);
+    }
+    assert(memcmp(image, reference, sizeof(image)) == 0);
+#endif
+}
+
+
+int main(int argc, char* argv[]) {
+    test_kernels();
+    test_estimate();
+    initThreadPool(4);
+    test_estimate();
+    closeThreadPool();
+    return 0;
+}
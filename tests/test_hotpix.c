@@ -0,0 +1,537 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../hotpix.h"
+#include "../threadpool.h"
+
+#define IMAGE_WIDTH 5320
+#define IMAGE_HEIGHT 3032
+#define IMAGE_NUM_PX (IMAGE_WIDTH * IMAGE_HEIGHT)
+
+#define TEST_MAP "test_hp_map.bin"
+#define TEST_TEXT "test_hp_map.txt"
+
+uint16_t image[IMAGE_NUM_PX] = {0};
+uint8_t mask[IMAGE_NUM_PX] = {0};
+uint8_t reference_mask[IMAGE_NUM_PX] = {0};
+
+
+void reset(void)
+{
+    srand(42);
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        image[i] = 100 + (rand() & 0x3F);
+    }
+    // a sprinkling of hot pixels, including the first and last pixel
+    for (int i = 0; i < 500; i++) {
+        image[rand() % IMAGE_NUM_PX] = 4000;
+    }
+    image[0] = 4000;
+    image[IMAGE_NUM_PX - 1] = 4000;
+}
+
+
+void test_write_load(void) {
+    printf("\ntest_write_load\n");
+    uint32_t indices[] = {0, 17, IMAGE_WIDTH + 3, IMAGE_NUM_PX - 1};
+    struct hot_pixel_map_t map;
+
+    assert(writeHotPixelMap(TEST_MAP, indices, 4, IMAGE_WIDTH, IMAGE_HEIGHT)
+        == 0);
+    assert(loadHotPixelMap(TEST_MAP, IMAGE_WIDTH, IMAGE_HEIGHT, &map) == 0);
+    assert(map.count == 4);
+    assert(memcmp(map.indices, indices, sizeof(indices)) == 0);
+    unloadHotPixelMap(&map);
+    assert(map.indices == NULL);
+
+    // a map for another sensor must not be used
+    assert(loadHotPixelMap(TEST_MAP, IMAGE_WIDTH / 2, IMAGE_HEIGHT, &map) < 0);
+    assert(map.count == 0);
+    assert(loadHotPixelMap("no_such_map.bin", IMAGE_WIDTH, IMAGE_HEIGHT, &map)
+        < 0);
+    unlink(TEST_MAP);
+}
+
+
+void test_convert_text(void) {
+    printf("\ntest_convert_text\n");
+    struct hot_pixel_map_t map;
+    FILE* f = fopen(TEST_TEXT, "w");
+    // y counts up from the bottom; duplicates and off-sensor entries dropped
+    fprintf(f, "10,%d\n", IMAGE_HEIGHT - 5);
+    fprintf(f, "3,%d\n", IMAGE_HEIGHT);
+    fprintf(f, "10,%d\n", IMAGE_HEIGHT - 5);
+    fprintf(f, "%d,1\n", IMAGE_WIDTH + 1);
+    fprintf(f, "7,0\n");
+    fclose(f);
+
+    assert(convertHotPixelText(TEST_TEXT, TEST_MAP, IMAGE_WIDTH, IMAGE_HEIGHT)
+        == 0);
+    assert(loadHotPixelMap(TEST_MAP, IMAGE_WIDTH, IMAGE_HEIGHT, &map) == 0);
+    assert(map.count == 2);
+    assert(map.indices[0] == 3);
+    assert(map.indices[1] == 5 * IMAGE_WIDTH + 10);
+    unloadHotPixelMap(&map);
+    unlink(TEST_TEXT);
+    unlink(TEST_MAP);
+}
+
+
+void test_find_hot_pixels(void) {
+    printf("\ntest_find_hot_pixels\n");
+    uint16_t threshold = 1000;
+    uint32_t* indices = NULL;
+    uint32_t count = 0;
+    uint32_t expected = 0;
+
+    reset();
+    assert(findHotPixels(image, IMAGE_WIDTH, IMAGE_HEIGHT, threshold, &indices,
+        &count) == 0);
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        if (image[i] > threshold) {
+            assert(expected < count);
+            assert(indices[expected] == (uint32_t)i);
+            expected++;
+        }
+    }
+    assert(count == expected);
+    printf("Found %u hot pixels on %d threads\n", count, threadPoolSize());
+    free(indices);
+
+    // the threshold itself is not hot
+    assert(findHotPixels(image, IMAGE_WIDTH, IMAGE_HEIGHT, 4000, &indices,
+        &count) == 0);
+    assert(count == 0);
+    free(indices);
+}
+
+
+void test_apply_map(void) {
+    printf("\ntest_apply_map\n");
+    uint32_t* indices = NULL;
+    uint32_t count = 0;
+    struct hot_pixel_map_t map;
+
+    reset();
+    assert(findHotPixels(image, IMAGE_WIDTH, IMAGE_HEIGHT, 1000, &indices,
+        &count) == 0);
+    assert(writeHotPixelMap(TEST_MAP, indices, count, IMAGE_WIDTH,
+        IMAGE_HEIGHT) == 0);
+    free(indices);
+    assert(loadHotPixelMap(TEST_MAP, IMAGE_WIDTH, IMAGE_HEIGHT, &map) == 0);
+
+    // whole frame
+    memset(mask, 1, sizeof(mask));
+    applyHotPixelMap(&map, IMAGE_WIDTH, mask, 0, 0, IMAGE_WIDTH, IMAGE_HEIGHT);
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        assert(mask[i] == (image[i] <= 1000));
+    }
+
+    // a window only touches pixels inside it
+    int i0 = 1000, j0 = 500, i1 = 3000, j1 = 2000;
+    memset(mask, 1, sizeof(mask));
+    applyHotPixelMap(&map, IMAGE_WIDTH, mask, i0, j0, i1, j1);
+    for (int j = 0; j < IMAGE_HEIGHT; j++) {
+        for (int i = 0; i < IMAGE_WIDTH; i++) {
+            int inside = (i >= i0) && (i < i1) && (j >= j0) && (j < j1);
+            int hot = image[j * IMAGE_WIDTH + i] > 1000;
+            assert(mask[j * IMAGE_WIDTH + i] == !(inside && hot));
+        }
+    }
+    unloadHotPixelMap(&map);
+    unlink(TEST_MAP);
+}
+
+
+/**
+ * @brief The dynamic hot pixel loop as makeMask() used to run it.
+ */
+int reference_dynamic_mask(uint16_t* ib, int i0, int j0, int i1, int j1,
+    int cutoff, uint8_t* mask)
+{
+    int i, j;
+    int p0, p1, p2, p3, p4;
+    int a, b;
+    int nhp = 0;
+
+    for (j = j0; j < j1; j++) {
+        for (i = i0; i < i1; i++) {
+            // pixels left/right, above/below
+            p0 = 100*ib[i + j*IMAGE_WIDTH]/cutoff;
+            p1 = ib[i - 1 + (j)*IMAGE_WIDTH];
+            p2 = ib[i + 1 + (j)*IMAGE_WIDTH];
+            p3 = ib[i + (j+1)*IMAGE_WIDTH];
+            p4 = ib[i + (j-1)*IMAGE_WIDTH];
+            a = p1 + p2 + p3 + p4 + 4;
+            // pixels on diagonal (upper left/right, lower left/right)
+            p1 = ib[i - 1 + (j-1)*IMAGE_WIDTH];
+            p2 = ib[i + 1 + (j+1)*IMAGE_WIDTH];
+            p3 = ib[i - 1 + (j+1)*IMAGE_WIDTH];
+            p4 = ib[i + 1 + (j-1)*IMAGE_WIDTH];
+            b = p1 + p2 + p3 + p4 + 4;
+            mask[i + j*IMAGE_WIDTH] = ((p0 < a) && (p0 < b));
+            if (p0 > a || p0 > b) nhp++;
+        }
+    }
+    return nhp;
+}
+
+
+/**
+ * @brief Noisy image where many pixels sit right at the hot pixel boundary,
+ * plus full-scale 16-bit pixels to exercise the largest products.
+ */
+void reset_dynamic(void)
+{
+    srand(7);
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        image[i] = 100 + (rand() % 200);
+    }
+    for (int i = 0; i < 20000; i++) {
+        image[rand() % IMAGE_NUM_PX] = rand() % 4096;
+    }
+    for (int i = 0; i < 1000; i++) {
+        image[rand() % IMAGE_NUM_PX] = 65535;
+    }
+}
+
+
+void check_dynamic(int (*kernel)(const uint16_t*, uint32_t, int, int, int,
+    int, int, uint8_t*), int i0, int j0, int i1, int j1, int cutoff)
+{
+    memset(reference_mask, 0xFF, sizeof(reference_mask));
+    memset(mask, 0xFF, sizeof(mask));
+    int expected = 0;
+    if (cutoff == 0) {
+        // the old loop divided by zero; now nothing is masked
+        for (int j = j0; j < j1; j++) {
+            memset(reference_mask + j * IMAGE_WIDTH + i0, 1, i1 - i0);
+        }
+    } else {
+        expected = reference_dynamic_mask(image, i0, j0, i1, j1, cutoff,
+            reference_mask);
+    }
+    int nhp = kernel(image, IMAGE_WIDTH, i0, j0, i1, j1, cutoff, mask);
+    if (nhp != expected) {
+        printf("cutoff %d: %d hot pixels, expected %d\n", cutoff, nhp,
+            expected);
+    }
+    assert(nhp == expected);
+    // bit-identical, including untouched pixels outside the window
+    assert(memcmp(mask, reference_mask, sizeof(mask)) == 0);
+}
+
+
+void test_dynamic_mask(void) {
+    printf("\ntest_dynamic_mask\n");
+    int cutoffs[] = {1, 7, 150, 300, 1000, 8191, 8192, 100000, 0, -300};
+    // full interior, and windows whose widths leave vector tails
+    int windows[][4] = {
+        {1, 1, IMAGE_WIDTH - 1, IMAGE_HEIGHT - 1},
+        {100, 200, 149, 249},
+        {5, 7, 12, 9},
+        {1, 1, 2, 2},
+    };
+    reset_dynamic();
+    for (size_t c = 0; c < sizeof(cutoffs) / sizeof(cutoffs[0]); c++) {
+        for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+            int* win = windows[w];
+            check_dynamic(maskDynamicHotPixelsScalar, win[0], win[1], win[2],
+                win[3], cutoffs[c]);
+            check_dynamic(maskDynamicHotPixels, win[0], win[1], win[2],
+                win[3], cutoffs[c]);
+#ifdef HOTPIX_HAVE_X86_KERNELS
+            if (__builtin_cpu_supports("avx2")) {
+                check_dynamic(maskDynamicHotPixelsAvx2, win[0], win[1],
+                    win[2], win[3], cutoffs[c]);
+            }
+#endif
+        }
+    }
+}
+
+
+double time_dynamic(const char* name, int (*kernel)(const uint16_t*,
+    uint32_t, int, int, int, int, int, uint8_t*))
+{
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+    int nCalls = 10;
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (int i = 0; i < nCalls; i++) {
+        kernel(image, IMAGE_WIDTH, 1, 1, IMAGE_WIDTH - 1, IMAGE_HEIGHT - 1,
+            300, mask);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    double dt = (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+        ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)) / nCalls;
+    printf("%-28s %.3f ms per frame\n", name, dt * 1e3);
+    return dt;
+}
+
+
+int reference_dynamic_kernel(const uint16_t* image, uint32_t width, int i0,
+    int j0, int i1, int j1, int cutoff, uint8_t* mask)
+{
+    return reference_dynamic_mask((uint16_t*)image, i0, j0, i1, j1, cutoff,
+        mask);
+}
+
+
+void test_dynamic_perf(void) {
+    printf("\ntest_dynamic_perf (%d threads)\n", threadPoolSize());
+    reset_dynamic();
+    time_dynamic("reference (division)", reference_dynamic_kernel);
+    time_dynamic("maskDynamicHotPixelsScalar", maskDynamicHotPixelsScalar);
+#ifdef HOTPIX_HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        time_dynamic("maskDynamicHotPixelsAvx2", maskDynamicHotPixelsAvx2);
+    }
+#endif
+    time_dynamic("maskDynamicHotPixels", maskDynamicHotPixels);
+}
+
+
+void test_find_perf(void) {
+    printf("\ntest_find_perf\n");
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+    uint32_t* indices = NULL;
+    uint32_t count = 0;
+    int nCalls = 20;
+
+    reset();
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (int i = 0; i < nCalls; i++) {
+        findHotPixels(image, IMAGE_WIDTH, IMAGE_HEIGHT, 1000, &indices,
+            &count);
+        free(indices);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    double dt = (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+        ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)) / nCalls;
+    printf("findHotPixels on %d threads: %.3f ms per frame\n",
+        threadPoolSize(), dt * 1e3);
+}
+
+
+/**
+ * @brief Approximately normal deviate (sum of 12 uniforms)
+ */
+double gaussian_noise(void)
+{
+    double sum = -6.0;
+    for (int k = 0; k < 12; k++) {
+        sum += rand() / (RAND_MAX + 1.0);
+    }
+    return sum;
+}
+
+
+#define CR_NUM_STARS 400
+#define CR_NUM_HITS 300
+#define CR_NUM_TRACKS 60
+#define CR_TRACK_LENGTH 12
+#define CR_SIGMA 5.0f
+int cr_x[CR_NUM_HITS + CR_NUM_TRACKS * CR_TRACK_LENGTH];
+int cr_y[CR_NUM_HITS + CR_NUM_TRACKS * CR_TRACK_LENGTH];
+int num_cr = 0;
+int star_x[CR_NUM_STARS];
+int star_y[CR_NUM_STARS];
+
+
+/**
+ * @brief Shot-noise sky with Gaussian stars (sigma 0.8 - 1.5 px), isolated
+ * single pixel hits and straight tracks at assorted angles.
+ */
+void reset_cosmic(void)
+{
+    static float sky[IMAGE_NUM_PX];
+    srand(11);
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        sky[i] = 200.0f;
+    }
+    for (int s = 0; s < CR_NUM_STARS; s++) {
+        star_x[s] = 20 + rand() % (IMAGE_WIDTH - 40);
+        star_y[s] = 20 + rand() % (IMAGE_HEIGHT - 40);
+        double width = 0.8 + 0.7 * (rand() / (double)RAND_MAX);
+        double amplitude = 100.0 + rand() % 3000;
+        for (int dy = -6; dy <= 6; dy++) {
+            for (int dx = -6; dx <= 6; dx++) {
+                sky[(star_y[s] + dy) * IMAGE_WIDTH + star_x[s] + dx] +=
+                    amplitude * exp(-0.5 * (dx * dx + dy * dy) /
+                    (width * width));
+            }
+        }
+    }
+    for (int i = 0; i < IMAGE_NUM_PX; i++) {
+        double electrons = sky[i] * COSMIC_RAY_GAIN;
+        double v = (electrons + sqrt(electrons) * gaussian_noise()) /
+            COSMIC_RAY_GAIN + COSMIC_RAY_READ_NOISE * gaussian_noise();
+        image[i] = (v < 0.0) ? 0 : ((v > 4095.0) ? 4095 : (uint16_t)v);
+    }
+
+    // hits land away from stars and from each other
+    num_cr = 0;
+    for (int h = 0; h < CR_NUM_HITS + CR_NUM_TRACKS; h++) {
+        int x = 30 + rand() % (IMAGE_WIDTH - 60);
+        int y = 30 + rand() % (IMAGE_HEIGHT - 60);
+        int clear = 1;
+        for (int s = 0; s < CR_NUM_STARS; s++) {
+            if ((abs(x - star_x[s]) < 30) && (abs(y - star_y[s]) < 30)) {
+                clear = 0;
+            }
+        }
+        for (int c = 0; c < num_cr; c++) {
+            if ((abs(x - cr_x[c]) < 6) && (abs(y - cr_y[c]) < 6)) {
+                clear = 0;
+            }
+        }
+        if (!clear) {
+            continue;
+        }
+        int length = (h < CR_NUM_HITS) ? 1 : CR_TRACK_LENGTH;
+        double angle = (rand() % 360) * M_PI / 180.0;
+        int deposit = 300 + rand() % 3000;
+        int last = -1;
+        for (int k = 0; k < length; k++) {
+            int px = x + (int)lround(k * cos(angle));
+            int py = y + (int)lround(k * sin(angle));
+            int idx = py * IMAGE_WIDTH + px;
+            if (idx == last) {
+                continue;
+            }
+            last = idx;
+            image[idx] = (image[idx] + deposit > 4095) ? 4095 :
+                image[idx] + deposit;
+            cr_x[num_cr] = px;
+            cr_y[num_cr] = py;
+            num_cr++;
+        }
+    }
+}
+
+
+void check_cosmic(const char* name, int (*kernel)(const uint16_t*, uint32_t,
+    int, int, int, int, float, uint8_t*))
+{
+    memset(mask, 1, sizeof(mask));
+    int hits = kernel(image, IMAGE_WIDTH, 2, 2, IMAGE_WIDTH - 2,
+        IMAGE_HEIGHT - 2, CR_SIGMA, mask);
+
+    int missed = 0;
+    for (int c = 0; c < num_cr; c++) {
+        missed += mask[cr_y[c] * IMAGE_WIDTH + cr_x[c]];
+    }
+    // no pixel of a star's core may go
+    int star_pixels_lost = 0;
+    for (int s = 0; s < CR_NUM_STARS; s++) {
+        for (int dy = -2; dy <= 2; dy++) {
+            for (int dx = -2; dx <= 2; dx++) {
+                star_pixels_lost += !mask[(star_y[s] + dy) * IMAGE_WIDTH +
+                    star_x[s] + dx];
+            }
+        }
+    }
+    printf("%-22s %d hits for %d hit pixels: %d missed, %d star pixels "
+        "lost\n", name, hits, num_cr, missed, star_pixels_lost);
+    assert(missed == 0);
+    assert(star_pixels_lost == 0);
+    // plus the odd noise spike
+    assert(hits >= num_cr);
+    assert(hits < num_cr + 20);
+}
+
+
+void test_cosmic_rays(void) {
+    printf("\ntest_cosmic_rays\n");
+    reset_cosmic();
+    check_cosmic("maskCosmicRaysScalar", maskCosmicRaysScalar);
+    memcpy(reference_mask, mask, sizeof(mask));
+    check_cosmic("maskCosmicRays", maskCosmicRays);
+    assert(memcmp(mask, reference_mask, sizeof(mask)) == 0);
+#ifdef HOTPIX_HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        check_cosmic("maskCosmicRaysAvx2", maskCosmicRaysAvx2);
+        assert(memcmp(mask, reference_mask, sizeof(mask)) == 0);
+        // windows whose widths leave vector tails
+        int windows[][4] = {{2, 2, 9, 5}, {101, 40, 150, 77}};
+        for (int w = 0; w < 2; w++) {
+            int* win = windows[w];
+            memset(mask, 1, sizeof(mask));
+            memset(reference_mask, 1, sizeof(reference_mask));
+            int a = maskCosmicRaysScalar(image, IMAGE_WIDTH, win[0], win[1],
+                win[2], win[3], 0.5f, reference_mask);
+            int b = maskCosmicRaysAvx2(image, IMAGE_WIDTH, win[0], win[1],
+                win[2], win[3], 0.5f, mask);
+            assert(a == b);
+            assert(memcmp(mask, reference_mask, sizeof(mask)) == 0);
+        }
+    }
+#endif
+    // a threshold of 0 turns rejection off
+    assert(maskCosmicRays(image, IMAGE_WIDTH, 2, 2, IMAGE_WIDTH - 2,
+        IMAGE_HEIGHT - 2, 0.0f, mask) == 0);
+}
+
+
+double time_cosmic(const char* name, int (*kernel)(const uint16_t*,
+    uint32_t, int, int, int, int, float, uint8_t*))
+{
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+    int nCalls = 10;
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (int i = 0; i < nCalls; i++) {
+        kernel(image, IMAGE_WIDTH, 2, 2, IMAGE_WIDTH - 2, IMAGE_HEIGHT - 2,
+            CR_SIGMA, mask);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    double dt = (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
+        ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)) / nCalls;
+    printf("%-28s %.3f ms per frame\n", name, dt * 1e3);
+    return dt;
+}
+
+
+void test_cosmic_perf(void) {
+    printf("\ntest_cosmic_perf (%d threads)\n", threadPoolSize());
+    time_cosmic("maskCosmicRaysScalar", maskCosmicRaysScalar);
+#ifdef HOTPIX_HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        time_cosmic("maskCosmicRaysAvx2", maskCosmicRaysAvx2);
+    }
+#endif
+    time_cosmic("maskCosmicRays", maskCosmicRays);
+}
+
+
+int main(int argc, char* argv[]) {
+    test_write_load();
+    test_convert_text();
+
+    // serial, then split over a pool
+    test_find_hot_pixels();
+    test_find_perf();
+    test_dynamic_mask();
+    test_dynamic_perf();
+    test_cosmic_rays();
+    test_cosmic_perf();
+    initThreadPool(4);
+    test_find_hot_pixels();
+    test_apply_map();
+    test_find_perf();
+    test_dynamic_mask();
+    test_dynamic_perf();
+    test_cosmic_rays();
+    test_cosmic_perf();
+    closeThreadPool();
+
+    return 0;
+}
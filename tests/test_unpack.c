@@ -0,0 +1,164 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../unpack.h"
+
+#define IMAGE_WIDTH 5320
+#define IMAGE_HEIGHT 3032
+#define IMAGE_NUM_PX (IMAGE_WIDTH * IMAGE_HEIGHT)
+
+uint16_t reference[IMAGE_NUM_PX] = {0};
+uint16_t wide[IMAGE_NUM_PX] = {0};
+uint8_t packed[MONO12P_NUM_BYTES(IMAGE_NUM_PX)] = {0};
+uint16_t result[IMAGE_NUM_PX] = {0};
+
+
+/**
+ * @brief Pack 12-bit pixels the way the camera does for Mono12p.
+ */
+void pack_mono12p(uint16_t* pixels, uint8_t* out, int num_pixels)
+{
+    memset(out, 0, MONO12P_NUM_BYTES(num_pixels));
+    for (int i = 0; i < num_pixels; i++) {
+        size_t bit = (size_t)i * 12;
+        uint32_t v = (uint32_t)(pixels[i] & 0x0FFF) << (bit % 8);
+        out[bit / 8] |= v & 0xFF;
+        out[bit / 8 + 1] |= (v >> 8) & 0xFF;
+        if (bit % 8) {
+            out[bit / 8 + 2] |= (v >> 16) & 0xFF;
+        }
+    }
+}
+
+
+void reset(int num_pixels)
+{
+    srand(42);
+    for (int i = 0; i < num_pixels; i++) {
+        reference[i] = rand() & 0x0FFF;
+        // the unpacked format leaves garbage in the top 4 bits
+        wide[i] = reference[i] | ((rand() & 0xF) << 12);
+    }
+    pack_mono12p(reference, packed, num_pixels);
+    memset(result, 0xFF, sizeof(result));
+}
+
+
+void check(int num_pixels)
+{
+    for (int i = 0; i < num_pixels; i++) {
+        if (result[i] != reference[i]) {
+            printf("Mismatch at pixel %d: %u != %u\n", i, result[i],
+                reference[i]);
+        }
+        assert(result[i] == reference[i]);
+    }
+    // must not write past the end
+    assert(result[num_pixels] == 0xFFFF);
+}
+
+
+void test_unpack_mono12p_known(void) {
+    printf("\ntest_unpack_mono12p_known\n");
+    // p0 = 0xABC, p1 = 0x123
+    uint8_t bytes[3] = {0xBC, 0x3A, 0x12};
+    uint16_t out[2] = {0};
+    unpack_mono12p_scalar(bytes, out, 2);
+    assert(out[0] == 0xABC);
+    assert(out[1] == 0x123);
+}
+
+
+void test_unpack_mono12p_kernels(void) {
+    printf("\ntest_unpack_mono12p_kernels\n");
+    // odd lengths and lengths that do not fill a whole vector exercise tails
+    int lengths[] = {1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 33, 1001, IMAGE_WIDTH,
+        IMAGE_NUM_PX - 1};
+    for (size_t n = 0; n < sizeof(lengths) / sizeof(lengths[0]); n++) {
+        int num_pixels = lengths[n];
+        reset(num_pixels);
+        unpack_mono12p_scalar(packed, result, num_pixels);
+        check(num_pixels);
+        reset(num_pixels);
+        unpack_mono12p(packed, result, num_pixels);
+        check(num_pixels);
+#ifdef UNPACK_HAVE_X86_KERNELS
+        if (__builtin_cpu_supports("ssse3")) {
+            reset(num_pixels);
+            unpack_mono12p_ssse3(packed, result, num_pixels);
+            check(num_pixels);
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            reset(num_pixels);
+            unpack_mono12p_avx2(packed, result, num_pixels);
+            check(num_pixels);
+        }
+#endif
+    }
+}
+
+
+void test_unpack_mono12(void) {
+    printf("\ntest_unpack_mono12\n");
+    reset(IMAGE_NUM_PX - 1);
+    unpack_mono12(wide, result, IMAGE_NUM_PX - 1);
+    check(IMAGE_NUM_PX - 1);
+}
+
+
+double time_unpack(const char* name, void (*kernel)(const uint8_t*, uint16_t*,
+    int))
+{
+    struct timespec tstart = {0,0};
+    struct timespec tend = {0,0};
+    int nCalls = 20;
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (int i = 0; i < nCalls; i++) {
+        kernel(packed, result, IMAGE_NUM_PX);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    double dt = (((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) - 
+        ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec)) / nCalls;
+    printf("%-24s %.3f ms per frame\n", name, dt * 1e3);
+    return dt;
+}
+
+
+void unpack_mono12_wide(const uint8_t* unused, uint16_t* out, int n)
+{
+    (void)unused;
+    unpack_mono12(wide, out, n);
+}
+
+
+void test_unpack_perf(void) {
+    printf("\ntest_unpack_perf\n");
+    reset(IMAGE_NUM_PX);
+    printf("Frame bytes: Mono12 %zu, Mono12p %zu\n",
+        sizeof(uint16_t) * IMAGE_NUM_PX, MONO12P_NUM_BYTES(IMAGE_NUM_PX));
+    time_unpack("unpack_mono12", unpack_mono12_wide);
+    time_unpack("unpack_mono12p_scalar", unpack_mono12p_scalar);
+#ifdef UNPACK_HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("ssse3")) {
+        time_unpack("unpack_mono12p_ssse3", unpack_mono12p_ssse3);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        time_unpack("unpack_mono12p_avx2", unpack_mono12p_avx2);
+    }
+#endif
+}
+
+
+int main(int argc, char* argv[]) {
+    test_unpack_mono12p_known();
+    test_unpack_mono12p_kernels();
+    test_unpack_mono12();
+    test_unpack_perf();
+
+    return 0;
+}
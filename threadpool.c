@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+/* A fixed set of worker threads for splitting image passes into tasks. One
+** job runs at a time; the calling thread works on it too, so a pool of N
+** threads has N - 1 workers. */
+
+static pthread_t workers[THREAD_POOL_MAX_THREADS];
+static int num_workers = 0;
+static int pool_open = 0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_posted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+// serializes parallelFor() callers
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// current job, guarded by pool_lock
+static parallel_task_t job_task = NULL;
+static void* job_arg = NULL;
+static int job_num_tasks = 0;
+static int job_next_task = 0;
+static int job_unfinished = 0;
+static unsigned long job_generation = 0;
+
+
+/**
+ * @brief Run tasks of the current job until none are left. Called with
+ * pool_lock held; returns with it held.
+ */
+static void runTasks(void)
+{
+    while (job_next_task < job_num_tasks) {
+        int index = job_next_task++;
+        parallel_task_t task = job_task;
+        void* arg = job_arg;
+        pthread_mutex_unlock(&pool_lock);
+        task(arg, index);
+        pthread_mutex_lock(&pool_lock);
+        if (--job_unfinished == 0) {
+            pthread_cond_broadcast(&job_done);
+        }
+    }
+}
+
+
+static void* workerThread(void* arg)
+{
+    unsigned long seen_generation = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (pool_open && (job_generation == seen_generation)) {
+            pthread_cond_wait(&job_posted, &pool_lock);
+        }
+        if (!pool_open) {
+            break;
+        }
+        seen_generation = job_generation;
+        runTasks();
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+
+/**
+ * @brief Start the worker threads.
+ *
+ * @param num_threads threads to split work over, including the caller's; 0
+ * for one per online CPU
+ * @return int -1 if no worker could be started (work then runs on the
+ * calling thread), 0 otherwise
+ */
+int initThreadPool(int num_threads)
+{
+    if (pool_open) {
+        closeThreadPool();
+    }
+    if (num_threads <= 0) {
+        num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_threads > THREAD_POOL_MAX_THREADS) {
+        num_threads = THREAD_POOL_MAX_THREADS;
+    }
+
+    pool_open = 1;
+    num_workers = 0;
+    for (int i = 0; i < num_threads - 1; i++) {
+        if (pthread_create(&workers[num_workers], NULL, workerThread,
+            NULL) != 0) {
+            fprintf(stderr, "initThreadPool: Error creating worker thread: "
+                "%s.\n", strerror(errno));
+            break;
+        }
+        num_workers++;
+    }
+    return ((num_threads > 1) && (num_workers == 0)) ? -1 : 0;
+}
+
+
+/**
+ * @brief Stop and join the worker threads. Later parallelFor() calls run on
+ * the calling thread.
+ */
+void closeThreadPool(void)
+{
+    pthread_mutex_lock(&job_lock);
+    pthread_mutex_lock(&pool_lock);
+    pool_open = 0;
+    pthread_cond_broadcast(&job_posted);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    num_workers = 0;
+    pthread_mutex_unlock(&job_lock);
+}
+
+
+/**
+ * @return int number of threads parallelFor() spreads work over
+ */
+int threadPoolSize(void)
+{
+    return num_workers + 1;
+}
+
+
+/**
+ * @brief Call task(arg, i) for i in [0, num_tasks) on the pool, returning once
+ * all calls have finished. Tasks may run in any order and concurrently.
+ */
+void parallelFor(int num_tasks, parallel_task_t task, void* arg)
+{
+    if (num_tasks <= 0) {
+        return;
+    }
+    if ((num_workers == 0) || (num_tasks == 1)) {
+        for (int i = 0; i < num_tasks; i++) {
+            task(arg, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&job_lock);
+    pthread_mutex_lock(&pool_lock);
+    job_task = task;
+    job_arg = arg;
+    job_num_tasks = num_tasks;
+    job_next_task = 0;
+    job_unfinished = num_tasks;
+    job_generation++;
+    pthread_cond_broadcast(&job_posted);
+
+    runTasks();
+    while (job_unfinished > 0) {
+        pthread_cond_wait(&job_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&job_lock);
+}
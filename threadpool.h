@@ -0,0 +1,15 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Upper limit on worker threads, whatever the CPU count
+#define THREAD_POOL_MAX_THREADS 64
+
+/* Called once per task index by parallelFor(), from any pool thread */
+typedef void (*parallel_task_t)(void* arg, int index);
+
+int initThreadPool(int num_threads);
+void closeThreadPool(void);
+int threadPoolSize(void);
+void parallelFor(int num_tasks, parallel_task_t task, void* arg);
+
+#endif
@@ -0,0 +1,143 @@
+#include "unpack.h"
+#include "stdio.h"
+
+#ifdef UNPACK_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief function to take 16 bit pixel values which are filled with 12 bits and 
+ * mask out the last 4 bits to ensure they are zero and not random garbage
+ * @param packed pointer to array of pixel values from camera transfer
+ * @param unpacked pointer to destination array for use by rest of code
+ * @param num_pixels total number of pixels in image
+ */
+void unpack_mono12(uint16_t* packed, uint16_t* unpacked, int num_pixels)
+{
+    for (int i = 0; i < num_pixels; i++) {
+        unpacked[i] = packed[i] & 0x0FFF; // this masks the last four pixels
+    }
+}
+
+
+/**
+ * @brief Expand 12-bit packed pixels (PFNC Mono12p: a little-endian bit
+ * stream, two pixels per three bytes) into 16-bit pixels.
+ * byte 0: p0[7:0], byte 1: p1[3:0] << 4 | p0[11:8], byte 2: p1[11:4]
+ * 
+ * @param packed pointer to MONO12P_NUM_BYTES(num_pixels) bytes from the camera
+ * @param unpacked pointer to destination array of num_pixels pixels
+ * @param num_pixels total number of pixels in image
+ */
+void unpack_mono12p_scalar(const uint8_t* packed, uint16_t* unpacked,
+    int num_pixels)
+{
+    int i = 0;
+    for (; i + 1 < num_pixels; i += 2) {
+        uint8_t b0 = packed[0];
+        uint8_t b1 = packed[1];
+        uint8_t b2 = packed[2];
+        unpacked[i] = (uint16_t)(b0 | ((b1 & 0x0F) << 8));
+        unpacked[i + 1] = (uint16_t)((b1 >> 4) | (b2 << 4));
+        packed += 3;
+    }
+    // an odd pixel count ends on a half-filled byte
+    if (i < num_pixels) {
+        unpacked[i] = (uint16_t)(packed[0] | ((packed[1] & 0x0F) << 8));
+    }
+}
+
+
+#ifdef UNPACK_HAVE_X86_KERNELS
+/*
+ * Both SIMD kernels use the same trick: each 3-byte group is shuffled into
+ * two 16-bit lanes holding bytes (0, 1) and (1, 2). The even lane masked to 12
+ * bits is p0; the odd lane shifted right by 4 is p1.
+ */
+
+/**
+ * @brief SSSE3 version of unpack_mono12p_scalar(), 8 pixels per iteration.
+ */
+__attribute__((target("ssse3")))
+void unpack_mono12p_ssse3(const uint8_t* packed, uint16_t* unpacked,
+    int num_pixels)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+                                          6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i even_mask = _mm_set1_epi32(0x00000FFF);
+    const __m128i odd_mask = _mm_set1_epi32((int)0xFFFF0000);
+    int i = 0;
+    // each load reads 16 bytes but consumes 12; stop before reading past the
+    // end of the buffer
+    for (; i + 8 <= num_pixels &&
+        MONO12P_NUM_BYTES(i) + 16 <= MONO12P_NUM_BYTES(num_pixels); i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(packed +
+            MONO12P_NUM_BYTES(i)));
+        v = _mm_shuffle_epi8(v, shuffle);
+        __m128i even = _mm_and_si128(v, even_mask);
+        __m128i odd = _mm_and_si128(_mm_srli_epi16(v, 4), odd_mask);
+        _mm_storeu_si128((__m128i*)(unpacked + i), _mm_or_si128(even, odd));
+    }
+    unpack_mono12p_scalar(packed + MONO12P_NUM_BYTES(i), unpacked + i,
+        num_pixels - i);
+}
+
+
+/**
+ * @brief AVX2 version of unpack_mono12p_scalar(), 16 pixels per iteration.
+ */
+__attribute__((target("avx2")))
+void unpack_mono12p_avx2(const uint8_t* packed, uint16_t* unpacked,
+    int num_pixels)
+{
+    // vpshufb works within 128-bit lanes, so each lane gets its own 12 bytes
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+                                             6, 7, 7, 8, 9, 10, 10, 11,
+                                             0, 1, 1, 2, 3, 4, 4, 5,
+                                             6, 7, 7, 8, 9, 10, 10, 11);
+    const __m256i even_mask = _mm256_set1_epi32(0x00000FFF);
+    const __m256i odd_mask = _mm256_set1_epi32((int)0xFFFF0000);
+    int i = 0;
+    // the upper lane load starts 12 bytes in and reads 16
+    for (; i + 16 <= num_pixels &&
+        MONO12P_NUM_BYTES(i) + 28 <= MONO12P_NUM_BYTES(num_pixels); i += 16) {
+        const uint8_t* src = packed + MONO12P_NUM_BYTES(i);
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)src)),
+            _mm_loadu_si128((const __m128i*)(src + 12)), 1);
+        v = _mm256_shuffle_epi8(v, shuffle);
+        __m256i even = _mm256_and_si256(v, even_mask);
+        __m256i odd = _mm256_and_si256(_mm256_srli_epi16(v, 4), odd_mask);
+        _mm256_storeu_si256((__m256i*)(unpacked + i),
+            _mm256_or_si256(even, odd));
+    }
+    unpack_mono12p_ssse3(packed + MONO12P_NUM_BYTES(i), unpacked + i,
+        num_pixels - i);
+}
+#endif
+
+
+/**
+ * @brief Expand 12-bit packed pixels into 16-bit pixels using the widest
+ * kernel the CPU supports. See unpack_mono12p_scalar() for the layout.
+ * 
+ * @param packed pointer to MONO12P_NUM_BYTES(num_pixels) bytes from the camera
+ * @param unpacked pointer to destination array of num_pixels pixels
+ * @param num_pixels total number of pixels in image
+ */
+void unpack_mono12p(const uint8_t* packed, uint16_t* unpacked, int num_pixels)
+{
+    static void (*kernel)(const uint8_t*, uint16_t*, int) = NULL;
+    if (kernel == NULL) {
+        kernel = unpack_mono12p_scalar;
+#ifdef UNPACK_HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernel = unpack_mono12p_avx2;
+        } else if (__builtin_cpu_supports("ssse3")) {
+            kernel = unpack_mono12p_ssse3;
+        }
+#endif
+    }
+    kernel(packed, unpacked, num_pixels);
+}
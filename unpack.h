@@ -0,0 +1,23 @@
+#ifndef _UNPACK_H
+#define _UNPACK_H
+#include <stdint.h>
+#include <stddef.h>
+
+// Bytes occupied by n pixels in the 12-bit packed (Mono12p) format
+#define MONO12P_NUM_BYTES(n) (((size_t)(n) * 3 + 1) / 2)
+
+void unpack_mono12(uint16_t* packed, uint16_t* unpacked, int num_pixels);
+void unpack_mono12p(const uint8_t* packed, uint16_t* unpacked, int num_pixels);
+
+// Individual kernels, exposed for testing and benchmarking
+void unpack_mono12p_scalar(const uint8_t* packed, uint16_t* unpacked,
+    int num_pixels);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UNPACK_HAVE_X86_KERNELS
+void unpack_mono12p_ssse3(const uint8_t* packed, uint16_t* unpacked,
+    int num_pixels);
+void unpack_mono12p_avx2(const uint8_t* packed, uint16_t* unpacked,
+    int num_pixels);
+#endif
+
+#endif